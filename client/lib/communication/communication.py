@@ -9,19 +9,64 @@
 import serial
 
 BAUDRATE = 115200
+FRAME_SYNC = b"\xa5\x5a"
+FRAME_DATA = 0x01
+FRAME_RECORD = 0x02
+FRAME_HEADER_SIZE = 6
+
+
+def crc8(data: bytes) -> int:
+    """CRC-8 (polynomial 0x07) over the type and length fields of a frame header."""
+    crc = 0
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x07) & 0xFF if crc & 0x80 else (crc << 1) & 0xFF
+    return crc
 
 class Communication:
     ser = None
 
     def __init__(self, port, baudrate=BAUDRATE):
-        self.ser = serial.Serial(port, baudrate)
+        # A serial port, or an URL such as "socket://192.168.1.20:5000" for the TCP transport
+        self.ser = serial.serial_for_url(port, baudrate)
         self.log = ("Connected to " + port + " at " + str(baudrate) + " baud")
 
-    def communication_send(self, buffer: bytes):
-        return self.ser.write(buffer)
+    def communication_send(self, buffer: bytes, frame_type: int = FRAME_DATA):
+        header = bytes([frame_type]) + len(buffer).to_bytes(2, "little")
+        sent = self.ser.write(FRAME_SYNC + header + bytes([crc8(header)]) + buffer)
+        return sent - FRAME_HEADER_SIZE
 
     def communication_read(self, size: int) -> bytes:
-        return self.ser.read(size)
+        """Read the payload of the next frame, resynchronising on garbage."""
+        window = b""
+        while True:
+            byte = self.ser.read(1)
+            if not byte:
+                return b""
+            window = (window + byte)[-FRAME_HEADER_SIZE:]
+            if len(window) == FRAME_HEADER_SIZE and window[0:2] == FRAME_SYNC and window[5] == crc8(window[2:5]):
+                break
+        length = int.from_bytes(window[3:5], "little")
+        payload = self.ser.read(length)
+        return payload if len(payload) == length else b""
+
+    def communication_baudrate(self, baudrate: int) -> int:
+        """Switch the port to baudrate once the pending data is sent, returns the previous baud rate."""
+        previous = self.ser.baudrate
+        self.ser.flush()
+        self.ser.baudrate = baudrate
+        return previous
+
+    def communication_timeout(self, timeout):
+        """Set the read timeout in seconds, None to block, returns the previous timeout."""
+        previous = self.ser.timeout
+        self.ser.timeout = timeout
+        return previous
+
+    def communication_discard(self):
+        """Drop everything received but not read yet."""
+        self.ser.reset_input_buffer()
 
     def communication_open(self) -> bool:
         if not self.ser.is_open:
@@ -6,8 +6,11 @@
     * @Created: 2021-06-15
 """
 
+import os
+import time
+
 from mbedtls import pk, hmac, hashlib, cipher
-from client.lib.communication.communication import Communication
+from client.lib.communication.communication import Communication, FRAME_RECORD
 
 response_codes = {
     "00": "STATUS OKAY",
@@ -16,6 +19,8 @@ response_codes = {
     "03": "STATUS HASH ERROR",
     "04": "STATUS BAD REQUEST",
     "05": "STATUS INVALID SESSION",
+    "06": "STATUS UNKNOWN KEY",
+    "07": "STATUS BUSY",
 }
 
 class Session:
@@ -24,6 +29,11 @@ class Session:
     EXPONENT = 65537
     SECRET_KEY = b"Fj2-;wu3Ur=ARl2!Tqi6IuKM3nG]8z1+"
     CONNECTED = None
+    WINDOW = 8
+    TAG_SIZE = 16
+    BAUDRATE_CONFIRM = 1.0
+    BAUDRATE_SETTLE = 0.01
+    STATS_UNKNOWN = 0xFFFFFFFF
 
     def __init__(self, port):
         self.initialize = False
@@ -39,6 +49,12 @@ class Session:
             self.RSA_SIZE * 8, self.EXPONENT)
         self.server_public_rsa = None
         self.aes_key = None
+        self.ticket = None
+        self.session_key = None
+        self.mac_key = None
+        self.record_key = None
+        self.resume_nonce = b""
+        self.tx_sequence = 0
         Session.CONNECTED = port
         self.status = None
 
@@ -59,21 +75,27 @@ class Session:
             if received == 0:
                 return received
 
-    def client_send(self, buffer: bytes):
-        self.hmac_hash.update(buffer)
-        buffer += self.hmac_hash.digest()
+    def hkdf(self, salt: bytes, ikm: bytes, info: bytes) -> bytes:
+        """HKDF-SHA256 (RFC 5869) of one block, as the server derives its session keys."""
+        prk = hmac.new(salt, ikm, digestmod="SHA256").digest()
+        return hmac.new(prk, info + b"\x01", digestmod="SHA256").digest()
+
+    def client_send(self, buffer: bytes, key: bytes = None):
+        """Send a message with its HMAC, keyed with the session HMAC key or, by default, the pre-shared secret."""
+        key = self.HMAC_KEY if key is None else key
+        buffer += hmac.new(key, buffer, digestmod="SHA256").digest()
         sent_length = self.ser.communication_send(buffer)
         if len(buffer) != sent_length:
-            self.ser.close_connection()
+            self.ser.communication_close()
 
-    def client_read(self, size: int) -> bytes:
+    def client_read(self, size: int, key: bytes = None) -> bytes:
+        key = self.HMAC_KEY if key is None else key
         buffer = self.ser.communication_read(
             size + self.hmac_hash.digest_size)
-        self.hmac_hash.update(buffer[0: size])
-        buf = buffer[size: size + self.hmac_hash.digest_size]
-        temp = self.hmac_hash.digest()
+        size = len(buffer) - self.hmac_hash.digest_size
+        temp = hmac.new(key, buffer[0: size], digestmod="SHA256").digest()
 
-        if temp != buf:
+        if size < 0 or temp != buffer[size:]:
             self.ser.communication_close()
         return buffer[0: size]
     
@@ -147,6 +169,12 @@ class Session:
 
                 self.aes_key = cipher.AES.new(
                     buffer[24: 56], cipher.MODE_CBC, buffer[8: 24])
+                self.session_key = buffer[24: 56]
+                # The HMAC key of the session is derived from its AES key
+                self.mac_key = self.hkdf(self.HMAC_KEY, self.session_key, b"mac")
+                self.record_key = None
+                self.resume_nonce = b""
+                self.ticket = buffer[56: 184] if len(buffer) >= 184 else None
                 connected = True
 
                 return connected
@@ -156,6 +184,264 @@ class Session:
         else:
             self.ser.communication_open()
 
+    def establish_hybrid(self) -> bool:
+        """Establish a session in one round trip with the server key of an earlier handshake."""
+        if self.server_public_rsa is None:
+            return False
+
+        for _ in range(2):
+            # RSA only wraps the key and IV of the envelope, the envelope carries the key and the proof
+            wrap = os.urandom(32 + cipher.AES.block_size)
+            envelope = self.client_public_rsa.export_public_key(
+            ) + self.client_public_rsa.sign(self.SECRET_KEY, "SHA256")
+            padding_length = cipher.AES.block_size - \
+                (len(envelope) % cipher.AES.block_size)
+            envelope += bytes([padding_length] * padding_length)
+            envelope = cipher.AES.new(
+                wrap[0:32], cipher.MODE_CBC, wrap[32:]).encrypt(envelope)
+            self.client_send(self.server_public_rsa.encrypt(wrap) + envelope)
+
+            buffer = self.client_read(self.RSA_SIZE)
+            if len(buffer) == self.RSA_SIZE:
+                buffer = self.client_public_rsa.decrypt(buffer)
+                self.SESSION_ID = buffer[0:8]
+                self.aes_key = cipher.AES.new(
+                    buffer[24: 56], cipher.MODE_CBC, buffer[8: 24])
+                self.session_key = buffer[24: 56]
+                self.mac_key = self.hkdf(self.HMAC_KEY, self.session_key, b"mac")
+                self.record_key = None
+                self.resume_nonce = b""
+                self.ticket = buffer[56: 184] if len(buffer) >= 184 else None
+                return True
+
+            # The server key was rotated, retry with the key the server sent
+            if len(buffer) > 1 and buffer[0] == 0x06:
+                self.server_public_rsa = pk.RSA().from_DER(buffer[1:])
+            else:
+                return False
+
+        return False
+
+    def resume(self) -> bool:
+        """Resume the session with the ticket of the last established session, no RSA operation is needed."""
+        if self.ticket is None:
+            return False
+
+        nonce = os.urandom(cipher.AES.block_size)
+        self.client_send(nonce + self.ticket)
+
+        # The ticket is single-use, the answer carries the follow-up ticket
+        buffer = self.client_read(2 * cipher.AES.block_size + len(self.ticket))
+        if len(buffer) != 2 * cipher.AES.block_size + len(self.ticket):
+            self.ticket = None
+            return False
+
+        self.ticket = buffer[2 * cipher.AES.block_size:]
+        buffer = cipher.AES.new(self.session_key, cipher.MODE_CBC, nonce).decrypt(
+            buffer[0: 2 * cipher.AES.block_size])
+        self.SESSION_ID = buffer[0:8]
+        self.aes_key = cipher.AES.new(
+            self.session_key, cipher.MODE_CBC, buffer[8: 24])
+        self.record_key = None
+        # The nonce makes the record key of this resumption differ from the ones before
+        self.resume_nonce = nonce
+        return True
+
+    def enable_records(self):
+        """Derive the AES-GCM record key of the session, HKDF-SHA256 salted with the session HMAC key."""
+        self.record_key = self.hkdf(self.mac_key, self.session_key,
+                                    b"record" + self.SESSION_ID + self.resume_nonce)
+        self.tx_sequence = 0
+
+    def record_send(self, command: int, request_id: int, data: bytes = b""):
+        self.tx_sequence += 1
+        header = self.SESSION_ID + self.tx_sequence.to_bytes(8, "little")
+        nonce = (0).to_bytes(4, "little") + self.tx_sequence.to_bytes(8, "little")
+        buffer, tag = cipher.AES.new(self.record_key, cipher.MODE_GCM, nonce, header).encrypt(
+            bytes([command]) + request_id.to_bytes(2, "little") + data)
+        self.ser.communication_send(header + buffer + tag, FRAME_RECORD)
+
+    def record_read(self):
+        """Read a record, returns (request ID, status | data) or None if it could not be authenticated."""
+        buffer = self.ser.communication_read(0)
+        if len(buffer) < 16 + 3 + self.TAG_SIZE:
+            return None
+        header = buffer[0:16]
+        nonce = (1).to_bytes(4, "little") + header[8:16]
+        try:
+            plain = cipher.AES.new(self.record_key, cipher.MODE_GCM, nonce, header).decrypt(
+                buffer[16:-self.TAG_SIZE], buffer[-self.TAG_SIZE:])
+        except Exception:
+            return None
+        return int.from_bytes(plain[1:3], "little"), plain[0:1] + plain[3:]
+
+    def record_request(self, command: int, data: bytes = b"") -> bytes:
+        """Send one GCM request and return status | data of its response, b"" on failure."""
+        if self.record_key is None:
+            self.enable_records()
+
+        self.record_send(command, 0, data)
+        record = self.record_read()
+        return record[1] if record is not None else b""
+
+    def get_history(self, since: int = 0) -> list:
+        """Samples taken after since (ms), as (time in ms, temperature) tuples, as many as fit in one record."""
+        buffer = self.record_request(0x09, since.to_bytes(4, "little"))
+        samples = []
+        if len(buffer) > 0 and buffer[0] == 0x00:
+            for i in range(1, len(buffer) - 5, 6):
+                samples.append((int.from_bytes(buffer[i:i + 4], "little"),
+                                int.from_bytes(buffer[i + 4:i + 6], "little", signed=True) / 100))
+        return samples
+
+    def get_aggregate(self) -> dict:
+        """Minimum, maximum and mean temperature over the history of the server."""
+        buffer = self.record_request(0x0A)
+        if len(buffer) != 17 or buffer[0] != 0x00:
+            return {}
+        return {
+            "first": int.from_bytes(buffer[1:5], "little"),
+            "last": int.from_bytes(buffer[5:9], "little"),
+            "count": int.from_bytes(buffer[9:11], "little"),
+            "min": int.from_bytes(buffer[11:13], "little", signed=True) / 100,
+            "max": int.from_bytes(buffer[13:15], "little", signed=True) / 100,
+            "mean": int.from_bytes(buffer[15:17], "little", signed=True) / 100,
+        }
+
+    def subscribe(self, interval: int, threshold: float = 0.0) -> bool:
+        """Subscribe to temperature pushes every interval ms, or only on changes of at least threshold degrees."""
+        if self.record_key is None:
+            self.enable_records()
+
+        self.record_send(0x06, 0, interval.to_bytes(4, "little") +
+                         int(round(threshold * 100)).to_bytes(2, "little"))
+        record = self.record_read()
+        return record is not None and record[1][0] == 0x00
+
+    def unsubscribe(self) -> bool:
+        self.record_send(0x07, 1)
+        # Pushes sent before the server handled the request may still arrive
+        record = self.record_read()
+        while record is not None and record[0] != 1:
+            record = self.record_read()
+        return record is not None and record[1][0] == 0x00
+
+    def read_samples(self) -> list:
+        """Read the next push, returns a list of (time in ms, temperature) tuples."""
+        record = self.record_read()
+        samples = []
+        if record is not None and record[0] == 0 and len(record[1]) >= 5:
+            buffer = record[1]
+            base = int.from_bytes(buffer[1:5], "little")
+            for i in range(5, len(buffer) - 3, 4):
+                offset = int.from_bytes(buffer[i:i + 2], "little")
+                value = int.from_bytes(buffer[i + 2:i + 4], "little", signed=True)
+                samples.append((base + offset, value / 100))
+        return samples
+
+    def set_baudrate(self, baudrate: int) -> bool:
+        """Switch the link to baudrate, falls back to the current rate if the link check at the new rate fails."""
+        argument = baudrate.to_bytes(4, "little")
+        buffer = self.record_request(0x0B, argument)
+        if len(buffer) == 0 or buffer[0] != 0x00:
+            return False
+
+        # The server switches once the response has left its UART
+        time.sleep(self.BAUDRATE_SETTLE)
+        previous = self.ser.communication_baudrate(baudrate)
+
+        # The link check, the request repeated at the new rate confirms the switch
+        timeout = self.ser.communication_timeout(self.BAUDRATE_CONFIRM / 2)
+        buffer = self.record_request(0x0B, argument)
+        self.ser.communication_timeout(timeout)
+        if len(buffer) > 0 and buffer[0] == 0x00:
+            return True
+
+        # Not confirmed, the server falls back to the previous rate on its own
+        time.sleep(self.BAUDRATE_CONFIRM)
+        self.ser.communication_baudrate(previous)
+        self.ser.communication_discard()
+        return False
+
+    def get_stats(self, page: int = 0):
+        """A page of the server statistics: 0 latency and status counts, 1 memory, 2 + n the histogram of measurement n.
+        Heap and stack values the server cannot measure are None."""
+        buffer = self.record_request(0x0C, page.to_bytes(4, "little"))
+        if len(buffer) < 2 or buffer[0] != 0x00:
+            return None
+        buffer = buffer[1:]
+
+        if page == 0:
+            count = buffer[0]
+            latency = []
+            for i in range(1, 1 + 24 * count, 24):
+                latency.append({
+                    "count": int.from_bytes(buffer[i:i + 4], "little"),
+                    "total_us": int.from_bytes(buffer[i + 4:i + 12], "little"),
+                    "max_us": int.from_bytes(buffer[i + 12:i + 16], "little"),
+                    "p50_us": int.from_bytes(buffer[i + 16:i + 20], "little"),
+                    "p99_us": int.from_bytes(buffer[i + 20:i + 24], "little"),
+                })
+            offset = 1 + 24 * count
+            statuses = [int.from_bytes(buffer[i:i + 4], "little")
+                        for i in range(offset + 1, offset + 1 + 4 * buffer[offset], 4)]
+            return {"latency": latency, "statuses": statuses}
+
+        if page == 1:
+            values = [int.from_bytes(buffer[i:i + 4], "little") for i in range(0, 40, 4)]
+            stats = dict(zip(["arena_size", "arena_used", "arena_peak", "arena_carved", "allocations",
+                              "overflows", "failures", "heap_free", "heap_min", "heap_largest"], values))
+            # A host server does not measure the heap and the stacks, it sends 0xFFFFFFFF
+            for key in ("heap_free", "heap_min", "heap_largest"):
+                stats[key] = None if stats[key] == self.STATS_UNKNOWN else stats[key]
+            offset = 41
+            stats["phases"] = []
+            for i in range(buffer[40]):
+                runs, last, peak, retained = (int.from_bytes(buffer[offset + j:offset + j + 4], "little")
+                                              for j in range(0, 16, 4))
+                stats["phases"].append({"runs": runs, "last": last, "peak": peak, "retained": retained})
+                offset += 16
+            stats["tasks"] = {}
+            for i in range(buffer[offset]):
+                entry = buffer[offset + 1 + 12 * i:offset + 13 + 12 * i]
+                stack = int.from_bytes(entry[8:12], "little")
+                stats["tasks"][entry[0:8].rstrip(b"\x00").decode()] = None if stack == self.STATS_UNKNOWN else stack
+            return stats
+
+        return {
+            "count": int.from_bytes(buffer[0:4], "little"),
+            "max_us": int.from_bytes(buffer[4:8], "little"),
+            "buckets": [int.from_bytes(buffer[i:i + 4], "little") for i in range(8, len(buffer) - 3, 4)],
+        }
+
+    def pipeline(self, commands, window=WINDOW) -> list:
+        """Send the commands with up to window requests in flight, the results are in the order of the commands."""
+        if self.record_key is None:
+            self.enable_records()
+
+        results = [None] * len(commands)
+        sent = received = 0
+
+        while received < len(commands):
+            while sent < len(commands) and sent - received < window:
+                self.record_send(commands[sent], sent & 0xFFFF)
+                sent += 1
+
+            record = self.record_read()
+            if record is None:
+                break
+
+            request_id, buffer = record
+            # Responses may arrive in any order, they are matched by the request ID
+            for index in range(request_id, len(commands), 0x10000):
+                if results[index] is None:
+                    results[index] = self.describe(buffer)
+                    break
+            received += 1
+
+        return results
+
+
     def requests(self, invalue) -> str:
         request = bytes([invalue])
         buffer = request + self.SESSION_ID
@@ -164,12 +450,18 @@ class Session:
         buffer = self.aes_key.encrypt(
             buffer + bytes([len(buffer)] * padding_length))
 
-        self.client_send(buffer)
+        # The session ID is sent in clear so the server can find the session keys
+        self.client_send(self.SESSION_ID + buffer, self.mac_key)
 
 
-        buffer = self.client_read(cipher.AES.block_size)
-        buffer = self.aes_key.decrypt(buffer)
+        buffer = self.client_read(cipher.AES.block_size, self.mac_key)
+        if len(buffer) == cipher.AES.block_size:
+            buffer = self.aes_key.decrypt(buffer)
 
+        return self.describe(buffer)
+
+    def describe(self, buffer: bytes) -> str:
+        """Describe a response, status | data."""
         if buffer[0] == 0x00:
 
             result = str(buffer[1:6], "utf-8").replace('\x00', '').strip()
@@ -185,7 +477,6 @@ class Session:
             except ValueError:
                 return "Unexpected result =>: " + result
 
-
         else:
             error_code = str(buffer[:1].hex())
             if error_code in response_codes:
@@ -0,0 +1,985 @@
+/**
+ * @file gateway.cpp
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @brief The gateway, shares one session with the server among many local clients.
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @details Only one process can own the serial port of the device, and every session costs a handshake.
+ *          The gateway owns the link, keeps one session established and serves the local clients over a
+ *          UNIX domain socket. A client sends `command | request ID (2) | arguments` in a FRAME_DATA frame
+ *          and gets `status | request ID (2) | data` back, the plaintext of a GCM record, so the request
+ *          IDs of the clients are their own.
+ *
+ *          Reads that are identical to a read still queued or in flight are not sent again, they are
+ *          answered with its response. Every client has a queue of its own and the queues are served
+ *          round robin, one request per turn, so a client with many actuations cannot starve the
+ *          others. Up to PROTOCOL_WINDOW requests are in flight on the link, as many as the server
+ *          keeps outstanding.
+ *
+ *          One thread sends, one thread receives the responses and keeps the session alive, and every
+ *          client has a thread that reads its requests. When the server drops the session, e.g. after
+ *          a reboot, the receive thread resumes it with the ticket or runs a new handshake and the
+ *          requests the server did not answer are sent again.
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "link.h"
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <getopt.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Private define ------------------------------------------------------------*/
+
+constexpr size_t REQUEST_SLOTS{256}; /**< Requests on the link the gateway can track, by request ID */
+constexpr size_t ARGS_SIZE{FRAME_MAX_PAYLOAD - PROTOCOL_RECORD_OVERHEAD - PROTOCOL_REQUEST_OVERHEAD}; /**< Largest arguments of a request */
+
+/* Private typedef -----------------------------------------------------------*/
+
+typedef std::chrono::steady_clock clock_type; /**< The clock of the timeouts */
+
+struct client_t;
+
+/**
+ * @brief A local client waiting for the response of a job.
+ */
+typedef struct
+{
+    std::shared_ptr<client_t> client; /**< The client */
+    uint16_t request_id;              /**< The request ID of the client */
+} waiter_t;
+
+/**
+ * @brief A request to the server, with all the clients waiting for its response.
+ */
+typedef struct
+{
+    uint8_t command;                  /**< The request */
+    uint8_t args[ARGS_SIZE];          /**< The arguments of the request */
+    size_t alen;                      /**< Length of the arguments */
+    bool read;                        /**< The request only reads, identical requests can share the response */
+    std::shared_ptr<client_t> owner;  /**< The client that queued the job, null for the keep alive */
+    std::vector<waiter_t> waiters;    /**< The clients waiting for the response */
+    clock_type::time_point queued;    /**< The time the job was queued */
+    clock_type::time_point sent;      /**< The time the job was sent, if it is in flight */
+    uint64_t order;                   /**< The number of the send, orders the jobs in flight */
+    uint16_t request_id;              /**< The request ID on the link, if it is in flight */
+} job_t;
+
+/**
+ * @brief A local client.
+ *
+ * The socket is received on by the thread of the client and sent on by the receive thread. Both have
+ * a descriptor of their own, the sending one is only closed with the client, so a response never goes
+ * to a descriptor that was closed and reused.
+ */
+struct client_t
+{
+    link_t rx;                  /**< The link the requests are received on */
+    link_t tx;                  /**< The link the responses are sent on */
+    std::deque<job_t *> queue;  /**< The jobs of the client not sent yet, in order */
+    size_t pending;             /**< The requests of the client not answered yet */
+    bool connected;             /**< The client has not disconnected */
+
+    ~client_t()
+    {
+        link_close(&tx);
+    }
+};
+
+/**
+ * @brief A response to a local client, sent after the lock is released.
+ */
+typedef struct
+{
+    std::shared_ptr<client_t> client; /**< The client */
+    std::vector<uint8_t> payload;     /**< status | request ID (2) | data */
+} delivery_t;
+
+/**
+ * @brief The options of the gateway.
+ */
+typedef struct
+{
+    const char *link;               /**< The name of the link to the server */
+    const char *socket;             /**< The path of the socket of the local clients */
+    protocol_handshake_t handshake; /**< The handshake of the session */
+    size_t window;                  /**< Requests in flight on the link */
+    size_t queue;                   /**< Requests a client can have waiting */
+} options_t;
+
+/**
+ * @brief The counters of the gateway.
+ */
+typedef struct
+{
+    uint64_t clients;    /**< Clients accepted */
+    uint64_t requests;   /**< Requests of the clients */
+    uint64_t coalesced;  /**< Requests answered with the response of an identical read */
+    uint64_t refused;    /**< Requests answered by the gateway, with STATUS_BUSY or STATUS_BAD_REQUEST */
+    uint64_t sent;       /**< Records sent to the server */
+    uint64_t retried;    /**< Requests sent again after STATUS_BUSY or a lost session */
+    uint64_t lost;       /**< Requests without response after PROTOCOL_TIMEOUT */
+    uint64_t handshakes; /**< Handshakes of the session */
+    uint64_t resumed;    /**< Resumptions of the session with its ticket */
+} counters_t;
+
+/* Private macro -------------------------------------------------------------*/
+
+constexpr int RECEIVE_TIMEOUT{100};     /**< Longest wait in ms of the receive thread before it looks for timeouts */
+constexpr int QUIET_TIME{250};          /**< Time in ms without a frame after which a lost session is drained */
+constexpr int RECONNECT_DELAY{1000};    /**< Time in ms between two attempts to restore the session */
+constexpr int KEEP_ALIVE{20000};        /**< Idle time in ms after which the session is kept alive, a third of the server's */
+constexpr int QUEUE_TIMEOUT{2 * PROTOCOL_TIMEOUT}; /**< Longest wait in ms of a request in a queue */
+constexpr int SEND_TIMEOUT{100};        /**< Longest wait in ms to send a response, a client that does not read is dropped */
+
+/* Private variables ---------------------------------------------------------*/
+
+static link_t upstream;                                  /**< The link to the server */
+static protocol_session_t session;                       /**< The session shared by the clients */
+static std::vector<std::shared_ptr<client_t>> clients;   /**< The clients, connected or with jobs left */
+static std::deque<job_t *> control;                      /**< The jobs of the gateway, sent before the clients' */
+static std::vector<job_t *> reads;                       /**< The reads queued or in flight, to coalesce */
+static job_t *flight[REQUEST_SLOTS]{nullptr};            /**< The jobs in flight, by request ID */
+static counters_t counters{};                            /**< The counters of the gateway */
+
+/* The options of the gateway */
+static options_t options{"unix:///tmp/dataintegrity.sock", "/tmp/dataintegrity-gateway.sock", PROTOCOL_X25519,
+                         PROTOCOL_WINDOW, 32};
+
+static std::mutex lock;                 /**< Protects the clients, the jobs and the counters */
+static std::condition_variable work;    /**< Signalled when a job can be sent */
+static bool ready{false};               /**< The session is established, jobs may be sent */
+static size_t in_flight{0};             /**< Jobs in flight */
+static size_t next_client{0};           /**< The client served next */
+static uint16_t next_id{0};             /**< The request ID of the next record */
+static uint64_t sends{0};               /**< Number of sends, the order of the next job */
+static clock_type::time_point last_sent; /**< The time the last record was sent */
+
+static std::atomic<bool> running{true}; /**< Cleared by SIGINT and SIGTERM */
+static std::atomic<size_t> readers{0};  /**< Client threads running */
+
+/* Static Assertions ---------------------------------------------------------*/
+
+static_assert(REQUEST_SLOTS > PROTOCOL_WINDOW, "Every request in the window needs a slot");
+static_assert(0x10000 % REQUEST_SLOTS == 0, "The request IDs wrap around the slots");
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief Prints the usage.
+ */
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -l, --link NAME        the server: serial port, socket://host:port or unix://path (%s)\n"
+            "  -s, --socket PATH      the UNIX domain socket of the local clients (%s)\n"
+            "  -k, --handshake NAME   x25519, p256, rsa or hybrid (x25519)\n"
+            "  -w, --window W         requests in flight on the link (%zu)\n"
+            "  -q, --queue Q          requests a client can have waiting (%zu)\n",
+            name, options.link, options.socket, options.window, options.queue);
+}
+
+/**
+ * @brief Parses the command line into the options.
+ *
+ * @return True if the options are valid, false otherwise.
+ */
+static bool parse(int argc, char **argv)
+{
+    static const struct option longopts[] = {
+        {"link", required_argument, nullptr, 'l'},
+        {"socket", required_argument, nullptr, 's'},
+        {"handshake", required_argument, nullptr, 'k'},
+        {"window", required_argument, nullptr, 'w'},
+        {"queue", required_argument, nullptr, 'q'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0},
+    };
+    static const char *handshakes[] = {"rsa", "hybrid", "x25519", "p256"};
+
+    bool status = true;
+    int option = 0;
+
+    while (status && (-1 != (option = getopt_long(argc, argv, "l:s:k:w:q:h", longopts, nullptr))))
+    {
+        switch (option)
+        {
+        case 'l':
+            options.link = optarg;
+            break;
+        case 's':
+            options.socket = optarg;
+            break;
+        case 'k':
+            status = false;
+            for (size_t i = 0; i < sizeof(handshakes) / sizeof(handshakes[0]); i++)
+            {
+                if (0 == strcmp(optarg, handshakes[i]))
+                {
+                    options.handshake = (protocol_handshake_t)i;
+                    status = true;
+                }
+            }
+            break;
+        case 'w':
+            options.window = strtoul(optarg, nullptr, 0);
+            break;
+        case 'q':
+            options.queue = strtoul(optarg, nullptr, 0);
+            break;
+        default:
+            status = false;
+            break;
+        }
+    }
+
+    return status && (options.window > 0) && (options.window < REQUEST_SLOTS) && (options.queue > 0);
+}
+
+/**
+ * @brief Stops the gateway on SIGINT and SIGTERM.
+ */
+static void stop(int)
+{
+    running = false;
+}
+
+/**
+ * @brief Checks if a request only reads, so identical requests can share a response.
+ */
+static bool command_read(uint8_t command)
+{
+    return (command == PROTOCOL_GET_TEMP) || (command == PROTOCOL_GET_LATEST) || (command == PROTOCOL_GET_HISTORY) ||
+           (command == PROTOCOL_GET_AGGREGATE) || (command == PROTOCOL_GET_STATS);
+}
+
+/**
+ * @brief Checks if a client may send a request.
+ *
+ * The gateway owns the session and the link, so closing the session and switching the baud rate are
+ * refused. The pushes of a subscription cannot be shared yet, so are subscriptions.
+ */
+static bool command_allowed(uint8_t command)
+{
+    return command_read(command) || (command == PROTOCOL_TOGGLE_LED);
+}
+
+/**
+ * @brief Appends a response to a client to the deliveries.
+ */
+static void respond(std::vector<delivery_t> &deliveries, const std::shared_ptr<client_t> &client, uint16_t request_id,
+                    uint8_t status, const uint8_t *data, size_t dlen)
+{
+    delivery_t delivery{client, std::vector<uint8_t>(PROTOCOL_REQUEST_OVERHEAD + dlen)};
+
+    delivery.payload[0] = status;
+    memcpy(delivery.payload.data() + 1, &request_id, sizeof(request_id));
+
+    if (dlen > 0)
+    {
+        memcpy(delivery.payload.data() + PROTOCOL_REQUEST_OVERHEAD, data, dlen);
+    }
+
+    deliveries.push_back(std::move(delivery));
+}
+
+/**
+ * @brief Sends the responses to the clients, without the lock.
+ *
+ * A client whose socket does not take a response within SEND_TIMEOUT is disconnected.
+ */
+static void deliver(std::vector<delivery_t> &deliveries)
+{
+    for (delivery_t &delivery : deliveries)
+    {
+        if (!link_send(&delivery.client->tx, FRAME_DATA, delivery.payload.data(), delivery.payload.size()))
+        {
+            /* Wakes the thread of the client, which cleans up */
+            (void)shutdown(delivery.client->tx.fd, SHUT_RDWR);
+        }
+    }
+
+    deliveries.clear();
+}
+
+/**
+ * @brief Answers the waiters of a job and deletes it. The lock is held.
+ */
+static void job_answer(job_t *job, uint8_t status, const uint8_t *data, size_t dlen, std::vector<delivery_t> &deliveries)
+{
+    for (waiter_t &waiter : job->waiters)
+    {
+        waiter.client->pending--;
+
+        if (waiter.client->connected)
+        {
+            respond(deliveries, waiter.client, waiter.request_id, status, data, dlen);
+        }
+    }
+
+    reads.erase(std::remove(reads.begin(), reads.end(), job), reads.end());
+    delete job;
+}
+
+/**
+ * @brief Puts a job in flight back in front of the queue of the gateway. The lock is held.
+ *
+ * It was the turn of the job already, and its client may be gone since.
+ */
+static void job_requeue(job_t *job)
+{
+    flight[job->request_id % REQUEST_SLOTS] = nullptr;
+    in_flight--;
+    counters.retried++;
+    job->queued = clock_type::now();
+    control.push_front(job);
+}
+
+/**
+ * @brief Takes the next job to send, the jobs of the gateway first, then the clients round robin. The lock is held.
+ *
+ * Disconnected clients without jobs are removed on the way, jobs nobody waits for any more are dropped.
+ *
+ * @return The job, or nullptr if no job is queued.
+ */
+static job_t *job_next(void)
+{
+    job_t *job{nullptr};
+    std::vector<delivery_t> none;
+
+    while ((job == nullptr) && !control.empty())
+    {
+        job = control.front();
+        control.pop_front();
+
+        if ((job->owner != nullptr) && job->waiters.empty())
+        {
+            job_answer(job, PROTOCOL_ERROR, nullptr, 0, none);
+            job = nullptr;
+        }
+    }
+
+    for (size_t visited = 0; (job == nullptr) && (visited < clients.size());)
+    {
+        next_client %= clients.size();
+        std::shared_ptr<client_t> client = clients[next_client];
+
+        if (client->queue.empty())
+        {
+            if (!client->connected)
+            {
+                clients.erase(clients.begin() + next_client);
+            }
+            else
+            {
+                next_client++;
+                visited++;
+            }
+        }
+        else
+        {
+            job = client->queue.front();
+            client->queue.pop_front();
+            next_client++;
+
+            if (job->waiters.empty())
+            {
+                /* Everybody who waited for it is gone */
+                job_answer(job, PROTOCOL_ERROR, nullptr, 0, none);
+                job = nullptr;
+            }
+        }
+    }
+
+    return job;
+}
+
+/**
+ * @brief Checks if a job can be sent. The lock is held.
+ */
+static bool job_ready(void)
+{
+    bool queued = !control.empty();
+
+    for (size_t i = 0; (i < clients.size()) && !queued; i++)
+    {
+        queued = !clients[i]->queue.empty() || !clients[i]->connected;
+    }
+
+    return ready && (in_flight < options.window) && queued;
+}
+
+/**
+ * @brief Sends the jobs while the window has room.
+ *
+ * Records are sealed and sent on this thread only, so the sequence numbers reach the server in order.
+ */
+static void sender(void)
+{
+    uint8_t record[FRAME_MAX_PAYLOAD];
+
+    while (running)
+    {
+        size_t length = 0;
+
+        {
+            std::unique_lock<std::mutex> guard(lock);
+
+            work.wait_for(guard, std::chrono::milliseconds(RECEIVE_TIMEOUT), [] { return job_ready() || !running; });
+
+            job_t *job = job_ready() ? job_next() : nullptr;
+
+            if (job != nullptr)
+            {
+                job->request_id = next_id++;
+                job->order = sends++;
+                job->sent = clock_type::now();
+                flight[job->request_id % REQUEST_SLOTS] = job;
+                in_flight++;
+                last_sent = job->sent;
+
+                length = protocol_seal(&session, job->command, job->request_id, job->args, job->alen, record);
+                counters.sent++;
+            }
+        }
+
+        /* A record that cannot be sent is lost, the receive thread restores the link */
+        if (length > 0)
+        {
+            (void)link_send(&upstream, FRAME_RECORD, record, length);
+        }
+    }
+}
+
+/**
+ * @brief Handles a frame of the server. The lock is held.
+ *
+ * @return True if the server dropped the session, false otherwise.
+ */
+static bool dispatch(link_frame_t *frame, std::vector<delivery_t> &deliveries)
+{
+    bool lost = false;
+
+    if (frame->type == FRAME_RECORD)
+    {
+        uint16_t request_id = 0;
+        const uint8_t *response{nullptr};
+        size_t length = protocol_open(&session, frame->payload, frame->length, &request_id, &response);
+        job_t *job = (length > 0) ? flight[request_id % REQUEST_SLOTS] : nullptr;
+
+        if ((job != nullptr) && (job->request_id == request_id))
+        {
+            if ((response[0] == PROTOCOL_BUSY) || (response[0] == PROTOCOL_EXPIRED))
+            {
+                /* Not handled by the server, an expired session is freed by it */
+                job_requeue(job);
+                lost = (response[0] == PROTOCOL_EXPIRED);
+            }
+            else
+            {
+                flight[request_id % REQUEST_SLOTS] = nullptr;
+                in_flight--;
+                job_answer(job, response[0], response + 1, length - 1, deliveries);
+            }
+        }
+    }
+    else
+    {
+        uint8_t status = 0;
+
+        /* Records of a session the server does not know are answered in clear */
+        lost = protocol_error(frame, &status) && ((status == PROTOCOL_INVALID_SESSION) || (status == PROTOCOL_EXPIRED));
+    }
+
+    return lost;
+}
+
+/**
+ * @brief Answers the requests that waited too long and keeps the session alive. The lock is held.
+ *
+ * @return True if a request in flight got no response, false otherwise.
+ */
+static bool sweep(clock_type::time_point now, std::vector<delivery_t> &deliveries)
+{
+    bool lost = false;
+
+    for (job_t *&job : flight)
+    {
+        if ((job != nullptr) && (now - job->sent > std::chrono::milliseconds(PROTOCOL_TIMEOUT)))
+        {
+            /* An actuation may have been carried out, so it is not sent again */
+            job_t *expired = job;
+            job = nullptr;
+            in_flight--;
+            counters.lost++;
+            job_answer(expired, PROTOCOL_ERROR, nullptr, 0, deliveries);
+            lost = true;
+        }
+    }
+
+    std::vector<std::deque<job_t *> *> queues{&control};
+
+    for (std::shared_ptr<client_t> &client : clients)
+    {
+        queues.push_back(&client->queue);
+    }
+
+    for (std::deque<job_t *> *queue : queues)
+    {
+        auto expired = std::stable_partition(queue->begin(), queue->end(), [now](const job_t *job) {
+            return (job->owner == nullptr) || (now - job->queued <= std::chrono::milliseconds(QUEUE_TIMEOUT));
+        });
+
+        for (auto job = expired; job != queue->end(); job++)
+        {
+            job_answer(*job, PROTOCOL_ERROR, nullptr, 0, deliveries);
+        }
+
+        queue->erase(expired, queue->end());
+    }
+
+    if (ready && control.empty() && (now - last_sent > std::chrono::milliseconds(KEEP_ALIVE)))
+    {
+        /* A read the clients can join */
+        job_t *job = new job_t();
+        job->command = PROTOCOL_GET_TEMP;
+        job->read = true;
+        job->queued = now;
+        control.push_back(job);
+        reads.push_back(job);
+        last_sent = now;
+        work.notify_one();
+    }
+
+    return lost;
+}
+
+/**
+ * @brief Establishes the session, with its ticket if it has one.
+ *
+ * @return True if the session was established, false otherwise.
+ */
+static bool session_establish(void)
+{
+    bool status = false;
+    clock_type::time_point start = clock_type::now();
+
+    if ((upstream.fd < 0) && !link_open(&upstream, options.link))
+    {
+        fprintf(stderr, "Cannot open %s\n", options.link);
+    }
+    else if (session.resumable && protocol_resume(&upstream, &session))
+    {
+        counters.resumed++;
+        status = true;
+    }
+    else if (protocol_establish(&upstream, &session, options.handshake))
+    {
+        counters.handshakes++;
+        status = true;
+    }
+    else
+    {
+        fprintf(stderr, "Handshake with %s failed\n", options.link);
+    }
+
+    if (status)
+    {
+        fprintf(stderr, "Session %016llx %s in %.1f ms\n", (unsigned long long)session.id,
+                (counters.handshakes + counters.resumed > 1) ? "restored" : "established",
+                std::chrono::duration<double, std::milli>(clock_type::now() - start).count());
+    }
+
+    return status;
+}
+
+/**
+ * @brief Restores a session the server dropped, on the receive thread.
+ *
+ * Sending stops, the responses still on their way are taken until the link is quiet and the requests
+ * left in flight are queued again. Handshake messages carry no session ID, so nothing else may be on
+ * the link while the session is established again.
+ */
+static void session_restore(std::vector<delivery_t> &deliveries)
+{
+    link_frame_t frame;
+    clock_type::time_point deadline = clock_type::now() + std::chrono::milliseconds(PROTOCOL_TIMEOUT);
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        ready = false;
+    }
+
+    while ((upstream.fd >= 0) && (clock_type::now() < deadline) && link_receive(&upstream, &frame, QUIET_TIME))
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        (void)dispatch(&frame, deliveries);
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::vector<job_t *> left;
+
+        for (job_t *job : flight)
+        {
+            if (job != nullptr)
+            {
+                left.push_back(job);
+            }
+        }
+
+        /* Back in front of their queues in the order they were sent */
+        std::sort(left.begin(), left.end(), [](const job_t *a, const job_t *b) { return a->order > b->order; });
+
+        for (job_t *job : left)
+        {
+            job_requeue(job);
+        }
+    }
+
+    deliver(deliveries);
+    link_discard(&upstream);
+
+    while (running && !session_establish())
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(RECONNECT_DELAY));
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        ready = running;
+        last_sent = clock_type::now();
+    }
+
+    work.notify_one();
+}
+
+/**
+ * @brief Receives the responses of the server, answers the clients and keeps the session alive.
+ */
+static void receiver(void)
+{
+    link_frame_t frame;
+    std::vector<delivery_t> deliveries;
+    clock_type::time_point swept = clock_type::now();
+
+    while (running)
+    {
+        bool lost = false;
+        bool received = link_receive(&upstream, &frame, RECEIVE_TIMEOUT);
+        clock_type::time_point now = clock_type::now();
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+
+            if (received)
+            {
+                lost = dispatch(&frame, deliveries);
+            }
+
+            if (now - swept > std::chrono::milliseconds(RECEIVE_TIMEOUT))
+            {
+                swept = now;
+                lost = sweep(now, deliveries) || lost;
+            }
+
+            /* Room in the window */
+            work.notify_one();
+        }
+
+        deliver(deliveries);
+
+        if (lost || (upstream.fd < 0))
+        {
+            fprintf(stderr, "Session %016llx lost\n", (unsigned long long)session.id);
+            session_restore(deliveries);
+        }
+    }
+
+    work.notify_all();
+}
+
+/**
+ * @brief Queues a request of a client, or joins an identical read. The lock is held.
+ *
+ * @return The status to answer right away, PROTOCOL_OKAY if the request was queued.
+ */
+static uint8_t request_queue(const std::shared_ptr<client_t> &client, uint8_t command, uint16_t request_id,
+                             const uint8_t *args, size_t alen)
+{
+    uint8_t status = PROTOCOL_OKAY;
+    job_t *job{nullptr};
+
+    counters.requests++;
+
+    if (!command_allowed(command) || (alen > ARGS_SIZE))
+    {
+        status = PROTOCOL_BAD_REQUEST;
+    }
+    else if (client->pending >= options.queue)
+    {
+        status = PROTOCOL_BUSY;
+    }
+    else if (command_read(command))
+    {
+        auto found = std::find_if(reads.begin(), reads.end(), [&](const job_t *read) {
+            return (read->command == command) && (read->alen == alen) && (0 == memcmp(read->args, args, alen));
+        });
+
+        if (found != reads.end())
+        {
+            job = *found;
+            counters.coalesced++;
+        }
+    }
+
+    if ((status == PROTOCOL_OKAY) && (job == nullptr))
+    {
+        job = new job_t();
+        job->command = command;
+        memcpy(job->args, args, alen);
+        job->alen = alen;
+        job->read = command_read(command);
+        job->owner = client;
+        job->queued = clock_type::now();
+        client->queue.push_back(job);
+
+        if (job->read)
+        {
+            reads.push_back(job);
+        }
+
+        work.notify_one();
+    }
+
+    if (status == PROTOCOL_OKAY)
+    {
+        job->waiters.push_back({client, request_id});
+        client->pending++;
+    }
+    else
+    {
+        counters.refused++;
+    }
+
+    return status;
+}
+
+/**
+ * @brief Reads the requests of a client until it disconnects.
+ */
+static void reader(std::shared_ptr<client_t> client)
+{
+    link_frame_t frame;
+    std::vector<delivery_t> deliveries;
+
+    while (running && link_receive(&client->rx, &frame, -1))
+    {
+        if ((frame.type == FRAME_DATA) && (frame.length >= PROTOCOL_REQUEST_OVERHEAD))
+        {
+            uint16_t request_id = 0;
+            memcpy(&request_id, frame.payload + 1, sizeof(request_id));
+
+            std::lock_guard<std::mutex> guard(lock);
+            uint8_t status = request_queue(client, frame.payload[0], request_id, frame.payload + PROTOCOL_REQUEST_OVERHEAD,
+                                           frame.length - PROTOCOL_REQUEST_OVERHEAD);
+
+            if (status != PROTOCOL_OKAY)
+            {
+                respond(deliveries, client, request_id, status, nullptr, 0);
+            }
+        }
+
+        deliver(deliveries);
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        /* Its queued jobs are dropped when their turn comes, unless others joined them */
+        client->connected = false;
+
+        for (job_t *job : client->queue)
+        {
+            job->waiters.erase(std::remove_if(job->waiters.begin(), job->waiters.end(),
+                                              [&](const waiter_t &waiter) { return waiter.client == client; }),
+                               job->waiters.end());
+        }
+
+        work.notify_one();
+    }
+
+    link_close(&client->rx);
+    readers--;
+}
+
+/**
+ * @brief Creates the socket of the local clients.
+ *
+ * @return The socket, -1 if it could not be created.
+ */
+static int listen_open(const char *path)
+{
+    struct sockaddr_un address{};
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+
+    /* A socket left behind by an earlier run */
+    (void)unlink(path);
+
+    if ((fd >= 0) && ((0 != bind(fd, (const struct sockaddr *)&address, sizeof(address))) || (0 != listen(fd, SOMAXCONN))))
+    {
+        close(fd);
+        fd = -1;
+    }
+
+    return fd;
+}
+
+/**
+ * @brief Accepts the clients until the gateway is stopped.
+ */
+static void acceptor(int fd)
+{
+    while (running)
+    {
+        struct pollfd listener{fd, POLLIN, 0};
+
+        if ((1 == poll(&listener, 1, RECEIVE_TIMEOUT)) && (listener.revents & POLLIN))
+        {
+            int socket = accept(fd, nullptr, nullptr);
+            struct timeval timeout{0, SEND_TIMEOUT * 1000};
+
+            if (socket >= 0)
+            {
+                std::shared_ptr<client_t> client = std::make_shared<client_t>();
+
+                (void)setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                client->rx.fd = socket;
+                client->tx.fd = dup(socket);
+                client->connected = true;
+
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    clients.push_back(client);
+                    counters.clients++;
+                }
+
+                readers++;
+                std::thread(reader, client).detach();
+            }
+        }
+    }
+}
+
+/**
+ * @brief Prints the counters of the gateway.
+ */
+static void report(void)
+{
+    printf("link         %s\n", options.link);
+    printf("clients      %llu, requests %llu, coalesced %llu, refused %llu\n", (unsigned long long)counters.clients,
+           (unsigned long long)counters.requests, (unsigned long long)counters.coalesced, (unsigned long long)counters.refused);
+    printf("upstream     sent %llu, retried %llu, lost %llu\n", (unsigned long long)counters.sent,
+           (unsigned long long)counters.retried, (unsigned long long)counters.lost);
+    printf("session      handshakes %llu, resumed %llu\n", (unsigned long long)counters.handshakes,
+           (unsigned long long)counters.resumed);
+}
+
+/* Exported user code --------------------------------------------------------*/
+
+int main(int argc, char **argv)
+{
+    int status = EXIT_FAILURE;
+    int fd = -1;
+
+    upstream.fd = -1;
+    protocol_session_init(&session);
+
+    if (!parse(argc, argv))
+    {
+        usage(argv[0]);
+    }
+    else if (!protocol_init() || !session_establish())
+    {
+        fprintf(stderr, "Cannot establish a session with %s\n", options.link);
+    }
+    else if (0 > (fd = listen_open(options.socket)))
+    {
+        fprintf(stderr, "Cannot listen on %s\n", options.socket);
+    }
+    else
+    {
+        status = EXIT_SUCCESS;
+
+        /* A client that went away must not end the gateway */
+        signal(SIGPIPE, SIG_IGN);
+        signal(SIGINT, stop);
+        signal(SIGTERM, stop);
+
+        ready = true;
+        last_sent = clock_type::now();
+
+        std::thread sending(sender);
+        std::thread receiving(receiver);
+
+        acceptor(fd);
+
+        close(fd);
+        (void)unlink(options.socket);
+        work.notify_all();
+        sending.join();
+        receiving.join();
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+
+            for (std::shared_ptr<client_t> &client : clients)
+            {
+                (void)shutdown(client->tx.fd, SHUT_RDWR);
+            }
+        }
+
+        while (readers > 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        report();
+
+        /* The server slot is freed right away instead of after the keep alive */
+        uint8_t response[PROTOCOL_BLOCK_SIZE];
+        (void)protocol_call(&upstream, &session, PROTOCOL_CLOSE, nullptr, 0, response, sizeof(response));
+    }
+
+    protocol_session_free(&session);
+    link_close(&upstream);
+
+    return status;
+}
@@ -0,0 +1,391 @@
+/**
+ * @file link.cpp
+ * @brief This file contains the implementation of the link module.
+ *        The link module sends and receives the frames of the server over a serial port or a socket.
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @details A frame is `sync (2) | type (1) | length (2, LE) | CRC-8 (1) | payload`, the same as in the
+ *          communication module of the server. A frame is assembled and written with a single write()
+ *          under the lock, so several threads can send on one link without interleaving their frames.
+ *          The received bytes are collected in a buffer of one frame, which is searched for a valid
+ *          header, so garbage in front of a frame is skipped as on the server.
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "link.h"
+#include <chrono>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/* Private define ------------------------------------------------------------*/
+
+/* Private typedef -----------------------------------------------------------*/
+
+/**
+ * @brief A baud rate and its termios speed.
+ */
+typedef struct
+{
+    uint32_t baudrate; /**< The baud rate */
+    speed_t speed;     /**< The termios speed */
+} link_speed_t;
+
+/* Private macro -------------------------------------------------------------*/
+
+constexpr uint8_t CRC8_POLY{0x07};            /**< CRC-8 polynomial x^8 + x^2 + x + 1 */
+constexpr const char TCP_PREFIX[]{"socket://"}; /**< Prefix of a TCP link, as in pyserial */
+constexpr const char UNIX_PREFIX[]{"unix://"};  /**< Prefix of a UNIX domain socket link */
+
+/* Private variables ---------------------------------------------------------*/
+
+/* The baud rates termios can set */
+static const link_speed_t speeds[] = {
+    {9600, B9600},
+    {19200, B19200},
+    {38400, B38400},
+    {57600, B57600},
+    {115200, B115200},
+    {230400, B230400},
+    {460800, B460800},
+    {921600, B921600},
+    {1000000, B1000000},
+    {1500000, B1500000},
+    {2000000, B2000000},
+};
+
+/* Static Assertions ---------------------------------------------------------*/
+
+static_assert(FRAME_MAX_PAYLOAD <= UINT16_MAX, "The length field of the header is 16 bits");
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief Calculates the CRC-8 of the type and length fields of a header.
+ */
+static uint8_t crc8(const uint8_t *data, size_t dlen)
+{
+    uint8_t crc = 0;
+
+    for (size_t i = 0; i < dlen; i++)
+    {
+        crc ^= data[i];
+        for (uint8_t bit = 0; bit < CHAR_BIT; bit++)
+        {
+            crc = (crc & 0x80) ? ((crc << 1) ^ CRC8_POLY) : (crc << 1);
+        }
+    }
+
+    return crc;
+}
+
+/**
+ * @brief Checks if the bytes hold a valid frame header.
+ */
+static bool header_valid(const uint8_t *header)
+{
+    return (header[0] == FRAME_SYNC_1) && (header[1] == FRAME_SYNC_2) &&
+           (header[5] == crc8(&header[2], 3));
+}
+
+/**
+ * @brief Sets a serial port to raw mode at the given baud rate.
+ *
+ * @param fd The serial port.
+ * @param baudrate The baud rate, one of speeds.
+ * @return True if the baud rate was set, false otherwise.
+ */
+static bool tty_speed(int fd, uint32_t baudrate)
+{
+    bool status = false;
+    struct termios options{};
+
+    for (const link_speed_t &entry : speeds)
+    {
+        if ((entry.baudrate == baudrate) && (0 == tcgetattr(fd, &options)))
+        {
+            cfmakeraw(&options);
+            options.c_cc[VMIN] = 0;
+            options.c_cc[VTIME] = 0;
+            status = (0 == cfsetspeed(&options, entry.speed)) && (0 == tcsetattr(fd, TCSANOW, &options));
+        }
+    }
+
+    return status;
+}
+
+/**
+ * @brief Connects to a TCP server given as "host:port".
+ *
+ * @return The socket, -1 if the connection failed.
+ */
+static int tcp_connect(const char *address)
+{
+    int fd = -1;
+    char host[256]{0};
+    const char *port = strrchr(address, ':');
+    struct addrinfo hints{};
+    struct addrinfo *result{nullptr};
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ((port != nullptr) && ((size_t)(port - address) < sizeof(host)))
+    {
+        memcpy(host, address, port - address);
+
+        if (0 == getaddrinfo(host, port + 1, &hints, &result))
+        {
+            for (struct addrinfo *entry = result; (entry != nullptr) && (fd < 0); entry = entry->ai_next)
+            {
+                fd = socket(entry->ai_family, entry->ai_socktype, entry->ai_protocol);
+
+                if ((fd >= 0) && (0 != connect(fd, entry->ai_addr, entry->ai_addrlen)))
+                {
+                    close(fd);
+                    fd = -1;
+                }
+            }
+
+            freeaddrinfo(result);
+        }
+    }
+
+    if (fd >= 0)
+    {
+        /* Requests are small and latency bound */
+        int enable = 1;
+        (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    }
+
+    return fd;
+}
+
+/**
+ * @brief Connects to a UNIX domain socket.
+ *
+ * @return The socket, -1 if the connection failed.
+ */
+static int unix_connect(const char *path)
+{
+    struct sockaddr_un address{};
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+
+    if ((fd >= 0) && (0 != connect(fd, (const struct sockaddr *)&address, sizeof(address))))
+    {
+        close(fd);
+        fd = -1;
+    }
+
+    return fd;
+}
+
+/**
+ * @brief Returns the ms left until the deadline, -1 to block.
+ */
+static int remaining(int timeout, std::chrono::steady_clock::time_point deadline)
+{
+    int left = -1;
+
+    if (timeout >= 0)
+    {
+        auto now = std::chrono::steady_clock::now();
+        left = (now < deadline) ? (int)std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() : 0;
+    }
+
+    return left;
+}
+
+/* Exported user code --------------------------------------------------------*/
+
+bool link_open(link_t *link, const char *name)
+{
+    link->fd = -1;
+    link->serial = false;
+    link->rx_length = 0;
+    link->dropped = 0;
+
+    if (0 == strncmp(name, TCP_PREFIX, sizeof(TCP_PREFIX) - 1))
+    {
+        link->fd = tcp_connect(name + sizeof(TCP_PREFIX) - 1);
+    }
+    else if (0 == strncmp(name, UNIX_PREFIX, sizeof(UNIX_PREFIX) - 1))
+    {
+        link->fd = unix_connect(name + sizeof(UNIX_PREFIX) - 1);
+    }
+    else
+    {
+        link->fd = open(name, O_RDWR | O_NOCTTY);
+        link->serial = true;
+
+        if ((link->fd >= 0) && !tty_speed(link->fd, LINK_BAUDRATE))
+        {
+            close(link->fd);
+            link->fd = -1;
+        }
+    }
+
+    return (link->fd >= 0);
+}
+
+void link_close(link_t *link)
+{
+    if (link->fd >= 0)
+    {
+        close(link->fd);
+        link->fd = -1;
+    }
+}
+
+bool link_send(link_t *link, uint8_t type, const uint8_t *payload, size_t length)
+{
+    bool status = false;
+    uint8_t frame[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD];
+
+    if ((link->fd >= 0) && (length <= FRAME_MAX_PAYLOAD))
+    {
+        size_t count = 0;
+        size_t size = FRAME_HEADER_SIZE + length;
+
+        frame[0] = FRAME_SYNC_1;
+        frame[1] = FRAME_SYNC_2;
+        frame[2] = type;
+        frame[3] = (uint8_t)(length & 0xFF);
+        frame[4] = (uint8_t)(length >> 8);
+        frame[5] = crc8(&frame[2], 3);
+        memcpy(frame + FRAME_HEADER_SIZE, payload, length);
+
+        std::lock_guard<std::mutex> guard(link->lock);
+
+        while (count < size)
+        {
+            ssize_t written = write(link->fd, frame + count, size - count);
+
+            if (written <= 0)
+            {
+                break;
+            }
+
+            count += (size_t)written;
+        }
+
+        status = (count == size);
+    }
+
+    return status;
+}
+
+bool link_receive(link_t *link, link_frame_t *frame, int timeout)
+{
+    bool status = false;
+    bool waiting = (link->fd >= 0);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+
+    while (waiting && !status)
+    {
+        size_t skip = 0;
+
+        /* Search the buffer for a valid header */
+        while ((link->rx_length - skip >= FRAME_HEADER_SIZE) && !header_valid(link->rx + skip))
+        {
+            skip++;
+        }
+
+        if ((link->rx_length - skip >= FRAME_HEADER_SIZE))
+        {
+            size_t length = link->rx[skip + 3] | ((size_t)link->rx[skip + 4] << 8);
+
+            if (length > FRAME_MAX_PAYLOAD)
+            {
+                /* The payload is skipped as garbage */
+                skip += FRAME_HEADER_SIZE;
+                link->dropped++;
+            }
+            else if (link->rx_length - skip >= FRAME_HEADER_SIZE + length)
+            {
+                frame->type = link->rx[skip + 2];
+                frame->length = (uint16_t)length;
+                memcpy(frame->payload, link->rx + skip + FRAME_HEADER_SIZE, length);
+                skip += FRAME_HEADER_SIZE + length;
+                status = true;
+            }
+        }
+
+        link->rx_length -= skip;
+        memmove(link->rx, link->rx + skip, link->rx_length);
+
+        if (!status)
+        {
+            struct pollfd fd{link->fd, POLLIN, 0};
+            int left = remaining(timeout, deadline);
+            ssize_t length = 0;
+
+            if ((left != 0) && (1 == poll(&fd, 1, left)))
+            {
+                length = read(link->fd, link->rx + link->rx_length, sizeof(link->rx) - link->rx_length);
+            }
+
+            if (length > 0)
+            {
+                link->rx_length += (size_t)length;
+            }
+            else if ((length == 0) && (left != 0) && (fd.revents != 0) && !link->serial)
+            {
+                /* The server closed the socket */
+                link_close(link);
+                waiting = false;
+            }
+            else
+            {
+                waiting = false;
+            }
+        }
+    }
+
+    return status;
+}
+
+bool link_baudrate(link_t *link, uint32_t baudrate)
+{
+    bool status = false;
+
+    if (link->serial && (link->fd >= 0))
+    {
+        std::lock_guard<std::mutex> guard(link->lock);
+
+        (void)tcdrain(link->fd);
+        status = tty_speed(link->fd, baudrate);
+    }
+
+    return status;
+}
+
+void link_discard(link_t *link)
+{
+    if (link->serial && (link->fd >= 0))
+    {
+        (void)tcflush(link->fd, TCIFLUSH);
+    }
+
+    link->rx_length = 0;
+}
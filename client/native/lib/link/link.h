@@ -0,0 +1,132 @@
+/**
+ * @file link.h
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @brief
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef LINK_H
+#define LINK_H
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mutex>
+
+/* Exported defines ----------------------------------------------------------*/
+
+constexpr uint8_t FRAME_SYNC_1{0xA5};     /**< First synchronisation byte */
+constexpr uint8_t FRAME_SYNC_2{0x5A};     /**< Second synchronisation byte */
+constexpr size_t FRAME_HEADER_SIZE{6};    /**< Sync (2) + Type (1) + Length (2) + CRC-8 (1) */
+constexpr size_t FRAME_MAX_PAYLOAD{1024}; /**< Largest payload the server accepts */
+
+/* Exported types ------------------------------------------------------------*/
+
+/**
+ * @brief The frame types carried in the frame header.
+ */
+typedef enum : uint8_t
+{
+    FRAME_DATA = 0x01,   /**< Session data (handshake and requests) */
+    FRAME_RECORD = 0x02, /**< AES-GCM session record */
+} frame_type_t;
+
+/**
+ * @brief A received frame.
+ */
+typedef struct
+{
+    uint8_t type;                       /**< The frame type */
+    uint16_t length;                    /**< The payload length */
+    uint8_t payload[FRAME_MAX_PAYLOAD]; /**< The payload */
+} link_frame_t;
+
+/**
+ * @brief A link to the server, a serial port or a socket.
+ *
+ * Frames can be sent from several threads, whole frames are written under the lock.
+ * Only one thread may receive.
+ */
+typedef struct
+{
+    int fd;                                            /**< The file descriptor, -1 if the link is closed */
+    bool serial;                                       /**< The link is a serial port and has a baud rate */
+    std::mutex lock;                                   /**< Serialises the writers */
+    uint8_t rx[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD]; /**< Bytes received but not framed yet */
+    size_t rx_length;                                  /**< Number of bytes in rx */
+    uint32_t dropped;                                  /**< Frames dropped because they were too large */
+} link_t;
+
+/* Exported constants --------------------------------------------------------*/
+
+constexpr uint32_t LINK_BAUDRATE{115200}; /**< The baud rate of a serial port after open, as on the server */
+
+/* Exported macro ------------------------------------------------------------*/
+
+/* Exported functions prototypes ---------------------------------------------*/
+
+/**
+ * @brief Open a link
+ *
+ * The names are those of the Python client: "socket://host:port" for the TCP transport,
+ * "unix://path" for the UNIX domain socket of a host build, anything else is a serial port
+ * or pseudo-terminal.
+ *
+ * @param link the link to open
+ * @param name the name of the link
+ * @return true if the link was opened else false
+ */
+bool link_open(link_t *link, const char *name);
+
+/**
+ * @brief Close a link
+ *
+ * @param link the link to close
+ */
+void link_close(link_t *link);
+
+/**
+ * @brief Send a frame
+ *
+ * @param link the link to send on
+ * @param type the frame type
+ * @param payload the payload
+ * @param length the length of the payload, at most FRAME_MAX_PAYLOAD
+ * @return true if the whole frame was written else false
+ */
+bool link_send(link_t *link, uint8_t type, const uint8_t *payload, size_t length);
+
+/**
+ * @brief Receive the next frame
+ *
+ * Garbage in front of a frame is skipped, a frame with a valid header but too long is dropped.
+ *
+ * @param link the link to receive on
+ * @param frame pointer to store the frame in
+ * @param timeout the longest wait in ms for the whole frame, -1 to block
+ * @return true if a frame was received else false
+ */
+bool link_receive(link_t *link, link_frame_t *frame, int timeout);
+
+/**
+ * @brief Change the baud rate of a serial port once all data written so far has been sent
+ *
+ * @param link the link
+ * @param baudrate the new baud rate
+ * @return true if the baud rate was set, false if it is not supported or the link is a socket
+ */
+bool link_baudrate(link_t *link, uint32_t baudrate);
+
+/**
+ * @brief Drop everything received but not framed yet
+ *
+ * @param link the link
+ */
+void link_discard(link_t *link);
+
+#endif /* LINK_H */
@@ -0,0 +1,851 @@
+/**
+ * @file protocol.cpp
+ * @brief This file contains the implementation of the protocol module.
+ *        The protocol module is the client side of the session module of the server.
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @details The module implements every handshake of the server and both request formats:
+ *          - The RSA key transport in three steps. The server accepts any client key in the
+ *            second step, the client sends the same key again, so a handshake only costs the
+ *            key generation once per process and the measured time is that of the protocol.
+ *          - The hybrid handshake in one message with the server key of an earlier RSA handshake.
+ *            Without a known server key the first message is refused and the server sends its key.
+ *          - The ECDH handshake with X25519 or P-256. The identity key of the first ECDH handshake
+ *            is pinned, a later handshake signed by a different identity is refused.
+ *          - Resuming a session with its ticket.
+ *          - Legacy requests, a single AES-CBC block with an HMAC, and AES-256-GCM records with
+ *            request IDs, which can be outstanding up to the window of the server.
+ *
+ *          The HMACs are computed without a shared context and every session seals and opens its
+ *          records with contexts of its own, so requests of different sessions, and the requests
+ *          and responses of one session, can be processed on different threads. The handshakes
+ *          share the random number generator and the RSA keys and must not run concurrently.
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "protocol.h"
+#include <chrono>
+#include <limits.h>
+#include <string.h>
+#include <mbedtls/md.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/rsa.h>
+#include <mbedtls/ecp.h>
+#include <mbedtls/ecdh.h>
+#include <mbedtls/hkdf.h>
+#include <mbedtls/bignum.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+
+/* Private define ------------------------------------------------------------*/
+
+/* Private typedef -----------------------------------------------------------*/
+
+/* Private macro -------------------------------------------------------------*/
+
+constexpr size_t AES_SIZE{32};          /**< AES Key Size */
+constexpr size_t DER_SIZE{294};         /**< DER Size of a RSA-2048 public key */
+constexpr size_t RSA_SIZE{256};         /**< RSA Size */
+constexpr int RSA_EXPONENT{65537};      /**< RSA Public Exponent */
+constexpr size_t HASH_SIZE{32};         /**< Hash Size */
+constexpr size_t AES_BLOCK_SIZE{16};    /**< AES Block Size */
+constexpr size_t SESSION_ID_SIZE{8};    /**< Session ID Size */
+constexpr size_t SEQUENCE_SIZE{8};      /**< GCM Record Sequence Number Size */
+constexpr size_t NONCE_SIZE{12};        /**< GCM Nonce Size */
+constexpr size_t TAG_SIZE{16};          /**< GCM Tag Size */
+constexpr size_t RECORD_HEADER_SIZE{SESSION_ID_SIZE + SEQUENCE_SIZE}; /**< Session ID + Sequence Number */
+constexpr size_t REQUEST_ID_SIZE{2};    /**< Request ID Size of GCM records */
+constexpr size_t TICKET_SIZE{128};      /**< Ticket Size */
+constexpr size_t IDENTITY_SIZE{91};     /**< DER of the P-256 identity key of the server */
+constexpr size_t X25519_SIZE{32};       /**< X25519 Public Key Size */
+constexpr size_t P256_SIZE{65};         /**< Uncompressed P-256 Public Key Size */
+constexpr size_t SECRET_SIZE{32};       /**< ECDH Shared Secret Size */
+constexpr uint8_t LEGACY_PADDING{9};    /**< Padding byte of a legacy request, the length of command | session ID */
+constexpr uint32_t DIRECTION_REQUEST{0};  /**< Nonce prefix of client records */
+constexpr uint32_t DIRECTION_RESPONSE{1}; /**< Nonce prefix of server records */
+constexpr size_t REPLY_SIZE{SESSION_ID_SIZE + AES_BLOCK_SIZE + AES_SIZE}; /**< Session ID + IV + AES Key of a RSA reply */
+constexpr size_t ENVELOPE_SIZE{((DER_SIZE + RSA_SIZE) / AES_BLOCK_SIZE + 1) * AES_BLOCK_SIZE}; /**< Padded Client DER + Signature */
+
+/* Private variables ---------------------------------------------------------*/
+
+static mbedtls_entropy_context entropy;   /**< Entropy Context */
+static mbedtls_ctr_drbg_context ctr_drbg; /**< CTR DRBG Context */
+static mbedtls_pk_context client_ctx;     /**< Client Key Context, generated with the first RSA handshake */
+static mbedtls_pk_context server_ctx;     /**< Server Public Key of the last RSA handshake */
+static bool client_ready{false};          /**< The client key was generated */
+static bool server_known{false};          /**< The server key is known */
+static uint8_t identity[IDENTITY_SIZE];   /**< The pinned identity key of the server */
+static bool pinned{false};                /**< An identity key is pinned */
+
+/* Security Key */
+static const uint8_t secret_key[HASH_SIZE] = {0x29, 0x49, 0xde, 0xc2, 0x3e, 0x1e, 0x34, 0xb5, 0x2d, 0x22, 0xb5,
+                                              0xba, 0x4c, 0x34, 0x23, 0x3a, 0x9d, 0x3f, 0xe2, 0x97, 0x14, 0xbe,
+                                              0x24, 0x62, 0x81, 0x0c, 0x86, 0xb1, 0xf6, 0x92, 0x54, 0xd6};
+
+/* Static Assertions ---------------------------------------------------------*/
+
+static_assert(ENVELOPE_SIZE == 560, "The envelope is the padded client DER and signature");
+static_assert(RSA_SIZE + ENVELOPE_SIZE + HASH_SIZE <= FRAME_MAX_PAYLOAD, "Every handshake message must fit in a frame");
+static_assert(NONCE_SIZE == sizeof(uint32_t) + SEQUENCE_SIZE, "The nonce is the direction and the sequence number");
+static_assert(PROTOCOL_RECORD_OVERHEAD == RECORD_HEADER_SIZE + TAG_SIZE, "A record is header | payload | tag");
+static_assert(PROTOCOL_REQUEST_OVERHEAD == 1 + REQUEST_ID_SIZE, "A record payload starts with command | request ID");
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief Calculates the HMAC-SHA256 of the data.
+ */
+static bool hmac(const uint8_t *key, const uint8_t *data, size_t dlen, uint8_t *output)
+{
+    return (0 == mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), key, HASH_SIZE, data, dlen, output));
+}
+
+/**
+ * @brief Appends the HMAC of the message and sends it as FRAME_DATA.
+ *
+ * @param link The link to send on.
+ * @param key The HMAC key of HASH_SIZE bytes.
+ * @param message The message, with HASH_SIZE bytes of room behind it.
+ * @param length The length of the message.
+ * @return True if the message was sent, false otherwise.
+ */
+static bool hmac_send(link_t *link, const uint8_t *key, uint8_t *message, size_t length)
+{
+    return hmac(key, message, length, message + length) &&
+           link_send(link, FRAME_DATA, message, length + HASH_SIZE);
+}
+
+/**
+ * @brief Receives the next FRAME_DATA frame and checks its HMAC.
+ *
+ * GCM records, e.g. the pushes of other sessions, are skipped.
+ *
+ * @param link The link to receive on.
+ * @param key The HMAC key of HASH_SIZE bytes.
+ * @param frame The frame to receive into.
+ * @return The length of the message without the HMAC, 0 if no authenticated message was received.
+ */
+static size_t hmac_read(link_t *link, const uint8_t *key, link_frame_t *frame)
+{
+    size_t length = 0;
+    bool received = false;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(PROTOCOL_TIMEOUT);
+
+    while (!received && (std::chrono::steady_clock::now() < deadline))
+    {
+        int left = (int)std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+
+        if (!link_receive(link, frame, left))
+        {
+            break;
+        }
+
+        received = (frame->type == FRAME_DATA);
+    }
+
+    if (received && (frame->length > HASH_SIZE))
+    {
+        uint8_t mac[HASH_SIZE]{0};
+        length = frame->length - HASH_SIZE;
+
+        if (!hmac(key, frame->payload, length, mac) || (0 != memcmp(mac, frame->payload + length, HASH_SIZE)))
+        {
+            length = 0;
+        }
+    }
+
+    return length;
+}
+
+/**
+ * @brief Encrypts a message with a public key.
+ *
+ * @param ctx The key.
+ * @param input The message, at most RSA_SIZE - 11 bytes.
+ * @param ilen Length of the message.
+ * @param output Buffer of RSA_SIZE bytes for the ciphertext.
+ * @return True if the message was encrypted, false otherwise.
+ */
+static bool rsa_encrypt(mbedtls_pk_context *ctx, const uint8_t *input, size_t ilen, uint8_t *output)
+{
+    size_t olen = 0;
+
+    return (0 == mbedtls_pk_encrypt(ctx, input, ilen, output, &olen, RSA_SIZE, mbedtls_ctr_drbg_random, &ctr_drbg)) &&
+           (olen == RSA_SIZE);
+}
+
+/**
+ * @brief Decrypts a block of RSA_SIZE bytes with the client key.
+ *
+ * @param input The ciphertext.
+ * @param output Buffer for the message.
+ * @param osize Size of the output buffer.
+ * @return The length of the message, 0 if the block could not be decrypted.
+ */
+static size_t rsa_decrypt(const uint8_t *input, uint8_t *output, size_t osize)
+{
+    size_t olen = 0;
+
+    if (0 != mbedtls_pk_decrypt(&client_ctx, input, RSA_SIZE, output, &olen, osize, mbedtls_ctr_drbg_random, &ctr_drbg))
+    {
+        olen = 0;
+    }
+
+    return olen;
+}
+
+/**
+ * @brief Generates the client key, once per process.
+ */
+static bool client_key(void)
+{
+    if (!client_ready)
+    {
+        mbedtls_pk_free(&client_ctx);
+        mbedtls_pk_init(&client_ctx);
+
+        client_ready = (0 == mbedtls_pk_setup(&client_ctx, mbedtls_pk_info_from_type(MBEDTLS_PK_RSA))) &&
+                       (0 == mbedtls_rsa_gen_key(mbedtls_pk_rsa(client_ctx), mbedtls_ctr_drbg_random, &ctr_drbg,
+                                                 RSA_SIZE * CHAR_BIT, RSA_EXPONENT));
+    }
+
+    return client_ready;
+}
+
+/**
+ * @brief Writes the client key and its signature of the secret, DER_SIZE + RSA_SIZE bytes.
+ */
+static bool client_proof(uint8_t *output)
+{
+    size_t slen = 0;
+    uint8_t der[DER_SIZE + 64]{0};
+
+    /* The DER is written at the end of the given buffer */
+    int length = mbedtls_pk_write_pubkey_der(&client_ctx, der, sizeof(der));
+
+    if (length == (int)DER_SIZE)
+    {
+        memcpy(output, der + sizeof(der) - DER_SIZE, DER_SIZE);
+    }
+
+    return (length == (int)DER_SIZE) &&
+           (0 == mbedtls_pk_sign(&client_ctx, MBEDTLS_MD_SHA256, secret_key, HASH_SIZE, output + DER_SIZE, &slen,
+                                 mbedtls_ctr_drbg_random, &ctr_drbg)) &&
+           (slen == RSA_SIZE);
+}
+
+/**
+ * @brief Replaces the known server key.
+ */
+static bool server_key(const uint8_t *der)
+{
+    mbedtls_pk_free(&server_ctx);
+    mbedtls_pk_init(&server_ctx);
+
+    server_known = (0 == mbedtls_pk_parse_public_key(&server_ctx, der, DER_SIZE)) &&
+                   (MBEDTLS_PK_RSA == mbedtls_pk_get_type(&server_ctx));
+
+    return server_known;
+}
+
+/**
+ * @brief Sets up the keys of an established session.
+ *
+ * The GCM key is derived from the AES key as on the server, salted with the HMAC key and with the session ID
+ * and the nonce of a resumption in the info.
+ *
+ * @param session The session.
+ * @param aes The AES key.
+ * @param mac The HMAC key.
+ * @param iv The IV of the session.
+ * @param nonce The nonce of the resume request, nullptr for a new key.
+ * @param id The session ID.
+ * @return True if the keys were set, false otherwise.
+ */
+static bool session_setup(protocol_session_t *session, const uint8_t *aes, const uint8_t *mac, const uint8_t *iv,
+                          const uint8_t *nonce, uint64_t id)
+{
+    static const uint8_t label[] = "record";
+    uint8_t info[sizeof(label) - 1 + SESSION_ID_SIZE + AES_BLOCK_SIZE]{0};
+    size_t ilen = sizeof(label) - 1;
+    uint8_t gcm_key[AES_SIZE]{0};
+
+    memcpy(info, label, ilen);
+    memcpy(info + ilen, &id, SESSION_ID_SIZE);
+    ilen += SESSION_ID_SIZE;
+
+    if (nonce != nullptr)
+    {
+        memcpy(info + ilen, nonce, AES_BLOCK_SIZE);
+        ilen += AES_BLOCK_SIZE;
+    }
+
+    memmove(session->aes_key, aes, AES_SIZE);
+    memmove(session->mac_key, mac, HASH_SIZE);
+    memcpy(session->enc_iv, iv, AES_BLOCK_SIZE);
+    memcpy(session->dec_iv, iv, AES_BLOCK_SIZE);
+    session->tx_sequence = 0;
+    session->rx_sequence = 0;
+
+    bool status = (0 == mbedtls_aes_setkey_enc(&session->enc_ctx, session->aes_key, AES_SIZE * CHAR_BIT)) &&
+                  (0 == mbedtls_aes_setkey_dec(&session->dec_ctx, session->aes_key, AES_SIZE * CHAR_BIT)) &&
+                  (0 == mbedtls_hkdf(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), session->mac_key, HASH_SIZE,
+                                     session->aes_key, AES_SIZE, info, ilen, gcm_key, sizeof(gcm_key))) &&
+                  (0 == mbedtls_gcm_setkey(&session->seal_ctx, MBEDTLS_CIPHER_ID_AES, gcm_key, AES_SIZE * CHAR_BIT)) &&
+                  (0 == mbedtls_gcm_setkey(&session->open_ctx, MBEDTLS_CIPHER_ID_AES, gcm_key, AES_SIZE * CHAR_BIT));
+
+    session->id = status ? id : 0;
+    memset(gcm_key, 0, sizeof(gcm_key));
+
+    return status;
+}
+
+/**
+ * @brief Takes the session from the answer of a key transport handshake.
+ *
+ * @param session The session.
+ * @param reply The decrypted answer, `session ID | IV | AES key | ticket`, older servers send no ticket.
+ * @param length The length of the answer.
+ * @return True if the server established the session, false if it answered with zeros.
+ */
+static bool establish_reply(protocol_session_t *session, const uint8_t *reply, size_t length)
+{
+    bool status = false;
+    uint64_t id{0};
+    static const uint8_t label[] = "mac";
+    uint8_t mac[HASH_SIZE]{0};
+
+    if (length >= REPLY_SIZE)
+    {
+        const uint8_t *aes = reply + SESSION_ID_SIZE + AES_BLOCK_SIZE;
+        memcpy(&id, reply, SESSION_ID_SIZE);
+
+        /* The HMAC key of a key transport session is derived from its AES key as on the server */
+        status = (id != 0) &&
+                 (0 == mbedtls_hkdf(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), secret_key, HASH_SIZE,
+                                    aes, AES_SIZE, label, sizeof(label) - 1, mac, sizeof(mac))) &&
+                 session_setup(session, aes, mac, reply + SESSION_ID_SIZE, nullptr, id);
+    }
+
+    memset(mac, 0, sizeof(mac));
+
+    session->resumable = status && (length >= REPLY_SIZE + TICKET_SIZE);
+
+    if (session->resumable)
+    {
+        memcpy(session->ticket, reply + REPLY_SIZE, TICKET_SIZE);
+    }
+
+    return status;
+}
+
+/**
+ * @brief Establishes a session with the RSA key transport in three steps.
+ */
+static bool establish_rsa(link_t *link, protocol_session_t *session)
+{
+    static const size_t chunks[] = {184, 184, 182}; /**< The key and signature split into RSA blocks */
+    link_frame_t frame;
+    uint8_t *message = frame.payload; /**< Messages are built in the frame the answers are received in */
+    uint8_t plain[DER_SIZE + RSA_SIZE]{0};
+    size_t length = 0;
+    size_t offset = 0;
+
+    /* The client key, the server answers with its key encrypted in two blocks */
+    bool status = client_key() && client_proof(plain);
+
+    if (status)
+    {
+        memcpy(message, plain, DER_SIZE);
+        status = hmac_send(link, secret_key, message, DER_SIZE) &&
+                 (2 * RSA_SIZE == hmac_read(link, secret_key, &frame));
+    }
+
+    if (status)
+    {
+        uint8_t der[DER_SIZE]{0};
+
+        length = rsa_decrypt(message, der, sizeof(der));
+        length += rsa_decrypt(message + RSA_SIZE, der + length, sizeof(der) - length);
+        status = (length == DER_SIZE) && server_key(der);
+    }
+
+    /* The key again with its signature, encrypted with the server key in three blocks */
+    for (size_t i = 0; status && (i < sizeof(chunks) / sizeof(chunks[0])); i++)
+    {
+        status = rsa_encrypt(&server_ctx, plain + offset, chunks[i], message + i * RSA_SIZE);
+        offset += chunks[i];
+    }
+
+    if (status)
+    {
+        uint8_t okay[RSA_SIZE]{0};
+
+        status = hmac_send(link, secret_key, message, 3 * RSA_SIZE) &&
+                 (RSA_SIZE == hmac_read(link, secret_key, &frame)) &&
+                 (4 == rsa_decrypt(message, okay, sizeof(okay))) &&
+                 (0 == memcmp(okay, "OKAY", 4));
+    }
+
+    /* The proof, the signature in two blocks, is answered with the session */
+    if (status)
+    {
+        status = rsa_encrypt(&server_ctx, plain + DER_SIZE, RSA_SIZE / 2, message) &&
+                 rsa_encrypt(&server_ctx, plain + DER_SIZE + RSA_SIZE / 2, RSA_SIZE / 2, message + RSA_SIZE) &&
+                 hmac_send(link, secret_key, message, 2 * RSA_SIZE) &&
+                 (RSA_SIZE == hmac_read(link, secret_key, &frame));
+    }
+
+    if (status)
+    {
+        length = rsa_decrypt(message, plain, sizeof(plain));
+        status = establish_reply(session, plain, length);
+    }
+
+    memset(plain, 0, sizeof(plain));
+
+    return status;
+}
+
+/**
+ * @brief Establishes a session with the hybrid handshake.
+ *
+ * Without a known server key, or with a rotated one, the server refuses the first message with
+ * `STATUS_UNKNOWN_KEY | server DER` and the message is sent again with the key of the server.
+ */
+static bool establish_hybrid(link_t *link, protocol_session_t *session)
+{
+    bool status = false;
+    bool retry = client_key();
+    link_frame_t frame;
+    uint8_t *message = frame.payload;
+    uint8_t wrap[AES_SIZE + AES_BLOCK_SIZE]{0};
+    uint8_t envelope[ENVELOPE_SIZE]{0};
+    mbedtls_aes_context aes_ctx;
+
+    mbedtls_aes_init(&aes_ctx);
+
+    for (size_t attempt = 0; retry && (attempt < 2); attempt++)
+    {
+        uint8_t iv[AES_BLOCK_SIZE]{0};
+        size_t padding = ENVELOPE_SIZE - DER_SIZE - RSA_SIZE;
+
+        retry = false;
+
+        /* RSA only wraps the key and IV of the envelope, the envelope carries the key and the proof */
+        if ((0 == mbedtls_ctr_drbg_random(&ctr_drbg, wrap, sizeof(wrap))) && client_proof(envelope))
+        {
+            memset(envelope + DER_SIZE + RSA_SIZE, (int)padding, padding);
+            memcpy(iv, wrap + AES_SIZE, sizeof(iv));
+
+            bool wrapped = server_known ? rsa_encrypt(&server_ctx, wrap, sizeof(wrap), message)
+                                        : (0 == mbedtls_ctr_drbg_random(&ctr_drbg, message, RSA_SIZE));
+
+            if (wrapped && (0 == mbedtls_aes_setkey_enc(&aes_ctx, wrap, AES_SIZE * CHAR_BIT)) &&
+                (0 == mbedtls_aes_crypt_cbc(&aes_ctx, MBEDTLS_AES_ENCRYPT, ENVELOPE_SIZE, iv, envelope, message + RSA_SIZE)) &&
+                hmac_send(link, secret_key, message, RSA_SIZE + ENVELOPE_SIZE))
+            {
+                size_t length = hmac_read(link, secret_key, &frame);
+
+                if (length == RSA_SIZE)
+                {
+                    uint8_t plain[RSA_SIZE]{0};
+
+                    length = rsa_decrypt(message, plain, sizeof(plain));
+                    status = establish_reply(session, plain, length);
+                    memset(plain, 0, sizeof(plain));
+                }
+                else if ((length == 1 + DER_SIZE) && (message[0] == PROTOCOL_UNKNOWN_KEY))
+                {
+                    retry = server_key(message + 1);
+                }
+            }
+        }
+    }
+
+    mbedtls_aes_free(&aes_ctx);
+    memset(wrap, 0, sizeof(wrap));
+
+    return status;
+}
+
+/**
+ * @brief Establishes a session with the ECDH handshake.
+ *
+ * The client sends `mode | ephemeral public key`, the server answers with `mode | ephemeral public key |
+ * session ID | ticket | identity key | signature length | signature`. The signature covers
+ * `mode | client key | server key | session ID`. The AES key, HMAC key and IV are derived with HKDF from
+ * the shared secret, salted with the pre-shared secret.
+ */
+static bool establish_ecdh(link_t *link, protocol_session_t *session, uint8_t mode, mbedtls_ecp_group_id curve, size_t size)
+{
+    bool status = false;
+    size_t olen = 0;
+    link_frame_t frame;
+    uint8_t *message = frame.payload;
+    uint8_t transcript[1 + 2 * P256_SIZE + SESSION_ID_SIZE]{mode};
+    uint8_t secret[SECRET_SIZE]{0};
+    uint8_t keys[AES_SIZE + HASH_SIZE + AES_BLOCK_SIZE]{0};
+
+    mbedtls_ecp_group grp;
+    mbedtls_ecp_point own, other;
+    mbedtls_mpi d, z;
+    mbedtls_pk_context identity_ctx;
+
+    mbedtls_ecp_group_init(&grp);
+    mbedtls_ecp_point_init(&own);
+    mbedtls_ecp_point_init(&other);
+    mbedtls_mpi_init(&d);
+    mbedtls_mpi_init(&z);
+    mbedtls_pk_init(&identity_ctx);
+
+    if ((0 == mbedtls_ecp_group_load(&grp, curve)) &&
+        (0 == mbedtls_ecdh_gen_public(&grp, &d, &own, mbedtls_ctr_drbg_random, &ctr_drbg)) &&
+        (0 == mbedtls_ecp_point_write_binary(&grp, &own, MBEDTLS_ECP_PF_UNCOMPRESSED, &olen, transcript + 1, size)) &&
+        (olen == size))
+    {
+        memcpy(message, transcript, 1 + size);
+
+        size_t length = hmac_send(link, secret_key, message, 1 + size) ? hmac_read(link, secret_key, &frame) : 0;
+        size_t offset = 1 + size + SESSION_ID_SIZE + TICKET_SIZE + IDENTITY_SIZE;
+
+        if ((length > offset + 1) && (message[0] == mode) && (length == offset + 1 + message[offset]))
+        {
+            uint64_t id{0};
+            uint8_t hash[HASH_SIZE]{0};
+            const uint8_t *der = message + offset - IDENTITY_SIZE;
+
+            memcpy(transcript + 1 + size, message + 1, size + SESSION_ID_SIZE);
+            memcpy(&id, message + 1 + size, SESSION_ID_SIZE);
+
+            /* The server proves its identity over both keys and the session ID */
+            status = (!pinned || (0 == memcmp(identity, der, IDENTITY_SIZE))) &&
+                     (0 == mbedtls_pk_parse_public_key(&identity_ctx, der, IDENTITY_SIZE)) &&
+                     (MBEDTLS_PK_ECKEY == mbedtls_pk_get_type(&identity_ctx)) &&
+                     (0 == mbedtls_md(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), transcript, sizeof(uint8_t) + 2 * size + SESSION_ID_SIZE, hash)) &&
+                     (0 == mbedtls_pk_verify(&identity_ctx, MBEDTLS_MD_SHA256, hash, sizeof(hash), message + offset + 1, message[offset]));
+
+            status = status &&
+                     (0 == mbedtls_ecp_point_read_binary(&grp, &other, message + 1, size)) &&
+                     (0 == mbedtls_ecp_check_pubkey(&grp, &other)) &&
+                     (0 == mbedtls_ecdh_compute_shared(&grp, &z, &other, &d, mbedtls_ctr_drbg_random, &ctr_drbg));
+
+            /* X25519 secrets are little endian (RFC 7748), P-256 secrets big endian */
+            if (status)
+            {
+                status = (0 == ((curve == MBEDTLS_ECP_DP_CURVE25519) ? mbedtls_mpi_write_binary_le(&z, secret, sizeof(secret))
+                                                                     : mbedtls_mpi_write_binary(&z, secret, sizeof(secret))));
+            }
+
+            status = status &&
+                     (0 == mbedtls_hkdf(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), secret_key, HASH_SIZE, secret, sizeof(secret),
+                                        transcript, 1 + 2 * size, keys, sizeof(keys))) &&
+                     session_setup(session, keys, keys + AES_SIZE, keys + AES_SIZE + HASH_SIZE, nullptr, id);
+
+            if (status)
+            {
+                memcpy(session->ticket, message + 1 + size + SESSION_ID_SIZE, TICKET_SIZE);
+                session->resumable = true;
+
+                /* Trust on first use, the identity must not change during the process */
+                memcpy(identity, der, IDENTITY_SIZE);
+                pinned = true;
+            }
+        }
+    }
+
+    mbedtls_pk_free(&identity_ctx);
+    mbedtls_mpi_free(&z);
+    mbedtls_mpi_free(&d);
+    mbedtls_ecp_point_free(&other);
+    mbedtls_ecp_point_free(&own);
+    mbedtls_ecp_group_free(&grp);
+    memset(secret, 0, sizeof(secret));
+    memset(keys, 0, sizeof(keys));
+
+    return status;
+}
+
+/* Exported user code --------------------------------------------------------*/
+
+bool protocol_init(void)
+{
+    static const uint8_t personalization[] = "dataintegrity-client";
+
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&ctr_drbg);
+    mbedtls_pk_init(&client_ctx);
+    mbedtls_pk_init(&server_ctx);
+
+    return (0 == mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, personalization, sizeof(personalization) - 1));
+}
+
+void protocol_session_init(protocol_session_t *session)
+{
+    session->id = 0;
+    session->resumable = false;
+    mbedtls_aes_init(&session->enc_ctx);
+    mbedtls_aes_init(&session->dec_ctx);
+    mbedtls_gcm_init(&session->seal_ctx);
+    mbedtls_gcm_init(&session->open_ctx);
+}
+
+void protocol_session_free(protocol_session_t *session)
+{
+    mbedtls_aes_free(&session->enc_ctx);
+    mbedtls_aes_free(&session->dec_ctx);
+    mbedtls_gcm_free(&session->seal_ctx);
+    mbedtls_gcm_free(&session->open_ctx);
+    memset(session->aes_key, 0, sizeof(session->aes_key));
+    memset(session->mac_key, 0, sizeof(session->mac_key));
+    memset(session->ticket, 0, sizeof(session->ticket));
+    protocol_session_init(session);
+}
+
+bool protocol_establish(link_t *link, protocol_session_t *session, protocol_handshake_t handshake)
+{
+    bool status = false;
+
+    session->id = 0;
+
+    switch (handshake)
+    {
+    case PROTOCOL_RSA:
+        status = establish_rsa(link, session);
+        break;
+    case PROTOCOL_HYBRID:
+        status = establish_hybrid(link, session);
+        break;
+    case PROTOCOL_X25519:
+        status = establish_ecdh(link, session, 0x01, MBEDTLS_ECP_DP_CURVE25519, X25519_SIZE);
+        break;
+    case PROTOCOL_P256:
+        status = establish_ecdh(link, session, 0x02, MBEDTLS_ECP_DP_SECP256R1, P256_SIZE);
+        break;
+    default:
+        break;
+    }
+
+    return status;
+}
+
+bool protocol_resume(link_t *link, protocol_session_t *session)
+{
+    bool status = false;
+    link_frame_t frame;
+    uint8_t *message = frame.payload;
+    uint8_t nonce[AES_BLOCK_SIZE]{0};
+
+    if (session->resumable && (0 == mbedtls_ctr_drbg_random(&ctr_drbg, nonce, sizeof(nonce))))
+    {
+        memcpy(message, nonce, sizeof(nonce));
+        memcpy(message + sizeof(nonce), session->ticket, TICKET_SIZE);
+
+        /* The ticket is single-use, the answer carries the follow-up ticket */
+        if (hmac_send(link, secret_key, message, sizeof(nonce) + TICKET_SIZE) &&
+            (2 * AES_BLOCK_SIZE + TICKET_SIZE == hmac_read(link, secret_key, &frame)))
+        {
+            /* ID and IV are encrypted with the resumed key, the nonce serves as IV and is updated by the decryption */
+            uint64_t id{0};
+            uint8_t iv[AES_BLOCK_SIZE]{0};
+            uint8_t plain[2 * AES_BLOCK_SIZE]{0};
+
+            memcpy(iv, nonce, sizeof(iv));
+
+            if (0 == mbedtls_aes_crypt_cbc(&session->dec_ctx, MBEDTLS_AES_DECRYPT, sizeof(plain), iv, message, plain))
+            {
+                memcpy(&id, plain, SESSION_ID_SIZE);
+                status = (id != 0) && session_setup(session, session->aes_key, session->mac_key, plain + SESSION_ID_SIZE, nonce, id);
+            }
+
+            memcpy(session->ticket, message + sizeof(plain), TICKET_SIZE);
+            session->resumable = status;
+        }
+        else
+        {
+            /* Expired or unknown, only a new handshake helps */
+            session->resumable = false;
+        }
+    }
+
+    return status;
+}
+
+bool protocol_request(link_t *link, protocol_session_t *session, uint8_t command, uint8_t *response)
+{
+    bool status = false;
+    link_frame_t frame;
+    uint8_t *message = frame.payload;
+    uint8_t plain[AES_BLOCK_SIZE]{command};
+
+    memcpy(plain + 1, &session->id, SESSION_ID_SIZE);
+    memset(plain + 1 + SESSION_ID_SIZE, LEGACY_PADDING, sizeof(plain) - 1 - SESSION_ID_SIZE);
+
+    /* The session ID is sent in clear so the server can find the session keys */
+    memcpy(message, &session->id, SESSION_ID_SIZE);
+
+    if ((session->id != 0) &&
+        (0 == mbedtls_aes_crypt_cbc(&session->enc_ctx, MBEDTLS_AES_ENCRYPT, AES_BLOCK_SIZE, session->enc_iv, plain, message + SESSION_ID_SIZE)) &&
+        hmac_send(link, session->mac_key, message, SESSION_ID_SIZE + AES_BLOCK_SIZE))
+    {
+        size_t length = hmac_read(link, session->mac_key, &frame);
+
+        if (length == AES_BLOCK_SIZE)
+        {
+            status = (0 == mbedtls_aes_crypt_cbc(&session->dec_ctx, MBEDTLS_AES_DECRYPT, AES_BLOCK_SIZE, session->dec_iv, message, response));
+        }
+        else if (protocol_error(&frame, response))
+        {
+            /* Not assigned to the session, e.g. an unknown session ID */
+            memset(response + 1, 0, PROTOCOL_BLOCK_SIZE - 1);
+            status = true;
+        }
+    }
+
+    return status;
+}
+
+size_t protocol_seal(protocol_session_t *session, uint8_t command, uint16_t request_id,
+                     const uint8_t *args, size_t alen, uint8_t *record)
+{
+    size_t length = 0;
+    uint8_t nonce[NONCE_SIZE]{0};
+    uint8_t *payload = record + RECORD_HEADER_SIZE;
+    size_t plen = PROTOCOL_REQUEST_OVERHEAD + alen;
+
+    if ((session->id != 0) && (RECORD_HEADER_SIZE + plen + TAG_SIZE <= FRAME_MAX_PAYLOAD))
+    {
+        uint64_t sequence = ++session->tx_sequence;
+
+        memcpy(record, &session->id, SESSION_ID_SIZE);
+        memcpy(record + SESSION_ID_SIZE, &sequence, SEQUENCE_SIZE);
+        memcpy(nonce, &DIRECTION_REQUEST, sizeof(DIRECTION_REQUEST));
+        memcpy(nonce + sizeof(DIRECTION_REQUEST), &sequence, SEQUENCE_SIZE);
+
+        payload[0] = command;
+        memcpy(payload + 1, &request_id, REQUEST_ID_SIZE);
+        memmove(payload + PROTOCOL_REQUEST_OVERHEAD, args, alen);
+
+        if (0 == mbedtls_gcm_crypt_and_tag(&session->seal_ctx, MBEDTLS_GCM_ENCRYPT, plen, nonce, NONCE_SIZE, record,
+                                           RECORD_HEADER_SIZE, payload, payload, TAG_SIZE, payload + plen))
+        {
+            length = RECORD_HEADER_SIZE + plen + TAG_SIZE;
+        }
+    }
+
+    return length;
+}
+
+uint64_t protocol_record_session(const uint8_t *record, size_t length)
+{
+    uint64_t id{0};
+
+    if (length >= RECORD_HEADER_SIZE)
+    {
+        memcpy(&id, record, SESSION_ID_SIZE);
+    }
+
+    return id;
+}
+
+size_t protocol_open(protocol_session_t *session, uint8_t *record, size_t length,
+                     uint16_t *request_id, const uint8_t **response)
+{
+    size_t rlen = 0;
+    uint64_t sequence{0};
+
+    if ((length >= PROTOCOL_RECORD_OVERHEAD + PROTOCOL_REQUEST_OVERHEAD) &&
+        (session->id != 0) && (session->id == protocol_record_session(record, length)))
+    {
+        memcpy(&sequence, record + SESSION_ID_SIZE, SEQUENCE_SIZE);
+    }
+
+    if (sequence > session->rx_sequence)
+    {
+        uint8_t nonce[NONCE_SIZE]{0};
+        uint8_t *payload = record + RECORD_HEADER_SIZE;
+        size_t plen = length - PROTOCOL_RECORD_OVERHEAD;
+
+        memcpy(nonce, &DIRECTION_RESPONSE, sizeof(DIRECTION_RESPONSE));
+        memcpy(nonce + sizeof(DIRECTION_RESPONSE), &sequence, SEQUENCE_SIZE);
+
+        if (0 == mbedtls_gcm_auth_decrypt(&session->open_ctx, plen, nonce, NONCE_SIZE, record, RECORD_HEADER_SIZE,
+                                          payload + plen, TAG_SIZE, payload, payload))
+        {
+            session->rx_sequence = sequence;
+            memcpy(request_id, payload + 1, REQUEST_ID_SIZE);
+
+            /* The status is moved next to the data, over the request ID */
+            payload[REQUEST_ID_SIZE] = payload[0];
+            *response = payload + REQUEST_ID_SIZE;
+            rlen = plen - REQUEST_ID_SIZE;
+        }
+    }
+
+    return rlen;
+}
+
+bool protocol_error(const link_frame_t *frame, uint8_t *status)
+{
+    bool valid = false;
+    uint8_t mac[HASH_SIZE]{0};
+
+    if ((frame->type == FRAME_DATA) && (frame->length == 1 + HASH_SIZE) && hmac(secret_key, frame->payload, 1, mac))
+    {
+        valid = (0 == memcmp(mac, frame->payload + 1, HASH_SIZE));
+        *status = frame->payload[0];
+    }
+
+    return valid;
+}
+
+size_t protocol_call(link_t *link, protocol_session_t *session, uint8_t command,
+                     const uint8_t *args, size_t alen, uint8_t *response, size_t size)
+{
+    size_t rlen = 0;
+    bool waiting = false;
+    link_frame_t frame;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(PROTOCOL_TIMEOUT);
+    size_t length = protocol_seal(session, command, 0, args, alen, frame.payload);
+
+    waiting = (length > 0) && link_send(link, FRAME_RECORD, frame.payload, length);
+
+    while (waiting && (std::chrono::steady_clock::now() < deadline))
+    {
+        uint16_t request_id = 0;
+        const uint8_t *result{nullptr};
+        int left = (int)std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+
+        if (!link_receive(link, &frame, left))
+        {
+            break;
+        }
+
+        if (frame.type == FRAME_RECORD)
+        {
+            length = protocol_open(session, frame.payload, frame.length, &request_id, &result);
+
+            if ((length > 0) && (request_id == 0))
+            {
+                rlen = (length < size) ? length : size;
+                memcpy(response, result, rlen);
+                waiting = false;
+            }
+        }
+        else if ((size > 0) && protocol_error(&frame, response))
+        {
+            rlen = 1;
+            waiting = false;
+        }
+    }
+
+    return rlen;
+}
@@ -0,0 +1,232 @@
+/**
+ * @file protocol.h
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @brief
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "link.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <mbedtls/aes.h>
+#include <mbedtls/gcm.h>
+
+/* Exported defines ----------------------------------------------------------*/
+
+/* Exported types ------------------------------------------------------------*/
+
+/**
+ * @brief The requests of the server, the values of request_t.
+ */
+typedef enum : uint8_t
+{
+    PROTOCOL_CLOSE = 0x00,
+    PROTOCOL_TOGGLE_LED = 0x02,
+    PROTOCOL_GET_TEMP = 0x03,
+    PROTOCOL_SUBSCRIBE = 0x06,
+    PROTOCOL_UNSUBSCRIBE = 0x07,
+    PROTOCOL_GET_LATEST = 0x08,
+    PROTOCOL_GET_HISTORY = 0x09,
+    PROTOCOL_GET_AGGREGATE = 0x0A,
+    PROTOCOL_SET_BAUD = 0x0B,
+    PROTOCOL_GET_STATS = 0x0C,
+} protocol_command_t;
+
+/**
+ * @brief The status codes of the server, the first byte of every response.
+ */
+typedef enum : uint8_t
+{
+    PROTOCOL_OKAY,
+    PROTOCOL_ERROR,
+    PROTOCOL_EXPIRED,
+    PROTOCOL_HASH_ERROR,
+    PROTOCOL_BAD_REQUEST,
+    PROTOCOL_INVALID_SESSION,
+    PROTOCOL_UNKNOWN_KEY,
+    PROTOCOL_BUSY,
+} protocol_status_t;
+
+/**
+ * @brief The handshakes a session can be established with.
+ */
+typedef enum : uint8_t
+{
+    PROTOCOL_RSA,    /**< The three step RSA key transport */
+    PROTOCOL_HYBRID, /**< The single message hybrid handshake, with the server key of an earlier handshake */
+    PROTOCOL_X25519, /**< Ephemeral X25519 */
+    PROTOCOL_P256,   /**< Ephemeral NIST P-256 */
+} protocol_handshake_t;
+
+/**
+ * @brief An established session.
+ *
+ * The request and the response direction have their own GCM context, so one thread can seal
+ * the records of a session while another one opens them.
+ */
+typedef struct
+{
+    uint64_t id;                  /**< The session ID, 0 if the session is not established */
+    uint8_t aes_key[32];          /**< The AES Key */
+    uint8_t mac_key[32];          /**< The HMAC Key */
+    uint8_t enc_iv[16];           /**< The IV of the legacy requests */
+    uint8_t dec_iv[16];           /**< The IV of the legacy responses */
+    mbedtls_aes_context enc_ctx;  /**< AES Encryption Context */
+    mbedtls_aes_context dec_ctx;  /**< AES Decryption Context */
+    mbedtls_gcm_context seal_ctx; /**< AES-GCM Context of the requests */
+    mbedtls_gcm_context open_ctx; /**< AES-GCM Context of the responses */
+    uint64_t tx_sequence;         /**< Sequence number of the last sent record */
+    uint64_t rx_sequence;         /**< Sequence number of the last accepted record */
+    uint8_t ticket[128];          /**< The ticket to resume the session with */
+    bool resumable;               /**< The server issued a ticket */
+} protocol_session_t;
+
+/* Exported constants --------------------------------------------------------*/
+
+constexpr size_t PROTOCOL_WINDOW{8};           /**< Requests the server keeps outstanding, over all sessions */
+constexpr size_t PROTOCOL_RECORD_OVERHEAD{32}; /**< Session ID (8) + Sequence Number (8) + Tag (16) */
+constexpr size_t PROTOCOL_REQUEST_OVERHEAD{3}; /**< Command or Status (1) + Request ID (2) */
+constexpr size_t PROTOCOL_BLOCK_SIZE{16};      /**< Status and data of a legacy response */
+constexpr int PROTOCOL_TIMEOUT{5000};          /**< Longest wait in ms for an answer of the server */
+
+/* Exported macro ------------------------------------------------------------*/
+
+/* Exported functions prototypes ---------------------------------------------*/
+
+/**
+ * @brief Initialize the protocol module
+ *
+ * Seeds the random number generator. The RSA key of the client is generated with the first
+ * RSA or hybrid handshake.
+ *
+ * @return true if the protocol module was initialized else false
+ */
+bool protocol_init(void);
+
+/**
+ * @brief Initialize a session
+ *
+ * @param session the session
+ */
+void protocol_session_init(protocol_session_t *session);
+
+/**
+ * @brief Free a session and wipe its keys
+ *
+ * @param session the session
+ */
+void protocol_session_free(protocol_session_t *session);
+
+/**
+ * @brief Establish a session
+ *
+ * The server runs one handshake at a time and handshake messages carry no session ID, so
+ * the handshakes on a link must not overlap. Handshakes are not thread-safe.
+ *
+ * @param link the link to the server
+ * @param session the session to establish
+ * @param handshake the handshake to establish it with
+ * @return true if the session was established else false
+ */
+bool protocol_establish(link_t *link, protocol_session_t *session, protocol_handshake_t handshake);
+
+/**
+ * @brief Resume a session with its ticket
+ *
+ * The session gets a new ID and IV for the same keys, no RSA or ECDH operation is needed. A ticket
+ * is single-use, the session keeps the follow-up ticket the server answers with.
+ *
+ * @param link the link to the server
+ * @param session the session to resume, it must have a ticket
+ * @return true if the session was resumed, false if the ticket was rejected
+ */
+bool protocol_resume(link_t *link, protocol_session_t *session);
+
+/**
+ * @brief Send a legacy AES-CBC request and read its response
+ *
+ * @param link the link to the server
+ * @param session the session
+ * @param command the request
+ * @param response the buffer of PROTOCOL_BLOCK_SIZE bytes to store status | data in
+ * @return true if the response was authenticated else false
+ */
+bool protocol_request(link_t *link, protocol_session_t *session, uint8_t command, uint8_t *response);
+
+/**
+ * @brief Seal a GCM request record
+ *
+ * The first record switches the session to GCM on the server for good.
+ *
+ * @param session the session
+ * @param command the request
+ * @param request_id the request ID, echoed in the response
+ * @param args the arguments of the request
+ * @param alen the length of the arguments
+ * @param record the buffer to store the record in, alen + PROTOCOL_REQUEST_OVERHEAD + PROTOCOL_RECORD_OVERHEAD bytes
+ * @return size_t the length of the record, 0 if it could not be sealed
+ */
+size_t protocol_seal(protocol_session_t *session, uint8_t command, uint16_t request_id,
+                     const uint8_t *args, size_t alen, uint8_t *record);
+
+/**
+ * @brief Get the session ID of a received record
+ *
+ * @param record the record
+ * @param length the length of the record
+ * @return uint64_t the session ID, 0 if the record is too short
+ */
+uint64_t protocol_record_session(const uint8_t *record, size_t length);
+
+/**
+ * @brief Open a GCM response record
+ *
+ * The record is decrypted in place. A record with a sequence number not above the last one
+ * opened is rejected as a replay.
+ *
+ * @param session the session of the record
+ * @param record the record
+ * @param length the length of the record
+ * @param request_id pointer to store the request ID in
+ * @param response pointer to store a pointer to status | data in, inside the record
+ * @return size_t the length of status | data, 0 if the record was not authenticated
+ */
+size_t protocol_open(protocol_session_t *session, uint8_t *record, size_t length,
+                     uint16_t *request_id, const uint8_t **response);
+
+/**
+ * @brief Read the status of an error the server could not assign to a session
+ *
+ * @param frame a FRAME_DATA frame
+ * @param status pointer to store the status in
+ * @return true if the frame is an authenticated status else false
+ */
+bool protocol_error(const link_frame_t *frame, uint8_t *status);
+
+/**
+ * @brief Send a GCM request and wait for its response
+ *
+ * Frames of other sessions and pushes are skipped.
+ *
+ * @param link the link to the server
+ * @param session the session
+ * @param command the request
+ * @param args the arguments of the request
+ * @param alen the length of the arguments
+ * @param response the buffer to store status | data in
+ * @param size the size of the buffer
+ * @return size_t the length of status | data, 0 if no response was received
+ */
+size_t protocol_call(link_t *link, protocol_session_t *session, uint8_t command,
+                     const uint8_t *args, size_t alen, uint8_t *response, size_t size);
+
+#endif /* PROTOCOL_H */
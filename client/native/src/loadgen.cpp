@@ -0,0 +1,602 @@
+/**
+ * @file loadgen.cpp
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @brief The load generator, drives concurrent sessions at a target request rate and reports the latency.
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @details The sessions are established one after another, the server runs one handshake at a time.
+ *          Then every session sends GCM records on a thread of its own, all over the same link, and
+ *          one thread receives the responses and matches them to their requests by the session ID
+ *          and the request ID. The server keeps PROTOCOL_WINDOW requests outstanding over all
+ *          sessions, a request beyond the window is answered with STATUS_BUSY, so the requests in
+ *          flight are limited to the window.
+ *
+ *          With a target rate every request has its time in a fixed schedule and its latency is
+ *          measured from that time, not from the time it was sent. A request held back by a full
+ *          window is counted with the time it waited, so a stalled server shows up in the
+ *          percentiles instead of lowering the rate (coordinated omission). Without a target rate
+ *          the requests are sent as fast as the window allows.
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "link.h"
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Private define ------------------------------------------------------------*/
+
+constexpr size_t REQUEST_SLOTS{256}; /**< Outstanding requests per session a client can track */
+
+/* Private typedef -----------------------------------------------------------*/
+
+typedef std::chrono::steady_clock clock_type; /**< The clock of the schedule and the latencies */
+
+/**
+ * @brief The options of a run.
+ */
+typedef struct
+{
+    const char *link;               /**< The name of the link */
+    size_t sessions;                /**< Number of sessions */
+    double rate;                    /**< Target requests per second over all sessions, 0 to send as fast as possible */
+    double duration;                /**< Length of the run in seconds */
+    size_t window;                  /**< Requests in flight over all sessions */
+    protocol_handshake_t handshake; /**< The handshake of the sessions */
+    uint8_t command;                /**< The request */
+    uint8_t args[4];                /**< The argument of the request, LE */
+    size_t alen;                    /**< Length of the argument, 0 or 4 */
+} options_t;
+
+/**
+ * @brief A session of the run.
+ */
+typedef struct
+{
+    protocol_session_t session;                    /**< The session */
+    std::mutex lock;                               /**< Protects the outstanding requests */
+    clock_type::time_point started[REQUEST_SLOTS]; /**< Start time of the outstanding requests, by request ID */
+    bool outstanding[REQUEST_SLOTS];               /**< The request ID is outstanding */
+    uint16_t next_id;                              /**< The request ID of the next request */
+    double handshake_ms;                           /**< Time the handshake took */
+} client_t;
+
+/**
+ * @brief The counters of the run, written by the receive thread.
+ */
+typedef struct
+{
+    std::vector<uint32_t> latencies; /**< Latencies of the answered requests in us */
+    uint64_t statuses[8];            /**< Responses by status code */
+    uint64_t unassigned;             /**< Errors the server could not assign to a session */
+    uint64_t rejected;               /**< Records that could not be opened */
+    uint64_t lost;                   /**< Requests without response after PROTOCOL_TIMEOUT */
+} counters_t;
+
+/* Private macro -------------------------------------------------------------*/
+
+constexpr int RECEIVE_TIMEOUT{100}; /**< Longest wait in ms of the receive thread before it looks for lost requests */
+constexpr double DRAIN_TIME{2.0};   /**< Longest wait in s for the outstanding requests after the run */
+
+/* Private variables ---------------------------------------------------------*/
+
+static link_t link;                     /**< The link to the server */
+static std::vector<client_t *> clients; /**< The sessions */
+static counters_t counters{};           /**< The counters of the run */
+
+/* The options of the run */
+static options_t options{"unix:///tmp/dataintegrity.sock", 4, 0.0, 10.0, PROTOCOL_WINDOW,
+                         PROTOCOL_X25519, PROTOCOL_GET_TEMP, {0}, 0};
+
+static std::atomic<bool> running{false};    /**< The senders are running */
+static std::atomic<uint64_t> sent{0};       /**< Number of requests sent */
+static std::mutex window_lock;              /**< Protects in_flight */
+static std::condition_variable window_free; /**< Signalled when a request leaves the window */
+static size_t in_flight{0};                 /**< Requests in flight over all sessions */
+
+/* Static Assertions ---------------------------------------------------------*/
+
+static_assert(REQUEST_SLOTS > PROTOCOL_WINDOW, "Every request in the window needs a slot");
+static_assert(0x10000 % REQUEST_SLOTS == 0, "The request IDs wrap around the slots");
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief Prints the usage.
+ */
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -l, --link NAME        serial port, socket://host:port or unix://path (%s)\n"
+            "  -n, --sessions N       number of concurrent sessions (%zu)\n"
+            "  -r, --rate R           target requests per second over all sessions, 0 for as fast as possible\n"
+            "  -d, --duration S       length of the run in seconds (%.0f)\n"
+            "  -w, --window W         requests in flight over all sessions (%zu)\n"
+            "  -k, --handshake NAME   x25519, p256, rsa or hybrid (x25519)\n"
+            "  -c, --command C        the request, e.g. 3 GET_TEMP, 10 GET_AGGREGATE (%u)\n"
+            "  -a, --argument A       a 4 byte argument of the request, e.g. the page of GET_STATS\n",
+            name, options.link, options.sessions, options.duration, options.window, options.command);
+}
+
+/**
+ * @brief Parses the command line into the options.
+ *
+ * @return True if the options are valid, false otherwise.
+ */
+static bool parse(int argc, char **argv)
+{
+    static const struct option longopts[] = {
+        {"link", required_argument, nullptr, 'l'},
+        {"sessions", required_argument, nullptr, 'n'},
+        {"rate", required_argument, nullptr, 'r'},
+        {"duration", required_argument, nullptr, 'd'},
+        {"window", required_argument, nullptr, 'w'},
+        {"handshake", required_argument, nullptr, 'k'},
+        {"command", required_argument, nullptr, 'c'},
+        {"argument", required_argument, nullptr, 'a'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0},
+    };
+    static const char *handshakes[] = {"rsa", "hybrid", "x25519", "p256"};
+
+    bool status = true;
+    int option = 0;
+
+    while (status && (-1 != (option = getopt_long(argc, argv, "l:n:r:d:w:k:c:a:h", longopts, nullptr))))
+    {
+        uint32_t argument = 0;
+
+        switch (option)
+        {
+        case 'l':
+            options.link = optarg;
+            break;
+        case 'n':
+            options.sessions = strtoul(optarg, nullptr, 0);
+            break;
+        case 'r':
+            options.rate = strtod(optarg, nullptr);
+            break;
+        case 'd':
+            options.duration = strtod(optarg, nullptr);
+            break;
+        case 'w':
+            options.window = strtoul(optarg, nullptr, 0);
+            break;
+        case 'k':
+            status = false;
+            for (size_t i = 0; i < sizeof(handshakes) / sizeof(handshakes[0]); i++)
+            {
+                if (0 == strcmp(optarg, handshakes[i]))
+                {
+                    options.handshake = (protocol_handshake_t)i;
+                    status = true;
+                }
+            }
+            break;
+        case 'c':
+            options.command = (uint8_t)strtoul(optarg, nullptr, 0);
+            break;
+        case 'a':
+            argument = (uint32_t)strtoul(optarg, nullptr, 0);
+            memcpy(options.args, &argument, sizeof(argument));
+            options.alen = sizeof(argument);
+            break;
+        default:
+            status = false;
+            break;
+        }
+    }
+
+    return status && (options.sessions > 0) && (options.duration > 0) && (options.rate >= 0) &&
+           (options.window > 0) && (options.window < REQUEST_SLOTS);
+}
+
+/**
+ * @brief Returns the time between two points in us.
+ */
+static uint32_t elapsed_us(clock_type::time_point start, clock_type::time_point end)
+{
+    return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+/**
+ * @brief Takes a place in the window, waits while it is full.
+ *
+ * @param end The end of the run.
+ * @return True if a place was taken, false if the run is over.
+ */
+static bool window_take(clock_type::time_point end)
+{
+    std::unique_lock<std::mutex> guard(window_lock);
+
+    bool taken = window_free.wait_until(guard, end, [] { return (in_flight < options.window) || !running; }) && running;
+
+    if (taken)
+    {
+        in_flight++;
+    }
+
+    return taken;
+}
+
+/**
+ * @brief Gives a place in the window back.
+ */
+static void window_give(void)
+{
+    {
+        std::lock_guard<std::mutex> guard(window_lock);
+        in_flight--;
+    }
+
+    window_free.notify_one();
+}
+
+/**
+ * @brief Sends the requests of a session until the run is over.
+ *
+ * @param client The session.
+ * @param first The time of the first request in the schedule.
+ * @param interval The time between two requests of the session, zero to send as fast as possible.
+ * @param end The end of the run.
+ */
+static void sender(client_t *client, clock_type::time_point first, clock_type::duration interval, clock_type::time_point end)
+{
+    uint8_t record[FRAME_MAX_PAYLOAD];
+    clock_type::time_point scheduled = first;
+
+    while (running && (clock_type::now() < end))
+    {
+        if (interval != clock_type::duration::zero())
+        {
+            std::this_thread::sleep_until(scheduled);
+        }
+
+        if (!window_take(end))
+        {
+            break;
+        }
+
+        clock_type::time_point start = (interval != clock_type::duration::zero()) ? scheduled : clock_type::now();
+        uint16_t request_id = 0;
+
+        {
+            std::lock_guard<std::mutex> guard(client->lock);
+
+            request_id = client->next_id++;
+            client->started[request_id % REQUEST_SLOTS] = start;
+            client->outstanding[request_id % REQUEST_SLOTS] = true;
+        }
+
+        /* Sealed and sent on this thread only, so the sequence numbers reach the server in order */
+        size_t length = protocol_seal(&client->session, options.command, request_id, options.args, options.alen, record);
+
+        if ((length > 0) && link_send(&link, FRAME_RECORD, record, length))
+        {
+            sent++;
+        }
+        else
+        {
+            running = false;
+        }
+
+        scheduled += interval;
+    }
+}
+
+/**
+ * @brief Ends an outstanding request.
+ *
+ * @return True if the request was outstanding, false otherwise.
+ */
+static bool request_end(client_t *client, uint16_t request_id, clock_type::time_point *start)
+{
+    bool status = false;
+    size_t slot = request_id % REQUEST_SLOTS;
+
+    {
+        std::lock_guard<std::mutex> guard(client->lock);
+
+        if (client->outstanding[slot])
+        {
+            client->outstanding[slot] = false;
+            *start = client->started[slot];
+            status = true;
+        }
+    }
+
+    if (status)
+    {
+        window_give();
+    }
+
+    return status;
+}
+
+/**
+ * @brief Gives up the requests outstanding for longer than PROTOCOL_TIMEOUT.
+ */
+static void requests_expire(clock_type::time_point now)
+{
+    for (client_t *client : clients)
+    {
+        for (size_t slot = 0; slot < REQUEST_SLOTS; slot++)
+        {
+            bool expired = false;
+
+            {
+                std::lock_guard<std::mutex> guard(client->lock);
+
+                if (client->outstanding[slot] && (now - client->started[slot] > std::chrono::milliseconds(PROTOCOL_TIMEOUT)))
+                {
+                    client->outstanding[slot] = false;
+                    expired = true;
+                }
+            }
+
+            if (expired)
+            {
+                counters.lost++;
+                window_give();
+            }
+        }
+    }
+}
+
+/**
+ * @brief Receives the responses until the run is over and the window is empty.
+ *
+ * @param drained The latest time to wait for the outstanding requests after the run.
+ */
+static void receiver(clock_type::time_point drained)
+{
+    link_frame_t frame;
+    clock_type::time_point swept = clock_type::now();
+
+    while (true)
+    {
+        {
+            std::lock_guard<std::mutex> guard(window_lock);
+
+            if (!running && ((in_flight == 0) || (clock_type::now() > drained)))
+            {
+                break;
+            }
+        }
+
+        if (link_receive(&link, &frame, RECEIVE_TIMEOUT))
+        {
+            clock_type::time_point now = clock_type::now();
+
+            if (frame.type == FRAME_RECORD)
+            {
+                uint64_t id = protocol_record_session(frame.payload, frame.length);
+                auto found = std::find_if(clients.begin(), clients.end(),
+                                          [id](const client_t *client) { return client->session.id == id; });
+                uint16_t request_id = 0;
+                const uint8_t *response{nullptr};
+                size_t length = (found != clients.end()) ? protocol_open(&(*found)->session, frame.payload, frame.length, &request_id, &response) : 0;
+                clock_type::time_point start;
+
+                if ((length > 0) && request_end(*found, request_id, &start))
+                {
+                    counters.statuses[response[0] & 0x07]++;
+
+                    /* Only requests the server handled have a latency */
+                    if ((response[0] == PROTOCOL_OKAY) || (response[0] == PROTOCOL_ERROR))
+                    {
+                        counters.latencies.push_back(elapsed_us(start, now));
+                    }
+                }
+                else
+                {
+                    counters.rejected++;
+                }
+            }
+            else
+            {
+                uint8_t status = 0;
+                counters.unassigned += protocol_error(&frame, &status) ? 1 : 0;
+            }
+        }
+
+        if (clock_type::now() - swept > std::chrono::milliseconds(RECEIVE_TIMEOUT))
+        {
+            swept = clock_type::now();
+            requests_expire(swept);
+        }
+
+        if (link.fd < 0)
+        {
+            break;
+        }
+    }
+
+    /* Wake the senders waiting for the window */
+    window_free.notify_all();
+}
+
+/**
+ * @brief Returns the latency below which the given share of the sorted latencies lie.
+ */
+static uint32_t percentile(const std::vector<uint32_t> &sorted, double share)
+{
+    uint32_t value = 0;
+
+    if (!sorted.empty())
+    {
+        size_t rank = (size_t)(share * sorted.size() + 0.999999);
+        value = sorted[(rank > 0) ? rank - 1 : 0];
+    }
+
+    return value;
+}
+
+/**
+ * @brief Prints the report of the run.
+ *
+ * @param elapsed The length of the run in seconds.
+ */
+static void report(double elapsed)
+{
+    static const char *handshakes[] = {"rsa", "hybrid", "x25519", "p256"};
+    static const char *names[] = {"okay", "error", "expired", "hash error", "bad request", "invalid session", "unknown key", "busy"};
+
+    std::vector<double> handshake;
+    std::vector<uint32_t> &sorted = counters.latencies;
+    uint64_t answered = 0;
+
+    for (const client_t *client : clients)
+    {
+        handshake.push_back(client->handshake_ms);
+    }
+
+    std::sort(handshake.begin(), handshake.end());
+    std::sort(sorted.begin(), sorted.end());
+
+    for (uint64_t count : counters.statuses)
+    {
+        answered += count;
+    }
+
+    printf("link         %s\n", options.link);
+    printf("handshake    %s, %zu sessions, median %.1f ms, max %.1f ms\n", handshakes[options.handshake], clients.size(),
+           handshake[(handshake.size() - 1) / 2], handshake.back());
+    printf("requests     command 0x%02X, window %zu, sent %llu, answered %llu, lost %llu\n", options.command, options.window,
+           (unsigned long long)sent.load(), (unsigned long long)answered, (unsigned long long)counters.lost);
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if (counters.statuses[i] > 0)
+        {
+            printf("  %-16s %llu\n", names[i], (unsigned long long)counters.statuses[i]);
+        }
+    }
+
+    if ((counters.unassigned > 0) || (counters.rejected > 0))
+    {
+        printf("  %-16s %llu\n  %-16s %llu\n", "unassigned", (unsigned long long)counters.unassigned,
+               "rejected", (unsigned long long)counters.rejected);
+    }
+
+    printf("throughput   %.1f req/s over %.2f s", sorted.size() / elapsed, elapsed);
+    if (options.rate > 0)
+    {
+        printf(" (target %.1f req/s)", options.rate);
+    }
+    printf("\n");
+
+    if (!sorted.empty())
+    {
+        printf("latency us   p50 %u, p99 %u, p999 %u, max %u\n", percentile(sorted, 0.5), percentile(sorted, 0.99),
+               percentile(sorted, 0.999), sorted.back());
+    }
+}
+
+/* Exported user code --------------------------------------------------------*/
+
+int main(int argc, char **argv)
+{
+    int status = EXIT_FAILURE;
+
+    if (!parse(argc, argv))
+    {
+        usage(argv[0]);
+    }
+    else if (!protocol_init() || !link_open(&link, options.link))
+    {
+        fprintf(stderr, "Cannot open %s\n", options.link);
+    }
+    else
+    {
+        status = EXIT_SUCCESS;
+
+        /* The server runs one handshake at a time */
+        for (size_t i = 0; (i < options.sessions) && (status == EXIT_SUCCESS); i++)
+        {
+            client_t *client = new client_t();
+            clock_type::time_point start = clock_type::now();
+
+            protocol_session_init(&client->session);
+            clients.push_back(client);
+
+            if (protocol_establish(&link, &client->session, options.handshake))
+            {
+                client->handshake_ms = elapsed_us(start, clock_type::now()) / 1000.0;
+            }
+            else
+            {
+                fprintf(stderr, "Handshake %zu failed\n", i + 1);
+                status = EXIT_FAILURE;
+            }
+        }
+
+        if (status == EXIT_SUCCESS)
+        {
+            std::vector<std::thread> senders;
+            clock_type::time_point start = clock_type::now();
+            clock_type::time_point end = start + std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(options.duration));
+            clock_type::duration interval{0};
+
+            if (options.rate > 0)
+            {
+                interval = std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(options.sessions / options.rate));
+            }
+
+            running = true;
+            std::thread reception(receiver, end + std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(DRAIN_TIME)));
+
+            /* The schedules of the sessions are shifted against each other */
+            for (size_t i = 0; i < clients.size(); i++)
+            {
+                senders.emplace_back(sender, clients[i], start + interval * i / clients.size(), interval, end);
+            }
+
+            for (std::thread &thread : senders)
+            {
+                thread.join();
+            }
+
+            running = false;
+            window_free.notify_all();
+            reception.join();
+
+            report(std::chrono::duration<double>(std::min(clock_type::now(), end) - start).count());
+
+            /* The server slots are freed right away instead of after the keep alive */
+            for (client_t *client : clients)
+            {
+                uint8_t response[PROTOCOL_BLOCK_SIZE];
+                (void)protocol_call(&link, &client->session, PROTOCOL_CLOSE, nullptr, 0, response, sizeof(response));
+            }
+        }
+
+        for (client_t *client : clients)
+        {
+            protocol_session_free(&client->session);
+            delete client;
+        }
+
+        link_close(&link);
+    }
+
+    return status;
+}
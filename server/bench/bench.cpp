@@ -0,0 +1,710 @@
+/**
+ * @file bench.cpp
+ * @brief This file contains the microbenchmarks of the crypto hot paths of the session module.
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @details Every benchmark makes the crypto module calls of one code path of the session module,
+ *          with the contexts set up once as the session module does, or calls the module the session
+ *          module calls (kex, ticket). The crypto provider is chosen with --crypto on the host. Each one runs at the sizes the session layer uses and at
+ *          larger ones, in batches doubled until a batch takes BENCH_TIME ms.
+ *
+ *          The results are printed as a table and as JSON. On the host, the JSON is written to
+ *          the file given with --output, bench/compare.py compares two of them. On the target,
+ *          both are printed over the serial port once after boot.
+ *
+ *          The allocations are counted by wrapping malloc() on the host, so they include every
+ *          allocation of mbedTLS and of the C++ runtime. On the target they are the allocations
+ *          of mbedTLS counted by the arena of the memory module.
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "crypto.h"
+#include "hal.h"
+#include "kex.h"
+#include "memory.h"
+#include "ticket.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <atomic>
+#include <chrono>
+#include <mbedtls/md.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/rsa.h>
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include <stdlib.h>
+#include <getopt.h>
+#endif
+
+/* Private define ------------------------------------------------------------*/
+
+#ifndef BENCH_TIME
+#define BENCH_TIME 200 /**< Shortest time in ms of the measured batch of a benchmark */
+#endif
+
+#ifndef BENCH_LABEL
+#define BENCH_LABEL "" /**< The label of the results, e.g. the commit, unless set with --label */
+#endif
+
+/* Private typedef -----------------------------------------------------------*/
+
+/**
+ * @brief A benchmark at one size.
+ */
+typedef struct
+{
+    const char *name;          /**< The name of the benchmark */
+    size_t bytes;              /**< The bytes processed per operation, 0 if the operation has no payload */
+    bool (*run)(size_t bytes); /**< Runs one operation, returns false on an error */
+} bench_case_t;
+
+/**
+ * @brief The result of a benchmark.
+ */
+typedef struct
+{
+    uint64_t iterations;  /**< The operations of the measured batch */
+    double ns_per_op;     /**< Time per operation in ns */
+    double bytes_per_s;   /**< Throughput, 0 if the operation has no payload */
+    double allocs_per_op; /**< Allocations per operation */
+} bench_result_t;
+
+/* Private macro -------------------------------------------------------------*/
+
+constexpr size_t HASH_SIZE{32};      /**< SHA256 Hash Size */
+constexpr size_t AES_SIZE{32};       /**< AES-256 Key Size */
+constexpr size_t RSA_SIZE{256};      /**< RSA-2048 Block Size */
+constexpr size_t DER_SIZE{294};      /**< DER Size of a RSA-2048 public key */
+constexpr int EXPONENT{65537};       /**< RSA Exponent */
+constexpr size_t NONCE_SIZE{12};     /**< GCM Nonce Size */
+constexpr size_t TAG_SIZE{16};       /**< GCM Tag Size */
+constexpr size_t HEADER_SIZE{16};    /**< Session ID (8) + Sequence Number (8), the AAD of a record */
+constexpr size_t BUFFER_SIZE{16384}; /**< Largest payload of a benchmark */
+constexpr uint64_t MAX_ITERATIONS{1u << 24}; /**< Largest batch of a benchmark */
+
+/* Private variables ---------------------------------------------------------*/
+
+static crypto_hmac_t hmac_ctx;            /**< HMAC Context, keyed once as the one of a session */
+static crypto_cbc_t enc_ctx;              /**< AES Encryption Context */
+static crypto_cbc_t dec_ctx;              /**< AES Decryption Context */
+static crypto_gcm_t gcm_ctx;              /**< AES-GCM Context of the record layer */
+static mbedtls_pk_context server_ctx;     /**< The RSA-2048 key pair of the server, as generated by the key manager */
+static crypto_rsa_t server_key;           /**< The key pair of the server, converted by the provider */
+static crypto_rsa_t client_key;           /**< The public key of the client, the public part of server_ctx */
+
+static uint8_t key[TICKET_KEY_SIZE];         /**< The AES key followed by the HMAC key of the session */
+static uint8_t iv[16];                       /**< The CBC IV */
+static uint8_t der[DER_SIZE];                /**< The DER public key of the client */
+static uint8_t rsa_block[RSA_SIZE];          /**< A block encrypted with the public key */
+static uint8_t rsa_signature[RSA_SIZE];      /**< The signature of the key over the secret */
+static uint8_t identity[KEX_IDENTITY_SIZE];  /**< The P-256 identity key, its point is the peer of the P-256 agreement */
+static uint8_t ticket[TICKET_SIZE];          /**< A ticket issued for the session keys */
+static uint8_t input[BUFFER_SIZE + HASH_SIZE]; /**< The payload, followed by room for a MAC or tag */
+static uint8_t output[BUFFER_SIZE + HASH_SIZE]; /**< The output of an operation */
+
+#ifndef ARDUINO
+static std::atomic<uint64_t> allocations{0}; /**< The calls to malloc(), calloc() and realloc() */
+static const char *label{BENCH_LABEL};       /**< The label of the results */
+#endif
+
+/* Static Assertions ---------------------------------------------------------*/
+
+static_assert(TICKET_KEY_SIZE == AES_SIZE + HASH_SIZE, "A ticket holds the AES and the HMAC key");
+static_assert(DER_SIZE <= sizeof(output), "The DER key is written to the end of the output");
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* Private user code ---------------------------------------------------------*/
+
+#ifndef ARDUINO
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+/* The allocation functions of the process, glibc serves them and the benchmark counts them */
+extern "C" void *malloc(size_t size) noexcept
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size) noexcept
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size) noexcept
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+/**
+ * @brief Returns the number of allocations since start.
+ */
+static uint64_t allocation_count(void)
+{
+#ifdef ARDUINO
+    memory_stats_t stats{};
+    memory_stats(&stats);
+    return (uint64_t)stats.allocations + stats.overflows;
+#else
+    return allocations.load(std::memory_order_relaxed);
+#endif
+}
+
+/**
+ * @brief Prints a line of the report, over the serial port on the target.
+ */
+static void report(const char *format, ...)
+{
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    (void)vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+#ifdef ARDUINO
+    Serial.print(line);
+#else
+    fputs(line, stdout);
+#endif
+}
+
+/**
+ * @brief hmac_check() and hmac_write(), the HMAC of every handshake message and legacy request.
+ */
+static bool bench_hmac(size_t bytes)
+{
+    crypto_hmac(&hmac_ctx, input, bytes, output);
+
+    return true;
+}
+
+/**
+ * @brief block_crypt() of a legacy response, AES-256-CBC with the session IV.
+ */
+static bool bench_cbc_encrypt(size_t bytes)
+{
+    return crypto_cbc_crypt(&enc_ctx, CRYPTO_ENCRYPT, bytes, iv, input, output);
+}
+
+/**
+ * @brief block_crypt() of a legacy request.
+ */
+static bool bench_cbc_decrypt(size_t bytes)
+{
+    return crypto_cbc_crypt(&dec_ctx, CRYPTO_DECRYPT, bytes, iv, input, output);
+}
+
+/**
+ * @brief record_write(), sealing a response record with AES-256-GCM.
+ */
+static bool bench_gcm_seal(size_t bytes)
+{
+    static uint64_t sequence{0};
+    uint8_t nonce[NONCE_SIZE]{0};
+
+    sequence++;
+    memcpy(nonce + sizeof(uint32_t), &sequence, sizeof(sequence));
+
+    return crypto_gcm_seal(&gcm_ctx, nonce, output, HEADER_SIZE, input, bytes, output + HEADER_SIZE, output + HEADER_SIZE + bytes);
+}
+
+/**
+ * @brief record_read(), opening a request record. The record is sealed once per size.
+ */
+static bool bench_gcm_open(size_t bytes)
+{
+    static size_t sealed{0};
+    static uint8_t record[HEADER_SIZE + BUFFER_SIZE + TAG_SIZE];
+    uint8_t nonce[NONCE_SIZE]{0};
+    bool status = true;
+
+    if (sealed != bytes)
+    {
+        memset(record, 0, HEADER_SIZE);
+        status = crypto_gcm_seal(&gcm_ctx, nonce, record, HEADER_SIZE, input, bytes, record + HEADER_SIZE, record + HEADER_SIZE + bytes);
+        sealed = status ? bytes : 0;
+    }
+
+    return status && crypto_gcm_open(&gcm_ctx, nonce, record, HEADER_SIZE, record + HEADER_SIZE, bytes, record + HEADER_SIZE + bytes, output);
+}
+
+/**
+ * @brief rsa_encrypt(), encrypting a half of the server key with the client key.
+ */
+static bool bench_rsa_encrypt(size_t bytes)
+{
+    return crypto_rsa_encrypt(&client_key, input, bytes, output);
+}
+
+/**
+ * @brief rsa_decrypt(), decrypting a block of a handshake message with the server key.
+ */
+static bool bench_rsa_decrypt(size_t bytes)
+{
+    size_t olen = 0;
+    (void)bytes;
+
+    return crypto_rsa_decrypt(&server_key, rsa_block, output, &olen, sizeof(output));
+}
+
+/**
+ * @brief rsa_verify(), verifying the signature of the client over the secret.
+ */
+static bool bench_rsa_verify(size_t bytes)
+{
+    (void)bytes;
+
+    return crypto_rsa_verify(&client_key, input, rsa_signature);
+}
+
+/**
+ * @brief Parsing the DER public key of the client, as the handshakes do with every new client key.
+ */
+static bool bench_rsa_parse(size_t bytes)
+{
+    crypto_rsa_t ctx;
+    crypto_rsa_init(&ctx);
+    bool status = crypto_rsa_parse_public(&ctx, der, bytes);
+    crypto_rsa_free(&ctx);
+
+    return status;
+}
+
+/**
+ * @brief generate() of the key manager, a RSA-2048 key without storing it.
+ */
+static bool bench_rsa_genkey(size_t bytes)
+{
+    (void)bytes;
+    mbedtls_pk_context ctx;
+    mbedtls_pk_init(&ctx);
+    bool status = (0 == mbedtls_pk_setup(&ctx, mbedtls_pk_info_from_type(MBEDTLS_PK_RSA))) &&
+                  (0 == mbedtls_rsa_gen_key(mbedtls_pk_rsa(ctx), crypto_random, nullptr, RSA_SIZE * CHAR_BIT, EXPONENT));
+    mbedtls_pk_free(&ctx);
+
+    return status;
+}
+
+/**
+ * @brief kex_agree() of an X25519 handshake.
+ */
+static bool bench_x25519(size_t bytes)
+{
+    (void)bytes;
+    uint8_t secret[KEX_SECRET_SIZE];
+
+    return kex_agree(KEX_X25519, input, output, secret);
+}
+
+/**
+ * @brief kex_agree() of a P-256 handshake, the peer is the point of the identity key.
+ */
+static bool bench_p256(size_t bytes)
+{
+    (void)bytes;
+    uint8_t secret[KEX_SECRET_SIZE];
+
+    return kex_agree(KEX_P256, identity + KEX_IDENTITY_SIZE - KEX_MAX_PUBLIC_SIZE, output, secret);
+}
+
+/**
+ * @brief kex_sign(), the ECDSA signature over the transcript of an ECDH handshake.
+ */
+static bool bench_ecdsa_sign(size_t bytes)
+{
+    return (0 < kex_sign(input, bytes, output));
+}
+
+/**
+ * @brief kex_derive(), the session keys of an ECDH handshake or the GCM key of a session.
+ */
+static bool bench_hkdf(size_t bytes)
+{
+    static const uint8_t label[] = "record";
+
+    return kex_derive(key + AES_SIZE, HASH_SIZE, input, KEX_SECRET_SIZE, label, sizeof(label) - 1, output, bytes);
+}
+
+/**
+ * @brief ticket_issue(), the ticket of a new session.
+ */
+static bool bench_ticket_issue(size_t bytes)
+{
+    (void)bytes;
+
+    return ticket_issue(key, hal_millis(), output);
+}
+
+/**
+ * @brief ticket_open() and the follow-up ticket_issue() of a resumed session, tickets are single-use.
+ */
+static bool bench_ticket_open(size_t bytes)
+{
+    uint32_t issued{0};
+    (void)bytes;
+
+    return ticket_open(ticket, hal_millis(), output, &issued) && ticket_issue(output, issued, ticket);
+}
+
+/* The benchmarks, at the sizes of the session layer and larger ones */
+static const bench_case_t cases[] = {
+    {"hmac_sha256", 24, bench_hmac},        /**< Session ID and a legacy request block */
+    {"hmac_sha256", 768, bench_hmac},       /**< The second message of the RSA handshake */
+    {"hmac_sha256", 1024, bench_hmac},      /**< A full frame */
+    {"hmac_sha256", 4096, bench_hmac},
+    {"hmac_sha256", 16384, bench_hmac},
+    {"aes_cbc_encrypt", 16, bench_cbc_encrypt}, /**< A legacy response */
+    {"aes_cbc_encrypt", 1024, bench_cbc_encrypt},
+    {"aes_cbc_encrypt", 16384, bench_cbc_encrypt},
+    {"aes_cbc_decrypt", 16, bench_cbc_decrypt}, /**< A legacy request */
+    {"aes_cbc_decrypt", 1024, bench_cbc_decrypt},
+    {"aes_gcm_seal", 3, bench_gcm_seal},    /**< A status and request ID */
+    {"aes_gcm_seal", 64, bench_gcm_seal},   /**< A short response, e.g. an aggregate */
+    {"aes_gcm_seal", 976, bench_gcm_seal},  /**< A full record */
+    {"aes_gcm_seal", 16384, bench_gcm_seal},
+    {"aes_gcm_open", 7, bench_gcm_open},    /**< A request with an argument */
+    {"aes_gcm_open", 976, bench_gcm_open},
+    {"aes_gcm_open", 16384, bench_gcm_open},
+    {"rsa_encrypt", 147, bench_rsa_encrypt}, /**< A half of the DER server key */
+    {"rsa_decrypt", RSA_SIZE, bench_rsa_decrypt},
+    {"rsa_verify", HASH_SIZE, bench_rsa_verify},
+    {"rsa_parse", DER_SIZE, bench_rsa_parse},
+    {"rsa_genkey", 0, bench_rsa_genkey},
+    {"ecdh_x25519", 0, bench_x25519},
+    {"ecdh_p256", 0, bench_p256},
+    {"ecdsa_sign", 73, bench_ecdsa_sign},   /**< mode | client key | server key | session ID of X25519 */
+    {"hkdf_sha256", 80, bench_hkdf},        /**< AES key | HMAC key | IV */
+    {"ticket_issue", 0, bench_ticket_issue},
+    {"ticket_open", 0, bench_ticket_open},
+};
+
+/**
+ * @brief Sets up the keys and contexts of the benchmarks, as the session module does.
+ *
+ * @return True if all benchmarks can run, false otherwise.
+ */
+static bool bench_setup(void)
+{
+    uint8_t gcm_key[AES_SIZE]{0};
+    size_t length = 0;
+
+    /* The provider passes its self-test first, as in session_init() */
+    bool status = crypto_init();
+
+    if (status)
+    {
+        crypto_hmac_init(&hmac_ctx);
+        crypto_cbc_init(&enc_ctx);
+        crypto_cbc_init(&dec_ctx);
+        crypto_gcm_init(&gcm_ctx);
+    }
+
+    mbedtls_pk_init(&server_ctx);
+    crypto_rsa_init(&server_key);
+    crypto_rsa_init(&client_key);
+
+    hal_random(key, sizeof(key));
+    hal_random(iv, sizeof(iv));
+    hal_random(input, sizeof(input));
+
+    status = status &&
+             crypto_hmac_setkey(&hmac_ctx, key + AES_SIZE, HASH_SIZE) &&
+             crypto_cbc_setkey(&enc_ctx, CRYPTO_ENCRYPT, key) &&
+             crypto_cbc_setkey(&dec_ctx, CRYPTO_DECRYPT, key) &&
+             kex_derive(key + AES_SIZE, HASH_SIZE, key, AES_SIZE, (const uint8_t *)"record", 6, gcm_key, sizeof(gcm_key)) &&
+             crypto_gcm_setkey(&gcm_ctx, gcm_key);
+
+    /* The server key pair, its public part is the client key */
+    status = status &&
+             (0 == mbedtls_pk_setup(&server_ctx, mbedtls_pk_info_from_type(MBEDTLS_PK_RSA))) &&
+             (0 == mbedtls_rsa_gen_key(mbedtls_pk_rsa(server_ctx), crypto_random, nullptr, RSA_SIZE * CHAR_BIT, EXPONENT)) &&
+             (DER_SIZE == mbedtls_pk_write_pubkey_der(&server_ctx, output, sizeof(output)));
+
+    if (status)
+    {
+        /* The DER key is written at the end of the buffer */
+        memcpy(der, output + sizeof(output) - DER_SIZE, DER_SIZE);
+        int written = mbedtls_pk_write_key_der(&server_ctx, output, sizeof(output));
+        status = (written > 0) && crypto_rsa_parse_private(&server_key, output + sizeof(output) - written, written) &&
+                 crypto_rsa_parse_public(&client_key, der, DER_SIZE) &&
+                 crypto_rsa_encrypt(&client_key, input, 147, rsa_block) &&
+                 (0 == mbedtls_pk_sign(&server_ctx, MBEDTLS_MD_SHA256, input, HASH_SIZE, rsa_signature, &length, crypto_random, nullptr));
+    }
+
+    /* The modules the session module calls */
+    status = status && kex_init(crypto_random, nullptr) && kex_identity(identity) &&
+             ticket_init(crypto_random, nullptr) && ticket_issue(key, hal_millis(), ticket);
+
+    memset(gcm_key, 0, sizeof(gcm_key));
+
+    return status;
+}
+
+/**
+ * @brief Runs a benchmark in batches, doubled until a batch takes BENCH_TIME ms.
+ *
+ * @param entry The benchmark.
+ * @param result Pointer to store the result of the last batch in.
+ * @return True if every operation succeeded, false otherwise.
+ */
+static bool bench_run(const bench_case_t *entry, bench_result_t *result)
+{
+    using clock = std::chrono::steady_clock;
+
+    bool status = entry->run(entry->bytes); /**< Warm up the caches and the lazy allocations */
+    uint64_t iterations = 1;
+    uint64_t elapsed = 0;
+
+    while (status)
+    {
+        uint64_t allocated = allocation_count();
+        clock::time_point start = clock::now();
+
+        for (uint64_t i = 0; status && (i < iterations); i++)
+        {
+            status = entry->run(entry->bytes);
+        }
+
+        elapsed = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+        result->iterations = iterations;
+        result->ns_per_op = (double)elapsed / (double)iterations;
+        result->bytes_per_s = (entry->bytes > 0) ? (double)entry->bytes * 1e9 / result->ns_per_op : 0;
+        result->allocs_per_op = (double)(allocation_count() - allocated) / (double)iterations;
+
+        if ((elapsed >= (uint64_t)BENCH_TIME * 1000000) || (iterations >= MAX_ITERATIONS))
+        {
+            break;
+        }
+
+        iterations *= 2;
+    }
+
+    return status;
+}
+
+/**
+ * @brief Writes a part of the JSON results to the file, or prints it with report() if there is none.
+ */
+static void json_write(FILE *file, const char *text)
+{
+    if (file != nullptr)
+    {
+        (void)fputs(text, file);
+    }
+    else
+    {
+        report("%s", text);
+    }
+}
+
+/**
+ * @brief Prints the result of a benchmark as a row of the table.
+ */
+static void print_row(const bench_case_t *entry, const bench_result_t *result)
+{
+    report("%-16s %6u %10llu %14.1f %12.2f %10.2f\n", entry->name, (unsigned)entry->bytes,
+           (unsigned long long)result->iterations, result->ns_per_op, result->bytes_per_s / 1e6, result->allocs_per_op);
+}
+
+/**
+ * @brief Writes the results as JSON, one benchmark per line.
+ *
+ * @param file The file to write to, nullptr to print the results with report().
+ * @param name The label of the results.
+ * @param platform The platform the benchmarks ran on.
+ * @param results The results, in the order of cases.
+ * @param passed Whether the benchmark at the same index succeeded.
+ */
+static void print_json(FILE *file, const char *name, const char *platform, const bench_result_t *results, const bool *passed)
+{
+    char line[200];
+    bool first = true;
+
+    snprintf(line, sizeof(line), "{\n  \"label\": \"%s\",\n  \"platform\": \"%s\",\n  \"crypto\": \"%s\",\n  \"time_ms\": %u,\n  \"results\": [\n",
+             name, platform, crypto_name(), (unsigned)BENCH_TIME);
+    json_write(file, line);
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        if (passed[i])
+        {
+            snprintf(line, sizeof(line),
+                     "%s    {\"name\": \"%s\", \"bytes\": %u, \"iterations\": %llu, \"ns_per_op\": %.1f, \"bytes_per_s\": %.0f, \"allocs_per_op\": %.2f}",
+                     first ? "" : ",\n", cases[i].name, (unsigned)cases[i].bytes, (unsigned long long)results[i].iterations,
+                     results[i].ns_per_op, results[i].bytes_per_s, results[i].allocs_per_op);
+            json_write(file, line);
+            first = false;
+        }
+    }
+
+    json_write(file, "\n  ]\n}\n");
+}
+
+/**
+ * @brief Runs the benchmarks whose name contains the filter and prints the results.
+ *
+ * @param filter Part of the names of the benchmarks to run, nullptr to run all.
+ * @param file The file to write the JSON results to, nullptr to print them.
+ * @param name The label of the results.
+ * @return True if all benchmarks that ran succeeded, false otherwise.
+ */
+static bool bench_all(const char *filter, FILE *file, const char *name)
+{
+    static bench_result_t results[sizeof(cases) / sizeof(cases[0])];
+    static bool passed[sizeof(cases) / sizeof(cases[0])];
+    bool status = bench_setup();
+
+    if (!status)
+    {
+        report("The benchmarks could not be set up\n");
+    }
+    else
+    {
+        report("crypto provider: %s\n", crypto_name());
+        report("%-16s %6s %10s %14s %12s %10s\n", "benchmark", "bytes", "iterations", "ns/op", "MB/s", "allocs/op");
+
+        for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+        {
+            if ((filter == nullptr) || (nullptr != strstr(cases[i].name, filter)))
+            {
+                passed[i] = bench_run(&cases[i], &results[i]);
+
+                if (passed[i])
+                {
+                    print_row(&cases[i], &results[i]);
+                }
+                else
+                {
+                    report("%-16s %6u failed\n", cases[i].name, (unsigned)cases[i].bytes);
+                    status = false;
+                }
+            }
+        }
+
+#ifdef ARDUINO
+        print_json(file, name, "esp32", results, passed);
+#else
+        if (file != nullptr)
+        {
+            print_json(file, name, "linux", results, passed);
+        }
+#endif
+    }
+
+    return status;
+}
+
+/* Exported user code --------------------------------------------------------*/
+
+#ifdef ARDUINO
+/**
+ * @brief Runs the benchmarks once after boot and prints the table and the JSON results over the serial port.
+ */
+void setup(void)
+{
+    Serial.begin(115200);
+    (void)hal_init();
+    (void)memory_init(); /**< The allocations of mbedTLS are counted by the arena */
+    hal_delay(1000);     /**< Time to open the serial monitor */
+
+    (void)bench_all(nullptr, nullptr, BENCH_LABEL);
+}
+
+/**
+ * @brief Nothing to do after the benchmarks.
+ */
+void loop(void)
+{
+    hal_delay(1000);
+}
+#else
+/**
+ * @brief Runs the benchmarks on the host.
+ *
+ * Options:
+ * - `-o, --output FILE` the file to write the JSON results to.
+ * - `-l, --label LABEL` the label of the results, e.g. the commit.
+ * - `-f, --filter NAME` run only the benchmarks whose name contains NAME.
+ * - `-c, --crypto NAME` the crypto provider, `mbedtls` or, in a build with CRYPTO_OPENSSL, `openssl`.
+ *
+ * @param argc The number of arguments.
+ * @param argv The arguments.
+ * @return int EXIT_SUCCESS if all benchmarks succeeded, EXIT_FAILURE otherwise.
+ */
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        {"output", required_argument, nullptr, 'o'},
+        {"label", required_argument, nullptr, 'l'},
+        {"filter", required_argument, nullptr, 'f'},
+        {"crypto", required_argument, nullptr, 'c'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    const char *path = nullptr;
+    const char *filter = nullptr;
+    bool status = true;
+    int option;
+
+    while (status && (-1 != (option = getopt_long(argc, argv, "o:l:f:c:h", options, nullptr))))
+    {
+        switch (option)
+        {
+        case 'o':
+            path = optarg;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        case 'c':
+            status = crypto_select(optarg);
+            break;
+        default:
+            status = false;
+            break;
+        }
+    }
+
+    if (!status || (optind < argc))
+    {
+        fprintf(stderr, "Usage: %s [--output FILE] [--label LABEL] [--filter NAME] [--crypto NAME]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *file = (path != nullptr) ? fopen(path, "w") : nullptr;
+
+    if ((path != nullptr) && (file == nullptr))
+    {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    (void)hal_init();
+    status = bench_all(filter, file, label);
+
+    if (file != nullptr)
+    {
+        fclose(file);
+    }
+
+    return status ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+#endif /* ARDUINO */
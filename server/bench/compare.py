@@ -0,0 +1,71 @@
+"""
+    * @File: compare.py
+    * @Autor: Oliver Joisten    (contact@oliver-joisten.se)
+    * @Desccription: This file compares two JSON results of the benchmarks, e.g. of two commits.
+    * @Version: 1.0
+    * @Created: 2024-06-05
+
+Usage: python3 compare.py BASE.json NEW.json [--threshold PERCENT]
+
+A file may also be a serial log of the target, the JSON results are taken
+from its first '{' on. The exit status is 1 if a benchmark got slower by
+more than the threshold (10 % by default), so the script can gate a build.
+"""
+
+import argparse
+import json
+import sys
+
+
+def load(path):
+    """Returns the results of a file by (name, bytes)."""
+    with open(path, encoding="utf-8", errors="replace") as file:
+        text = file.read()
+
+    start = text.find("{")
+    end = text.rfind("}")
+    if start < 0 or end < start:
+        sys.exit(f"{path}: no JSON results found")
+
+    data = json.loads(text[start:end + 1])
+    return data.get("label", ""), {(r["name"], r["bytes"]): r for r in data["results"]}
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compare two benchmark results")
+    parser.add_argument("base", help="the results to compare against")
+    parser.add_argument("new", help="the new results")
+    parser.add_argument("--threshold", type=float, default=10.0,
+                        help="slowdown in percent reported as a regression")
+    args = parser.parse_args()
+
+    base_label, base = load(args.base)
+    new_label, new = load(args.new)
+    regressions = 0
+
+    print(f"{'benchmark':<16} {'bytes':>6} {base_label or 'base':>14} {new_label or 'new':>14} "
+          f"{'change':>8} {'allocs':>13}")
+
+    for key, result in new.items():
+        old = base.get(key)
+        if old is None:
+            print(f"{key[0]:<16} {key[1]:>6} {'-':>14} {result['ns_per_op']:>14.1f}")
+            continue
+
+        change = (result["ns_per_op"] / old["ns_per_op"] - 1) * 100
+        mark = ""
+        if change > args.threshold:
+            mark = "  slower"
+            regressions += 1
+        elif change < -args.threshold:
+            mark = "  faster"
+
+        allocs = f"{old['allocs_per_op']:.2f} -> {result['allocs_per_op']:.2f}"
+        print(f"{key[0]:<16} {key[1]:>6} {old['ns_per_op']:>14.1f} {result['ns_per_op']:>14.1f} "
+              f"{change:>+7.1f}% {allocs:>13}{mark}")
+
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,223 @@
+/**
+ * @file capture.cpp
+ * @brief This file contains the implementation of the capture module.
+ *        The capture module records the frames of the communication module with their timestamps.
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @details A capture is a capture_header_t followed by one capture_record_t and the payload per frame,
+ *          8 bytes on top of the payload. The time of a record is the time in us since the previous
+ *          one, so the timestamps need no more than 32 bits.
+ *
+ *          The receive and transmit stages only copy the frame into a ring buffer under a short lock.
+ *          A low priority thread writes the ring to the sink every CAPTURE_INTERVAL ms, or earlier
+ *          once it is half full. A full ring drops the frame instead of waiting for the sink, so a
+ *          slow sink can lose frames but never slows the link down.
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "capture.h"
+#include "queue.h"
+#include "memory.h"
+#include "hal.h"
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#ifdef ARDUINO
+#include <esp_pthread.h>
+#endif
+
+/* Private define ------------------------------------------------------------*/
+
+#ifndef CAPTURE_BUFFER_SIZE
+#ifdef ARDUINO
+#define CAPTURE_BUFFER_SIZE 8192 /**< Size of the ring buffer, the frames of a burst */
+#else
+#define CAPTURE_BUFFER_SIZE 262144 /**< Size of the ring buffer, the frames of a burst */
+#endif
+#endif
+
+/* Private typedef -----------------------------------------------------------*/
+
+/* Private macro -------------------------------------------------------------*/
+
+constexpr uint32_t CAPTURE_INTERVAL{100};  /**< Longest time in ms a captured frame waits for the sink */
+constexpr size_t WRITER_STACK_SIZE{3072};  /**< Stack Size of the writer thread */
+constexpr size_t WRITER_PRIORITY{1};       /**< Priority of the writer thread, just above idle */
+
+/* Private variables ---------------------------------------------------------*/
+
+static uint8_t ring[CAPTURE_BUFFER_SIZE]; /**< The captured bytes not written yet */
+static size_t head{0};                    /**< Number of bytes put into the ring, written by the stages */
+static size_t tail{0};                    /**< Number of bytes written to the sink, written by the writer */
+static uint32_t last{0};                  /**< Time in us of the last record */
+static uint32_t pending{0};               /**< Frames dropped since the last record */
+static capture_stats_t statistics{};      /**< The counters */
+static capture_sink_t writer{nullptr};    /**< The sink */
+
+static std::atomic<bool> capturing{false}; /**< A capture runs */
+static std::mutex lock;                    /**< Protects the ring and the counters */
+static std::mutex flushing;                /**< Only one thread writes to the sink */
+static event_t filled;                     /**< Notified when the ring is half full */
+
+/* Static Assertions ---------------------------------------------------------*/
+
+static_assert(sizeof(capture_header_t) == 16, "The header layout has changed");
+static_assert(sizeof(capture_record_t) == 8, "The record layout has changed");
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief Copies bytes into the ring behind head, wrapping around its end.
+ *
+ * @note The lock must be held and the ring must have room for the bytes.
+ */
+static void ring_put(const void *data, size_t dlen)
+{
+    size_t offset = head % CAPTURE_BUFFER_SIZE;
+    size_t first = (dlen < CAPTURE_BUFFER_SIZE - offset) ? dlen : CAPTURE_BUFFER_SIZE - offset;
+
+    memcpy(&ring[offset], data, first);
+    memcpy(ring, (const uint8_t *)data + first, dlen - first);
+    head += dlen;
+}
+
+/**
+ * @brief Puts a record and its payload into the ring.
+ *
+ * @note The lock must be held and the ring must have room for the record.
+ */
+static void record_put(uint32_t now, uint8_t direction, uint8_t type, const uint8_t *payload, size_t length)
+{
+    capture_record_t record{now - last, direction, type, (uint16_t)length};
+
+    last = now;
+    ring_put(&record, sizeof(record));
+    ring_put(payload, length);
+}
+
+/**
+ * @brief The writer thread, it writes the ring to the sink.
+ */
+static void worker(void)
+{
+    memory_task("capture");
+
+    while (capturing)
+    {
+        (void)filled.wait(CAPTURE_INTERVAL);
+        capture_flush();
+    }
+}
+
+/* Exported user code --------------------------------------------------------*/
+
+bool capture_start(capture_sink_t sink, uint64_t seed)
+{
+    bool status = false;
+    capture_header_t header{CAPTURE_MAGIC, CAPTURE_VERSION, 0, seed};
+
+    if (!capturing && (sink != nullptr) && (sizeof(header) == sink((const uint8_t *)&header, sizeof(header))))
+    {
+        writer = sink;
+        last = hal_micros();
+        statistics.bytes = sizeof(header);
+        capturing = true;
+
+#ifdef ARDUINO
+        esp_pthread_cfg_t cfg = esp_pthread_get_default_config();
+        cfg.stack_size = WRITER_STACK_SIZE;
+        cfg.prio = WRITER_PRIORITY;
+        cfg.thread_name = "capture";
+        esp_pthread_set_cfg(&cfg);
+#endif
+        std::thread(worker).detach();
+
+        status = true;
+    }
+
+    return status;
+}
+
+void capture_frame(capture_direction_t direction, uint8_t type, const uint8_t *payload, size_t length)
+{
+    if (capturing)
+    {
+        bool half = false;
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            uint32_t now = hal_micros();
+            size_t needed = sizeof(capture_record_t) + length + ((pending > 0) ? sizeof(capture_record_t) + sizeof(pending) : 0);
+
+            if (head - tail + needed > CAPTURE_BUFFER_SIZE)
+            {
+                pending++;
+                statistics.dropped++;
+            }
+            else
+            {
+                if (pending > 0)
+                {
+                    record_put(now, CAPTURE_DROPPED, 0, (const uint8_t *)&pending, sizeof(pending));
+                    pending = 0;
+                }
+
+                record_put(now, direction, type, payload, length);
+                statistics.frames++;
+            }
+
+            half = (head - tail > CAPTURE_BUFFER_SIZE / 2);
+        }
+
+        if (half)
+        {
+            filled.notify();
+        }
+    }
+}
+
+void capture_flush(void)
+{
+    std::lock_guard<std::mutex> guard(flushing);
+    size_t end = 0;
+
+    {
+        std::lock_guard<std::mutex> ring_guard(lock);
+        end = head;
+    }
+
+    /* The bytes up to end are only touched by this thread until tail passes them */
+    while (capturing && (tail != end))
+    {
+        size_t offset = tail % CAPTURE_BUFFER_SIZE;
+        size_t chunk = (end - tail < CAPTURE_BUFFER_SIZE - offset) ? end - tail : CAPTURE_BUFFER_SIZE - offset;
+        size_t written = writer(&ring[offset], chunk);
+
+        std::lock_guard<std::mutex> ring_guard(lock);
+        tail += written;
+        statistics.bytes += (uint32_t)written;
+
+        if (written != chunk)
+        {
+            /* A capture with a gap cannot be replayed */
+            statistics.errors++;
+            capturing = false;
+        }
+    }
+}
+
+void capture_stats(capture_stats_t *stats)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    *stats = statistics;
+}
@@ -0,0 +1,118 @@
+/**
+ * @file capture.h
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @brief
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Exported defines ----------------------------------------------------------*/
+
+/* Exported types ------------------------------------------------------------*/
+
+/**
+ * @brief The direction of a captured frame.
+ */
+typedef enum : uint8_t
+{
+    CAPTURE_INBOUND = 0x00,  /**< A frame received from the client */
+    CAPTURE_OUTBOUND = 0x01, /**< A frame written to the client */
+    CAPTURE_DROPPED = 0x02,  /**< Not a frame, the number of frames dropped because the buffer was full */
+} capture_direction_t;
+
+/**
+ * @brief The header at the start of a capture, packed as it is written.
+ */
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;    /**< CAPTURE_MAGIC */
+    uint16_t version;  /**< CAPTURE_VERSION */
+    uint16_t reserved; /**< 0 */
+    uint64_t seed;     /**< The seed of hal_random(), 0 if the server was not seeded */
+} capture_header_t;
+
+/**
+ * @brief The header of a captured frame, packed as it is written, followed by the payload.
+ */
+typedef struct __attribute__((packed))
+{
+    uint32_t delta;    /**< Time in us since the previous record */
+    uint8_t direction; /**< The capture_direction_t */
+    uint8_t type;      /**< The frame type */
+    uint16_t length;   /**< The payload length, 0 for a frame that was incomplete or too large */
+} capture_record_t;
+
+/**
+ * @brief The counters of the capture.
+ */
+typedef struct
+{
+    uint32_t frames;  /**< Frames captured */
+    uint32_t dropped; /**< Frames dropped because the buffer was full */
+    uint32_t bytes;   /**< Bytes written to the sink */
+    uint32_t errors;  /**< Writes the sink did not take, the capture stops at the first */
+} capture_stats_t;
+
+/**
+ * @brief Writes captured bytes, e.g. to a file, returns the number of bytes written.
+ */
+typedef size_t (*capture_sink_t)(const uint8_t *data, size_t dlen);
+
+/* Exported constants --------------------------------------------------------*/
+
+constexpr uint32_t CAPTURE_MAGIC{0x50414344}; /**< "DCAP" */
+constexpr uint16_t CAPTURE_VERSION{1};        /**< The version of the format */
+
+/* Exported macro ------------------------------------------------------------*/
+
+/* Exported functions prototypes ---------------------------------------------*/
+
+/**
+ * @brief Start capturing the frames
+ *
+ * Writes the header and starts the thread that writes the captured frames to the sink. The frames are
+ * collected in a buffer of CAPTURE_BUFFER_SIZE bytes, capture_frame() never waits for the sink.
+ *
+ * @param sink the function the captured bytes are written with
+ * @param seed the seed of hal_random() to record for the replay, 0 if the server is not seeded
+ * @return true if the capture was started, false if it runs already or the header could not be written
+ */
+bool capture_start(capture_sink_t sink, uint64_t seed);
+
+/**
+ * @brief Capture a frame
+ *
+ * Returns right away if no capture runs. A frame that does not fit into the buffer is dropped and counted,
+ * the next frame that fits is preceded by a CAPTURE_DROPPED record.
+ *
+ * @param direction CAPTURE_INBOUND or CAPTURE_OUTBOUND
+ * @param type the frame type
+ * @param payload the payload
+ * @param length the length of the payload
+ */
+void capture_frame(capture_direction_t direction, uint8_t type, const uint8_t *payload, size_t length);
+
+/**
+ * @brief Write everything captured so far to the sink
+ */
+void capture_flush(void);
+
+/**
+ * @brief Get the counters of the capture
+ *
+ * @param stats pointer to store the counters in
+ */
+void capture_stats(capture_stats_t *stats);
+
+#endif /* CAPTURE_H */
@@ -5,6 +5,38 @@
  * @version 0.1
  * @date 2024-05-29
  *
+ * @details Every message is sent as a frame with the following layout:
+ *
+ *          | 0xA5 | 0x5A | type | length (LE16) | CRC-8 | payload |
+ *
+ *          The CRC-8 covers the type and length fields. The receiver slides a
+ *          window over the incoming bytes until it finds the sync bytes followed
+ *          by a valid header, so it resynchronises after garbage or a lost byte.
+ *
+ *          The frames are sent over a transport_t, UART, TCP or, in a host build, a UNIX
+ *          domain socket. The transport is chosen at build time with COMMUNICATION_TRANSPORT
+ *          or at run time with communication_select().
+ *
+ *          Once communication_start() was called, a receive thread reads the frames into a
+ *          queue and a transmit thread writes the queued frames, both pinned to core 0. The
+ *          request handling on core 1 then only moves frames from and to the queues, so the
+ *          next frame is received while the current one is decrypted.
+ *
+ *          All frames live in a fixed pool. A frame is received into a pool frame, handed to the
+ *          session by its pointer, decrypted and answered in place and handed back to the pool
+ *          once written, so the payload is never copied between the stages.
+ *
+ *          No thread polls: the receive thread sleeps in the transport until data arrives, and
+ *          each side of a queue sleeps on an event_t until the other side notifies it. An idle
+ *          device spends its time in the FreeRTOS idle task.
+ *
+ *          A baud rate switch is attached to the next frame written, the response to the client's
+ *          request, and applied once that frame has left the transport. Unless an authenticated
+ *          frame confirms the new rate within BAUDRATE_CONFIRM ms, the receive thread falls back.
+ *
+ *          Every frame read or written is passed to capture_frame(), which returns right away
+ *          unless a capture was started. A capture is played again with the replay transport.
+ *
  * @copyright Copyright (c) 2024
  *
  */
@@ -12,44 +44,599 @@
 /* Includes ------------------------------------------------------------------*/
 
 #include "communication.h"
-#include <Arduino.h>
+#include "queue.h"
+#include "pool.h"
+#include "memory.h"
+#include "metrics.h"
+#include "capture.h"
+#include "hal.h"
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <thread>
+
+#ifdef ARDUINO
+#include <esp_pthread.h>
+#endif
 
 /* Private define ------------------------------------------------------------*/
 
+#ifndef COMMUNICATION_TRANSPORT
+#ifdef ARDUINO
+#define COMMUNICATION_TRANSPORT "uart" /**< The transport used unless another one is selected */
+#else
+#define COMMUNICATION_TRANSPORT "unix" /**< The transport used unless another one is selected, a host has no UART0 */
+#endif
+#endif
+
 /* Private typedef -----------------------------------------------------------*/
 
 /* Private macro -------------------------------------------------------------*/
 
-#define BAUDRATE 115200 /**< Baudrate for the Serial Communication */
+constexpr uint8_t CRC8_POLY{0x07};      /**< CRC-8 polynomial (x^8 + x^2 + x + 1) */
+constexpr uint32_t FRAME_TIMEOUT{100};  /**< Max time in ms between two bytes of a frame */
+constexpr size_t FRAME_QUEUE_SIZE{4};   /**< Frames queued per direction */
+constexpr size_t FRAME_POOL_SIZE{2 * FRAME_QUEUE_SIZE + 3}; /**< Both queues, the frame being received, a request and its response */
+constexpr size_t STAGE_STACK_SIZE{4096}; /**< Stack Size of the receive and transmit threads */
+constexpr size_t STAGE_PRIORITY{2};     /**< Priority of the receive and transmit threads, above the handler */
+constexpr int STAGE_CORE{0};            /**< The core of the receive and transmit threads */
+constexpr uint32_t STAGE_WAIT{1000};    /**< Longest sleep in ms of a stage, it is woken up by an event before */
 
 /* Private variables ---------------------------------------------------------*/
 
+static pool_t<frame_buffer_t, FRAME_POOL_SIZE> pool;         /**< All frames */
+static queue_t<frame_buffer_t *, FRAME_QUEUE_SIZE> rx_queue; /**< Frames received by the receive thread */
+static queue_t<frame_buffer_t *, FRAME_QUEUE_SIZE> tx_queue; /**< Frames to be written by the transmit thread */
+static event_t pool_space;                          /**< Notified when a frame was returned to the pool */
+static event_t rx_ready;                            /**< Notified when a frame was received, or by communication_wake() */
+static event_t rx_space;                            /**< Notified when a received frame was read */
+static event_t tx_ready;                            /**< Notified when a frame was queued for the transmit thread */
+static event_t tx_space;                            /**< Notified when a frame was written */
+static bool started{false};                         /**< The stages are running */
+static const transport_t *transport{nullptr};       /**< The transport, set by communication_init() */
+static const char *selected{COMMUNICATION_TRANSPORT}; /**< The name of the transport to open */
+static const char *selected_address{nullptr};         /**< The address to open the transport at, nullptr for its default */
+
+/* The transports of this build */
+static const transport_t *const transports[] = {
+#ifdef ARDUINO
+    &transport_uart,
+#endif
+    &transport_tcp,
+#ifndef ARDUINO
+    &transport_unix,
+    &transport_tty,
+    &transport_replay,
+#endif
+};
+static std::atomic<uint32_t> baudrate{0};           /**< The baud rate in use */
+static std::atomic<uint32_t> baudrate_next{0};      /**< The baud rate to switch to after the next frame, 0 if none */
+static std::atomic<uint32_t> baudrate_fallback{0};  /**< The previous baud rate until the switch is confirmed, 0 if confirmed */
+static std::atomic<uint32_t> baudrate_switched{0};  /**< Time of the last switch */
+static std::atomic<uint32_t> rx_errors{0};          /**< Dropped received frames */
+static std::atomic<uint32_t> tx_errors{0};          /**< Frames that could not be written */
+
 /* Static Assertions ---------------------------------------------------------*/
 
+static_assert(FRAME_HEADER_SIZE == 6, "The frame header layout has changed");
+static_assert(FRAME_MAX_PAYLOAD <= UINT16_MAX, "The payload length is sent in 16 bits");
+static_assert(offsetof(frame_buffer_t, payload) == offsetof(frame_buffer_t, header) + FRAME_HEADER_SIZE,
+              "The header is written together with the payload");
+
 /* Private function prototypes -----------------------------------------------*/
 
 /* Private user code ---------------------------------------------------------*/
 
+/**
+ * @brief Calculates the CRC-8 of the given data.
+ *
+ * @param data Pointer to the data.
+ * @param dlen Length of the data.
+ * @return The CRC-8 of the data.
+ */
+static uint8_t crc8(const uint8_t *data, size_t dlen)
+{
+    uint8_t crc = 0;
+
+    for (size_t i = 0; i < dlen; i++)
+    {
+        crc ^= data[i];
+        for (uint8_t bit = 0; bit < CHAR_BIT; bit++)
+        {
+            crc = (crc & 0x80) ? ((crc << 1) ^ CRC8_POLY) : (crc << 1);
+        }
+    }
+
+    return crc;
+}
+
+/**
+ * @brief Checks if the window holds a valid frame header.
+ *
+ * @param header Pointer to the header window of FRAME_HEADER_SIZE bytes.
+ * @return True if the sync bytes and the CRC-8 match, false otherwise.
+ */
+static bool header_valid(const uint8_t *header)
+{
+    return (header[0] == FRAME_SYNC_1) && (header[1] == FRAME_SYNC_2) &&
+           (header[5] == crc8(&header[2], 3));
+}
+
+/**
+ * @brief Discards the given number of bytes from the transport.
+ *
+ * @param length The number of bytes to discard.
+ */
+static void discard(size_t length)
+{
+    uint8_t scratch[32];
+
+    while (length > 0)
+    {
+        size_t chunk = (length < sizeof(scratch)) ? length : sizeof(scratch);
+        size_t received = transport->read(scratch, chunk, FRAME_TIMEOUT);
+
+        if (received == 0)
+        {
+            break;
+        }
+
+        length -= received;
+    }
+}
+
+/**
+ * @brief Switches the transport to the given baud rate.
+ *
+ * @param rate The new baud rate.
+ * @param confirm True if the switch has to be confirmed, false for a fallback.
+ */
+static void baudrate_apply(uint32_t rate, bool confirm)
+{
+    uint32_t previous = baudrate;
+
+    if (rate != previous)
+    {
+        /* Armed before the switch, the confirmation can only arrive after it */
+        baudrate_switched = hal_millis();
+        baudrate_fallback = confirm ? previous : 0;
+
+        if (transport->configure(rate))
+        {
+            baudrate = rate;
+        }
+        else
+        {
+            baudrate_fallback = 0;
+        }
+    }
+}
+
+/**
+ * @brief Falls back to the previous baud rate if the switch was not confirmed in time.
+ *
+ * @return The time in ms until the fallback is due, STAGE_WAIT if none is pending.
+ */
+static uint32_t baudrate_check(void)
+{
+    uint32_t due = STAGE_WAIT;
+    uint32_t previous = baudrate_fallback;
+
+    if (previous != 0)
+    {
+        uint32_t elapsed = hal_millis() - baudrate_switched;
+
+        if ((elapsed >= BAUDRATE_CONFIRM) && baudrate_fallback.compare_exchange_strong(previous, 0))
+        {
+            baudrate_apply(previous, false);
+        }
+        else if (elapsed < BAUDRATE_CONFIRM)
+        {
+            due = BAUDRATE_CONFIRM - elapsed;
+        }
+    }
+
+    return due;
+}
+
+/**
+ * @brief Writes a frame to the transport, the header and the payload in one piece.
+ *
+ * @param frame The frame with its type and length set.
+ * @return True if the whole frame was written, false otherwise.
+ */
+static bool frame_write(frame_buffer_t *frame)
+{
+    size_t length = FRAME_HEADER_SIZE + frame->length;
+
+    frame->header[0] = FRAME_SYNC_1;
+    frame->header[1] = FRAME_SYNC_2;
+    frame->header[2] = frame->type;
+    frame->header[3] = (uint8_t)(frame->length & 0xFF);
+    frame->header[4] = (uint8_t)(frame->length >> 8);
+    frame->header[5] = crc8(&frame->header[2], 3);
+
+    bool status = (length == transport->write(frame->header, length));
+
+    capture_frame(CAPTURE_OUTBOUND, frame->type, frame->payload, frame->length);
+
+    return status;
+}
+
+/**
+ * @brief Reads a frame from the transport.
+ *
+ * Waits until a valid frame header has been found, sleeping in the transport while no data is available.
+ *
+ * @param frame The frame to read into, its length is 0 if the frame was incomplete or too large.
+ */
+static void frame_read(frame_buffer_t *frame)
+{
+    uint8_t *header = frame->header;
+
+    memset(header, 0, FRAME_HEADER_SIZE);
+
+    /* Slide over the incoming bytes until a valid header is found */
+    while (!header_valid(header))
+    {
+        /* Wait for the data to be available */
+        while (0 == transport->available())
+        {
+            (void)transport->wait(STAGE_WAIT);
+        }
+
+        memmove(header, header + 1, FRAME_HEADER_SIZE - 1);
+        (void)transport->read(&header[FRAME_HEADER_SIZE - 1], 1, FRAME_TIMEOUT);
+    }
+
+    size_t length = header[3] | (header[4] << 8);
+
+    frame->type = header[2];
+
+    if (length > sizeof(frame->payload))
+    {
+        discard(length); /**< The frame does not fit, drop its payload */
+        length = 0;
+    }
+    else if (length != transport->read(frame->payload, length, FRAME_TIMEOUT))
+    {
+        length = 0; /**< The frame was truncated */
+    }
+
+    frame->length = (uint16_t)length;
+
+    capture_frame(CAPTURE_INBOUND, frame->type, frame->payload, length);
+}
+
+/**
+ * @brief The receive thread, it reads the frames into the receive queue.
+ *
+ * A full queue leaves the data in the transport, so a slow consumer slows the client down.
+ */
+static void receiver(void)
+{
+    memory_task("rx");
+
+    while (true)
+    {
+        frame_buffer_t **entry = rx_queue.acquire();
+
+        if (entry == nullptr)
+        {
+            (void)rx_space.wait(STAGE_WAIT);
+            continue;
+        }
+
+        /* An unconfirmed baud rate switch wakes the receive thread to fall back */
+        if (!transport->wait(baudrate_check()))
+        {
+            continue;
+        }
+
+        frame_buffer_t *frame = communication_allocate();
+        metrics_time_t start = metrics_start();
+        frame_read(frame);
+        metrics_stop(METRICS_SERIAL, start);
+
+        if (frame->length == 0)
+        {
+            rx_errors++;
+        }
+
+        *entry = frame;
+        rx_queue.publish();
+        rx_ready.notify();
+    }
+}
+
+/**
+ * @brief The transmit thread, it writes the frames of the transmit queue.
+ */
+static void transmitter(void)
+{
+    memory_task("tx");
+
+    while (true)
+    {
+        frame_buffer_t **entry = tx_queue.peek();
+
+        if (entry == nullptr)
+        {
+            (void)tx_ready.wait(STAGE_WAIT);
+            continue;
+        }
+
+        frame_buffer_t *frame = *entry;
+
+        if (!frame_write(frame))
+        {
+            tx_errors++;
+        }
+
+        if (frame->baudrate != 0)
+        {
+            baudrate_apply(frame->baudrate, true);
+        }
+
+        tx_queue.release();
+        tx_space.notify();
+        communication_free(frame);
+    }
+}
+
+/**
+ * @brief Starts a stage thread on STAGE_CORE.
+ *
+ * @param stage The function of the thread.
+ * @param name The name of the thread.
+ */
+static void stage_start(void (*stage)(void), const char *name)
+{
+#ifdef ARDUINO
+    esp_pthread_cfg_t cfg = esp_pthread_get_default_config();
+    cfg.stack_size = STAGE_STACK_SIZE;
+    cfg.prio = STAGE_PRIORITY;
+    cfg.thread_name = name;
+    cfg.pin_to_core = STAGE_CORE;
+    esp_pthread_set_cfg(&cfg);
+#else
+    (void)name;
+#endif
+    std::thread(stage).detach();
+}
+
 /* Exported user code --------------------------------------------------------*/
 
+bool communication_select(const char *name, const char *address)
+{
+    bool status = false;
+
+    if (transport == nullptr)
+    {
+        for (const transport_t *entry : transports)
+        {
+            if (0 == strcmp(entry->name, name))
+            {
+                selected = entry->name;
+                selected_address = address;
+                status = true;
+            }
+        }
+    }
+
+    return status;
+}
+
 bool communication_init(void)
 {
-    Serial.begin(BAUDRATE); /**< Initialize the Serial Communication */
-    return Serial;          /**< Return the Serial Communication */
+    for (const transport_t *entry : transports)
+    {
+        if ((transport == nullptr) && (0 == strcmp(entry->name, selected)) && entry->open(selected_address))
+        {
+            transport = entry; /**< Frames are only read and written once the transport is open */
+            baudrate = entry->baudrate;
+        }
+    }
+
+    return (transport != nullptr);
+}
+
+bool communication_start(void)
+{
+    if (!started)
+    {
+        stage_start(receiver, "rx");
+        stage_start(transmitter, "tx");
+        started = true;
+    }
+
+    return started;
+}
+
+void communication_stats(communication_stats_t *stats)
+{
+    stats->rx_depth = (uint32_t)rx_queue.depth();
+    stats->rx_max = (uint32_t)rx_queue.high_water();
+    stats->rx_errors = rx_errors;
+    stats->tx_depth = (uint32_t)tx_queue.depth();
+    stats->tx_max = (uint32_t)tx_queue.high_water();
+    stats->tx_errors = tx_errors;
+    stats->pool_used = (uint32_t)pool.in_use();
+    stats->pool_max = (uint32_t)pool.high_water();
+}
+
+frame_buffer_t *communication_allocate(void)
+{
+    frame_buffer_t *frame{nullptr};
+
+    /* The pool has a frame for every holder, this only waits if a caller holds on to frames */
+    while (nullptr == (frame = pool.acquire()))
+    {
+        (void)pool_space.wait(STAGE_WAIT);
+    }
+
+    frame->type = FRAME_DATA;
+    frame->length = 0;
+    frame->baudrate = 0;
+
+    return frame;
 }
 
-bool communication_write(const uint8_t *data, size_t dlen)
+void communication_free(frame_buffer_t *frame)
 {
-    return (dlen == Serial.write(data, dlen)); /**< Write the data to the Serial Communication */
+    if (frame != nullptr)
+    {
+        pool.release(frame);
+        pool_space.notify();
+    }
 }
 
-size_t communication_read(uint8_t *buf, size_t blen)
+bool communication_send(frame_buffer_t *frame)
 {
-    /* Wait for the data to be available */
-    while (0 == Serial.available())
+    bool status = false;
+
+    frame->baudrate = baudrate_next.exchange(0);
+
+    if (!started)
+    {
+        status = frame_write(frame);
+
+        if (frame->baudrate != 0)
+        {
+            baudrate_apply(frame->baudrate, true);
+        }
+
+        communication_free(frame);
+    }
+    else
     {
-        ;
+        frame_buffer_t **entry{nullptr};
+
+        /* The transmit thread frees an entry as soon as it has written a frame */
+        while (nullptr == (entry = tx_queue.acquire()))
+        {
+            (void)tx_space.wait(STAGE_WAIT);
+        }
+
+        *entry = frame;
+        tx_queue.publish();
+        tx_ready.notify();
+        status = true;
     }
 
-    return Serial.readBytes(buf, blen); /**< Read the data from the Serial Communication */
-}
\ No newline at end of file
+    return status;
+}
+
+frame_buffer_t *communication_receive(void)
+{
+    frame_buffer_t *frame{nullptr};
+
+    if (!started)
+    {
+        frame = communication_allocate();
+        frame_read(frame);
+    }
+    else
+    {
+        frame_buffer_t **entry{nullptr};
+
+        while (nullptr == (entry = rx_queue.peek()))
+        {
+            (void)rx_ready.wait(STAGE_WAIT);
+        }
+
+        frame = *entry;
+        rx_queue.release();
+        rx_space.notify();
+    }
+
+    return frame;
+}
+
+bool communication_write(const uint8_t *data, size_t dlen, uint8_t type)
+{
+    bool status = false;
+
+    if (dlen <= FRAME_MAX_PAYLOAD)
+    {
+        frame_buffer_t *frame = communication_allocate();
+
+        frame->type = type;
+        frame->length = (uint16_t)dlen;
+        memcpy(frame->payload, data, dlen);
+        status = communication_send(frame);
+    }
+
+    return status;
+}
+
+size_t communication_read(uint8_t *buf, size_t blen, uint8_t *type)
+{
+    size_t length = 0;
+    frame_buffer_t *frame = communication_receive();
+
+    if (type != nullptr)
+    {
+        *type = frame->type;
+    }
+
+    if (frame->length <= blen)
+    {
+        length = frame->length;
+        memcpy(buf, frame->payload, length);
+    }
+
+    communication_free(frame);
+
+    return length;
+}
+
+bool communication_available(void)
+{
+    return started ? (nullptr != rx_queue.peek()) : (0 < transport->available());
+}
+
+bool communication_wait(uint32_t timeout)
+{
+    bool status = communication_available();
+
+    if (!status && started)
+    {
+        status = rx_ready.wait(timeout) && communication_available();
+    }
+    else if (!status)
+    {
+        uint32_t due = baudrate_check();
+        status = transport->wait((due < timeout) ? due : timeout);
+    }
+
+    return status;
+}
+
+void communication_wake(void)
+{
+    rx_ready.notify();
+}
+
+bool communication_switch(uint32_t rate)
+{
+    bool status = (rate == baudrate);
+
+    if (!status && (transport->configure != nullptr) && (rate >= BAUDRATE_MIN) && (rate <= transport->baudrate_max))
+    {
+        baudrate_next = rate;
+        status = true;
+    }
+
+    return status;
+}
+
+void communication_confirm(void)
+{
+    baudrate_fallback = 0;
+}
+
+uint32_t communication_baudrate(void)
+{
+    return baudrate;
+}
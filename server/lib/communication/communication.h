@@ -19,37 +19,226 @@
 
 /* Exported defines ----------------------------------------------------------*/
 
+constexpr uint8_t FRAME_SYNC_1{0xA5};  /**< First synchronisation byte */
+constexpr uint8_t FRAME_SYNC_2{0x5A};  /**< Second synchronisation byte */
+constexpr size_t FRAME_HEADER_SIZE{6}; /**< Sync (2) + Type (1) + Length (2) + CRC-8 (1) */
+constexpr size_t FRAME_MAX_PAYLOAD{1024}; /**< Largest payload the receive and transmit stages can queue, the size of a pool frame */
+
 /* Exported types ------------------------------------------------------------*/
 
+/**
+ * @brief The frame types carried in the frame header.
+ */
+typedef enum : uint8_t
+{
+    FRAME_DATA = 0x01,   /**< Session data (handshake and requests) */
+    FRAME_RECORD = 0x02, /**< AES-GCM session record */
+} frame_type_t;
+
+/**
+ * @brief The queue depths of the receive and transmit stages.
+ */
+typedef struct
+{
+    uint32_t rx_depth;  /**< Received frames waiting to be read */
+    uint32_t rx_max;    /**< Highest number of received frames waiting */
+    uint32_t rx_errors; /**< Frames dropped because they were truncated or too large */
+    uint32_t tx_depth;  /**< Frames waiting to be transmitted */
+    uint32_t tx_max;    /**< Highest number of frames waiting to be transmitted */
+    uint32_t tx_errors; /**< Frames that could not be transmitted */
+    uint32_t pool_used; /**< Frames of the pool in use */
+    uint32_t pool_max;  /**< Highest number of frames of the pool in use */
+} communication_stats_t;
+
+/**
+ * @brief A frame of the frame pool.
+ *
+ * The header is the headroom of the payload, so a frame is written in one piece. The payload
+ * is decrypted and the response is built in place, MACs and tags go into its tailroom.
+ */
+typedef struct
+{
+    uint8_t type;                       /**< The frame type */
+    uint16_t length;                    /**< The payload length, 0 for a dropped frame */
+    uint32_t baudrate;                  /**< The baud rate to switch to after writing the frame, 0 to keep it */
+    uint8_t header[FRAME_HEADER_SIZE];  /**< The frame header, filled in by the transmit stage */
+    uint8_t payload[FRAME_MAX_PAYLOAD]; /**< The payload, right behind the header */
+} frame_buffer_t;
+
+/**
+ * @brief A byte stream the frames are sent over.
+ */
+typedef struct
+{
+    const char *name;                                            /**< The name to select the transport with */
+    bool (*open)(const char *address);                           /**< Opens the transport at the address, nullptr for its default */
+    size_t (*available)(void);                                   /**< Returns the number of bytes that can be read without waiting */
+    bool (*wait)(uint32_t timeout);                              /**< Sleeps until data was received, at most timeout ms, returns true if data is available */
+    size_t (*read)(uint8_t *buf, size_t blen, uint32_t timeout); /**< Reads blen bytes, waits at most timeout ms for each */
+    size_t (*write)(const uint8_t *data, size_t dlen);           /**< Writes the data, returns the number of bytes written */
+    bool (*configure)(uint32_t baudrate);                        /**< Changes the baud rate once all data is written, nullptr if fixed */
+    uint32_t baudrate;                                           /**< The baud rate after open(), 0 if the transport has none */
+    uint32_t baudrate_max;                                       /**< The highest baud rate configure() accepts */
+} transport_t;
+
 /* Exported constants --------------------------------------------------------*/
 
+constexpr uint32_t BAUDRATE_MIN{9600};    /**< Lowest baud rate communication_switch() accepts */
+constexpr uint32_t BAUDRATE_CONFIRM{1000}; /**< Time in ms to confirm a new baud rate before falling back */
+
+/* Exported variables --------------------------------------------------------*/
+
+#ifdef ARDUINO
+extern const transport_t transport_uart; /**< UART0, at 115200 baud until switched */
+#endif
+extern const transport_t transport_tcp;  /**< TCP server, over WiFi on the target */
+#ifndef ARDUINO
+extern const transport_t transport_unix; /**< UNIX domain socket, host only */
+extern const transport_t transport_tty;  /**< Serial port or pseudo-terminal, host only */
+extern const transport_t transport_replay; /**< Replays a capture to the server, host only */
+#endif
+
 /* Exported macro ------------------------------------------------------------*/
 
 /* Exported functions prototypes ---------------------------------------------*/
 
+/**
+ * @brief Select the transport by its name
+ *
+ * Must be called before communication_init(), the default is COMMUNICATION_TRANSPORT ("uart", "unix" in a host build).
+ * In a host build, the address lets several servers run side by side.
+ *
+ * @param name "uart", "tcp" or, in a host build, "unix" or "tty"
+ * @param address the TCP port, socket path or serial port in a host build, nullptr for the default of the transport
+ * @return true if the transport exists and the communication module is not initialized yet else false
+ */
+bool communication_select(const char *name, const char *address = nullptr);
+
 /**
  * @brief Initialize the communication module
  *
+ * Opens the selected transport.
+ *
  * @return true if the communication module was successfully initialized else false
  */
 bool communication_init(void);
 
 /**
- * @brief Read data from the communication module
+ * @brief Start the receive and transmit stages
+ *
+ * From then on frames are received and transmitted by their own threads, pinned to the core
+ * the request handling does not run on. communication_receive() and communication_send() only
+ * hand pool frames from and to their queues.
+ *
+ * @return true if the stages were started else false
+ */
+bool communication_start(void);
+
+/**
+ * @brief Get the queue depths of the receive and transmit stages
+ *
+ * @param stats pointer to store the queue depths in
+ */
+void communication_stats(communication_stats_t *stats);
+
+/**
+ * @brief Take a frame from the pool to build a frame to send in
+ *
+ * Waits while all frames are in use, frames are returned by the transmit stage as soon as they are written.
+ *
+ * @return frame_buffer_t* the frame, owned by the caller until it is passed to communication_send() or communication_free()
+ */
+frame_buffer_t *communication_allocate(void);
+
+/**
+ * @brief Return a frame to the pool without sending it
  *
- * @param buffer the buffer to store the data
- * @param dlen the length of the buffer
- * @return size_t the length of the data
+ * @param frame the frame, nullptr is ignored
  */
-bool communication_write(const uint8_t *data, size_t dlen);
+void communication_free(frame_buffer_t *frame);
 
 /**
- * @brief Read data from the communication module
+ * @brief Send a frame of the pool, without copying its payload
  *
- * @param buf the buffer to store the data
+ * @param frame the frame with its type and length set, it is returned to the pool once written
+ * @return true if the whole frame was written, or queued once the stages are started, else false
+ */
+bool communication_send(frame_buffer_t *frame);
+
+/**
+ * @brief Receive the next frame, without copying its payload
+ *
+ * Blocks until a frame has been received.
+ *
+ * @return frame_buffer_t* the frame, a length of 0 if it was incomplete or too large; owned by
+ *         the caller until it is passed to communication_send() or communication_free()
+ */
+frame_buffer_t *communication_receive(void);
+
+/**
+ * @brief Write a frame to the communication module
+ *
+ * @param data the payload of the frame
+ * @param dlen the length of the payload
+ * @param type the type of the frame
+ * @return true if the whole frame was written, or queued once the stages are started, else false
+ */
+bool communication_write(const uint8_t *data, size_t dlen, uint8_t type = FRAME_DATA);
+
+/**
+ * @brief Read a frame from the communication module
+ *
+ * Blocks until a valid frame header has been found and returns as soon as the
+ * payload announced by the header has been received.
+ *
+ * @param buf the buffer to store the payload
  * @param blen the length of the buffer
- * @return size_t the length of the data
+ * @param type optional pointer to store the type of the frame
+ * @return size_t the length of the payload, 0 if the frame was incomplete or too large
+ */
+size_t communication_read(uint8_t *buf, size_t blen, uint8_t *type = nullptr);
+
+/**
+ * @brief Check if received data is waiting to be read
+ *
+ * @return true if communication_read() would not have to wait for the first byte else false
+ */
+bool communication_available(void);
+
+/**
+ * @brief Sleep until received data is waiting to be read
+ *
+ * @param timeout the longest sleep in ms
+ * @return true if communication_available() is true, false if the sleep timed out or was ended by communication_wake()
+ */
+bool communication_wait(uint32_t timeout);
+
+/**
+ * @brief End the sleep of communication_wait(), for work coming from another thread
+ */
+void communication_wake(void);
+
+/**
+ * @brief Switch the baud rate after the next frame written, the response to the client's request
+ *
+ * The transport falls back to the previous baud rate unless communication_confirm() is called
+ * within BAUDRATE_CONFIRM ms, so a rate the link cannot carry does not lock the client out.
+ *
+ * @param baudrate the new baud rate
+ * @return true if the switch was scheduled or the rate is already in use, false if the transport does not support it
+ */
+bool communication_switch(uint32_t baudrate);
+
+/**
+ * @brief Keep the current baud rate, an authenticated frame was received with it
+ */
+void communication_confirm(void);
+
+/**
+ * @brief Get the baud rate in use
+ *
+ * @return uint32_t the baud rate, 0 if the transport has none
  */
-size_t communication_read(uint8_t *buf, size_t blen);
+uint32_t communication_baudrate(void);
 
-#endif // COMMUNICATION_H
\ No newline at end of file
+#endif // COMMUNICATION_H
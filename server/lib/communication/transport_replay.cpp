@@ -0,0 +1,462 @@
+/**
+ * @file transport_replay.cpp
+ * @brief This file contains the replay transport of the communication module in a host build.
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @details The transport plays the received frames of a capture to the server instead of a client
+ *          and compares the frames the server writes with the captured ones. The address is the
+ *          capture file, followed by ":max" to replay at maximum speed:
+ *
+ *          - At the original speed every received frame is released at its captured time after
+ *            the server first waited for data.
+ *          - At maximum speed a frame is released right away.
+ *
+ *          In both a frame waits until the server has written all frames it wrote before it in the
+ *          capture, or for REPLAY_STALL ms if one of them does not come. The client of the capture
+ *          waited for them as well, it kept no more than the window of requests outstanding.
+ *
+ *          The transport seeds hal_random() with the seed of the capture before the session
+ *          layer is initialized, so a server with the key store of the captured one establishes
+ *          the same sessions and can decrypt the captured requests.
+ *
+ *          Once all frames were released and answered, the transport prints the latency of every
+ *          written frame, the time since the last received frame, next to the captured one and
+ *          ends the process. A written frame matches the captured one if its type and length are
+ *          the same. The bytes are not compared: tickets, temperatures and statistics carry the time
+ *          of the server, inside the encryption, so they differ in every replay. A request the
+ *          replay cannot decrypt is answered with a short status frame and does not match.
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef ARDUINO
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "communication.h"
+#include "capture.h"
+#include "hal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* Private define ------------------------------------------------------------*/
+
+/* Private typedef -----------------------------------------------------------*/
+
+typedef std::chrono::steady_clock clock_type; /**< The clock of the schedule and the latencies */
+
+/**
+ * @brief A frame of the capture.
+ */
+typedef struct
+{
+    uint64_t time;                /**< Time in us since the start of the capture */
+    uint8_t type;                 /**< The frame type */
+    std::vector<uint8_t> payload; /**< The payload */
+    size_t before;                /**< Received: frames written before it. Written: the received frame before it, 0 if none */
+} replay_frame_t;
+
+/* Private macro -------------------------------------------------------------*/
+
+constexpr const char SPEED_MAX[]{":max"}; /**< Suffix of the address for the maximum speed */
+constexpr uint32_t REPLAY_STALL{500};     /**< Time in ms a frame waits for a missing frame of the server */
+constexpr uint32_t REPLAY_DRAIN{1000};    /**< Time in ms the server gets for its last frames */
+constexpr uint32_t REPLAY_BAUDRATE{115200}; /**< The baud rate after open, as on the target */
+
+/* Private variables ---------------------------------------------------------*/
+
+static std::vector<replay_frame_t> received; /**< The captured frames of the client */
+static std::vector<replay_frame_t> written;  /**< The captured frames of the server */
+static std::string path;                     /**< The capture file */
+static uint64_t seed{0};                     /**< The seed of the capture */
+static uint32_t dropped{0};                  /**< Frames the capture dropped */
+static bool maximum{false};                  /**< Replay at maximum speed */
+
+static std::mutex lock;                           /**< Protects the state of the replay */
+static std::condition_variable progress;          /**< Notified when the server wrote a frame */
+static bool started{false};                       /**< The replay has started */
+static clock_type::time_point start;              /**< The time the replay started */
+static clock_type::time_point active;             /**< The time of the last release or write */
+static size_t next{0};                            /**< The next received frame to release */
+static std::vector<uint8_t> pending;              /**< The bytes of the released frame */
+static size_t offset{0};                          /**< The bytes of pending read by the server */
+static std::vector<clock_type::time_point> released; /**< The release times of the received frames */
+static std::vector<clock_type::time_point> answered; /**< The write times of the frames of the server */
+static std::vector<uint64_t> latencies;          /**< The time in us from the last release to each write, UINT64_MAX if none */
+static std::vector<bool> matching;                /**< The frame of the server has the type and length of the captured one */
+
+/* Static Assertions ---------------------------------------------------------*/
+
+/* Private function prototypes -----------------------------------------------*/
+
+static void replay_finish(void);
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief Returns the time between two points in us.
+ */
+static uint64_t elapsed_us(clock_type::time_point from, clock_type::time_point to)
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(to - from).count();
+}
+
+/**
+ * @brief Reads a capture into the received and written frames.
+ *
+ * @return True if the capture is valid, false otherwise.
+ */
+static bool capture_load(const char *file)
+{
+    bool status = false;
+    FILE *input = fopen(file, "rb");
+    capture_header_t header{};
+
+    if ((input != nullptr) && (1 == fread(&header, sizeof(header), 1, input)) &&
+        (header.magic == CAPTURE_MAGIC) && (header.version == CAPTURE_VERSION))
+    {
+        capture_record_t record{};
+        uint64_t time = 0;
+
+        status = true;
+        seed = header.seed;
+
+        while (status && (1 == fread(&record, sizeof(record), 1, input)))
+        {
+            replay_frame_t frame{time + record.delta, record.type, std::vector<uint8_t>(record.length), 0};
+
+            time = frame.time;
+            status = (record.length == 0) || (record.length == fread(frame.payload.data(), 1, record.length, input));
+
+            if (!status)
+            {
+                fprintf(stderr, "%s: truncated after %zu frames\n", file, received.size() + written.size());
+            }
+            else if (record.direction == CAPTURE_DROPPED)
+            {
+                uint32_t count = 0;
+                memcpy(&count, frame.payload.data(), std::min(sizeof(count), frame.payload.size()));
+                dropped += count;
+            }
+            else if ((record.direction == CAPTURE_INBOUND) && (record.length > 0))
+            {
+                /* A frame the server dropped as incomplete cannot be played again */
+                frame.before = written.size();
+                received.push_back(std::move(frame));
+            }
+            else if (record.direction == CAPTURE_OUTBOUND)
+            {
+                frame.before = received.size();
+                written.push_back(std::move(frame));
+            }
+        }
+    }
+
+    if (input != nullptr)
+    {
+        fclose(input);
+    }
+
+    return status;
+}
+
+/**
+ * @brief Releases the next received frame if it is due.
+ *
+ * @note The lock must be held.
+ *
+ * @param now The current time.
+ * @return The time the next frame is due, clock_type::time_point::max() if it waits for the server.
+ */
+static clock_type::time_point replay_release(clock_type::time_point now)
+{
+    clock_type::time_point due = clock_type::time_point::max();
+
+    if (!started)
+    {
+        started = true;
+        start = now;
+        active = now;
+    }
+
+    if ((offset == pending.size()) && (next < received.size()))
+    {
+        const replay_frame_t &frame = received[next];
+        clock_type::time_point ready = active; /**< The time the last frame it waits for was written */
+
+        due = maximum ? start : start + std::chrono::microseconds(frame.time);
+
+        if (answered.size() < frame.before)
+        {
+            ready = active + std::chrono::milliseconds(REPLAY_STALL);
+        }
+
+        if (std::max(due, ready) <= now)
+        {
+            size_t length = frame.payload.size();
+            uint8_t header[FRAME_HEADER_SIZE]{FRAME_SYNC_1, FRAME_SYNC_2, frame.type, (uint8_t)(length & 0xFF), (uint8_t)(length >> 8), 0};
+
+            /* The CRC-8 of the communication module, over type and length */
+            for (size_t i = 2; i < 5; i++)
+            {
+                header[5] ^= header[i];
+                for (uint8_t bit = 0; bit < CHAR_BIT; bit++)
+                {
+                    header[5] = (header[5] & 0x80) ? ((header[5] << 1) ^ 0x07) : (header[5] << 1);
+                }
+            }
+
+            pending.assign(header, header + FRAME_HEADER_SIZE);
+            pending.insert(pending.end(), frame.payload.begin(), frame.payload.end());
+            offset = 0;
+            /* The time it was due, not when this thread got to it */
+            released.push_back(std::max(due, ready));
+            active = now;
+            next++;
+            due = now;
+        }
+        else
+        {
+            due = std::max(due, ready);
+        }
+    }
+
+    return due;
+}
+
+/**
+ * @brief Checks if the replay is over, all frames were released and the server has answered them.
+ *
+ * @note The lock must be held.
+ */
+static bool replay_done(clock_type::time_point now)
+{
+    return started && (next == received.size()) && (offset == pending.size()) &&
+           ((answered.size() >= written.size()) || (now - active > std::chrono::milliseconds(REPLAY_DRAIN)));
+}
+
+/**
+ * @brief Returns the latency below which the given share of the sorted latencies lie.
+ */
+static uint64_t percentile(const std::vector<uint64_t> &sorted, double share)
+{
+    uint64_t value = 0;
+
+    if (!sorted.empty())
+    {
+        size_t rank = (size_t)(share * sorted.size() + 0.999999);
+        value = sorted[(rank > 0) ? rank - 1 : 0];
+    }
+
+    return value;
+}
+
+/**
+ * @brief Prints the latency of every frame of the server and ends the process.
+ *
+ * @note The lock must be held.
+ */
+static void replay_finish(void)
+{
+    std::vector<uint64_t> captured;
+    std::vector<uint64_t> replayed;
+    size_t same = 0;
+
+    printf("frame  type  bytes  captured us  replayed us  match\n");
+
+    for (size_t i = 0; i < written.size(); i++)
+    {
+        const replay_frame_t &frame = written[i];
+        bool timed = (frame.before > 0) && (i < latencies.size()) && (latencies[i] != UINT64_MAX);
+
+        printf("%5zu  0x%02X  %5zu", i + 1, frame.type, frame.payload.size());
+
+        if (timed)
+        {
+            uint64_t before = latencies[i];
+            uint64_t original = frame.time - received[frame.before - 1].time;
+
+            captured.push_back(original);
+            replayed.push_back(before);
+            printf("  %11llu  %11llu", (unsigned long long)original, (unsigned long long)before);
+        }
+        else
+        {
+            printf("  %11s  %11s", "-", "-");
+        }
+
+        same += ((i < matching.size()) && matching[i]) ? 1 : 0;
+        printf("  %s\n", (i >= answered.size()) ? "missing" : (matching[i] ? "yes" : "no"));
+    }
+
+    std::sort(captured.begin(), captured.end());
+    std::sort(replayed.begin(), replayed.end());
+
+    printf("replay       %s, seed 0x%016llx, %s speed\n", path.c_str(), (unsigned long long)seed, maximum ? "maximum" : "original");
+    printf("frames       received %zu, written %zu of %zu, matching %zu, dropped by the capture %u\n", received.size(),
+           answered.size(), written.size(), same, dropped);
+
+    if (!captured.empty())
+    {
+        printf("latency us   captured p50 %llu, p99 %llu, max %llu\n", (unsigned long long)percentile(captured, 0.5),
+               (unsigned long long)percentile(captured, 0.99), (unsigned long long)captured.back());
+        printf("             replayed p50 %llu, p99 %llu, max %llu\n", (unsigned long long)percentile(replayed, 0.5),
+               (unsigned long long)percentile(replayed, 0.99), (unsigned long long)replayed.back());
+    }
+
+    printf("time         captured %.3f s, replayed %.3f s\n", (received.empty() ? 0 : received.back().time) / 1e6,
+           elapsed_us(start, active) / 1e6);
+
+    /* The other threads of the server are still running, nothing is torn down */
+    fflush(stdout);
+    capture_flush();
+    _exit(EXIT_SUCCESS);
+}
+
+/**
+ * @brief Loads the capture and seeds the random bytes with its seed.
+ */
+static bool replay_open(const char *address)
+{
+    bool status = false;
+
+    if (address != nullptr)
+    {
+        size_t length = strlen(address);
+        size_t suffix = sizeof(SPEED_MAX) - 1;
+
+        maximum = (length > suffix) && (0 == strcmp(address + length - suffix, SPEED_MAX));
+        path.assign(address, maximum ? length - suffix : length);
+        status = capture_load(path.c_str());
+    }
+
+    if (status)
+    {
+        if (seed != 0)
+        {
+            hal_seed(seed);
+        }
+        else
+        {
+            fprintf(stderr, "%s: the server was not seeded, its sessions cannot be replayed\n", path.c_str());
+        }
+    }
+
+    return status;
+}
+
+/**
+ * @brief Returns the number of released bytes not read yet.
+ */
+static size_t replay_available(void)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    clock_type::time_point now = clock_type::now();
+
+    (void)replay_release(now);
+
+    if (replay_done(now))
+    {
+        replay_finish();
+    }
+
+    return pending.size() - offset;
+}
+
+/**
+ * @brief Sleeps until the next frame is released.
+ */
+static bool replay_wait(uint32_t timeout)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    clock_type::time_point now = clock_type::now();
+    clock_type::time_point deadline = now + std::chrono::milliseconds(timeout);
+    clock_type::time_point due = replay_release(now);
+
+    while ((offset == pending.size()) && (now < deadline) && !replay_done(now))
+    {
+        /* A write of the server can make the next frame due */
+        progress.wait_until(guard, std::min({due, deadline, now + std::chrono::milliseconds(REPLAY_STALL)}));
+        now = clock_type::now();
+        due = replay_release(now);
+    }
+
+    if (replay_done(now))
+    {
+        replay_finish();
+    }
+
+    return (offset < pending.size());
+}
+
+/**
+ * @brief Reads released bytes, waiting at most timeout ms for each.
+ */
+static size_t replay_read(uint8_t *buf, size_t blen, uint32_t timeout)
+{
+    size_t count = 0;
+
+    while ((count < blen) && ((0 < replay_available()) || replay_wait(timeout)))
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        size_t chunk = std::min(blen - count, pending.size() - offset);
+
+        memcpy(buf + count, pending.data() + offset, chunk);
+        offset += chunk;
+        count += chunk;
+    }
+
+    return count;
+}
+
+/**
+ * @brief Compares the type and length of a frame of the server with the captured one and takes its time.
+ */
+static size_t replay_write(const uint8_t *data, size_t dlen)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    size_t index = answered.size();
+    bool same = false;
+
+    if ((index < written.size()) && (dlen >= FRAME_HEADER_SIZE))
+    {
+        const replay_frame_t &frame = written[index];
+
+        same = (data[2] == frame.type) && (dlen - FRAME_HEADER_SIZE == frame.payload.size());
+    }
+
+    active = clock_type::now();
+    answered.push_back(active);
+    latencies.push_back(released.empty() ? UINT64_MAX : elapsed_us(std::min(released.back(), active), active));
+    matching.push_back(same);
+    progress.notify_all();
+
+    return dlen;
+}
+
+/**
+ * @brief Accepts every baud rate, so a capture of the target replays the same responses.
+ */
+static bool replay_configure(uint32_t)
+{
+    return true;
+}
+
+/* Exported user code --------------------------------------------------------*/
+
+const transport_t transport_replay{"replay", replay_open, replay_available, replay_wait, replay_read, replay_write,
+                                   replay_configure, REPLAY_BAUDRATE, 2000000};
+
+#endif /* ARDUINO */
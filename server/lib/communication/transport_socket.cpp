@@ -0,0 +1,229 @@
+/**
+ * @file transport_socket.cpp
+ * @brief This file contains the socket transports of the communication module in a host build.
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @details The server listens on TRANSPORT_TCP_PORT or on the UNIX domain socket TRANSPORT_UNIX_PATH
+ *          and serves one client at a time, the next one is accepted when the previous one has
+ *          disconnected. This lets the server run and be load tested as a Linux process.
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef ARDUINO
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "communication.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/* Private define ------------------------------------------------------------*/
+
+#ifndef TRANSPORT_TCP_PORT
+#define TRANSPORT_TCP_PORT 5000 /**< The TCP port the server listens on */
+#endif
+
+#ifndef TRANSPORT_UNIX_PATH
+#define TRANSPORT_UNIX_PATH "/tmp/dataintegrity.sock" /**< The UNIX domain socket the server listens on */
+#endif
+
+/* Private typedef -----------------------------------------------------------*/
+
+/* Private macro -------------------------------------------------------------*/
+
+/* Private variables ---------------------------------------------------------*/
+
+static int listener{-1}; /**< The listening socket */
+static int peer{-1};     /**< The connected client, -1 if there is none */
+
+/* Static Assertions ---------------------------------------------------------*/
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief Binds the listening socket to the address and starts listening.
+ */
+static bool socket_listen(int domain, const struct sockaddr *address, socklen_t length)
+{
+    bool status = false;
+    int enable = 1;
+
+    listener = socket(domain, SOCK_STREAM, 0);
+
+    if (listener >= 0)
+    {
+        status = ((domain != AF_INET) || (0 == setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)))) &&
+                 (0 == bind(listener, address, length)) &&
+                 (0 == listen(listener, 1)) &&
+                 (0 == fcntl(listener, F_SETFL, O_NONBLOCK));
+
+        if (!status)
+        {
+            close(listener);
+            listener = -1;
+        }
+    }
+
+    return status;
+}
+
+/**
+ * @brief Closes the connection to the client.
+ */
+static void socket_hangup(void)
+{
+    close(peer);
+    peer = -1;
+}
+
+/**
+ * @brief Accepts the next client if none is connected.
+ *
+ * @return True if a client is connected, false otherwise.
+ */
+static bool socket_accept(void)
+{
+    if (peer < 0)
+    {
+        int enable = 1;
+        peer = accept(listener, nullptr, nullptr);
+
+        if (peer >= 0)
+        {
+            /* Fails on UNIX domain sockets, which do not delay anyway */
+            (void)setsockopt(peer, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+        }
+    }
+
+    return (peer >= 0);
+}
+
+/**
+ * @brief Opens the TCP transport on the port in the address, or on TRANSPORT_TCP_PORT.
+ */
+static bool tcp_open(const char *port)
+{
+    struct sockaddr_in address{};
+
+    address.sin_family = AF_INET;
+    address.sin_port = htons((port != nullptr) ? (uint16_t)atoi(port) : TRANSPORT_TCP_PORT);
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    return socket_listen(AF_INET, (const struct sockaddr *)&address, sizeof(address));
+}
+
+/**
+ * @brief Opens the UNIX domain socket transport at the path, or at TRANSPORT_UNIX_PATH. A stale socket file is replaced.
+ */
+static bool unix_open(const char *path)
+{
+    struct sockaddr_un address{};
+
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, (path != nullptr) ? path : TRANSPORT_UNIX_PATH, sizeof(address.sun_path) - 1);
+    (void)unlink(address.sun_path);
+
+    return socket_listen(AF_UNIX, (const struct sockaddr *)&address, sizeof(address));
+}
+
+/**
+ * @brief Returns the number of received bytes, accepts the next client if none is connected.
+ */
+static size_t socket_available(void)
+{
+    int count = 0;
+
+    if (socket_accept())
+    {
+        struct pollfd fd{peer, POLLIN, 0};
+
+        if ((1 == poll(&fd, 1, 0)) && ((0 != ioctl(peer, FIONREAD, &count)) || (count == 0)))
+        {
+            /* Readable without data, the client has disconnected */
+            socket_hangup();
+            count = 0;
+        }
+    }
+
+    return (size_t)count;
+}
+
+/**
+ * @brief Sleeps until the client has sent data, or a client has connected if none is.
+ */
+static bool socket_wait(uint32_t timeout)
+{
+    struct pollfd fd{(peer >= 0) ? peer : listener, POLLIN, 0};
+
+    (void)poll(&fd, 1, (int)timeout);
+
+    return (0 < socket_available());
+}
+
+/**
+ * @brief Reads blen bytes, waiting at most timeout ms for each.
+ */
+static size_t socket_read(uint8_t *buf, size_t blen, uint32_t timeout)
+{
+    size_t count = 0;
+    struct pollfd fd{peer, POLLIN, 0};
+
+    while ((count < blen) && (peer >= 0) && (1 == poll(&fd, 1, (int)timeout)))
+    {
+        ssize_t length = recv(peer, buf + count, blen - count, 0);
+
+        if (length <= 0)
+        {
+            socket_hangup();
+            break;
+        }
+
+        count += (size_t)length;
+    }
+
+    return count;
+}
+
+/**
+ * @brief Writes the data to the connected client.
+ */
+static size_t socket_write(const uint8_t *data, size_t dlen)
+{
+    size_t count = 0;
+
+    while ((count < dlen) && (peer >= 0))
+    {
+        ssize_t length = send(peer, data + count, dlen - count, MSG_NOSIGNAL);
+
+        if (length <= 0)
+        {
+            socket_hangup();
+            break;
+        }
+
+        count += (size_t)length;
+    }
+
+    return count;
+}
+
+/* Exported user code --------------------------------------------------------*/
+
+const transport_t transport_tcp{"tcp", tcp_open, socket_available, socket_wait, socket_read, socket_write, nullptr, 0, 0};
+const transport_t transport_unix{"unix", unix_open, socket_available, socket_wait, socket_read, socket_write, nullptr, 0, 0};
+
+#endif /* ARDUINO */
@@ -0,0 +1,198 @@
+/**
+ * @file transport_tty.cpp
+ * @brief This file contains the serial port transport of the communication module in a host build.
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @details The server opens TRANSPORT_TTY_PATH in raw mode, a serial adapter or one end of a
+ *          pseudo-terminal pair, e.g. created with
+ *
+ *          socat pty,raw,echo=0,link=/tmp/dataintegrity.tty pty,raw,echo=0,link=/tmp/client.tty
+ *
+ *          This lets the baud rate negotiation be tested end to end without the board.
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef ARDUINO
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "communication.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+
+/* Private define ------------------------------------------------------------*/
+
+#ifndef TRANSPORT_TTY_PATH
+#define TRANSPORT_TTY_PATH "/tmp/dataintegrity.tty" /**< The serial port the server opens */
+#endif
+
+/* Private typedef -----------------------------------------------------------*/
+
+/**
+ * @brief A baud rate and its termios speed.
+ */
+typedef struct
+{
+    uint32_t baudrate; /**< The baud rate */
+    speed_t speed;     /**< The termios speed */
+} tty_speed_t;
+
+/* Private macro -------------------------------------------------------------*/
+
+constexpr uint32_t TTY_BAUDRATE{115200}; /**< The baud rate after open, as on the target */
+
+/* Private variables ---------------------------------------------------------*/
+
+static int tty{-1}; /**< The serial port */
+
+/* The baud rates termios can set */
+static const tty_speed_t speeds[] = {
+    {9600, B9600},
+    {19200, B19200},
+    {38400, B38400},
+    {57600, B57600},
+    {115200, B115200},
+    {230400, B230400},
+    {460800, B460800},
+    {921600, B921600},
+    {1000000, B1000000},
+    {1500000, B1500000},
+    {2000000, B2000000},
+};
+
+/* Static Assertions ---------------------------------------------------------*/
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief Sets the serial port to raw mode at the given baud rate.
+ *
+ * @param baudrate The baud rate, one of speeds.
+ * @return True if the baud rate was set, false otherwise.
+ */
+static bool tty_speed(uint32_t baudrate)
+{
+    bool status = false;
+    struct termios options{};
+
+    for (const tty_speed_t &entry : speeds)
+    {
+        if ((entry.baudrate == baudrate) && (0 == tcgetattr(tty, &options)))
+        {
+            cfmakeraw(&options);
+            options.c_cc[VMIN] = 0;
+            options.c_cc[VTIME] = 0;
+            status = (0 == cfsetspeed(&options, entry.speed)) && (0 == tcsetattr(tty, TCSANOW, &options));
+        }
+    }
+
+    return status;
+}
+
+/**
+ * @brief Opens the serial port.
+ */
+static bool tty_open(const char *address)
+{
+    tty = open((address != nullptr) ? address : TRANSPORT_TTY_PATH, O_RDWR | O_NOCTTY | O_NONBLOCK);
+
+    return (tty >= 0) && tty_speed(TTY_BAUDRATE);
+}
+
+/**
+ * @brief Returns the number of received bytes.
+ */
+static size_t tty_available(void)
+{
+    int count = 0;
+
+    if (0 != ioctl(tty, FIONREAD, &count))
+    {
+        count = 0;
+    }
+
+    return (size_t)count;
+}
+
+/**
+ * @brief Sleeps until data was received.
+ */
+static bool tty_wait(uint32_t timeout)
+{
+    struct pollfd fd{tty, POLLIN, 0};
+
+    (void)poll(&fd, 1, (int)timeout);
+
+    return (0 < tty_available());
+}
+
+/**
+ * @brief Reads blen bytes, waiting at most timeout ms for each.
+ */
+static size_t tty_read(uint8_t *buf, size_t blen, uint32_t timeout)
+{
+    size_t count = 0;
+    struct pollfd fd{tty, POLLIN, 0};
+
+    while ((count < blen) && (1 == poll(&fd, 1, (int)timeout)))
+    {
+        ssize_t length = read(tty, buf + count, blen - count);
+
+        if (length <= 0)
+        {
+            break;
+        }
+
+        count += (size_t)length;
+    }
+
+    return count;
+}
+
+/**
+ * @brief Writes the data to the serial port.
+ */
+static size_t tty_write(const uint8_t *data, size_t dlen)
+{
+    size_t count = 0;
+    struct pollfd fd{tty, POLLOUT, 0};
+
+    while ((count < dlen) && (1 == poll(&fd, 1, -1)))
+    {
+        ssize_t length = write(tty, data + count, dlen - count);
+
+        if (length <= 0)
+        {
+            break;
+        }
+
+        count += (size_t)length;
+    }
+
+    return count;
+}
+
+/**
+ * @brief Changes the baud rate once the data written so far has been sent.
+ */
+static bool tty_configure(uint32_t baudrate)
+{
+    (void)tcdrain(tty);
+    return tty_speed(baudrate);
+}
+
+/* Exported user code --------------------------------------------------------*/
+
+const transport_t transport_tty{"tty", tty_open, tty_available, tty_wait, tty_read, tty_write,
+                                tty_configure, TTY_BAUDRATE, 2000000};
+
+#endif /* ARDUINO */
@@ -0,0 +1,110 @@
+/**
+ * @file transport_uart.cpp
+ * @brief This file contains the UART transport of the communication module.
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifdef ARDUINO
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "communication.h"
+#include "queue.h"
+#include <Arduino.h>
+
+/* Private define ------------------------------------------------------------*/
+
+#define BAUDRATE 115200 /**< Baudrate for the Serial Communication */
+
+#ifndef UART_BAUDRATE_MAX
+#define UART_BAUDRATE_MAX 2000000 /**< Highest negotiated baud rate, the limit of the USB-UART bridge */
+#endif
+
+/* Private typedef -----------------------------------------------------------*/
+
+/* Private macro -------------------------------------------------------------*/
+
+constexpr size_t RX_BUFFER_SIZE{1024}; /**< UART receive buffer, holds a window of pipelined requests */
+
+/* Private variables ---------------------------------------------------------*/
+
+static event_t received; /**< Notified by the UART driver when data was received */
+
+/* Static Assertions ---------------------------------------------------------*/
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief Opens the Serial Communication, UART0 has no address.
+ */
+static bool uart_open(const char *address)
+{
+    (void)address;
+    Serial.setRxBufferSize(RX_BUFFER_SIZE); /**< Queue requests while the previous one is handled */
+    Serial.begin(BAUDRATE);                 /**< Initialize the Serial Communication */
+    Serial.onReceive([]()
+                     { received.notify(); }); /**< Called by the UART event task, on a full FIFO or a pause in the data */
+    return Serial;                          /**< Return the Serial Communication */
+}
+
+/**
+ * @brief Returns the number of received bytes in the UART buffer.
+ */
+static size_t uart_available(void)
+{
+    return (size_t)Serial.available();
+}
+
+/**
+ * @brief Sleeps until the UART driver has received data.
+ */
+static bool uart_wait(uint32_t timeout)
+{
+    if (0 == Serial.available())
+    {
+        (void)received.wait(timeout);
+    }
+
+    return (0 < Serial.available());
+}
+
+/**
+ * @brief Reads blen bytes, waiting at most timeout ms for each.
+ */
+static size_t uart_read(uint8_t *buf, size_t blen, uint32_t timeout)
+{
+    Serial.setTimeout(timeout);
+    return Serial.readBytes(buf, blen);
+}
+
+/**
+ * @brief Writes the data to the Serial Communication.
+ */
+static size_t uart_write(const uint8_t *data, size_t dlen)
+{
+    return Serial.write(data, dlen);
+}
+
+/**
+ * @brief Changes the baud rate once the data written so far has left the UART.
+ */
+static bool uart_configure(uint32_t baudrate)
+{
+    Serial.flush();                  /**< The response announcing the switch is sent at the old rate */
+    Serial.updateBaudRate(baudrate); /**< The receive buffer and the event task are kept */
+    return true;
+}
+
+/* Exported user code --------------------------------------------------------*/
+
+const transport_t transport_uart{"uart", uart_open, uart_available, uart_wait, uart_read, uart_write,
+                                   uart_configure, BAUDRATE, UART_BAUDRATE_MAX};
+
+#endif /* ARDUINO */
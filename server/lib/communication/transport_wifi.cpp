@@ -0,0 +1,174 @@
+/**
+ * @file transport_wifi.cpp
+ * @brief This file contains the TCP transport of the communication module on the target.
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @details The ESP32 joins the WiFi network given by WIFI_SSID and WIFI_PASSWORD and listens on
+ *          TRANSPORT_TCP_PORT. One client is served at a time, the next one is accepted when the
+ *          previous one has disconnected. The host build uses transport_socket.cpp instead.
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifdef ARDUINO
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "communication.h"
+#include <Arduino.h>
+#include <WiFi.h>
+#include <sys/select.h>
+
+/* Private define ------------------------------------------------------------*/
+
+#ifndef WIFI_SSID
+#define WIFI_SSID "" /**< The WiFi network to join */
+#endif
+
+#ifndef WIFI_PASSWORD
+#define WIFI_PASSWORD "" /**< The password of the WiFi network */
+#endif
+
+#ifndef TRANSPORT_TCP_PORT
+#define TRANSPORT_TCP_PORT 5000 /**< The TCP port the server listens on */
+#endif
+
+/* Private typedef -----------------------------------------------------------*/
+
+/* Private macro -------------------------------------------------------------*/
+
+constexpr uint32_t WIFI_TIMEOUT{10000}; /**< Longest wait in ms to join the WiFi network */
+constexpr uint32_t ACCEPT_INTERVAL{100}; /**< Interval in ms to look for a new client */
+
+/* Private variables ---------------------------------------------------------*/
+
+static WiFiServer server(TRANSPORT_TCP_PORT); /**< The TCP Server */
+static WiFiClient client;                     /**< The connected client */
+
+/* Static Assertions ---------------------------------------------------------*/
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief Joins the WiFi network and starts listening.
+ */
+static bool tcp_open(const char *address)
+{
+    (void)address;
+    uint32_t start = millis();
+
+    WiFi.mode(WIFI_STA);
+    WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+
+    while ((WiFi.status() != WL_CONNECTED) && (millis() - start < WIFI_TIMEOUT))
+    {
+        delay(100);
+    }
+
+    if (WiFi.status() == WL_CONNECTED)
+    {
+        server.begin();
+        server.setNoDelay(true); /**< Frames are written in one go, do not wait for more */
+    }
+
+    return (WiFi.status() == WL_CONNECTED);
+}
+
+/**
+ * @brief Returns the number of received bytes, accepts the next client if none is connected.
+ */
+static size_t tcp_available(void)
+{
+    if (!client.connected())
+    {
+        client = server.available();
+    }
+
+    return client.connected() ? (size_t)client.available() : 0;
+}
+
+/**
+ * @brief Sleeps until the connected client has sent data.
+ *
+ * @param timeout The longest wait in ms.
+ * @return True if the socket is readable, false if the wait timed out.
+ */
+static bool client_wait(uint32_t timeout)
+{
+    int fd = client.fd();
+    fd_set readable;
+    struct timeval interval{(time_t)(timeout / 1000), (suseconds_t)((timeout % 1000) * 1000)};
+
+    FD_ZERO(&readable);
+    FD_SET(fd, &readable);
+
+    return (0 < select(fd + 1, &readable, nullptr, nullptr, &interval));
+}
+
+/**
+ * @brief Sleeps until the client has sent data, looks for a new client if none is connected.
+ */
+static bool tcp_wait(uint32_t timeout)
+{
+    bool status = (0 < tcp_available());
+
+    if (!status && client.connected())
+    {
+        status = client_wait(timeout) && (0 < tcp_available());
+    }
+    else if (!status)
+    {
+        delay((timeout < ACCEPT_INTERVAL) ? timeout : ACCEPT_INTERVAL); /**< The server socket is not exposed, look again later */
+        status = (0 < tcp_available());
+    }
+
+    return status;
+}
+
+/**
+ * @brief Reads blen bytes, waiting at most timeout ms for each.
+ */
+static size_t tcp_read(uint8_t *buf, size_t blen, uint32_t timeout)
+{
+    size_t count = 0;
+    uint32_t received = millis();
+    uint32_t elapsed = 0;
+
+    while ((count < blen) && client.connected() && (elapsed < timeout))
+    {
+        int length = client.read(buf + count, blen - count);
+
+        if (length > 0)
+        {
+            count += length;
+            received = millis();
+        }
+        else
+        {
+            (void)client_wait(timeout - elapsed);
+        }
+
+        elapsed = millis() - received;
+    }
+
+    return count;
+}
+
+/**
+ * @brief Writes the data to the connected client.
+ */
+static size_t tcp_write(const uint8_t *data, size_t dlen)
+{
+    return client.connected() ? client.write(data, dlen) : 0;
+}
+
+/* Exported user code --------------------------------------------------------*/
+
+const transport_t transport_tcp{"tcp", tcp_open, tcp_available, tcp_wait, tcp_read, tcp_write, nullptr, 0, 0};
+
+#endif /* ARDUINO */
@@ -0,0 +1,407 @@
+/**
+ * @file crypto.cpp
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @brief This file contains the implementation of the crypto module.
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @details The session, ticket and kex modules do their symmetric crypto, their RSA operations and take their
+ *          random bytes through this module. It forwards every call to a crypto_provider_t, mbedTLS or, in a host
+ *          build with CRYPTO_OPENSSL, OpenSSL. The provider is chosen at build time with CRYPTO_PROVIDER or at
+ *          run time with crypto_select(), and is tested with known answers by crypto_init() before it is used.
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "crypto.h"
+#include <string.h>
+
+/* Private define ------------------------------------------------------------*/
+
+#ifndef CRYPTO_PROVIDER
+#define CRYPTO_PROVIDER "mbedtls" /**< The provider used unless another one is selected */
+#endif
+
+/* Private typedef -----------------------------------------------------------*/
+
+/* Private macro -------------------------------------------------------------*/
+
+/* Private variables ---------------------------------------------------------*/
+
+static const crypto_provider_t *provider{nullptr}; /**< The provider, set by crypto_init() */
+static const char *selected{CRYPTO_PROVIDER};      /**< The name of the provider to use */
+
+/* The providers of this build */
+static const crypto_provider_t *const providers[] = {
+    &crypto_mbedtls,
+#ifdef CRYPTO_OPENSSL
+    &crypto_openssl,
+#endif
+};
+
+/* AES-256 key of NIST SP 800-38A F.2.5 */
+static const uint8_t cbc_key[CRYPTO_KEY_SIZE] = {0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe, 0x2b, 0x73, 0xae,
+                                                 0xf0, 0x85, 0x7d, 0x77, 0x81, 0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61,
+                                                 0x08, 0xd7, 0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4};
+
+/* The first two plaintext blocks of NIST SP 800-38A F.2.5 */
+static const uint8_t cbc_plain[2 * CRYPTO_BLOCK_SIZE] = {0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e,
+                                                         0x11, 0x73, 0x93, 0x17, 0x2a, 0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03,
+                                                         0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51};
+
+/* The first two ciphertext blocks of NIST SP 800-38A F.2.5 */
+static const uint8_t cbc_cipher[2 * CRYPTO_BLOCK_SIZE] = {0xf5, 0x8c, 0x4c, 0x04, 0xd6, 0xe5, 0xf1, 0xba, 0x77, 0x9e, 0xab,
+                                                          0xfb, 0x5f, 0x7b, 0xfb, 0xd6, 0x9c, 0xfc, 0x4e, 0x96, 0x7e, 0xdb,
+                                                          0x80, 0x8d, 0x67, 0x9f, 0x77, 0x7b, 0xc6, 0x70, 0x2c, 0x7d};
+
+/* Ciphertext and tag of test case 14 of the GCM specification, zero key, nonce and plaintext block */
+static const uint8_t gcm_cipher[CRYPTO_BLOCK_SIZE] = {0xce, 0xa7, 0x40, 0x3d, 0x4d, 0x60, 0x6b, 0x6e,
+                                                      0x07, 0x4e, 0xc5, 0xd3, 0xba, 0xf3, 0x9d, 0x18};
+static const uint8_t gcm_tag[CRYPTO_TAG_SIZE] = {0xd0, 0xd1, 0xc8, 0xa7, 0x99, 0x99, 0x6b, 0xf0,
+                                                 0x26, 0x5b, 0x98, 0xb5, 0xd4, 0x8a, 0xb9, 0x19};
+
+/* HMAC of RFC 4231 test case 2, key "Jefe", data "what do ya want for nothing?" */
+static const uint8_t hmac_mac[CRYPTO_HASH_SIZE] = {0x5b, 0xdc, 0xc1, 0x46, 0xbf, 0x60, 0x75, 0x4e, 0x6a, 0x04, 0x24,
+                                                   0x26, 0x08, 0x95, 0x75, 0xc7, 0x5a, 0x00, 0x3f, 0x08, 0x9d, 0x27,
+                                                   0x39, 0x83, 0x9d, 0xec, 0x58, 0xb9, 0x64, 0xec, 0x38, 0x43};
+
+/* Static Assertions ---------------------------------------------------------*/
+
+static_assert(sizeof(providers) > 0, "A build needs at least one crypto provider");
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief Tests AES-256-CBC, the two blocks are processed in two calls to test the IV chaining.
+ *
+ * @return true if encryption and in place decryption give the known answers.
+ */
+static bool test_cbc(void)
+{
+    bool status = false;
+    uint8_t iv[CRYPTO_BLOCK_SIZE]{0};
+    uint8_t data[sizeof(cbc_plain)]{0};
+    crypto_cbc_t enc_ctx;
+    crypto_cbc_t dec_ctx;
+
+    provider->cbc_init(&enc_ctx);
+    provider->cbc_init(&dec_ctx);
+
+    for (size_t i = 0; i < sizeof(iv); i++)
+    {
+        iv[i] = (uint8_t)i;
+    }
+
+    if (provider->cbc_setkey(&enc_ctx, CRYPTO_ENCRYPT, cbc_key) &&
+        provider->cbc_crypt(&enc_ctx, CRYPTO_ENCRYPT, CRYPTO_BLOCK_SIZE, iv, cbc_plain, data) &&
+        provider->cbc_crypt(&enc_ctx, CRYPTO_ENCRYPT, CRYPTO_BLOCK_SIZE, iv, cbc_plain + CRYPTO_BLOCK_SIZE, data + CRYPTO_BLOCK_SIZE) &&
+        (0 == memcmp(data, cbc_cipher, sizeof(data))) &&
+        (0 == memcmp(iv, cbc_cipher + CRYPTO_BLOCK_SIZE, sizeof(iv))))
+    {
+        for (size_t i = 0; i < sizeof(iv); i++)
+        {
+            iv[i] = (uint8_t)i;
+        }
+
+        status = provider->cbc_setkey(&dec_ctx, CRYPTO_DECRYPT, cbc_key) &&
+                 provider->cbc_crypt(&dec_ctx, CRYPTO_DECRYPT, CRYPTO_BLOCK_SIZE, iv, data, data) &&
+                 provider->cbc_crypt(&dec_ctx, CRYPTO_DECRYPT, CRYPTO_BLOCK_SIZE, iv, data + CRYPTO_BLOCK_SIZE, data + CRYPTO_BLOCK_SIZE) &&
+                 (0 == memcmp(data, cbc_plain, sizeof(data))) &&
+                 (0 == memcmp(iv, cbc_cipher + CRYPTO_BLOCK_SIZE, sizeof(iv)));
+    }
+
+    provider->cbc_free(&enc_ctx);
+    provider->cbc_free(&dec_ctx);
+
+    return status;
+}
+
+/**
+ * @brief Tests AES-256-GCM, including the rejection of a forged tag.
+ *
+ * @return true if sealing and opening give the known answers.
+ */
+static bool test_gcm(void)
+{
+    bool status = false;
+    uint8_t key[CRYPTO_KEY_SIZE]{0};
+    uint8_t nonce[CRYPTO_NONCE_SIZE]{0};
+    uint8_t data[CRYPTO_BLOCK_SIZE]{0};
+    uint8_t plain[CRYPTO_BLOCK_SIZE]{0};
+    uint8_t tag[CRYPTO_TAG_SIZE]{0};
+    crypto_gcm_t ctx;
+
+    provider->gcm_init(&ctx);
+
+    if (provider->gcm_setkey(&ctx, key) &&
+        provider->gcm_seal(&ctx, nonce, nullptr, 0, data, sizeof(data), data, tag) &&
+        (0 == memcmp(data, gcm_cipher, sizeof(data))) && (0 == memcmp(tag, gcm_tag, sizeof(tag))))
+    {
+        /* A forged tag is rejected, the genuine one gives the zero plaintext back */
+        memset(plain, 0xFF, sizeof(plain));
+        tag[0] ^= 1;
+        status = !provider->gcm_open(&ctx, nonce, nullptr, 0, data, sizeof(data), tag, plain);
+        tag[0] ^= 1;
+        status = status && provider->gcm_open(&ctx, nonce, nullptr, 0, data, sizeof(data), tag, plain) &&
+                 (0 == memcmp(plain, key, sizeof(plain)));
+    }
+
+    provider->gcm_free(&ctx);
+
+    return status;
+}
+
+/**
+ * @brief Tests HMAC-SHA256, the keyed states are used twice and once in parts.
+ *
+ * @return true if every HMAC gives the known answer.
+ */
+static bool test_hmac(void)
+{
+    static const char data[] = "what do ya want for nothing?";
+    bool status = false;
+    uint8_t mac[CRYPTO_HASH_SIZE]{0};
+    crypto_hmac_t ctx;
+
+    provider->hmac_init(&ctx);
+
+    if (provider->hmac_setkey(&ctx, (const uint8_t *)"Jefe", 4))
+    {
+        status = true;
+
+        for (int i = 0; i < 2; i++)
+        {
+            memset(mac, 0, sizeof(mac));
+            provider->hmac_start(&ctx);
+            provider->hmac_update(&ctx, (const uint8_t *)data, sizeof(data) - 1);
+            provider->hmac_finish(&ctx, mac);
+            status = status && (0 == memcmp(mac, hmac_mac, sizeof(mac)));
+        }
+
+        memset(mac, 0, sizeof(mac));
+        provider->hmac_start(&ctx);
+        provider->hmac_update(&ctx, (const uint8_t *)data, 10);
+        provider->hmac_update(&ctx, (const uint8_t *)data + 10, sizeof(data) - 1 - 10);
+        provider->hmac_finish(&ctx, mac);
+        status = status && (0 == memcmp(mac, hmac_mac, sizeof(mac)));
+    }
+
+    provider->hmac_free(&ctx);
+
+    return status;
+}
+
+/**
+ * @brief Tests that the random number generator works and does not repeat itself.
+ *
+ * @return true if two requests gave different bytes.
+ */
+static bool test_random(void)
+{
+    uint8_t first[CRYPTO_BLOCK_SIZE]{0};
+    uint8_t second[CRYPTO_BLOCK_SIZE]{0};
+
+    return (0 == provider->random(nullptr, first, sizeof(first))) &&
+           (0 == provider->random(nullptr, second, sizeof(second))) &&
+           (0 != memcmp(first, second, sizeof(first)));
+}
+
+/* Exported user code --------------------------------------------------------*/
+
+bool crypto_select(const char *name)
+{
+    bool status = false;
+
+    if (provider == nullptr)
+    {
+        for (const crypto_provider_t *entry : providers)
+        {
+            if (0 == strcmp(entry->name, name))
+            {
+                selected = entry->name;
+                status = true;
+            }
+        }
+    }
+
+    return status;
+}
+
+bool crypto_init(void)
+{
+    bool status = false;
+
+    if (provider == nullptr)
+    {
+        for (const crypto_provider_t *entry : providers)
+        {
+            if (0 == strcmp(entry->name, selected))
+            {
+                provider = entry;
+            }
+        }
+
+        if ((provider != nullptr) && !(provider->init() && crypto_self_test()))
+        {
+            provider = nullptr;
+        }
+    }
+
+    status = (provider != nullptr);
+
+    return status;
+}
+
+const char *crypto_name(void)
+{
+    return selected;
+}
+
+bool crypto_self_test(void)
+{
+    return (provider != nullptr) && test_cbc() && test_gcm() && test_hmac() && test_random();
+}
+
+int crypto_random(void *p_rng, unsigned char *output, size_t length)
+{
+    return provider->random(p_rng, output, length);
+}
+
+void crypto_cbc_init(crypto_cbc_t *ctx)
+{
+    provider->cbc_init(ctx);
+}
+
+void crypto_cbc_free(crypto_cbc_t *ctx)
+{
+    provider->cbc_free(ctx);
+}
+
+bool crypto_cbc_setkey(crypto_cbc_t *ctx, crypto_direction_t direction, const uint8_t *key)
+{
+    return provider->cbc_setkey(ctx, direction, key);
+}
+
+bool crypto_cbc_crypt(crypto_cbc_t *ctx, crypto_direction_t direction, size_t length, uint8_t *iv,
+                      const uint8_t *input, uint8_t *output)
+{
+    return ((length % CRYPTO_BLOCK_SIZE) == 0) && provider->cbc_crypt(ctx, direction, length, iv, input, output);
+}
+
+void crypto_gcm_init(crypto_gcm_t *ctx)
+{
+    provider->gcm_init(ctx);
+}
+
+void crypto_gcm_free(crypto_gcm_t *ctx)
+{
+    provider->gcm_free(ctx);
+}
+
+bool crypto_gcm_setkey(crypto_gcm_t *ctx, const uint8_t *key)
+{
+    return provider->gcm_setkey(ctx, key);
+}
+
+bool crypto_gcm_seal(crypto_gcm_t *ctx, const uint8_t *nonce, const uint8_t *aad, size_t alen,
+                     const uint8_t *input, size_t length, uint8_t *output, uint8_t *tag)
+{
+    return provider->gcm_seal(ctx, nonce, aad, alen, input, length, output, tag);
+}
+
+bool crypto_gcm_open(crypto_gcm_t *ctx, const uint8_t *nonce, const uint8_t *aad, size_t alen,
+                     const uint8_t *input, size_t length, const uint8_t *tag, uint8_t *output)
+{
+    return provider->gcm_open(ctx, nonce, aad, alen, input, length, tag, output);
+}
+
+void crypto_hmac_init(crypto_hmac_t *ctx)
+{
+    provider->hmac_init(ctx);
+}
+
+void crypto_hmac_free(crypto_hmac_t *ctx)
+{
+    provider->hmac_free(ctx);
+}
+
+bool crypto_hmac_setkey(crypto_hmac_t *ctx, const uint8_t *key, size_t klen)
+{
+    return provider->hmac_setkey(ctx, key, klen);
+}
+
+void crypto_hmac_start(crypto_hmac_t *ctx)
+{
+    provider->hmac_start(ctx);
+}
+
+void crypto_hmac_update(crypto_hmac_t *ctx, const uint8_t *data, size_t dlen)
+{
+    provider->hmac_update(ctx, data, dlen);
+}
+
+void crypto_hmac_finish(crypto_hmac_t *ctx, uint8_t *mac)
+{
+    provider->hmac_finish(ctx, mac);
+}
+
+void crypto_hmac(crypto_hmac_t *ctx, const uint8_t *data, size_t dlen, uint8_t *mac)
+{
+    provider->hmac_start(ctx);
+    provider->hmac_update(ctx, data, dlen);
+    provider->hmac_finish(ctx, mac);
+}
+
+void crypto_rsa_init(crypto_rsa_t *key)
+{
+    key->handle = nullptr;
+}
+
+void crypto_rsa_free(crypto_rsa_t *key)
+{
+    if (key->handle != nullptr)
+    {
+        provider->rsa_free(key);
+    }
+
+    key->handle = nullptr;
+}
+
+bool crypto_rsa_parse_public(crypto_rsa_t *key, const uint8_t *der, size_t length)
+{
+    crypto_rsa_free(key);
+
+    return provider->rsa_parse(key, der, length, false);
+}
+
+bool crypto_rsa_parse_private(crypto_rsa_t *key, const uint8_t *der, size_t length)
+{
+    crypto_rsa_free(key);
+
+    return provider->rsa_parse(key, der, length, true);
+}
+
+size_t crypto_rsa_public(crypto_rsa_t *key, uint8_t *der, size_t size)
+{
+    return (key->handle != nullptr) ? provider->rsa_public(key, der, size) : 0;
+}
+
+bool crypto_rsa_encrypt(crypto_rsa_t *key, const uint8_t *input, size_t ilen, uint8_t *output)
+{
+    return (key->handle != nullptr) && provider->rsa_encrypt(key, input, ilen, output);
+}
+
+bool crypto_rsa_decrypt(crypto_rsa_t *key, const uint8_t *input, uint8_t *output, size_t *olen, size_t osize)
+{
+    return (key->handle != nullptr) && provider->rsa_decrypt(key, input, output, olen, osize);
+}
+
+bool crypto_rsa_verify(crypto_rsa_t *key, const uint8_t *hash, const uint8_t *signature)
+{
+    return (key->handle != nullptr) && provider->rsa_verify(key, hash, signature);
+}
@@ -0,0 +1,438 @@
+/**
+ * @file crypto.h
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @brief
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef CRYPTO_H
+#define CRYPTO_H
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mbedtls/aes.h>
+#include <mbedtls/gcm.h>
+#include <mbedtls/sha256.h>
+
+#ifdef CRYPTO_OPENSSL
+#ifndef OPENSSL_SUPPRESS_DEPRECATED
+#define OPENSSL_SUPPRESS_DEPRECATED /**< The SHA256_CTX states are copied, which the EVP interface cannot do without allocating */
+#endif
+#include <openssl/sha.h>
+#endif
+
+/* Exported defines ----------------------------------------------------------*/
+
+constexpr size_t CRYPTO_KEY_SIZE{32};   /**< AES-256 Key Size */
+constexpr size_t CRYPTO_BLOCK_SIZE{16}; /**< AES Block Size, the size of a CBC IV */
+constexpr size_t CRYPTO_HASH_SIZE{32};  /**< SHA-256 Hash Size, the size of a HMAC */
+constexpr size_t CRYPTO_NONCE_SIZE{12}; /**< GCM Nonce Size */
+constexpr size_t CRYPTO_TAG_SIZE{16};   /**< GCM Tag Size */
+constexpr size_t CRYPTO_RSA_SIZE{256};  /**< RSA-2048 Block Size */
+
+/* Exported types ------------------------------------------------------------*/
+
+/**
+ * @brief The direction of a CBC context, the key schedules differ.
+ */
+typedef enum : uint8_t
+{
+    CRYPTO_ENCRYPT, /**< The context encrypts */
+    CRYPTO_DECRYPT, /**< The context decrypts */
+} crypto_direction_t;
+
+/**
+ * @brief An AES-256-CBC context of one direction.
+ */
+typedef union
+{
+    mbedtls_aes_context mbedtls; /**< Context of the mbedtls provider */
+    void *handle;                /**< Context of a provider that keeps it on the heap, allocated by crypto_cbc_init() */
+} crypto_cbc_t;
+
+/**
+ * @brief An AES-256-GCM context.
+ */
+typedef union
+{
+    mbedtls_gcm_context mbedtls; /**< Context of the mbedtls provider */
+    void *handle;                /**< Context of a provider that keeps it on the heap, allocated by crypto_gcm_init() */
+} crypto_gcm_t;
+
+/**
+ * @brief A HMAC-SHA256 context.
+ *
+ * The states after the inner and the outer padded key are computed once by crypto_hmac_setkey(),
+ * every HMAC starts from a copy of them, so a HMAC of a short message costs two SHA-256 blocks instead of four.
+ */
+typedef union
+{
+    struct
+    {
+        mbedtls_sha256_context inner; /**< State after the inner padded key */
+        mbedtls_sha256_context outer; /**< State after the outer padded key */
+        mbedtls_sha256_context work;  /**< State of the running HMAC */
+    } mbedtls; /**< Context of the mbedtls provider */
+#ifdef CRYPTO_OPENSSL
+    struct
+    {
+        SHA256_CTX inner; /**< State after the inner padded key */
+        SHA256_CTX outer; /**< State after the outer padded key */
+        SHA256_CTX work;  /**< State of the running HMAC */
+    } openssl; /**< Context of the openssl provider */
+#endif
+} crypto_hmac_t;
+
+/**
+ * @brief A RSA-2048 key, public or private, in the form of the provider.
+ *
+ * The key is converted once by crypto_rsa_parse_public() or crypto_rsa_parse_private(), the RSA operations
+ * use it as it is. Its content is only known to the provider that parsed it.
+ */
+typedef struct
+{
+    void *handle; /**< Key of the provider, allocated by its parse function, nullptr if there is none */
+} crypto_rsa_t;
+
+/**
+ * @brief An implementation of the cryptographic primitives of the session.
+ *
+ * All functions return true on success. A provider must not allocate in the functions that run per request
+ * (cbc_crypt, gcm_seal, gcm_open, hmac_*), the contexts are prepared by their init and setkey functions.
+ */
+typedef struct
+{
+    const char *name;                                                                    /**< The name to select the provider with */
+    bool (*init)(void);                                                                  /**< Seeds the random number generator */
+    int (*random)(void *p_rng, unsigned char *output, size_t length);                    /**< Random bytes, 0 on success like a mbedTLS f_rng */
+    void (*cbc_init)(crypto_cbc_t *ctx);                                                 /**< Prepares a CBC context */
+    void (*cbc_free)(crypto_cbc_t *ctx);                                                 /**< Releases a CBC context and wipes its key */
+    bool (*cbc_setkey)(crypto_cbc_t *ctx, crypto_direction_t direction, const uint8_t *key); /**< Sets the CRYPTO_KEY_SIZE bytes key */
+    bool (*cbc_crypt)(crypto_cbc_t *ctx, crypto_direction_t direction, size_t length, uint8_t *iv,
+                      const uint8_t *input, uint8_t *output);                            /**< Processes whole blocks and updates the IV */
+    void (*gcm_init)(crypto_gcm_t *ctx);                                                 /**< Prepares a GCM context */
+    void (*gcm_free)(crypto_gcm_t *ctx);                                                 /**< Releases a GCM context and wipes its key */
+    bool (*gcm_setkey)(crypto_gcm_t *ctx, const uint8_t *key);                           /**< Sets the CRYPTO_KEY_SIZE bytes key */
+    bool (*gcm_seal)(crypto_gcm_t *ctx, const uint8_t *nonce, const uint8_t *aad, size_t alen,
+                     const uint8_t *input, size_t length, uint8_t *output, uint8_t *tag); /**< Encrypts and writes the tag */
+    bool (*gcm_open)(crypto_gcm_t *ctx, const uint8_t *nonce, const uint8_t *aad, size_t alen,
+                     const uint8_t *input, size_t length, const uint8_t *tag, uint8_t *output); /**< Verifies the tag and decrypts */
+    void (*hmac_init)(crypto_hmac_t *ctx);                                               /**< Prepares a HMAC context */
+    void (*hmac_free)(crypto_hmac_t *ctx);                                               /**< Releases a HMAC context and wipes its states */
+    bool (*hmac_setkey)(crypto_hmac_t *ctx, const uint8_t *key, size_t klen);            /**< Computes the keyed states */
+    void (*hmac_start)(crypto_hmac_t *ctx);                                              /**< Starts a HMAC from the keyed inner state */
+    void (*hmac_update)(crypto_hmac_t *ctx, const uint8_t *data, size_t dlen);           /**< Adds data to the running HMAC */
+    void (*hmac_finish)(crypto_hmac_t *ctx, uint8_t *mac);                               /**< Writes the CRYPTO_HASH_SIZE bytes HMAC */
+    bool (*rsa_parse)(crypto_rsa_t *key, const uint8_t *der, size_t length, bool secret); /**< Converts a DER RSA key, private if secret */
+    void (*rsa_free)(crypto_rsa_t *key);                                                 /**< Releases a key and wipes it */
+    size_t (*rsa_public)(crypto_rsa_t *key, uint8_t *der, size_t size);                  /**< Writes the DER public key, returns its length or 0 */
+    bool (*rsa_encrypt)(crypto_rsa_t *key, const uint8_t *input, size_t ilen, uint8_t *output); /**< RSAES-PKCS1-v1_5 encryption */
+    bool (*rsa_decrypt)(crypto_rsa_t *key, const uint8_t *input, uint8_t *output, size_t *olen, size_t osize); /**< RSAES-PKCS1-v1_5 decryption */
+    bool (*rsa_verify)(crypto_rsa_t *key, const uint8_t *hash, const uint8_t *signature); /**< RSASSA-PKCS1-v1_5 SHA-256 verification */
+} crypto_provider_t;
+
+/* Exported constants --------------------------------------------------------*/
+
+/* Exported variables --------------------------------------------------------*/
+
+extern const crypto_provider_t crypto_mbedtls; /**< mbedTLS, on the AES, SHA and RSA accelerators of the ESP32 */
+#ifdef CRYPTO_OPENSSL
+extern const crypto_provider_t crypto_openssl; /**< OpenSSL libcrypto, AES-NI and SHA-NI on a x86 host */
+#endif
+
+/* Exported macro ------------------------------------------------------------*/
+
+/* Exported functions prototypes ---------------------------------------------*/
+
+/**
+ * @brief Select the crypto provider by its name
+ *
+ * Must be called before crypto_init(), the default is CRYPTO_PROVIDER ("mbedtls").
+ *
+ * @param name "mbedtls" or, in a build with CRYPTO_OPENSSL, "openssl"
+ * @return true if the provider exists and the crypto module is not initialized yet else false
+ */
+bool crypto_select(const char *name);
+
+/**
+ * @brief Initialize the crypto module
+ *
+ * Seeds the random number generator of the selected provider and runs crypto_self_test().
+ *
+ * @return true if the provider passed its self-test else false
+ */
+bool crypto_init(void);
+
+/**
+ * @brief Get the name of the provider in use
+ *
+ * @return const char* the name of the selected provider
+ */
+const char *crypto_name(void);
+
+/**
+ * @brief Test the provider with known answers
+ *
+ * AES-256-CBC (NIST SP 800-38A F.2.5/F.2.6), AES-256-GCM (GCM spec test case 14, and a forged tag),
+ * HMAC-SHA256 (RFC 4231 test case 2, keyed once and used twice) and the random number generator.
+ *
+ * @return true if all answers match else false
+ */
+bool crypto_self_test(void);
+
+/**
+ * @brief Get random bytes of the provider
+ *
+ * Has the signature of a mbedTLS f_rng, so it can be handed to the modules using mbedTLS directly.
+ *
+ * @param p_rng unused, nullptr
+ * @param output the buffer
+ * @param length the number of bytes
+ * @return int 0 on success
+ */
+int crypto_random(void *p_rng, unsigned char *output, size_t length);
+
+/**
+ * @brief Prepare a CBC context, it is set up with crypto_cbc_setkey()
+ *
+ * @param ctx the context
+ */
+void crypto_cbc_init(crypto_cbc_t *ctx);
+
+/**
+ * @brief Release a CBC context and wipe its key
+ *
+ * @param ctx the context
+ */
+void crypto_cbc_free(crypto_cbc_t *ctx);
+
+/**
+ * @brief Set the key of a CBC context
+ *
+ * @param ctx the context
+ * @param direction the direction the context is used in
+ * @param key the key of CRYPTO_KEY_SIZE bytes
+ * @return true if the key was set else false
+ */
+bool crypto_cbc_setkey(crypto_cbc_t *ctx, crypto_direction_t direction, const uint8_t *key);
+
+/**
+ * @brief Encrypt or decrypt with AES-256-CBC
+ *
+ * The IV is updated like mbedtls_aes_crypt_cbc() does, so consecutive calls continue the chain.
+ * Input and output may be the same buffer.
+ *
+ * @param ctx the context
+ * @param direction the direction the key was set for
+ * @param length the length of the data, a multiple of CRYPTO_BLOCK_SIZE
+ * @param iv the IV of CRYPTO_BLOCK_SIZE bytes, it is updated
+ * @param input the data
+ * @param output the buffer for the result
+ * @return true if the data was processed else false
+ */
+bool crypto_cbc_crypt(crypto_cbc_t *ctx, crypto_direction_t direction, size_t length, uint8_t *iv,
+                      const uint8_t *input, uint8_t *output);
+
+/**
+ * @brief Prepare a GCM context, it is set up with crypto_gcm_setkey()
+ *
+ * @param ctx the context
+ */
+void crypto_gcm_init(crypto_gcm_t *ctx);
+
+/**
+ * @brief Release a GCM context and wipe its key
+ *
+ * @param ctx the context
+ */
+void crypto_gcm_free(crypto_gcm_t *ctx);
+
+/**
+ * @brief Set the key of a GCM context
+ *
+ * @param ctx the context
+ * @param key the key of CRYPTO_KEY_SIZE bytes
+ * @return true if the key was set else false
+ */
+bool crypto_gcm_setkey(crypto_gcm_t *ctx, const uint8_t *key);
+
+/**
+ * @brief Encrypt and authenticate with AES-256-GCM
+ *
+ * @param ctx the context
+ * @param nonce the nonce of CRYPTO_NONCE_SIZE bytes
+ * @param aad the additional data
+ * @param alen the length of the additional data
+ * @param input the plaintext
+ * @param length the length of the plaintext
+ * @param output the buffer for the ciphertext, it may be the input
+ * @param tag the buffer for the tag of CRYPTO_TAG_SIZE bytes
+ * @return true if the plaintext was sealed else false
+ */
+bool crypto_gcm_seal(crypto_gcm_t *ctx, const uint8_t *nonce, const uint8_t *aad, size_t alen,
+                     const uint8_t *input, size_t length, uint8_t *output, uint8_t *tag);
+
+/**
+ * @brief Authenticate and decrypt with AES-256-GCM
+ *
+ * @param ctx the context
+ * @param nonce the nonce of CRYPTO_NONCE_SIZE bytes
+ * @param aad the additional data
+ * @param alen the length of the additional data
+ * @param input the ciphertext
+ * @param length the length of the ciphertext
+ * @param tag the tag of CRYPTO_TAG_SIZE bytes
+ * @param output the buffer for the plaintext, it may be the input
+ * @return true if the tag is valid and the ciphertext was decrypted else false, the output is wiped then
+ */
+bool crypto_gcm_open(crypto_gcm_t *ctx, const uint8_t *nonce, const uint8_t *aad, size_t alen,
+                     const uint8_t *input, size_t length, const uint8_t *tag, uint8_t *output);
+
+/**
+ * @brief Prepare a HMAC context, it is set up with crypto_hmac_setkey()
+ *
+ * @param ctx the context
+ */
+void crypto_hmac_init(crypto_hmac_t *ctx);
+
+/**
+ * @brief Release a HMAC context and wipe its states
+ *
+ * @param ctx the context
+ */
+void crypto_hmac_free(crypto_hmac_t *ctx);
+
+/**
+ * @brief Set the key of a HMAC context
+ *
+ * The key is only used here, the context keeps the hash states after the padded keys.
+ *
+ * @param ctx the context
+ * @param key the key
+ * @param klen the length of the key
+ * @return true if the key was set else false
+ */
+bool crypto_hmac_setkey(crypto_hmac_t *ctx, const uint8_t *key, size_t klen);
+
+/**
+ * @brief Start a HMAC in parts with the key of the context
+ *
+ * @param ctx the context
+ */
+void crypto_hmac_start(crypto_hmac_t *ctx);
+
+/**
+ * @brief Add data to the HMAC started with crypto_hmac_start()
+ *
+ * @param ctx the context
+ * @param data the data
+ * @param dlen the length of the data
+ */
+void crypto_hmac_update(crypto_hmac_t *ctx, const uint8_t *data, size_t dlen);
+
+/**
+ * @brief Finish the HMAC started with crypto_hmac_start()
+ *
+ * @param ctx the context
+ * @param mac the buffer for the HMAC of CRYPTO_HASH_SIZE bytes
+ */
+void crypto_hmac_finish(crypto_hmac_t *ctx, uint8_t *mac);
+
+/**
+ * @brief Calculate the HMAC of a message with the key of the context
+ *
+ * @param ctx the context
+ * @param data the message
+ * @param dlen the length of the message
+ * @param mac the buffer for the HMAC of CRYPTO_HASH_SIZE bytes
+ */
+void crypto_hmac(crypto_hmac_t *ctx, const uint8_t *data, size_t dlen, uint8_t *mac);
+
+/**
+ * @brief Prepare a RSA key, it is set with crypto_rsa_parse_public() or crypto_rsa_parse_private()
+ *
+ * @param key the key
+ */
+void crypto_rsa_init(crypto_rsa_t *key);
+
+/**
+ * @brief Release a RSA key and wipe it
+ *
+ * @param key the key, it can be parsed again
+ */
+void crypto_rsa_free(crypto_rsa_t *key);
+
+/**
+ * @brief Convert a DER RSA public key (SubjectPublicKeyInfo) to a key of the provider
+ *
+ * A key set before is released first.
+ *
+ * @param key the key
+ * @param der the DER public key
+ * @param length the length of the DER
+ * @return true if the DER holds a RSA public key else false, the key is empty then
+ */
+bool crypto_rsa_parse_public(crypto_rsa_t *key, const uint8_t *der, size_t length);
+
+/**
+ * @brief Convert a DER RSA private key (PKCS#1) to a key of the provider
+ *
+ * A key set before is released first. The DER is not kept, the caller wipes it.
+ *
+ * @param key the key
+ * @param der the DER private key
+ * @param length the length of the DER
+ * @return true if the DER holds a RSA private key else false, the key is empty then
+ */
+bool crypto_rsa_parse_private(crypto_rsa_t *key, const uint8_t *der, size_t length);
+
+/**
+ * @brief Write the DER public key (SubjectPublicKeyInfo) of a RSA key
+ *
+ * @param key the key, public or private
+ * @param der the buffer, the DER is written to its start
+ * @param size the size of the buffer
+ * @return size_t the length of the DER, 0 if it does not fit or the key is empty
+ */
+size_t crypto_rsa_public(crypto_rsa_t *key, uint8_t *der, size_t size);
+
+/**
+ * @brief Encrypt a message with a RSA public key, PKCS#1 v1.5
+ *
+ * @param key the key, a public or private RSA-2048 key
+ * @param input the message, at most CRYPTO_RSA_SIZE - 11 bytes
+ * @param ilen the length of the message
+ * @param output the buffer for the ciphertext of CRYPTO_RSA_SIZE bytes
+ * @return true if the message was encrypted else false
+ */
+bool crypto_rsa_encrypt(crypto_rsa_t *key, const uint8_t *input, size_t ilen, uint8_t *output);
+
+/**
+ * @brief Decrypt a block of CRYPTO_RSA_SIZE bytes with a RSA private key, PKCS#1 v1.5
+ *
+ * @param key the private RSA-2048 key
+ * @param input the ciphertext
+ * @param output the buffer for the message
+ * @param olen pointer to store the length of the message in
+ * @param osize the size of the buffer
+ * @return true if the block was decrypted else false
+ */
+bool crypto_rsa_decrypt(crypto_rsa_t *key, const uint8_t *input, uint8_t *output, size_t *olen, size_t osize);
+
+/**
+ * @brief Verify a PKCS#1 v1.5 signature of a SHA-256 hash with a RSA public key
+ *
+ * @param key the key, a public or private RSA-2048 key
+ * @param hash the hash of CRYPTO_HASH_SIZE bytes
+ * @param signature the signature of CRYPTO_RSA_SIZE bytes
+ * @return true if the signature is valid else false
+ */
+bool crypto_rsa_verify(crypto_rsa_t *key, const uint8_t *hash, const uint8_t *signature);
+
+#endif /* CRYPTO_H */
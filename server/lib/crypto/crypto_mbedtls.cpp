@@ -0,0 +1,290 @@
+/**
+ * @file crypto_mbedtls.cpp
+ * @brief This file contains the mbedTLS provider of the crypto module.
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @details On the target, the mbedTLS of ESP-IDF runs AES, SHA-256 and the RSA big number arithmetic on the
+ *          accelerators of the ESP32 (CONFIG_MBEDTLS_HARDWARE_AES, _SHA and _MPI), so this provider is the
+ *          hardware one there. On the host it is the plain software implementation, with AES-NI if the
+ *          library was built with MBEDTLS_AESNI_C.
+ *
+ *          The random bytes come from a CTR-DRBG that draws its entropy from hal_random(), the hardware
+ *          RNG on the target and getrandom() on the host, as the mbedTLS entropy sources would. A host
+ *          build seeded with hal_seed() so generates the same bytes again, for the replay of a capture.
+ *
+ *          A RSA key is a mbedTLS pk context, allocated by rsa_parse() from the mbedTLS heap.
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "crypto.h"
+#include "hal.h"
+#include <string.h>
+#include <limits.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/platform.h>
+
+/* Private define ------------------------------------------------------------*/
+
+/* Private typedef -----------------------------------------------------------*/
+
+/* Private macro -------------------------------------------------------------*/
+
+constexpr size_t SHA256_BLOCK_SIZE{64}; /**< SHA-256 Block Size, the size of a padded HMAC key */
+constexpr uint8_t HMAC_IPAD{0x36};      /**< Inner Padding of a HMAC key */
+constexpr uint8_t HMAC_OPAD{0x5C};      /**< Outer Padding of a HMAC key */
+
+/* Private variables ---------------------------------------------------------*/
+
+static mbedtls_ctr_drbg_context ctr_drbg; /**< CTR DRBG Context */
+
+/* Static Assertions ---------------------------------------------------------*/
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief The entropy source of the CTR-DRBG, for the seed and every reseed.
+ */
+static int provider_entropy(void *, unsigned char *output, size_t length)
+{
+    hal_random(output, length);
+
+    return 0;
+}
+
+static bool provider_init(void)
+{
+    mbedtls_ctr_drbg_init(&ctr_drbg);
+
+    return (0 == mbedtls_ctr_drbg_seed(&ctr_drbg, provider_entropy, nullptr, nullptr, 0));
+}
+
+static int provider_random(void *, unsigned char *output, size_t length)
+{
+    return mbedtls_ctr_drbg_random(&ctr_drbg, output, length);
+}
+
+static void cbc_init(crypto_cbc_t *ctx)
+{
+    mbedtls_aes_init(&ctx->mbedtls);
+}
+
+static void cbc_free(crypto_cbc_t *ctx)
+{
+    mbedtls_aes_free(&ctx->mbedtls);
+}
+
+static bool cbc_setkey(crypto_cbc_t *ctx, crypto_direction_t direction, const uint8_t *key)
+{
+    int result = (direction == CRYPTO_ENCRYPT) ? mbedtls_aes_setkey_enc(&ctx->mbedtls, key, CRYPTO_KEY_SIZE * CHAR_BIT)
+                                               : mbedtls_aes_setkey_dec(&ctx->mbedtls, key, CRYPTO_KEY_SIZE * CHAR_BIT);
+
+    return (0 == result);
+}
+
+static bool cbc_crypt(crypto_cbc_t *ctx, crypto_direction_t direction, size_t length, uint8_t *iv,
+                      const uint8_t *input, uint8_t *output)
+{
+    int mode = (direction == CRYPTO_ENCRYPT) ? MBEDTLS_AES_ENCRYPT : MBEDTLS_AES_DECRYPT;
+
+    return (0 == mbedtls_aes_crypt_cbc(&ctx->mbedtls, mode, length, iv, input, output));
+}
+
+static void gcm_init(crypto_gcm_t *ctx)
+{
+    mbedtls_gcm_init(&ctx->mbedtls);
+}
+
+static void gcm_free(crypto_gcm_t *ctx)
+{
+    mbedtls_gcm_free(&ctx->mbedtls);
+}
+
+static bool gcm_setkey(crypto_gcm_t *ctx, const uint8_t *key)
+{
+    return (0 == mbedtls_gcm_setkey(&ctx->mbedtls, MBEDTLS_CIPHER_ID_AES, key, CRYPTO_KEY_SIZE * CHAR_BIT));
+}
+
+static bool gcm_seal(crypto_gcm_t *ctx, const uint8_t *nonce, const uint8_t *aad, size_t alen,
+                     const uint8_t *input, size_t length, uint8_t *output, uint8_t *tag)
+{
+    return (0 == mbedtls_gcm_crypt_and_tag(&ctx->mbedtls, MBEDTLS_GCM_ENCRYPT, length, nonce, CRYPTO_NONCE_SIZE, aad, alen,
+                                           input, output, CRYPTO_TAG_SIZE, tag));
+}
+
+static bool gcm_open(crypto_gcm_t *ctx, const uint8_t *nonce, const uint8_t *aad, size_t alen,
+                     const uint8_t *input, size_t length, const uint8_t *tag, uint8_t *output)
+{
+    return (0 == mbedtls_gcm_auth_decrypt(&ctx->mbedtls, length, nonce, CRYPTO_NONCE_SIZE, aad, alen, tag, CRYPTO_TAG_SIZE,
+                                          input, output));
+}
+
+static void hmac_init(crypto_hmac_t *ctx)
+{
+    mbedtls_sha256_init(&ctx->mbedtls.inner);
+    mbedtls_sha256_init(&ctx->mbedtls.outer);
+    mbedtls_sha256_init(&ctx->mbedtls.work);
+}
+
+static void hmac_free(crypto_hmac_t *ctx)
+{
+    mbedtls_sha256_free(&ctx->mbedtls.inner);
+    mbedtls_sha256_free(&ctx->mbedtls.outer);
+    mbedtls_sha256_free(&ctx->mbedtls.work);
+}
+
+static bool hmac_setkey(crypto_hmac_t *ctx, const uint8_t *key, size_t klen)
+{
+    bool status = true;
+    uint8_t pad[SHA256_BLOCK_SIZE]{0};
+
+    /* Longer keys are replaced by their hash (RFC 2104) */
+    if (klen > SHA256_BLOCK_SIZE)
+    {
+        status = (0 == mbedtls_sha256_ret(key, klen, pad, 0));
+    }
+    else
+    {
+        memcpy(pad, key, klen);
+    }
+
+    for (uint8_t &byte : pad)
+    {
+        byte ^= HMAC_IPAD;
+    }
+
+    status = status && (0 == mbedtls_sha256_starts_ret(&ctx->mbedtls.inner, 0)) &&
+             (0 == mbedtls_sha256_update_ret(&ctx->mbedtls.inner, pad, sizeof(pad)));
+
+    for (uint8_t &byte : pad)
+    {
+        byte ^= HMAC_IPAD ^ HMAC_OPAD;
+    }
+
+    status = status && (0 == mbedtls_sha256_starts_ret(&ctx->mbedtls.outer, 0)) &&
+             (0 == mbedtls_sha256_update_ret(&ctx->mbedtls.outer, pad, sizeof(pad)));
+
+    memset(pad, 0, sizeof(pad));
+
+    return status;
+}
+
+static void hmac_start(crypto_hmac_t *ctx)
+{
+    mbedtls_sha256_clone(&ctx->mbedtls.work, &ctx->mbedtls.inner);
+}
+
+static void hmac_update(crypto_hmac_t *ctx, const uint8_t *data, size_t dlen)
+{
+    (void)mbedtls_sha256_update_ret(&ctx->mbedtls.work, data, dlen);
+}
+
+static void hmac_finish(crypto_hmac_t *ctx, uint8_t *mac)
+{
+    uint8_t hash[CRYPTO_HASH_SIZE]{0};
+
+    (void)mbedtls_sha256_finish_ret(&ctx->mbedtls.work, hash);
+    mbedtls_sha256_clone(&ctx->mbedtls.work, &ctx->mbedtls.outer);
+    (void)mbedtls_sha256_update_ret(&ctx->mbedtls.work, hash, sizeof(hash));
+    (void)mbedtls_sha256_finish_ret(&ctx->mbedtls.work, mac);
+}
+
+static bool rsa_parse(crypto_rsa_t *key, const uint8_t *der, size_t length, bool secret)
+{
+    bool status = false;
+    mbedtls_pk_context *pk = (mbedtls_pk_context *)mbedtls_calloc(1, sizeof(mbedtls_pk_context));
+
+    if (pk != nullptr)
+    {
+        mbedtls_pk_init(pk);
+
+        status = (0 == (secret ? mbedtls_pk_parse_key(pk, der, length, nullptr, 0) : mbedtls_pk_parse_public_key(pk, der, length))) &&
+                 (MBEDTLS_PK_RSA == mbedtls_pk_get_type(pk));
+
+        if (!status)
+        {
+            mbedtls_pk_free(pk);
+            mbedtls_free(pk);
+            pk = nullptr;
+        }
+    }
+
+    key->handle = pk;
+
+    return status;
+}
+
+static void rsa_free(crypto_rsa_t *key)
+{
+    mbedtls_pk_free((mbedtls_pk_context *)key->handle);
+    mbedtls_free(key->handle);
+}
+
+static size_t rsa_public(crypto_rsa_t *key, uint8_t *der, size_t size)
+{
+    /* mbedTLS writes the DER at the end of the buffer */
+    int length = mbedtls_pk_write_pubkey_der((mbedtls_pk_context *)key->handle, der, size);
+
+    if (length > 0)
+    {
+        memmove(der, der + size - length, length);
+    }
+
+    return (length > 0) ? (size_t)length : 0;
+}
+
+static bool rsa_encrypt(crypto_rsa_t *key, const uint8_t *input, size_t ilen, uint8_t *output)
+{
+    size_t olen = 0;
+
+    return (0 == mbedtls_pk_encrypt((mbedtls_pk_context *)key->handle, input, ilen, output, &olen, CRYPTO_RSA_SIZE,
+                                    mbedtls_ctr_drbg_random, &ctr_drbg));
+}
+
+static bool rsa_decrypt(crypto_rsa_t *key, const uint8_t *input, uint8_t *output, size_t *olen, size_t osize)
+{
+    return (0 == mbedtls_pk_decrypt((mbedtls_pk_context *)key->handle, input, CRYPTO_RSA_SIZE, output, olen, osize,
+                                    mbedtls_ctr_drbg_random, &ctr_drbg));
+}
+
+static bool rsa_verify(crypto_rsa_t *key, const uint8_t *hash, const uint8_t *signature)
+{
+    return (0 == mbedtls_pk_verify((mbedtls_pk_context *)key->handle, MBEDTLS_MD_SHA256, hash, CRYPTO_HASH_SIZE, signature, CRYPTO_RSA_SIZE));
+}
+
+/* Exported user code --------------------------------------------------------*/
+
+const crypto_provider_t crypto_mbedtls = {
+    .name = "mbedtls",
+    .init = provider_init,
+    .random = provider_random,
+    .cbc_init = cbc_init,
+    .cbc_free = cbc_free,
+    .cbc_setkey = cbc_setkey,
+    .cbc_crypt = cbc_crypt,
+    .gcm_init = gcm_init,
+    .gcm_free = gcm_free,
+    .gcm_setkey = gcm_setkey,
+    .gcm_seal = gcm_seal,
+    .gcm_open = gcm_open,
+    .hmac_init = hmac_init,
+    .hmac_free = hmac_free,
+    .hmac_setkey = hmac_setkey,
+    .hmac_start = hmac_start,
+    .hmac_update = hmac_update,
+    .hmac_finish = hmac_finish,
+    .rsa_parse = rsa_parse,
+    .rsa_free = rsa_free,
+    .rsa_public = rsa_public,
+    .rsa_encrypt = rsa_encrypt,
+    .rsa_decrypt = rsa_decrypt,
+    .rsa_verify = rsa_verify,
+};
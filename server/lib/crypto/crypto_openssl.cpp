@@ -0,0 +1,378 @@
+/**
+ * @file crypto_openssl.cpp
+ * @brief This file contains the OpenSSL provider of the crypto module, host only.
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @details libcrypto picks its fastest code for the CPU at run time, AES-NI and PCLMULQDQ for AES-CBC and
+ *          AES-GCM, the SHA extensions for SHA-256 and its x86_64 assembly for the RSA arithmetic.
+ *
+ *          The AES contexts are EVP_CIPHER_CTX allocated by the init functions, their key schedule is set once
+ *          and every call only loads the IV or nonce. The HMAC states are plain SHA256_CTX, they can be copied
+ *          without allocating. A RSA key is an EVP_PKEY, parsed once from its DER when the key manager loads or
+ *          generates it or when a client sends it. Every RSA operation only creates a EVP_PKEY_CTX for the key,
+ *          so a key can be used by more than one thread at a time.
+ *
+ *          Built only with CRYPTO_OPENSSL, linked with -lcrypto.
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifdef CRYPTO_OPENSSL
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "crypto.h"
+#include <string.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+/* Private define ------------------------------------------------------------*/
+
+/* Private typedef -----------------------------------------------------------*/
+
+/* Private macro -------------------------------------------------------------*/
+
+constexpr size_t SHA256_BLOCK_SIZE{64}; /**< SHA-256 Block Size, the size of a padded HMAC key */
+constexpr uint8_t HMAC_IPAD{0x36};      /**< Inner Padding of a HMAC key */
+constexpr uint8_t HMAC_OPAD{0x5C};      /**< Outer Padding of a HMAC key */
+
+/* Private variables ---------------------------------------------------------*/
+
+/* Static Assertions ---------------------------------------------------------*/
+
+static_assert(CRYPTO_HASH_SIZE == SHA256_DIGEST_LENGTH, "The HMAC is a SHA-256 hash");
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief Creates a context for one RSA operation with PKCS#1 v1.5 padding.
+ *
+ * @param key The key.
+ * @param init The init function of the operation, EVP_PKEY_encrypt_init, _decrypt_init or _verify_init.
+ * @return The context, nullptr if it could not be set up.
+ */
+static EVP_PKEY_CTX *rsa_context(crypto_rsa_t *key, int (*init)(EVP_PKEY_CTX *))
+{
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new((EVP_PKEY *)key->handle, nullptr);
+
+    if ((ctx != nullptr) && ((1 != init(ctx)) || (1 != EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING))))
+    {
+        EVP_PKEY_CTX_free(ctx);
+        ctx = nullptr;
+    }
+
+    return ctx;
+}
+
+static bool provider_init(void)
+{
+    return (1 == RAND_status());
+}
+
+static int provider_random(void *, unsigned char *output, size_t length)
+{
+    return (1 == RAND_bytes(output, (int)length)) ? 0 : -1;
+}
+
+static void cbc_init(crypto_cbc_t *ctx)
+{
+    ctx->handle = EVP_CIPHER_CTX_new();
+}
+
+static void cbc_free(crypto_cbc_t *ctx)
+{
+    EVP_CIPHER_CTX_free((EVP_CIPHER_CTX *)ctx->handle);
+    ctx->handle = nullptr;
+}
+
+static bool cbc_setkey(crypto_cbc_t *ctx, crypto_direction_t direction, const uint8_t *key)
+{
+    EVP_CIPHER_CTX *cipher = (EVP_CIPHER_CTX *)ctx->handle;
+
+    return (cipher != nullptr) &&
+           (1 == EVP_CipherInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key, nullptr, (direction == CRYPTO_ENCRYPT) ? 1 : 0)) &&
+           (1 == EVP_CIPHER_CTX_set_padding(cipher, 0));
+}
+
+static bool cbc_crypt(crypto_cbc_t *ctx, crypto_direction_t direction, size_t length, uint8_t *iv,
+                      const uint8_t *input, uint8_t *output)
+{
+    bool status = (length == 0);
+    EVP_CIPHER_CTX *cipher = (EVP_CIPHER_CTX *)ctx->handle;
+
+    if (length > 0)
+    {
+        /* Like mbedTLS, the IV becomes the last ciphertext block, the input may be overwritten when decrypting */
+        uint8_t next[CRYPTO_BLOCK_SIZE];
+        int olen = 0;
+
+        memcpy(next, input + length - CRYPTO_BLOCK_SIZE, sizeof(next));
+
+        status = (1 == EVP_CipherInit_ex(cipher, nullptr, nullptr, nullptr, iv, -1)) &&
+                 (1 == EVP_CipherUpdate(cipher, output, &olen, input, (int)length)) && ((size_t)olen == length);
+
+        if (status)
+        {
+            memcpy(iv, (direction == CRYPTO_ENCRYPT) ? output + length - CRYPTO_BLOCK_SIZE : next, CRYPTO_BLOCK_SIZE);
+        }
+    }
+
+    return status;
+}
+
+static void gcm_init(crypto_gcm_t *ctx)
+{
+    ctx->handle = EVP_CIPHER_CTX_new();
+}
+
+static void gcm_free(crypto_gcm_t *ctx)
+{
+    EVP_CIPHER_CTX_free((EVP_CIPHER_CTX *)ctx->handle);
+    ctx->handle = nullptr;
+}
+
+static bool gcm_setkey(crypto_gcm_t *ctx, const uint8_t *key)
+{
+    EVP_CIPHER_CTX *cipher = (EVP_CIPHER_CTX *)ctx->handle;
+
+    return (cipher != nullptr) && (1 == EVP_CipherInit_ex(cipher, EVP_aes_256_gcm(), nullptr, key, nullptr, 1));
+}
+
+/**
+ * @brief Runs GCM over the additional data and the input, the direction and the tag are set by the caller.
+ *
+ * @return True if all data was processed and, when decrypting, the tag matched.
+ */
+static bool gcm_crypt(EVP_CIPHER_CTX *cipher, const uint8_t *aad, size_t alen, const uint8_t *input, size_t length,
+                      uint8_t *output)
+{
+    int olen = 0;
+    int flen = 0;
+
+    return ((alen == 0) || (1 == EVP_CipherUpdate(cipher, nullptr, &olen, aad, (int)alen))) &&
+           ((length == 0) || ((1 == EVP_CipherUpdate(cipher, output, &olen, input, (int)length)) && ((size_t)olen == length))) &&
+           (1 == EVP_CipherFinal_ex(cipher, output + length, &flen)) && (flen == 0);
+}
+
+static bool gcm_seal(crypto_gcm_t *ctx, const uint8_t *nonce, const uint8_t *aad, size_t alen,
+                     const uint8_t *input, size_t length, uint8_t *output, uint8_t *tag)
+{
+    EVP_CIPHER_CTX *cipher = (EVP_CIPHER_CTX *)ctx->handle;
+
+    return (1 == EVP_CipherInit_ex(cipher, nullptr, nullptr, nullptr, nonce, 1)) &&
+           gcm_crypt(cipher, aad, alen, input, length, output) &&
+           (1 == EVP_CIPHER_CTX_ctrl(cipher, EVP_CTRL_AEAD_GET_TAG, CRYPTO_TAG_SIZE, tag));
+}
+
+static bool gcm_open(crypto_gcm_t *ctx, const uint8_t *nonce, const uint8_t *aad, size_t alen,
+                     const uint8_t *input, size_t length, const uint8_t *tag, uint8_t *output)
+{
+    EVP_CIPHER_CTX *cipher = (EVP_CIPHER_CTX *)ctx->handle;
+
+    bool status = (1 == EVP_CipherInit_ex(cipher, nullptr, nullptr, nullptr, nonce, 0)) &&
+                  (1 == EVP_CIPHER_CTX_ctrl(cipher, EVP_CTRL_AEAD_SET_TAG, CRYPTO_TAG_SIZE, (void *)tag)) &&
+                  gcm_crypt(cipher, aad, alen, input, length, output);
+
+    if (!status)
+    {
+        /* Like mbedTLS, nothing of a forged record is left */
+        OPENSSL_cleanse(output, length);
+    }
+
+    return status;
+}
+
+static void hmac_init(crypto_hmac_t *ctx)
+{
+    memset(&ctx->openssl, 0, sizeof(ctx->openssl));
+}
+
+static void hmac_free(crypto_hmac_t *ctx)
+{
+    OPENSSL_cleanse(&ctx->openssl, sizeof(ctx->openssl));
+}
+
+static bool hmac_setkey(crypto_hmac_t *ctx, const uint8_t *key, size_t klen)
+{
+    bool status = true;
+    uint8_t pad[SHA256_BLOCK_SIZE]{0};
+
+    /* Longer keys are replaced by their hash (RFC 2104) */
+    if (klen > SHA256_BLOCK_SIZE)
+    {
+        status = (nullptr != SHA256(key, klen, pad));
+    }
+    else
+    {
+        memcpy(pad, key, klen);
+    }
+
+    for (uint8_t &byte : pad)
+    {
+        byte ^= HMAC_IPAD;
+    }
+
+    status = status && (1 == SHA256_Init(&ctx->openssl.inner)) && (1 == SHA256_Update(&ctx->openssl.inner, pad, sizeof(pad)));
+
+    for (uint8_t &byte : pad)
+    {
+        byte ^= HMAC_IPAD ^ HMAC_OPAD;
+    }
+
+    status = status && (1 == SHA256_Init(&ctx->openssl.outer)) && (1 == SHA256_Update(&ctx->openssl.outer, pad, sizeof(pad)));
+
+    OPENSSL_cleanse(pad, sizeof(pad));
+
+    return status;
+}
+
+static void hmac_start(crypto_hmac_t *ctx)
+{
+    ctx->openssl.work = ctx->openssl.inner;
+}
+
+static void hmac_update(crypto_hmac_t *ctx, const uint8_t *data, size_t dlen)
+{
+    (void)SHA256_Update(&ctx->openssl.work, data, dlen);
+}
+
+static void hmac_finish(crypto_hmac_t *ctx, uint8_t *mac)
+{
+    uint8_t hash[CRYPTO_HASH_SIZE]{0};
+
+    (void)SHA256_Final(hash, &ctx->openssl.work);
+    ctx->openssl.work = ctx->openssl.outer;
+    (void)SHA256_Update(&ctx->openssl.work, hash, sizeof(hash));
+    (void)SHA256_Final(mac, &ctx->openssl.work);
+}
+
+static bool rsa_parse(crypto_rsa_t *key, const uint8_t *der, size_t length, bool secret)
+{
+    const uint8_t *start = der;
+    EVP_PKEY *pkey{nullptr};
+
+    if (secret)
+    {
+        pkey = d2i_PrivateKey(EVP_PKEY_RSA, nullptr, &start, (long)length);
+    }
+    else
+    {
+        /* A handshake parses every client key, d2i_PUBKEY() runs the decoder framework and takes 50 times longer */
+        RSA *rsa = d2i_RSA_PUBKEY(nullptr, &start, (long)length);
+        pkey = (rsa != nullptr) ? EVP_PKEY_new() : nullptr;
+
+        if ((pkey == nullptr) || (1 != EVP_PKEY_assign_RSA(pkey, rsa)))
+        {
+            EVP_PKEY_free(pkey);
+            RSA_free(rsa);
+            pkey = nullptr;
+        }
+    }
+
+    key->handle = pkey;
+
+    return (pkey != nullptr);
+}
+
+static void rsa_free(crypto_rsa_t *key)
+{
+    EVP_PKEY_free((EVP_PKEY *)key->handle);
+}
+
+static size_t rsa_public(crypto_rsa_t *key, uint8_t *der, size_t size)
+{
+    size_t length = 0;
+    int needed = i2d_PUBKEY((EVP_PKEY *)key->handle, nullptr);
+
+    if ((needed > 0) && ((size_t)needed <= size))
+    {
+        uint8_t *end = der;
+        length = (needed == i2d_PUBKEY((EVP_PKEY *)key->handle, &end)) ? (size_t)needed : 0;
+    }
+
+    return length;
+}
+
+static bool rsa_encrypt(crypto_rsa_t *key, const uint8_t *input, size_t ilen, uint8_t *output)
+{
+    size_t olen = CRYPTO_RSA_SIZE;
+    EVP_PKEY_CTX *ctx = rsa_context(key, EVP_PKEY_encrypt_init);
+
+    bool status = (ctx != nullptr) && (1 == EVP_PKEY_encrypt(ctx, output, &olen, input, ilen)) && (olen == CRYPTO_RSA_SIZE);
+
+    EVP_PKEY_CTX_free(ctx);
+
+    return status;
+}
+
+static bool rsa_decrypt(crypto_rsa_t *key, const uint8_t *input, uint8_t *output, size_t *olen, size_t osize)
+{
+    uint8_t plain[CRYPTO_RSA_SIZE];
+    size_t length = sizeof(plain);
+    EVP_PKEY_CTX *ctx = rsa_context(key, EVP_PKEY_decrypt_init);
+
+    /* Decrypted into a block of its own, OpenSSL wants room for a whole block */
+    bool status = (ctx != nullptr) && (1 == EVP_PKEY_decrypt(ctx, plain, &length, input, CRYPTO_RSA_SIZE)) && (length <= osize);
+
+    if (status)
+    {
+        memcpy(output, plain, length);
+        *olen = length;
+    }
+
+    EVP_PKEY_CTX_free(ctx);
+    OPENSSL_cleanse(plain, sizeof(plain));
+
+    return status;
+}
+
+static bool rsa_verify(crypto_rsa_t *key, const uint8_t *hash, const uint8_t *signature)
+{
+    EVP_PKEY_CTX *ctx = rsa_context(key, EVP_PKEY_verify_init);
+
+    bool status = (ctx != nullptr) && (1 == EVP_PKEY_CTX_set_signature_md(ctx, EVP_sha256())) &&
+                  (1 == EVP_PKEY_verify(ctx, signature, CRYPTO_RSA_SIZE, hash, CRYPTO_HASH_SIZE));
+
+    EVP_PKEY_CTX_free(ctx);
+
+    return status;
+}
+
+/* Exported user code --------------------------------------------------------*/
+
+const crypto_provider_t crypto_openssl = {
+    .name = "openssl",
+    .init = provider_init,
+    .random = provider_random,
+    .cbc_init = cbc_init,
+    .cbc_free = cbc_free,
+    .cbc_setkey = cbc_setkey,
+    .cbc_crypt = cbc_crypt,
+    .gcm_init = gcm_init,
+    .gcm_free = gcm_free,
+    .gcm_setkey = gcm_setkey,
+    .gcm_seal = gcm_seal,
+    .gcm_open = gcm_open,
+    .hmac_init = hmac_init,
+    .hmac_free = hmac_free,
+    .hmac_setkey = hmac_setkey,
+    .hmac_start = hmac_start,
+    .hmac_update = hmac_update,
+    .hmac_finish = hmac_finish,
+    .rsa_parse = rsa_parse,
+    .rsa_free = rsa_free,
+    .rsa_public = rsa_public,
+    .rsa_encrypt = rsa_encrypt,
+    .rsa_decrypt = rsa_decrypt,
+    .rsa_verify = rsa_verify,
+};
+
+#endif /* CRYPTO_OPENSSL */
@@ -0,0 +1,148 @@
+/**
+ * @file hal.h
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @brief
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef HAL_H
+#define HAL_H
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Exported defines ----------------------------------------------------------*/
+
+/* Exported types ------------------------------------------------------------*/
+
+/**
+ * @brief The digital outputs of the board.
+ */
+typedef enum : uint8_t
+{
+    HAL_LED,     /**< The LED, GPIO 21 on the target */
+    HAL_RELAY,   /**< The relay, GPIO 32 on the target */
+    HAL_OUTPUTS, /**< The number of outputs */
+} hal_output_t;
+
+/* Exported constants --------------------------------------------------------*/
+
+/* Exported macro ------------------------------------------------------------*/
+
+/* Exported functions prototypes ---------------------------------------------*/
+
+/**
+ * @brief Initialize the hardware abstraction layer
+ *
+ * Configures the outputs and switches them off.
+ *
+ * @return true if the hardware abstraction layer was initialized else false
+ */
+bool hal_init(void);
+
+/**
+ * @brief Switch an output
+ *
+ * @param output the output
+ * @param state true to switch it on, false to switch it off
+ */
+void hal_write(hal_output_t output, bool state);
+
+/**
+ * @brief Read back the state of an output
+ *
+ * @param output the output
+ * @return true if the output is on else false
+ */
+bool hal_read(hal_output_t output);
+
+/**
+ * @brief Read the temperature
+ *
+ * @return float the temperature in °C
+ */
+float hal_temperature(void);
+
+/**
+ * @brief Get the time since start
+ *
+ * @return uint32_t the monotonic time in ms, it wraps around after 49 days
+ */
+uint32_t hal_millis(void);
+
+/**
+ * @brief Get the time since start with a finer resolution
+ *
+ * @return uint32_t the monotonic time in us, it wraps around after 71 minutes
+ */
+uint32_t hal_micros(void);
+
+/**
+ * @brief Sleep
+ *
+ * @param ms the time to sleep in ms
+ */
+void hal_delay(uint32_t ms);
+
+/**
+ * @brief Fill a buffer with random bytes of the random number generator of the platform
+ *
+ * The bytes are suited for key material, the hardware RNG on the target and getrandom() on the host.
+ *
+ * @param buffer the buffer
+ * @param length the number of bytes
+ */
+void hal_random(uint8_t *buffer, size_t length);
+
+#ifndef ARDUINO
+/**
+ * @brief Set the script of the simulated temperature, host only
+ *
+ * The script is a list of "time:temperature" points, in ms since start and °C, separated by
+ * commas, e.g. "0:21.5,60000:24,120000:21.5". The temperature is interpolated between the
+ * points and the script repeats after the last one. A single point is a constant temperature.
+ *
+ * @param text the script
+ * @return true if the script is valid else false, the previous script is kept
+ */
+bool hal_script(const char *text);
+
+/**
+ * @brief Make the random bytes a deterministic stream, host only
+ *
+ * Every call of hal_random() after this one continues the stream of the seed, so a server that
+ * receives the same frames generates the same keys. For captures and their replays, the bytes
+ * are not suited for key material that has to stay secret.
+ *
+ * @param seed the seed of the stream
+ */
+void hal_seed(uint64_t seed);
+
+/**
+ * @brief Check whether the random bytes are a seeded stream, host only
+ *
+ * The key store refuses to write while they are, a key generated from the stream is known to
+ * everyone with the seed and must not outlive the run.
+ *
+ * @return true if hal_seed() was called else false
+ */
+bool hal_seeded(void);
+
+/**
+ * @brief Set the time of hal_millis(), host only
+ *
+ * hal_millis() continues from the given time, so the wrap of the ms counter after 49 days can be
+ * tested in seconds. hal_micros() and the temperature script keep the time since start.
+ *
+ * @param ms the time hal_millis() returns now
+ */
+void hal_clock(uint32_t ms);
+#endif
+
+#endif /* HAL_H */
@@ -0,0 +1,92 @@
+/**
+ * @file hal_esp32.cpp
+ * @brief This file contains the hardware abstraction layer of the Olimex ESP32-EVB.
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @details The outputs are GPIO pins, the temperature is the internal sensor of the ESP32 and
+ *          the random bytes come from the hardware RNG, which is seeded by the RF noise while
+ *          WiFi or Bluetooth is on and by the SAR ADC otherwise.
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifdef ARDUINO
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "hal.h"
+#include <Arduino.h>
+#include <esp_system.h>
+
+/* Private define ------------------------------------------------------------*/
+
+/* Private typedef -----------------------------------------------------------*/
+
+/* Private macro -------------------------------------------------------------*/
+
+/* Private variables ---------------------------------------------------------*/
+
+/* The pins of the outputs, in the order of hal_output_t */
+static const uint8_t pins[HAL_OUTPUTS] = {
+    GPIO_NUM_21, /**< LED */
+    GPIO_NUM_32, /**< Relay, switched on when a request fails */
+};
+
+/* Static Assertions ---------------------------------------------------------*/
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* Private user code ---------------------------------------------------------*/
+
+/* Exported user code --------------------------------------------------------*/
+
+bool hal_init(void)
+{
+    for (uint8_t pin : pins)
+    {
+        pinMode(pin, OUTPUT);
+        digitalWrite(pin, LOW);
+    }
+
+    return true;
+}
+
+void hal_write(hal_output_t output, bool state)
+{
+    digitalWrite(pins[output], state ? HIGH : LOW);
+}
+
+bool hal_read(hal_output_t output)
+{
+    return (HIGH == digitalRead(pins[output]));
+}
+
+float hal_temperature(void)
+{
+    return temperatureRead();
+}
+
+uint32_t hal_millis(void)
+{
+    return (uint32_t)millis();
+}
+
+uint32_t hal_micros(void)
+{
+    return (uint32_t)micros();
+}
+
+void hal_delay(uint32_t ms)
+{
+    delay(ms);
+}
+
+void hal_random(uint8_t *buffer, size_t length)
+{
+    esp_fill_random(buffer, length);
+}
+
+#endif /* ARDUINO */
@@ -0,0 +1,248 @@
+/**
+ * @file hal_linux.cpp
+ * @brief This file contains the simulated hardware abstraction layer of a host build.
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @details The outputs only keep their state, the temperature follows a script of points set
+ *          with hal_script(), the time is the monotonic clock since start and the random bytes
+ *          come from getrandom(), the CSPRNG of the kernel. Nothing is shared between processes,
+ *          so many simulated devices can run on one host.
+ *
+ *          After hal_seed() the random bytes are a SplitMix64 stream of the seed instead, so the
+ *          replay of a capture generates the same session keys as the server that was captured.
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef ARDUINO
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "hal.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+/* Private define ------------------------------------------------------------*/
+
+#ifndef HAL_SCRIPT
+#define HAL_SCRIPT "0:21.5,300000:25,600000:21.5" /**< The temperature until hal_script() is called, 10 minutes around 23 °C */
+#endif
+
+/* Private typedef -----------------------------------------------------------*/
+
+/**
+ * @brief A point of the temperature script.
+ */
+typedef struct
+{
+    uint32_t time;     /**< Time in ms since the start of the script */
+    float temperature; /**< Temperature in °C at the time */
+} hal_point_t;
+
+/* Private macro -------------------------------------------------------------*/
+
+constexpr size_t SCRIPT_POINTS{32}; /**< Most points of a temperature script */
+
+/* Private variables ---------------------------------------------------------*/
+
+static const std::chrono::steady_clock::time_point started{std::chrono::steady_clock::now()}; /**< The time of start */
+static std::atomic<bool> outputs[HAL_OUTPUTS];  /**< The states of the outputs */
+static std::mutex script_lock;                  /**< Protects the script, the sampler reads it while it is set */
+static hal_point_t script[SCRIPT_POINTS];       /**< The points of the temperature script */
+static size_t script_length{0};                 /**< The number of points of the script, 0 until it is parsed */
+static std::mutex random_lock;                  /**< Protects the state of the seeded stream */
+static uint64_t random_state{0};                /**< The state of the seeded stream */
+static std::atomic<bool> seeded{false};         /**< The random bytes are the seeded stream */
+static std::atomic<uint32_t> offset{0};         /**< The ms hal_millis() is ahead of the time since start, see hal_clock() */
+
+/* Static Assertions ---------------------------------------------------------*/
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief Parses a temperature script.
+ *
+ * @param text The script, "time:temperature" points separated by commas, with rising times.
+ * @param points The buffer to store the points in, SCRIPT_POINTS points.
+ * @return The number of points, 0 if the script is invalid.
+ */
+static size_t script_parse(const char *text, hal_point_t *points)
+{
+    size_t count = 0;
+    bool valid = true;
+
+    while (valid && (*text != '\0'))
+    {
+        char *end = nullptr;
+        unsigned long time = strtoul(text, &end, 10);
+        valid = (count < SCRIPT_POINTS) && (end != text) && (*end == ':') && (time <= UINT32_MAX) &&
+                ((count == 0) || (time > points[count - 1].time));
+
+        if (valid)
+        {
+            text = end + 1;
+            points[count].time = (uint32_t)time;
+            points[count].temperature = strtof(text, &end);
+            valid = (end != text) && ((*end == ',') || (*end == '\0'));
+            text = (*end == ',') ? end + 1 : end;
+            count++;
+        }
+    }
+
+    return valid ? count : 0;
+}
+
+/* Exported user code --------------------------------------------------------*/
+
+bool hal_init(void)
+{
+    for (std::atomic<bool> &output : outputs)
+    {
+        output = false;
+    }
+
+    std::lock_guard<std::mutex> guard(script_lock);
+
+    if (script_length == 0)
+    {
+        script_length = script_parse(HAL_SCRIPT, script);
+    }
+
+    return (script_length > 0);
+}
+
+void hal_write(hal_output_t output, bool state)
+{
+    outputs[output] = state;
+}
+
+bool hal_read(hal_output_t output)
+{
+    return outputs[output];
+}
+
+float hal_temperature(void)
+{
+    float temperature = 0;
+    /* The script follows the time since start, hal_clock() does not move it */
+    uint32_t now = hal_millis() - offset;
+    std::lock_guard<std::mutex> guard(script_lock);
+
+    if (script_length > 0)
+    {
+        /* The script repeats after its last point, from there the first point is approached again */
+        const hal_point_t *last = &script[script_length - 1];
+        uint32_t time = (last->time > 0) ? now % last->time : 0;
+        size_t next = 0;
+
+        while ((next < script_length) && (script[next].time <= time))
+        {
+            next++;
+        }
+
+        temperature = last->temperature;
+
+        if (next < script_length)
+        {
+            const hal_point_t *from = (next == 0) ? last : &script[next - 1];
+            uint32_t since = (next == 0) ? 0 : from->time;
+            temperature = from->temperature + (script[next].temperature - from->temperature) *
+                                                  (float)(time - since) / (float)(script[next].time - since);
+        }
+    }
+
+    return temperature;
+}
+
+uint32_t hal_millis(void)
+{
+    return offset + (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count();
+}
+
+uint32_t hal_micros(void)
+{
+    return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count();
+}
+
+void hal_delay(uint32_t ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void hal_random(uint8_t *buffer, size_t length)
+{
+    size_t count = 0;
+
+    if (seeded)
+    {
+        std::lock_guard<std::mutex> guard(random_lock);
+
+        for (; count < length; count++)
+        {
+            /* SplitMix64, one byte of every output keeps the stream independent of the lengths asked for */
+            uint64_t z = (random_state += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            buffer[count] = (uint8_t)(z ^ (z >> 31));
+        }
+    }
+
+    while (count < length)
+    {
+        ssize_t result = getrandom(buffer + count, length - count, 0);
+
+        if (result > 0)
+        {
+            count += (size_t)result;
+        }
+        else if (errno != EINTR)
+        {
+            abort(); /**< Without the kernel CSPRNG no key material can be generated */
+        }
+    }
+}
+
+bool hal_script(const char *text)
+{
+    hal_point_t points[SCRIPT_POINTS];
+    size_t length = script_parse(text, points);
+
+    if (length > 0)
+    {
+        std::lock_guard<std::mutex> guard(script_lock);
+        memcpy(script, points, sizeof(hal_point_t) * length);
+        script_length = length;
+    }
+
+    return (length > 0);
+}
+
+void hal_seed(uint64_t seed)
+{
+    std::lock_guard<std::mutex> guard(random_lock);
+    random_state = seed;
+    seeded = true;
+}
+
+bool hal_seeded(void)
+{
+    return seeded;
+}
+
+void hal_clock(uint32_t ms)
+{
+    offset = ms - (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count();
+}
+
+#endif /* ARDUINO */
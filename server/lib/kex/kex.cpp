@@ -0,0 +1,256 @@
+/**
+ * @file kex.cpp
+ * @brief This file contains the implementation of the key exchange module.
+ *        It provides the ephemeral ECDH, the identity signature and the HKDF of the ECDH handshake.
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @details Both X25519 and P-256 are supported if they are enabled in the mbedTLS configuration.
+ *          The server signs the handshake with a long-term ECDSA P-256 identity key, which is kept
+ *          in the key store so clients can pin it. Its lifetime is counted in key store time, which
+ *          survives a reboot. HKDF is implemented on top of the HMAC API, because MBEDTLS_HKDF_C is
+ *          not enabled in every ESP-IDF configuration. The curves are checked once in kex_init().
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "kex.h"
+#include "crypto.h"
+#include "keystore.h"
+#include <string.h>
+#include <mbedtls/md.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/ecp.h>
+#include <mbedtls/ecdh.h>
+
+/* Private define ------------------------------------------------------------*/
+
+/* Private typedef -----------------------------------------------------------*/
+
+/* Private macro -------------------------------------------------------------*/
+
+constexpr size_t HASH_SIZE{32};                          /**< Hash Size */
+constexpr size_t X25519_SIZE{32};                        /**< X25519 Public Key Size */
+constexpr size_t P256_SIZE{65};                          /**< Uncompressed P-256 Public Key Size */
+constexpr uint32_t IDENTITY_LIFETIME{365UL * 24 * 60 * 60}; /**< Identity Key Lifetime in seconds (1 year) */
+
+/* Private variables ---------------------------------------------------------*/
+
+static mbedtls_pk_context identity_ctx; /**< Identity Key Context */
+static size_t public_size[KEX_P256 + 1]{0}; /**< Public key size of each mode, 0 if its curve is not compiled in */
+
+static int (*rng)(void *, unsigned char *, size_t){nullptr}; /**< Random Number Generator */
+static void *rng_ctx{nullptr};                               /**< Random Number Generator Context */
+
+/* Static Assertions ---------------------------------------------------------*/
+
+static_assert(KEX_MAX_PUBLIC_SIZE >= P256_SIZE, "A P-256 public key must fit");
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief Maps a handshake mode to its curve.
+ *
+ * @param mode The handshake mode.
+ * @return The curve, MBEDTLS_ECP_DP_NONE if the mode is unknown.
+ */
+static mbedtls_ecp_group_id kex_curve(uint8_t mode)
+{
+    mbedtls_ecp_group_id curve = MBEDTLS_ECP_DP_NONE;
+
+    if (mode == KEX_X25519)
+    {
+        curve = MBEDTLS_ECP_DP_CURVE25519;
+    }
+    else if (mode == KEX_P256)
+    {
+        curve = MBEDTLS_ECP_DP_SECP256R1;
+    }
+
+    return curve;
+}
+
+/**
+ * @brief Generates a new identity key and stores it.
+ *
+ * @return True if the key was generated, false otherwise.
+ */
+static bool identity_generate(void)
+{
+    bool status = false;
+
+    if (0 == mbedtls_pk_setup(&identity_ctx, mbedtls_pk_info_from_type(MBEDTLS_PK_ECKEY)))
+    {
+        status = (0 == mbedtls_ecp_gen_key(MBEDTLS_ECP_DP_SECP256R1, mbedtls_pk_ec(identity_ctx), rng, rng_ctx));
+    }
+
+    if (status)
+    {
+        /* A failed store only costs a new identity on the next boot */
+        (void)keystore_store(KEYSTORE_IDENTITY, &identity_ctx, keystore_time() + IDENTITY_LIFETIME);
+    }
+
+    return status;
+}
+
+/* Exported user code --------------------------------------------------------*/
+
+bool kex_init(int (*f_rng)(void *, unsigned char *, size_t), void *p_rng)
+{
+    rng = f_rng;
+    rng_ctx = p_rng;
+
+    mbedtls_pk_init(&identity_ctx);
+
+    /* A mode is only offered if its curve is compiled in, loading a group is too slow for every frame */
+    static const uint8_t modes[] = {KEX_X25519, KEX_P256};
+
+    for (uint8_t mode : modes)
+    {
+        mbedtls_ecp_group grp;
+        mbedtls_ecp_group_init(&grp);
+
+        if (0 == mbedtls_ecp_group_load(&grp, kex_curve(mode)))
+        {
+            public_size[mode] = (mode == KEX_X25519) ? X25519_SIZE : P256_SIZE;
+        }
+
+        mbedtls_ecp_group_free(&grp);
+    }
+
+    return keystore_load(KEYSTORE_IDENTITY, &identity_ctx) || identity_generate();
+}
+
+size_t kex_public_size(uint8_t mode)
+{
+    return (mode < sizeof(public_size) / sizeof(public_size[0])) ? public_size[mode] : 0;
+}
+
+bool kex_agree(uint8_t mode, const uint8_t *peer, uint8_t *pub, uint8_t *secret)
+{
+    bool status = false;
+    size_t olen = 0;
+    size_t size = kex_public_size(mode);
+
+    mbedtls_ecp_group grp;
+    mbedtls_ecp_point own, other;
+    mbedtls_mpi d, z;
+
+    mbedtls_ecp_group_init(&grp);
+    mbedtls_ecp_point_init(&own);
+    mbedtls_ecp_point_init(&other);
+    mbedtls_mpi_init(&d);
+    mbedtls_mpi_init(&z);
+
+    if ((size > 0) && (0 == mbedtls_ecp_group_load(&grp, kex_curve(mode))))
+    {
+        if ((0 == mbedtls_ecp_point_read_binary(&grp, &other, peer, size)) &&
+            (0 == mbedtls_ecp_check_pubkey(&grp, &other)) &&
+            (0 == mbedtls_ecdh_gen_public(&grp, &d, &own, rng, rng_ctx)) &&
+            (0 == mbedtls_ecp_point_write_binary(&grp, &own, MBEDTLS_ECP_PF_UNCOMPRESSED, &olen, pub, size)) &&
+            (olen == size) &&
+            (0 == mbedtls_ecdh_compute_shared(&grp, &z, &other, &d, rng, rng_ctx)))
+        {
+            /* X25519 secrets are little endian (RFC 7748), P-256 secrets big endian */
+            if (mode == KEX_X25519)
+            {
+                status = (0 == mbedtls_mpi_write_binary_le(&z, secret, KEX_SECRET_SIZE));
+            }
+            else
+            {
+                status = (0 == mbedtls_mpi_write_binary(&z, secret, KEX_SECRET_SIZE));
+            }
+        }
+    }
+
+    mbedtls_mpi_free(&z);
+    mbedtls_mpi_free(&d);
+    mbedtls_ecp_point_free(&other);
+    mbedtls_ecp_point_free(&own);
+    mbedtls_ecp_group_free(&grp);
+
+    return status;
+}
+
+bool kex_identity(uint8_t *der)
+{
+    uint8_t temp[KEX_IDENTITY_SIZE + 16]{0};
+
+    /* The DER is written at the end of the given buffer */
+    int length = mbedtls_pk_write_pubkey_der(&identity_ctx, temp, sizeof(temp));
+
+    if (length == (int)KEX_IDENTITY_SIZE)
+    {
+        memcpy(der, temp + sizeof(temp) - length, length);
+    }
+
+    return (length == (int)KEX_IDENTITY_SIZE);
+}
+
+size_t kex_sign(const uint8_t *data, size_t dlen, uint8_t *sig)
+{
+    size_t length = 0;
+    uint8_t hash[HASH_SIZE]{0};
+
+    if (0 == mbedtls_md(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), data, dlen, hash))
+    {
+        if (0 != mbedtls_pk_sign(&identity_ctx, MBEDTLS_MD_SHA256, hash, sizeof(hash), sig, &length, rng, rng_ctx))
+        {
+            length = 0;
+        }
+    }
+
+    return length;
+}
+
+bool kex_derive(const uint8_t *salt, size_t slen, const uint8_t *ikm, size_t ilen,
+                const uint8_t *info, size_t nlen, uint8_t *okm, size_t olen)
+{
+    bool status = (olen <= 255 * HASH_SIZE);
+    uint8_t prk[HASH_SIZE]{0};
+    uint8_t block[HASH_SIZE]{0};
+    crypto_hmac_t ctx;
+
+    crypto_hmac_init(&ctx);
+
+    /* Extract */
+    if (status && crypto_hmac_setkey(&ctx, salt, slen))
+    {
+        crypto_hmac(&ctx, ikm, ilen, prk);
+        status = crypto_hmac_setkey(&ctx, prk, sizeof(prk));
+    }
+    else
+    {
+        status = false;
+    }
+
+    /* Expand: T(i) = HMAC(PRK, T(i - 1) | info | i), the PRK is keyed once for all blocks */
+    for (uint8_t counter = 1, *out = okm; status && (out < okm + olen); counter++)
+    {
+        size_t chunk = ((size_t)(okm + olen - out) < HASH_SIZE) ? (size_t)(okm + olen - out) : HASH_SIZE;
+
+        crypto_hmac_start(&ctx);
+        if (counter > 1)
+        {
+            crypto_hmac_update(&ctx, block, sizeof(block));
+        }
+        crypto_hmac_update(&ctx, info, nlen);
+        crypto_hmac_update(&ctx, &counter, 1);
+        crypto_hmac_finish(&ctx, block);
+
+        memcpy(out, block, chunk);
+        out += chunk;
+    }
+
+    crypto_hmac_free(&ctx);
+    memset(prk, 0, sizeof(prk));
+    memset(block, 0, sizeof(block));
+
+    return status;
+}
@@ -0,0 +1,113 @@
+/**
+ * @file kex.h
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @brief
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef KEX_H
+#define KEX_H
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Exported defines ----------------------------------------------------------*/
+
+/* Exported types ------------------------------------------------------------*/
+
+/**
+ * @brief The ECDH handshake modes a client can offer.
+ */
+typedef enum : uint8_t
+{
+    KEX_X25519 = 0x01, /**< Ephemeral X25519 */
+    KEX_P256 = 0x02,   /**< Ephemeral NIST P-256 */
+} kex_mode_t;
+
+/* Exported constants --------------------------------------------------------*/
+
+constexpr size_t KEX_MAX_PUBLIC_SIZE{65};    /**< Uncompressed P-256 point */
+constexpr size_t KEX_SECRET_SIZE{32};        /**< Shared secret size of both curves */
+constexpr size_t KEX_IDENTITY_SIZE{91};      /**< DER SubjectPublicKeyInfo of a P-256 key */
+constexpr size_t KEX_MAX_SIGNATURE_SIZE{72}; /**< DER ECDSA P-256 signature */
+
+/* Exported macro ------------------------------------------------------------*/
+
+/* Exported functions prototypes ---------------------------------------------*/
+
+/**
+ * @brief Initialize the key exchange module
+ *
+ * Loads the ECDSA P-256 identity key from the key store or generates one, and checks which
+ * curves are compiled in. The key store must have been initialized.
+ *
+ * @param f_rng the random number generator
+ * @param p_rng the context of the random number generator
+ * @return true if the identity key is available
+ * @return false if the identity key could not be loaded or generated
+ */
+bool kex_init(int (*f_rng)(void *, unsigned char *, size_t), void *p_rng);
+
+/**
+ * @brief Get the size of a public key in a handshake mode
+ *
+ * @param mode the handshake mode
+ * @return size_t the size of the public key, 0 if the mode is not supported
+ */
+size_t kex_public_size(uint8_t mode);
+
+/**
+ * @brief Perform the server side of an ephemeral ECDH key agreement
+ *
+ * @param mode the handshake mode
+ * @param peer the public key of the client
+ * @param pub the buffer to store the ephemeral public key of the server in
+ * @param secret the buffer to store the KEX_SECRET_SIZE bytes shared secret in
+ * @return true if the key agreement succeeded
+ * @return false if the mode is unsupported or the peer key is invalid
+ */
+bool kex_agree(uint8_t mode, const uint8_t *peer, uint8_t *pub, uint8_t *secret);
+
+/**
+ * @brief Write the public identity key
+ *
+ * @param der the buffer to store the KEX_IDENTITY_SIZE bytes DER public key in
+ * @return true if the key was written
+ * @return false if the key could not be written
+ */
+bool kex_identity(uint8_t *der);
+
+/**
+ * @brief Sign data with the identity key
+ *
+ * @param data the data to sign, it is hashed with SHA-256
+ * @param dlen the length of the data
+ * @param sig the buffer to store the DER signature in, at least KEX_MAX_SIGNATURE_SIZE bytes
+ * @return size_t the length of the signature, 0 on error
+ */
+size_t kex_sign(const uint8_t *data, size_t dlen, uint8_t *sig);
+
+/**
+ * @brief Derive key material with HKDF-SHA256 (RFC 5869)
+ *
+ * @param salt the salt
+ * @param slen the length of the salt
+ * @param ikm the input key material
+ * @param ilen the length of the input key material
+ * @param info the context information
+ * @param nlen the length of the context information
+ * @param okm the buffer to store the output key material in
+ * @param olen the length of the output key material, at most 255 * 32 bytes
+ * @return true if the key material was derived
+ * @return false if the key material could not be derived
+ */
+bool kex_derive(const uint8_t *salt, size_t slen, const uint8_t *ikm, size_t ilen,
+                const uint8_t *info, size_t nlen, uint8_t *okm, size_t olen);
+
+#endif /* KEX_H */
@@ -0,0 +1,460 @@
+/**
+ * @file keymanager.cpp
+ * @brief This file contains the implementation of the key manager module.
+ *        The key manager owns the server RSA keys and rotates them without blocking the session.
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @details The keys live in a fixed number of slots. One slot holds the active key, up to
+ *          KEY_POOL_DEPTH slots hold keys that are ready to be activated and a retired key stays
+ *          in its slot until the last handshake using it has released it.
+ *          A low priority worker thread generates new keys whenever the pool is not full.
+ *          The active key is replaced in keymanager_acquire(), i.e. at the start of a handshake,
+ *          when it has expired or a rotation was requested. Switching is only a change of the
+ *          slot states, the RSA key generation never runs on the request path. The worker then
+ *          writes the new active key to the key store, the keys of the pool are never persisted,
+ *          so a reboot continues with the key the clients know. The lifetime of a key starts when
+ *          it becomes active and is counted in key store time, which survives a reboot. The worker
+ *          also persists the key store time every SYNC_INTERVAL.
+ *
+ *          A host build whose random bytes are seeded (hal_seeded()) seeds the CTR-DRBG of the worker
+ *          from hal_random() once, in keymanager_init(), and never reseeds it. The RSA keys are then
+ *          a stream of the seed, so a replay of a seeded capture generates the same keys.
+ *
+ *          A slot keeps the key twice: as a mbedTLS context, which is generated and stored, and converted
+ *          once by the crypto provider, which the handshakes decrypt with.
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "keymanager.h"
+#include "keystore.h"
+#include "memory.h"
+#include "hal.h"
+#include <limits.h>
+#include <string.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/rsa.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#ifdef ARDUINO
+#include <esp_pthread.h>
+#endif
+
+/* Private define ------------------------------------------------------------*/
+
+/* Private typedef -----------------------------------------------------------*/
+
+/**
+ * @brief The states of a key slot.
+ */
+typedef enum
+{
+    SLOT_FREE,       /**< The slot holds no key */
+    SLOT_GENERATING, /**< The worker is generating a key into the slot */
+    SLOT_READY,      /**< The slot holds a key ready to be activated */
+    SLOT_ACTIVE,     /**< The slot holds the active key */
+    SLOT_RETIRED,    /**< The slot holds a replaced key still used by a handshake */
+} slot_state_t;
+
+/**
+ * @brief A key slot.
+ */
+typedef struct
+{
+    mbedtls_pk_context key; /**< The RSA key */
+    crypto_rsa_t rsa;       /**< The RSA key of the crypto provider */
+    slot_state_t state;     /**< The state of the slot */
+    uint32_t expires;       /**< Key store time the key expires in seconds, set when it becomes active */
+    uint32_t users;         /**< Number of handshakes using the key */
+    uint32_t sequence;      /**< Generation order, the oldest ready key is activated first */
+} key_slot_t;
+
+/* Private macro -------------------------------------------------------------*/
+
+constexpr int RSA_SIZE{256};                          /**< RSA Size */
+constexpr int EXPONENT{65537};                        /**< Exponent */
+constexpr size_t KEY_DER_SIZE{1232};                  /**< Max DER Size of a RSA-2048 Private Key */
+constexpr size_t KEY_POOL_DEPTH{2};                   /**< Number of ready keys to keep */
+constexpr size_t KEY_SLOTS{KEY_POOL_DEPTH + 2};       /**< Active + Ready + Retired */
+constexpr uint32_t KEY_LIFETIME{30UL * 24 * 60 * 60}; /**< RSA Key Lifetime in seconds (30 days) */
+constexpr size_t WORKER_STACK_SIZE{8192};             /**< Stack Size of the worker thread */
+constexpr size_t WORKER_PRIORITY{1};                  /**< Priority of the worker thread, just above idle */
+constexpr std::chrono::minutes SYNC_INTERVAL{60};     /**< Interval the key store time is persisted at */
+
+/* Private variables ---------------------------------------------------------*/
+
+static key_slot_t slots[KEY_SLOTS];       /**< The Key Slots */
+static key_slot_t *active{nullptr};       /**< The Active Key Slot */
+static key_slot_t *unsaved{nullptr};      /**< The active key slot until the worker has stored it */
+static bool rotate_requested{false};      /**< Rotate at the next handshake */
+static uint32_t sequence{0};              /**< The Next Generation Number */
+static keymanager_stats_t statistics{};   /**< The Counters */
+
+static std::mutex lock;                   /**< Protects the slots and counters */
+static std::condition_variable wakeup;    /**< Wakes the worker when a slot is freed */
+
+static mbedtls_entropy_context entropy;   /**< Entropy Context of the worker */
+static mbedtls_ctr_drbg_context ctr_drbg; /**< CTR DRBG Context of the worker */
+
+/* Static Assertions ---------------------------------------------------------*/
+
+static_assert(KEY_POOL_DEPTH > 0, "The key pool must hold at least one key");
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* Private user code ---------------------------------------------------------*/
+
+#ifndef ARDUINO
+/**
+ * @brief The entropy source of a seeded build, the seeded stream of hal_random().
+ */
+static int seeded_entropy(void *, unsigned char *output, size_t length)
+{
+    hal_random(output, length);
+    return 0;
+}
+#endif
+
+/**
+ * @brief Releases the key of a slot.
+ *
+ * @param slot The slot.
+ */
+static void clear(key_slot_t *slot)
+{
+    mbedtls_pk_free(&slot->key);
+    mbedtls_pk_init(&slot->key);
+    crypto_rsa_free(&slot->rsa);
+}
+
+/**
+ * @brief Converts the key of a slot to a key of the crypto provider.
+ *
+ * @param slot The slot, it must not be visible to other threads.
+ * @return True if the key was converted, false otherwise.
+ */
+static bool convert(key_slot_t *slot)
+{
+    bool status = false;
+    uint8_t der[KEY_DER_SIZE];
+
+    /* mbedTLS writes the DER at the end of the buffer */
+    int length = mbedtls_pk_write_key_der(&slot->key, der, sizeof(der));
+
+    if (length > 0)
+    {
+        status = crypto_rsa_parse_private(&slot->rsa, der + sizeof(der) - length, length);
+    }
+
+    memset(der, 0, sizeof(der));
+
+    return status;
+}
+
+/**
+ * @brief Generates a RSA-2048 key into the given slot.
+ *
+ * @param slot The slot, it must not be visible to other threads.
+ * @return True if the key was generated, false otherwise.
+ */
+static bool generate(key_slot_t *slot)
+{
+    bool status = false;
+    auto start = std::chrono::steady_clock::now();
+
+    clear(slot);
+
+    if (0 == mbedtls_pk_setup(&slot->key, mbedtls_pk_info_from_type(MBEDTLS_PK_RSA)))
+    {
+        status = (0 == mbedtls_rsa_gen_key(mbedtls_pk_rsa(slot->key), mbedtls_ctr_drbg_random, &ctr_drbg, RSA_SIZE * CHAR_BIT, EXPONENT)) &&
+                 convert(slot);
+    }
+
+    if (status)
+    {
+        uint32_t elapsed = (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+        std::lock_guard<std::mutex> guard(lock);
+        statistics.generated++;
+        statistics.last_gen_ms = elapsed;
+        statistics.total_gen_ms += elapsed;
+        if (elapsed > statistics.max_gen_ms)
+        {
+            statistics.max_gen_ms = elapsed;
+        }
+    }
+
+    return status;
+}
+
+/**
+ * @brief Counts the ready keys and finds a free slot.
+ *
+ * @note The lock must be held.
+ *
+ * @param slot Pointer to store a free slot in, nullptr if there is none.
+ * @return The number of ready or generating keys.
+ */
+static size_t pool_depth(key_slot_t **slot)
+{
+    size_t depth = 0;
+    *slot = nullptr;
+
+    for (key_slot_t &entry : slots)
+    {
+        if ((entry.state == SLOT_READY) || (entry.state == SLOT_GENERATING))
+        {
+            depth++;
+        }
+        else if ((entry.state == SLOT_FREE) && (*slot == nullptr))
+        {
+            *slot = &entry;
+        }
+    }
+
+    return depth;
+}
+
+/**
+ * @brief Writes the active key to the key store.
+ *
+ * @param slot The slot of the active key, it is held by a user count while it is written.
+ */
+static void persist(key_slot_t *slot)
+{
+    /* A failed store only costs a new key on the next boot */
+    (void)keystore_store(KEYSTORE_RSA, &slot->key, slot->expires);
+
+    keymanager_release(&slot->rsa);
+}
+
+/**
+ * @brief The worker thread which stores the active key and keeps the pool of ready keys filled.
+ */
+static void worker(void)
+{
+    memory_task("keygen");
+
+    while (true)
+    {
+        key_slot_t *slot{nullptr};
+        key_slot_t *store{nullptr};
+        bool generating = false;
+
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            generating = wakeup.wait_for(guard, SYNC_INTERVAL, [&slot]
+                                         { return (unsaved != nullptr) || ((pool_depth(&slot) < KEY_POOL_DEPTH) && (slot != nullptr)); });
+
+            if (unsaved != nullptr)
+            {
+                /* A new active key is stored before the next key is generated */
+                store = unsaved;
+                store->users++;
+                unsaved = nullptr;
+                generating = false;
+            }
+            else if (generating)
+            {
+                slot->state = SLOT_GENERATING;
+            }
+        }
+
+        if (store != nullptr)
+        {
+            persist(store);
+            continue;
+        }
+
+        if (!generating)
+        {
+            /* Idle for SYNC_INTERVAL, a reboot only loses the time since now */
+            (void)keystore_sync();
+            continue;
+        }
+
+        bool status = generate(slot);
+        memory_phase(MEMORY_PHASE_KEYGEN);
+
+        std::lock_guard<std::mutex> guard(lock);
+        if (status)
+        {
+            slot->state = SLOT_READY;
+            slot->sequence = sequence++;
+            statistics.pool_depth++;
+        }
+        else
+        {
+            slot->state = SLOT_FREE;
+        }
+    }
+}
+
+/**
+ * @brief Replaces the active key with the oldest ready key.
+ *
+ * @note The lock must be held.
+ */
+static void activate_next(void)
+{
+    key_slot_t *next{nullptr};
+
+    for (key_slot_t &entry : slots)
+    {
+        if ((entry.state == SLOT_READY) && ((next == nullptr) || (entry.sequence < next->sequence)))
+        {
+            next = &entry;
+        }
+    }
+
+    if (next != nullptr)
+    {
+        if (active->users > 0)
+        {
+            active->state = SLOT_RETIRED;
+        }
+        else
+        {
+            clear(active);
+            active->state = SLOT_FREE;
+        }
+
+        next->state = SLOT_ACTIVE;
+        next->expires = keystore_time() + KEY_LIFETIME;
+        active = next;
+        unsaved = next; /**< Stored by the worker, not on the request path */
+        rotate_requested = false;
+        statistics.pool_depth--;
+        statistics.rotations++;
+        wakeup.notify_one();
+    }
+}
+
+/* Exported user code --------------------------------------------------------*/
+
+bool keymanager_init(void)
+{
+    bool status = false;
+
+    for (key_slot_t &entry : slots)
+    {
+        mbedtls_pk_init(&entry.key);
+        crypto_rsa_init(&entry.rsa);
+        entry.state = SLOT_FREE;
+        entry.users = 0;
+    }
+
+    int (*source)(void *, unsigned char *, size_t) = mbedtls_entropy_func;
+
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&ctr_drbg);
+
+#ifndef ARDUINO
+    if (hal_seeded())
+    {
+        source = seeded_entropy;
+    }
+#endif
+
+    if (0 == mbedtls_ctr_drbg_seed(&ctr_drbg, source, &entropy, nullptr, 0))
+    {
+        if (source != mbedtls_entropy_func)
+        {
+            /* A reseed would draw from hal_random() at a time the worker decides, not in the order of the frames */
+            mbedtls_ctr_drbg_set_reseed_interval(&ctr_drbg, INT_MAX);
+        }
+
+        if (keystore_init())
+        {
+            /* Only the first boot, or a boot after the key expired, has to wait for a key */
+            if (keystore_load(KEYSTORE_RSA, &slots[0].key, &slots[0].expires) && convert(&slots[0]))
+            {
+                status = true;
+            }
+            else if (generate(&slots[0]))
+            {
+                slots[0].expires = keystore_time() + KEY_LIFETIME;
+                unsaved = &slots[0];
+                status = true;
+            }
+        }
+    }
+
+    if (status)
+    {
+        slots[0].state = SLOT_ACTIVE;
+        active = &slots[0];
+
+#ifdef ARDUINO
+        esp_pthread_cfg_t cfg = esp_pthread_get_default_config();
+        cfg.stack_size = WORKER_STACK_SIZE;
+        cfg.prio = WORKER_PRIORITY;
+        cfg.thread_name = "keygen";
+        esp_pthread_set_cfg(&cfg);
+#endif
+        std::thread(worker).detach();
+    }
+
+    return status;
+}
+
+crypto_rsa_t *keymanager_acquire(void)
+{
+    crypto_rsa_t *key{nullptr};
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (active != nullptr)
+    {
+        if (rotate_requested || (keystore_time() >= active->expires))
+        {
+            activate_next();
+        }
+
+        active->users++;
+        key = &active->rsa;
+    }
+
+    return key;
+}
+
+void keymanager_release(crypto_rsa_t *key)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    for (key_slot_t &entry : slots)
+    {
+        if ((&entry.rsa == key) && (entry.users > 0))
+        {
+            entry.users--;
+
+            if ((entry.state == SLOT_RETIRED) && (entry.users == 0))
+            {
+                clear(&entry);
+                entry.state = SLOT_FREE;
+                wakeup.notify_one();
+            }
+        }
+    }
+}
+
+void keymanager_rotate(void)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    rotate_requested = true;
+}
+
+void keymanager_stats(keymanager_stats_t *stats)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    *stats = statistics;
+}
@@ -0,0 +1,87 @@
+/**
+ * @file keymanager.h
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @brief
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef KEYMANAGER_H
+#define KEYMANAGER_H
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include "crypto.h"
+
+/* Exported defines ----------------------------------------------------------*/
+
+/* Exported types ------------------------------------------------------------*/
+
+/**
+ * @brief The counters of the key manager.
+ */
+typedef struct
+{
+    uint32_t pool_depth;   /**< Number of generated keys ready to be activated */
+    uint32_t generated;    /**< Number of keys generated since boot */
+    uint32_t rotations;    /**< Number of times the active key was replaced */
+    uint32_t last_gen_ms;  /**< Duration of the last key generation in ms */
+    uint32_t max_gen_ms;   /**< Longest key generation in ms */
+    uint32_t total_gen_ms; /**< Sum of all key generations in ms */
+} keymanager_stats_t;
+
+/* Exported constants --------------------------------------------------------*/
+
+/* Exported macro ------------------------------------------------------------*/
+
+/* Exported functions prototypes ---------------------------------------------*/
+
+/**
+ * @brief Initialize the key manager
+ *
+ * Loads the stored key, or generates one if there is none, and starts the
+ * background task which keeps the pool of ready keys filled. The keys are
+ * converted by the crypto provider, so crypto_init() must have been called.
+ *
+ * @return true if an active key is available
+ * @return false if no key could be loaded or generated
+ */
+bool keymanager_init(void);
+
+/**
+ * @brief Acquire the active server key for a handshake
+ *
+ * If a rotation is due and a ready key exists, the ready key becomes the active
+ * key first. The returned key stays valid until it is released, even if the
+ * active key is rotated in the meantime.
+ *
+ * @return crypto_rsa_t* the key of the crypto provider, nullptr if there is no active key
+ */
+crypto_rsa_t *keymanager_acquire(void);
+
+/**
+ * @brief Release a key returned by keymanager_acquire()
+ *
+ * @param key the key to release
+ */
+void keymanager_release(crypto_rsa_t *key);
+
+/**
+ * @brief Request a rotation of the active key at the next handshake
+ *
+ */
+void keymanager_rotate(void);
+
+/**
+ * @brief Get the counters of the key manager
+ *
+ * @param stats the structure to store the counters in
+ */
+void keymanager_stats(keymanager_stats_t *stats);
+
+#endif /* KEYMANAGER_H */
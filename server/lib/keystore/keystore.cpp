@@ -0,0 +1,426 @@
+/**
+ * @file keystore.cpp
+ * @brief This file contains the implementation of the key store module.
+ *        The key store keeps the server RSA private key in non-volatile storage so it survives a reboot.
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @details The key is stored as a single blob:
+ *
+ *          | magic | version | length | created | expires | DER private key | SHA-256 |
+ *
+ *          The SHA-256 covers the header and the key, so a torn write or a corrupted flash page
+ *          is detected and the key is regenerated. Every entry has its own blob. On target the blobs
+ *          live in the NVS namespace "keystore", in a host build they are written to
+ *          KEYSTORE_DIR/keystore_<entry>.bin.
+ *
+ *          The times are taken from the key store clock, the seconds the server has been running,
+ *          summed over all boots. The ESP32 has no battery backed clock, time() restarts at zero
+ *          with every boot. The clock is kept in the blob "clock", written with every key and by
+ *          keystore_sync(), and continues from the stored value after a reboot. It never runs
+ *          backwards, a key created after the last sync moves it forward when it is loaded.
+ *
+ *          The key manager worker stores and syncs while the main thread loads or stores the identity,
+ *          every exported function holds the lock for the blob buffer and the clock.
+ *
+ *          A host build whose random bytes are seeded (hal_seeded()) reads the key store but never
+ *          writes or erases it: the RSA keys of the key manager and the identity of the kex module are
+ *          derived from the seed then, a replay of the capture generates them again.
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "keystore.h"
+#include "hal.h"
+#include <string.h>
+#include <chrono>
+#include <mutex>
+#include <mbedtls/md.h>
+
+#ifdef ARDUINO
+#include <Preferences.h>
+#else
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* Private define ------------------------------------------------------------*/
+
+#ifndef KEYSTORE_DIR
+#define KEYSTORE_DIR "." /**< The directory of the key store files in a host build */
+#endif
+
+#define KEYSTORE_NAMESPACE "keystore" /**< The NVS namespace */
+#define KEYSTORE_CLOCK "clock"         /**< The name of the clock blob */
+
+/* Private typedef -----------------------------------------------------------*/
+
+/**
+ * @brief The header of the stored key blob.
+ */
+typedef struct
+{
+    uint32_t magic;   /**< KEYSTORE_MAGIC */
+    uint16_t version; /**< KEYSTORE_VERSION */
+    uint16_t length;  /**< Length of the DER encoded key */
+    uint32_t created; /**< Key store time the key was stored in seconds */
+    uint32_t expires; /**< Key store time the key expires in seconds */
+} keystore_header_t;
+
+/**
+ * @brief The blob of the key store clock.
+ */
+typedef struct
+{
+    uint32_t magic;   /**< KEYSTORE_CLOCK_MAGIC */
+    uint32_t seconds; /**< The key store time of the last sync */
+    uint32_t check;   /**< The complement of seconds */
+} keystore_clock_t;
+
+/**
+ * @brief The NVS name and the key type of an entry.
+ */
+typedef struct
+{
+    const char *name;       /**< The name of the entry */
+    mbedtls_pk_type_t type; /**< The type of the stored key */
+} keystore_info_t;
+
+/* Private macro -------------------------------------------------------------*/
+
+constexpr uint32_t KEYSTORE_MAGIC{0x4B455931};       /**< "KEY1" */
+constexpr uint32_t KEYSTORE_CLOCK_MAGIC{0x434C4B31}; /**< "CLK1" */
+constexpr uint16_t KEYSTORE_VERSION{2};              /**< Blob Version, 2 counts in key store time */
+constexpr size_t KEY_DER_SIZE{1232};           /**< Max DER Size of a RSA-2048 Private Key */
+constexpr size_t HASH_SIZE{32};                /**< Hash Size */
+constexpr size_t BLOB_SIZE{sizeof(keystore_header_t) + KEY_DER_SIZE + HASH_SIZE}; /**< Max Blob Size */
+
+/* Private variables ---------------------------------------------------------*/
+
+static uint8_t blob[BLOB_SIZE]{0}; /**< The Blob Buffer */
+
+/* The Entries, indexed by keystore_entry_t */
+static const keystore_info_t entries[] = {
+    {"rsa", MBEDTLS_PK_RSA},
+    {"identity", MBEDTLS_PK_ECKEY},
+};
+
+static uint32_t clock_base{0};                                 /**< The key store time at keystore_init() */
+static std::chrono::steady_clock::time_point clock_start;     /**< The uptime at keystore_init() */
+static std::mutex lock;                                        /**< Protects the blob buffer, the storage and the clock */
+
+#ifdef ARDUINO
+static Preferences preferences; /**< The NVS Handle */
+#endif
+
+/* Static Assertions ---------------------------------------------------------*/
+
+static_assert(sizeof(keystore_header_t) == 16, "The key store header must not contain padding");
+static_assert(sizeof(keystore_clock_t) <= BLOB_SIZE, "The clock is read into the blob buffer");
+static_assert(sizeof(entries) / sizeof(entries[0]) == KEYSTORE_IDENTITY + 1, "Every entry needs a name");
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief Calculates the SHA-256 of the given data.
+ *
+ * @param data Pointer to the data.
+ * @param dlen Length of the data.
+ * @param hash Pointer to the HASH_SIZE bytes output.
+ * @return True if the hash was calculated, false otherwise.
+ */
+static bool blob_hash(const uint8_t *data, size_t dlen, uint8_t *hash)
+{
+    return (0 == mbedtls_md(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), data, dlen, hash));
+}
+
+#ifndef ARDUINO
+/**
+ * @brief Builds the file name of a blob.
+ *
+ * @param name The name of the blob.
+ * @param path Pointer to the output buffer.
+ * @param size The size of the output buffer.
+ */
+static void blob_path(const char *name, char *path, size_t size)
+{
+    snprintf(path, size, "%s/keystore_%s.bin", KEYSTORE_DIR, name);
+}
+#endif
+
+/**
+ * @brief Reads a blob from the non-volatile storage.
+ *
+ * @param name The name of the blob, the name of an entry or KEYSTORE_CLOCK.
+ * @return The length of the blob, 0 if there is none.
+ */
+static size_t blob_read(const char *name)
+{
+#ifdef ARDUINO
+    return preferences.getBytes(name, blob, sizeof(blob));
+#else
+    size_t length = 0;
+    char path[128];
+    blob_path(name, path, sizeof(path));
+    FILE *file = fopen(path, "rb");
+
+    if (file != nullptr)
+    {
+        length = fread(blob, 1, sizeof(blob), file);
+        fclose(file);
+    }
+
+    return length;
+#endif
+}
+
+/**
+ * @brief Writes a blob to the non-volatile storage.
+ *
+ * @param name The name of the blob, the name of an entry or KEYSTORE_CLOCK.
+ * @param length The length of the blob.
+ * @return True if the whole blob was written, false otherwise.
+ */
+static bool blob_write(const char *name, size_t length)
+{
+#ifdef ARDUINO
+    return (length == preferences.putBytes(name, blob, length));
+#else
+    bool status = false;
+    char path[128];
+    char temp[sizeof(path) + 4];
+    blob_path(name, path, sizeof(path));
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+
+    /* The blob is written to a new file only the owner can read and replaces the old one once it is on disk,
+       a crash leaves either the old or the new blob, never a torn one. A temp file of a crash is removed. */
+    (void)unlink(temp);
+    int file = hal_seeded() ? -1 : open(temp, O_CREAT | O_EXCL | O_WRONLY, 0600);
+
+    if (file >= 0)
+    {
+        status = ((ssize_t)length == write(file, blob, length));
+        status = (0 == fsync(file)) && status;
+        status = (0 == close(file)) && status;
+        status = status && (0 == rename(temp, path));
+
+        if (status)
+        {
+            /* The rename is durable once the directory is on disk */
+            int directory = open(KEYSTORE_DIR, O_RDONLY | O_DIRECTORY);
+
+            if (directory >= 0)
+            {
+                (void)fsync(directory);
+                (void)close(directory);
+            }
+        }
+        else
+        {
+            (void)unlink(temp);
+        }
+    }
+
+    return status;
+#endif
+}
+
+/**
+ * @brief Reads the stored key store time.
+ *
+ * @return The time of the last sync, 0 if the clock was never stored or its blob is damaged.
+ */
+static uint32_t clock_read(void)
+{
+    keystore_clock_t clock{};
+
+    if (sizeof(clock) == blob_read(KEYSTORE_CLOCK))
+    {
+        memcpy(&clock, blob, sizeof(clock));
+    }
+
+    memset(blob, 0, sizeof(blob));
+
+    return ((clock.magic == KEYSTORE_CLOCK_MAGIC) && (clock.check == ~clock.seconds)) ? clock.seconds : 0;
+}
+
+/**
+ * @brief Returns the key store time, the lock must be held.
+ *
+ * @return The key store time in seconds.
+ */
+static uint32_t clock_now(void)
+{
+    auto uptime = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - clock_start);
+
+    return clock_base + (uint32_t)uptime.count();
+}
+
+/**
+ * @brief Writes the key store time to the clock blob, the lock must be held.
+ *
+ * @return True if the time was written, false otherwise.
+ */
+static bool clock_write(void)
+{
+    keystore_clock_t clock{KEYSTORE_CLOCK_MAGIC, clock_now(), 0};
+    clock.check = ~clock.seconds;
+
+    memcpy(blob, &clock, sizeof(clock));
+    bool status = blob_write(KEYSTORE_CLOCK, sizeof(clock));
+    memset(blob, 0, sizeof(blob));
+
+    return status;
+}
+
+/**
+ * @brief Moves the key store clock forward to the given time, it never runs backwards. The lock must be held.
+ *
+ * @param seconds The key store time.
+ */
+static void clock_advance(uint32_t seconds)
+{
+    uint32_t now = clock_now();
+
+    if (seconds > now)
+    {
+        clock_base += seconds - now;
+    }
+}
+
+/* Exported user code --------------------------------------------------------*/
+
+bool keystore_init(void)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+#ifdef ARDUINO
+    bool status = preferences.begin(KEYSTORE_NAMESPACE, false);
+#else
+    bool status = true;
+#endif
+
+    /* The uptime restarts with every boot, the key store time continues from the last sync */
+    clock_start = std::chrono::steady_clock::now();
+    clock_base = status ? clock_read() : 0;
+
+    return status;
+}
+
+uint32_t keystore_time(void)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    return clock_now();
+}
+
+bool keystore_sync(void)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    return clock_write();
+}
+
+bool keystore_load(keystore_entry_t entry, mbedtls_pk_context *key, uint32_t *expires)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    bool status = false;
+    keystore_header_t header{};
+    size_t length = blob_read(entries[entry].name);
+
+    if (length > sizeof(header) + HASH_SIZE)
+    {
+        memcpy(&header, blob, sizeof(header));
+
+        if ((header.magic == KEYSTORE_MAGIC) && (header.version == KEYSTORE_VERSION) &&
+            (header.length <= KEY_DER_SIZE) && (length == sizeof(header) + header.length + HASH_SIZE))
+        {
+            uint8_t hash[HASH_SIZE]{0};
+            length -= HASH_SIZE;
+
+            if (blob_hash(blob, length, hash) && (0 == memcmp(hash, blob + length, HASH_SIZE)))
+            {
+                /* A key stored after the last sync, the clock lost the time in between */
+                clock_advance(header.created);
+
+                if (clock_now() < header.expires)
+                {
+                    status = (0 == mbedtls_pk_parse_key(key, blob + sizeof(header), header.length, nullptr, 0));
+
+                    if (status)
+                    {
+                        status = (entries[entry].type == mbedtls_pk_get_type(key));
+                    }
+
+                    if (!status)
+                    {
+                        mbedtls_pk_free(key);
+                        mbedtls_pk_init(key);
+                    }
+                    else if (expires != nullptr)
+                    {
+                        *expires = header.expires;
+                    }
+                }
+            }
+        }
+    }
+
+    memset(blob, 0, sizeof(blob));
+
+    return status;
+}
+
+bool keystore_store(keystore_entry_t entry, mbedtls_pk_context *key, uint32_t expires)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    bool status = false;
+    uint8_t *der = blob + sizeof(keystore_header_t);
+
+    /* The DER is written at the end of the given buffer */
+    int length = mbedtls_pk_write_key_der(key, der, KEY_DER_SIZE);
+
+    if (length > 0)
+    {
+        memmove(der, der + KEY_DER_SIZE - length, length);
+
+        keystore_header_t header{KEYSTORE_MAGIC, KEYSTORE_VERSION, (uint16_t)length, clock_now(), expires};
+        memcpy(blob, &header, sizeof(header));
+
+        size_t size = sizeof(header) + length;
+
+        if (blob_hash(blob, size, blob + size))
+        {
+            status = blob_write(entries[entry].name, size + HASH_SIZE);
+        }
+    }
+
+    memset(blob, 0, sizeof(blob));
+
+    /* The clock on flash is never older than a stored key */
+    return clock_write() && status;
+}
+
+void keystore_erase(keystore_entry_t entry)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+#ifdef ARDUINO
+    preferences.remove(entries[entry].name);
+#else
+    char path[128];
+    blob_path(entries[entry].name, path, sizeof(path));
+
+    if (!hal_seeded())
+    {
+        remove(path);
+    }
+#endif
+}
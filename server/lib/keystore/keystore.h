@@ -0,0 +1,99 @@
+/**
+ * @file keystore.h
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @brief
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef KEYSTORE_H
+#define KEYSTORE_H
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mbedtls/pk.h>
+
+/* Exported defines ----------------------------------------------------------*/
+
+/* Exported types ------------------------------------------------------------*/
+
+/**
+ * @brief The keys held by the key store.
+ */
+typedef enum
+{
+    KEYSTORE_RSA,      /**< The RSA-2048 key of the key transport handshake */
+    KEYSTORE_IDENTITY, /**< The ECDSA P-256 identity key of the ECDH handshake */
+} keystore_entry_t;
+
+/* Exported constants --------------------------------------------------------*/
+
+/* Exported macro ------------------------------------------------------------*/
+
+/* Exported functions prototypes ---------------------------------------------*/
+
+/**
+ * @brief Initialize the key store (NVS on target, a file on the host)
+ *
+ * Continues the key store clock from the time of its last sync.
+ *
+ * @return true if the key store was successfully initialized
+ * @return false if the key store could not be initialized
+ */
+bool keystore_init(void);
+
+/**
+ * @brief Get the key store time
+ *
+ * The seconds the server has been running, summed over all boots. It is persisted, so unlike time()
+ * on a device without a real time clock it does not restart at zero after a reboot.
+ *
+ * @return uint32_t the key store time in seconds
+ */
+uint32_t keystore_time(void);
+
+/**
+ * @brief Persist the key store time
+ *
+ * The time is also persisted with every stored key. A reboot loses the time since the last sync.
+ *
+ * @return true if the time was written
+ * @return false if the time could not be written
+ */
+bool keystore_sync(void);
+
+/**
+ * @brief Load the stored private key
+ *
+ * @param entry the key to load
+ * @param key the context to parse the key into, it must be initialized and empty
+ * @param expires optional pointer to store the expiry time of the key in key store time
+ * @return true if a valid, unexpired key was loaded
+ * @return false if no key exists, the blob is corrupt or the key has expired
+ */
+bool keystore_load(keystore_entry_t entry, mbedtls_pk_context *key, uint32_t *expires = nullptr);
+
+/**
+ * @brief Store a private key
+ *
+ * @param entry the entry to store the key in
+ * @param key the key to store
+ * @param expires the key store time the key expires at
+ * @return true if the key and the key store time were successfully stored
+ * @return false if the key could not be stored
+ */
+bool keystore_store(keystore_entry_t entry, mbedtls_pk_context *key, uint32_t expires);
+
+/**
+ * @brief Erase a stored key
+ *
+ * @param entry the key to erase
+ */
+void keystore_erase(keystore_entry_t entry);
+
+#endif /* KEYSTORE_H */
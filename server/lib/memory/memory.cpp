@@ -0,0 +1,325 @@
+/**
+ * @file memory.cpp
+ * @brief This file contains the implementation of the memory module.
+ *        The memory module keeps the mbedTLS allocations in an arena and reports the memory use.
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @details mbedTLS allocates the bignums of every RSA and ECP operation and the contexts of
+ *          the parsed keys. Through the general heap, these short-lived blocks of many sizes
+ *          are mixed with the long-lived ones and fragment the heap over a long uptime.
+ *
+ *          memory_init() installs an arena of MEMORY_ARENA_SIZE bytes through the platform
+ *          calloc/free hooks of mbedTLS. The arena hands out blocks of a fixed set of size
+ *          classes, each request is rounded up to the next class. A freed block goes onto the
+ *          free list of its class and is handed out again for the next request of that class,
+ *          only a class with an empty free list splits a new block off the unused end of the
+ *          arena. Blocks are never merged or split again, so after the first handshakes and
+ *          key generations the arena layout stays as it is and its use is bounded by the
+ *          highest number of blocks of each class in use at the same time.
+ *
+ *          A request larger than the largest class, or one the full arena cannot serve, is
+ *          passed to the heap and counted as an overflow.
+ *
+ *          The modules mark the end of a phase, e.g. a handshake, with memory_phase(). The
+ *          highest arena use of the phase and the use it left behind are recorded, so memory
+ *          a phase never gives back shows up as a retained use growing from run to run. The
+ *          phases may overlap, e.g. a key generation running during a handshake, so the
+ *          highest use of a phase includes the blocks of all others.
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "memory.h"
+#include <stdlib.h>
+#include <string.h>
+#include <mutex>
+#include <mbedtls/platform.h>
+
+#ifdef ARDUINO
+#include <esp_system.h>
+#include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#endif
+
+/* Private define ------------------------------------------------------------*/
+
+/* Private typedef -----------------------------------------------------------*/
+
+/**
+ * @brief The header in front of every arena block.
+ */
+typedef struct
+{
+    uint32_t index; /**< Size class of the block */
+    uint32_t magic; /**< BLOCK_MAGIC while the block is handed out */
+} block_t;
+
+/**
+ * @brief A watched task.
+ */
+typedef struct
+{
+    const char *name; /**< Name of the task */
+    void *handle;     /**< FreeRTOS handle of the task, nullptr on the host */
+} task_t;
+
+/* Private macro -------------------------------------------------------------*/
+
+constexpr uint32_t BLOCK_MAGIC{0x4d454d41};    /**< Marks a handed out block, "MEMA" */
+constexpr size_t BLOCK_ALIGN{sizeof(block_t)}; /**< Alignment of the blocks and the payloads */
+
+/* The size classes, 1.5 apart so at most a third of a block is wasted */
+constexpr size_t classes[] = {16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096};
+constexpr size_t CLASSES{sizeof(classes) / sizeof(classes[0])}; /**< Number of size classes */
+
+/* Private variables ---------------------------------------------------------*/
+
+alignas(BLOCK_ALIGN) static uint8_t arena[MEMORY_ARENA_SIZE]; /**< The Arena */
+static size_t carved{0};                                      /**< Offset of the unused end of the arena */
+static uint8_t *free_list[CLASSES]{nullptr};                  /**< The free blocks of each class, linked through their payload */
+
+static size_t used{0};          /**< Bytes of the arena in blocks handed out */
+static size_t peak{0};          /**< Highest use since boot */
+static uint32_t allocations{0}; /**< Number of allocations served by the arena */
+static uint32_t overflows{0};   /**< Number of allocations passed to the heap */
+static uint32_t failures{0};    /**< Number of failed allocations */
+
+static size_t phase_high[MEMORY_PHASES]{0};          /**< Highest use since the last reset point of each phase */
+static memory_phase_stats_t phases[MEMORY_PHASES]{}; /**< The recorded phases */
+
+static task_t tasks[MEMORY_TASKS]{}; /**< The watched tasks */
+static size_t task_count{0};         /**< Number of watched tasks */
+
+static std::mutex lock; /**< Protects the arena and the statistics, mbedTLS allocates on several threads */
+
+/* Static Assertions ---------------------------------------------------------*/
+
+static_assert(MEMORY_ARENA_SIZE % BLOCK_ALIGN == 0, "The arena holds whole aligned blocks");
+static_assert(sizeof(block_t) == 8, "The payload follows the header 8-byte aligned");
+static_assert(classes[0] >= sizeof(uint8_t *), "A free block links to the next one through its payload");
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief Finds the smallest class holding the given size.
+ *
+ * @param size The requested size in bytes.
+ * @return The index of the class, CLASSES if the size is larger than all classes.
+ */
+static size_t class_of(size_t size)
+{
+    size_t index = 0;
+
+    while ((index < CLASSES) && (classes[index] < size))
+    {
+        index++;
+    }
+
+    return index;
+}
+
+/**
+ * @brief Takes a block of the given class from its free list or the unused end of the arena.
+ *
+ * @note The lock must be held.
+ *
+ * @return The payload of the block, nullptr if the arena is full.
+ */
+static uint8_t *block_take(size_t index)
+{
+    uint8_t *payload = free_list[index];
+    size_t footprint = sizeof(block_t) + classes[index];
+
+    if (payload != nullptr)
+    {
+        memcpy(&free_list[index], payload, sizeof(uint8_t *));
+    }
+    else if (carved + footprint <= sizeof(arena))
+    {
+        payload = arena + carved + sizeof(block_t);
+        carved += footprint;
+    }
+
+    if (payload != nullptr)
+    {
+        block_t header{(uint32_t)index, BLOCK_MAGIC};
+        memcpy(payload - sizeof(block_t), &header, sizeof(header));
+
+        used += footprint;
+        peak = (used > peak) ? used : peak;
+
+        for (size_t &high : phase_high)
+        {
+            high = (used > high) ? used : high;
+        }
+    }
+
+    return payload;
+}
+
+/**
+ * @brief The calloc of mbedTLS.
+ */
+static void *arena_calloc(size_t count, size_t size)
+{
+    void *memory{nullptr};
+
+    if ((count != 0) && (size != 0) && (count <= SIZE_MAX / size))
+    {
+        size_t index = class_of(count * size);
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+
+            memory = (index < CLASSES) ? block_take(index) : nullptr;
+
+            if (memory != nullptr)
+            {
+                allocations++;
+            }
+            else
+            {
+                overflows++;
+            }
+        }
+
+        if (memory != nullptr)
+        {
+            memset(memory, 0, count * size);
+        }
+        else
+        {
+            memory = calloc(count, size);
+
+            if (memory == nullptr)
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                failures++;
+            }
+        }
+    }
+
+    return memory;
+}
+
+/**
+ * @brief The free of mbedTLS.
+ */
+static void arena_free(void *memory)
+{
+    uint8_t *payload = (uint8_t *)memory;
+
+    if ((payload >= arena) && (payload < arena + sizeof(arena)))
+    {
+        /* The header is read under the lock, a concurrent free of the same block must see the cleared magic */
+        std::lock_guard<std::mutex> guard(lock);
+        block_t header{};
+        memcpy(&header, payload - sizeof(block_t), sizeof(header));
+
+        /* A block freed twice or a pointer into a block is dropped instead of corrupting the free list */
+        if ((header.magic == BLOCK_MAGIC) && (header.index < CLASSES))
+        {
+            header.magic = 0;
+            memcpy(payload - sizeof(block_t), &header, sizeof(header));
+
+            memcpy(payload, &free_list[header.index], sizeof(uint8_t *));
+            free_list[header.index] = payload;
+            used -= sizeof(block_t) + classes[header.index];
+        }
+    }
+    else
+    {
+        free(memory);
+    }
+}
+
+/* Exported user code --------------------------------------------------------*/
+
+bool memory_init(void)
+{
+#if defined(MBEDTLS_PLATFORM_MEMORY)
+    return (0 == mbedtls_platform_set_calloc_free(arena_calloc, arena_free));
+#else
+    (void)arena_calloc;
+    (void)arena_free;
+    return false;
+#endif
+}
+
+void memory_task(const char *name)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (task_count < MEMORY_TASKS)
+    {
+        tasks[task_count].name = name;
+#ifdef ARDUINO
+        tasks[task_count].handle = xTaskGetCurrentTaskHandle();
+#endif
+        task_count++;
+    }
+}
+
+void memory_phase(memory_phase_t phase)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (phase < MEMORY_PHASES)
+    {
+        memory_phase_stats_t &entry = phases[phase];
+
+        entry.runs++;
+        entry.last = phase_high[phase];
+        entry.peak = (entry.last > entry.peak) ? entry.last : entry.peak;
+        entry.retained = used;
+
+        /* The next run starts from the use left behind */
+        phase_high[phase] = used;
+    }
+}
+
+void memory_stats(memory_stats_t *stats)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    stats->arena_size = sizeof(arena);
+    stats->arena_used = used;
+    stats->arena_peak = peak;
+    stats->arena_carved = carved;
+    stats->allocations = allocations;
+    stats->overflows = overflows;
+    stats->failures = failures;
+    memcpy(stats->phases, phases, sizeof(phases));
+
+#ifdef ARDUINO
+    stats->heap_free = esp_get_free_heap_size();
+    stats->heap_min = esp_get_minimum_free_heap_size();
+    stats->heap_largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+#else
+    /* A process has no heap limit of its own, 0 would read as an exhausted heap */
+    stats->heap_free = MEMORY_UNKNOWN;
+    stats->heap_min = MEMORY_UNKNOWN;
+    stats->heap_largest = MEMORY_UNKNOWN;
+#endif
+
+    for (size_t i = 0; i < task_count; i++)
+    {
+        stats->tasks[i].name = tasks[i].name;
+#ifdef ARDUINO
+        /* The stack of an ESP-IDF task is counted in bytes */
+        stats->tasks[i].stack_free = uxTaskGetStackHighWaterMark((TaskHandle_t)tasks[i].handle);
+#else
+        stats->tasks[i].stack_free = MEMORY_UNKNOWN;
+#endif
+    }
+
+    stats->task_count = task_count;
+}
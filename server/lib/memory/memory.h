@@ -0,0 +1,124 @@
+/**
+ * @file memory.h
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @brief
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef MEMORY_H
+#define MEMORY_H
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Exported defines ----------------------------------------------------------*/
+
+#ifndef MEMORY_ARENA_SIZE
+#define MEMORY_ARENA_SIZE 32768 /**< Size of the mbedTLS arena in bytes */
+#endif
+
+#ifndef MEMORY_TASKS
+#define MEMORY_TASKS 8 /**< Number of tasks whose stacks are watched */
+#endif
+
+#define MEMORY_UNKNOWN UINT32_MAX /**< A heap or stack value the platform does not report, e.g. the host */
+
+/* Exported types ------------------------------------------------------------*/
+
+/**
+ * @brief The phases which end in a reset point.
+ */
+typedef enum
+{
+    MEMORY_PHASE_HANDSHAKE, /**< A handshake, successful or not */
+    MEMORY_PHASE_KEYGEN,    /**< The generation of a server key */
+    MEMORY_PHASES,          /**< Number of phases */
+} memory_phase_t;
+
+/**
+ * @brief The arena use of a phase.
+ */
+typedef struct
+{
+    uint32_t runs;     /**< Number of times the phase ended */
+    uint32_t last;     /**< Highest arena use during the last run in bytes */
+    uint32_t peak;     /**< Highest arena use during any run in bytes */
+    uint32_t retained; /**< Arena use left behind by the last run in bytes */
+} memory_phase_stats_t;
+
+/**
+ * @brief The stack of a watched task.
+ */
+typedef struct
+{
+    const char *name;    /**< Name of the task */
+    uint32_t stack_free; /**< Least free stack since the task started in bytes, MEMORY_UNKNOWN on the host */
+} memory_task_stats_t;
+
+/**
+ * @brief The memory statistics.
+ */
+typedef struct
+{
+    uint32_t arena_size;   /**< Size of the arena in bytes */
+    uint32_t arena_used;   /**< Bytes of the arena in blocks handed out */
+    uint32_t arena_peak;   /**< Highest arena_used since boot */
+    uint32_t arena_carved; /**< Bytes of the arena split into blocks, the rest was never used */
+    uint32_t allocations;  /**< Number of allocations served by the arena */
+    uint32_t overflows;    /**< Number of allocations passed to the heap, too large or the arena was full */
+    uint32_t failures;     /**< Number of allocations neither the arena nor the heap could serve */
+    uint32_t heap_free;    /**< Free heap in bytes, MEMORY_UNKNOWN on the host */
+    uint32_t heap_min;     /**< Least free heap since boot in bytes, MEMORY_UNKNOWN on the host */
+    uint32_t heap_largest; /**< Largest free heap block in bytes, MEMORY_UNKNOWN on the host */
+    memory_phase_stats_t phases[MEMORY_PHASES]; /**< The arena use of each phase */
+    memory_task_stats_t tasks[MEMORY_TASKS];    /**< The watched tasks */
+    size_t task_count;                          /**< Number of watched tasks */
+} memory_stats_t;
+
+/* Exported constants --------------------------------------------------------*/
+
+/* Exported macro ------------------------------------------------------------*/
+
+/* Exported functions prototypes ---------------------------------------------*/
+
+/**
+ * @brief Install the arena as the allocator of mbedTLS
+ *
+ * Must be called before any mbedTLS context allocates, i.e. before all other modules are initialized.
+ *
+ * @return true if mbedTLS allocates from the arena
+ * @return false if mbedTLS was built without MBEDTLS_PLATFORM_MEMORY and keeps using the heap
+ */
+bool memory_init(void);
+
+/**
+ * @brief Watch the stack of the calling task
+ *
+ * @param name the name of the task, it must outlive the task
+ */
+void memory_task(const char *name);
+
+/**
+ * @brief Mark the end of a phase
+ *
+ * Records the highest arena use since the previous reset point of the phase and the use the phase left behind.
+ * A retained use which grows from run to run is memory the phase never gave back.
+ *
+ * @param phase the phase which ended
+ */
+void memory_phase(memory_phase_t phase);
+
+/**
+ * @brief Get the memory statistics
+ *
+ * @param stats pointer to store the statistics in
+ */
+void memory_stats(memory_stats_t *stats);
+
+#endif /* MEMORY_H */
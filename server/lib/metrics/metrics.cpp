@@ -0,0 +1,296 @@
+/**
+ * @file metrics.cpp
+ * @brief This file contains the implementation of the metrics module.
+ *        The metrics module measures the latency of the request stages and counts the status codes.
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @details A measurement takes the time with metrics_start() and records it with metrics_stop().
+ *          The time is the CPU cycle counter on the target and the steady clock in us on the host,
+ *          the cycle counter wraps after 17 s at 240 MHz, far longer than any measured operation.
+ *          A stage thread is pinned to its core, so a measurement never mixes the counters of
+ *          both cores.
+ *
+ *          Every latency is added to a log2 histogram in us, next to the count, the sum and the
+ *          maximum. All counters are relaxed atomics, the stages record without a lock and the
+ *          statistics request reads them while they change, each value is exact on its own.
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "metrics.h"
+#include "memory.h"
+#include <string.h>
+#include <stdio.h>
+#include <atomic>
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include <chrono>
+#endif
+
+/* Private define ------------------------------------------------------------*/
+
+/* Private typedef -----------------------------------------------------------*/
+
+/**
+ * @brief The counters of a measurement.
+ */
+typedef struct
+{
+    std::atomic<uint32_t> count;                    /**< Number of measurements */
+    std::atomic<uint64_t> total;                    /**< Sum of the latencies in us */
+    std::atomic<uint32_t> max;                      /**< Highest latency in us */
+    std::atomic<uint32_t> buckets[METRICS_BUCKETS]; /**< The histogram */
+} metric_t;
+
+/* Private macro -------------------------------------------------------------*/
+
+constexpr size_t TASK_NAME_SIZE{8}; /**< Length of a task name on the memory page, zero padded, at most 7 characters */
+
+/* Private variables ---------------------------------------------------------*/
+
+static metric_t metrics[METRICS_COUNT];                     /**< The measurements */
+static std::atomic<uint32_t> statuses[METRICS_STATUSES]{}; /**< The counts of the sent status codes */
+
+/* Static Assertions ---------------------------------------------------------*/
+
+static_assert(sizeof(metrics_summary_t) == 24, "A summary is count (4) | total (8) | max (4) | p50 (4) | p99 (4)");
+static_assert(METRICS_COUNT <= UINT8_MAX, "The latency page starts with the number of measurements");
+static_assert(METRICS_BUCKETS <= 31, "The bucket bounds must fit into 32 bits");
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief Converts the time since start to us.
+ */
+static uint32_t elapsed_us(metrics_time_t start)
+{
+#ifdef ARDUINO
+    static const uint32_t cycles_per_us = ESP.getCpuFreqMHz();
+    return (ESP.getCycleCount() - start) / cycles_per_us;
+#else
+    return metrics_start() - start;
+#endif
+}
+
+/**
+ * @brief Finds the histogram bucket of a latency.
+ */
+static size_t bucket_of(uint32_t us)
+{
+    size_t bucket = (us < 2) ? 0 : (size_t)(31 - __builtin_clz(us));
+
+    return (bucket < METRICS_BUCKETS) ? bucket : METRICS_BUCKETS - 1;
+}
+
+/**
+ * @brief Finds the latency below which the given share of the measurements lie.
+ *
+ * @param metric The measurement.
+ * @param count The number of measurements.
+ * @param max The highest latency.
+ * @param permille The share in 1/1000.
+ * @return The upper bound of the bucket holding the share, at most max.
+ */
+static uint32_t percentile(const metric_t &metric, uint32_t count, uint32_t max, uint32_t permille)
+{
+    uint32_t bound = 0;
+    uint64_t rank = ((uint64_t)count * permille + 999) / 1000;
+    uint64_t cumulative = 0;
+
+    for (size_t i = 0; (i < METRICS_BUCKETS) && (rank > 0); i++)
+    {
+        cumulative += metric.buckets[i].load(std::memory_order_relaxed);
+
+        if (cumulative >= rank)
+        {
+            bound = (uint32_t)((2ULL << i) - 1);
+            break;
+        }
+    }
+
+    return ((bound > max) || (cumulative < rank)) ? max : bound;
+}
+
+/**
+ * @brief Appends a value to a page.
+ *
+ * @return The length of the page after the value.
+ */
+static size_t page_put(uint8_t *data, size_t length, const void *value, size_t size)
+{
+    memcpy(data + length, value, size);
+    return length + size;
+}
+
+/**
+ * @brief Writes the latency page, `count (1) | summaries | statuses (1) | status counts (4 each)`.
+ */
+static size_t page_latency(uint8_t *data, size_t size)
+{
+    size_t length = 0;
+    uint8_t count = METRICS_COUNT;
+    uint8_t codes = METRICS_STATUSES;
+
+    if (size >= 2 + METRICS_COUNT * sizeof(metrics_summary_t) + METRICS_STATUSES * sizeof(uint32_t))
+    {
+        length = page_put(data, length, &count, sizeof(count));
+
+        for (size_t i = 0; i < METRICS_COUNT; i++)
+        {
+            metrics_summary_t summary{};
+            metrics_summary((metrics_id_t)i, &summary);
+            length = page_put(data, length, &summary, sizeof(summary));
+        }
+
+        length = page_put(data, length, &codes, sizeof(codes));
+
+        for (const std::atomic<uint32_t> &entry : statuses)
+        {
+            uint32_t value = entry.load(std::memory_order_relaxed);
+            length = page_put(data, length, &value, sizeof(value));
+        }
+    }
+
+    return length;
+}
+
+/**
+ * @brief Writes the memory page.
+ *
+ * `arena size | used | peak | carved | allocations | overflows | failures | heap free | heap min | heap largest`
+ * (4 each), `phases (1) | runs | last | peak | retained` (4 each per phase) and
+ * `tasks (1) | name (8) | least free stack (4)` per task.
+ */
+static size_t page_memory(uint8_t *data, size_t size)
+{
+    size_t length = 0;
+    memory_stats_t stats{};
+
+    memory_stats(&stats);
+
+    uint8_t phases = MEMORY_PHASES;
+    uint8_t tasks = (uint8_t)stats.task_count;
+    const uint32_t values[] = {stats.arena_size, stats.arena_used, stats.arena_peak, stats.arena_carved,
+                               stats.allocations, stats.overflows, stats.failures,
+                               stats.heap_free, stats.heap_min, stats.heap_largest};
+
+    if (size >= sizeof(values) + 2 + sizeof(stats.phases) + tasks * (TASK_NAME_SIZE + sizeof(uint32_t)))
+    {
+        length = page_put(data, length, values, sizeof(values));
+        length = page_put(data, length, &phases, sizeof(phases));
+        length = page_put(data, length, stats.phases, sizeof(stats.phases));
+        length = page_put(data, length, &tasks, sizeof(tasks));
+
+        for (size_t i = 0; i < stats.task_count; i++)
+        {
+            char name[TASK_NAME_SIZE]{0};
+            snprintf(name, sizeof(name), "%s", stats.tasks[i].name);
+            length = page_put(data, length, name, sizeof(name));
+            length = page_put(data, length, &stats.tasks[i].stack_free, sizeof(uint32_t));
+        }
+    }
+
+    return length;
+}
+
+/**
+ * @brief Writes the histogram page of a measurement, `count (4) | max (4) | buckets (4 each)`.
+ */
+static size_t page_histogram(metrics_id_t id, uint8_t *data, size_t size)
+{
+    size_t length = 0;
+    const metric_t &metric = metrics[id];
+
+    if (size >= (2 + METRICS_BUCKETS) * sizeof(uint32_t))
+    {
+        uint32_t count = metric.count.load(std::memory_order_relaxed);
+        uint32_t max = metric.max.load(std::memory_order_relaxed);
+
+        length = page_put(data, length, &count, sizeof(count));
+        length = page_put(data, length, &max, sizeof(max));
+
+        for (const std::atomic<uint32_t> &bucket : metric.buckets)
+        {
+            uint32_t value = bucket.load(std::memory_order_relaxed);
+            length = page_put(data, length, &value, sizeof(value));
+        }
+    }
+
+    return length;
+}
+
+/* Exported user code --------------------------------------------------------*/
+
+metrics_time_t metrics_start(void)
+{
+#ifdef ARDUINO
+    return ESP.getCycleCount();
+#else
+    return (metrics_time_t)std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+}
+
+void metrics_stop(metrics_id_t id, metrics_time_t start)
+{
+    uint32_t us = elapsed_us(start);
+    metric_t &metric = metrics[id];
+    uint32_t max = metric.max.load(std::memory_order_relaxed);
+
+    metric.count.fetch_add(1, std::memory_order_relaxed);
+    metric.total.fetch_add(us, std::memory_order_relaxed);
+    metric.buckets[bucket_of(us)].fetch_add(1, std::memory_order_relaxed);
+
+    while ((us > max) && !metric.max.compare_exchange_weak(max, us, std::memory_order_relaxed))
+    {
+    }
+}
+
+void metrics_status(uint8_t status)
+{
+    if (status < METRICS_STATUSES)
+    {
+        statuses[status].fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void metrics_summary(metrics_id_t id, metrics_summary_t *summary)
+{
+    const metric_t &metric = metrics[id];
+
+    summary->count = metric.count.load(std::memory_order_relaxed);
+    summary->total = metric.total.load(std::memory_order_relaxed);
+    summary->max = metric.max.load(std::memory_order_relaxed);
+    summary->p50 = percentile(metric, summary->count, summary->max, 500);
+    summary->p99 = percentile(metric, summary->count, summary->max, 990);
+}
+
+size_t metrics_page(uint32_t page, uint8_t *data, size_t size)
+{
+    size_t length = 0;
+
+    if (page == METRICS_PAGE_LATENCY)
+    {
+        length = page_latency(data, size);
+    }
+    else if (page == METRICS_PAGE_MEMORY)
+    {
+        length = page_memory(data, size);
+    }
+    else if (page - METRICS_PAGE_HISTOGRAM < METRICS_COUNT)
+    {
+        length = page_histogram((metrics_id_t)(page - METRICS_PAGE_HISTOGRAM), data, size);
+    }
+
+    return length;
+}
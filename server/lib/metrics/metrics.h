@@ -0,0 +1,120 @@
+/**
+ * @file metrics.h
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @brief
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Exported defines ----------------------------------------------------------*/
+
+/* Exported types ------------------------------------------------------------*/
+
+/**
+ * @brief The measured stages and operations.
+ *
+ * The stages contain the operations, e.g. METRICS_REQUEST includes the HMAC and AES of the request.
+ */
+typedef enum
+{
+    METRICS_SERIAL,      /**< Reading a frame from its first byte to its last, on the receive thread */
+    METRICS_REQUEST,     /**< session_request(), authenticating and decrypting a request */
+    METRICS_HANDSHAKE,   /**< A step of the RSA handshake, the server key or the client key */
+    METRICS_ESTABLISH,   /**< session_establish(), the last step of every handshake */
+    METRICS_RESPONSE,    /**< session_complete(), encrypting and queueing a response */
+    METRICS_HANDLER,     /**< Running a request on the handler thread */
+    METRICS_HMAC,        /**< An HMAC-SHA256 over a frame */
+    METRICS_AES,         /**< An AES-CBC or AES-GCM operation on a record */
+    METRICS_RSA_DECRYPT, /**< A RSA decryption with the server key */
+    METRICS_RSA_ENCRYPT, /**< A RSA encryption with the client key */
+    METRICS_RSA_VERIFY,  /**< A RSA signature verification with the client key */
+    METRICS_COUNT,       /**< Number of measurements */
+} metrics_id_t;
+
+/**
+ * @brief The pages of the statistics request.
+ */
+enum
+{
+    METRICS_PAGE_LATENCY,   /**< The latency summary of every measurement and the status counts */
+    METRICS_PAGE_MEMORY,    /**< The memory statistics */
+    METRICS_PAGE_HISTOGRAM, /**< The histogram of measurement page - METRICS_PAGE_HISTOGRAM */
+};
+
+/**
+ * @brief The latency summary of a measurement, packed as it is sent to the client.
+ *
+ * The percentiles are the upper bounds of their histogram buckets, at most the maximum.
+ */
+typedef struct __attribute__((packed))
+{
+    uint32_t count; /**< Number of measurements */
+    uint64_t total; /**< Sum of the latencies in us */
+    uint32_t max;   /**< Highest latency in us */
+    uint32_t p50;   /**< Median latency in us */
+    uint32_t p99;   /**< 99th percentile latency in us */
+} metrics_summary_t;
+
+typedef uint32_t metrics_time_t; /**< A start time, CPU cycles on the target and us on the host */
+
+/* Exported constants --------------------------------------------------------*/
+
+constexpr size_t METRICS_BUCKETS{24};  /**< Histogram buckets, bucket i counts latencies below 2^(i+1) us */
+constexpr size_t METRICS_STATUSES{16}; /**< Status codes that are counted */
+
+/* Exported macro ------------------------------------------------------------*/
+
+/* Exported functions prototypes ---------------------------------------------*/
+
+/**
+ * @brief Get the start time of a measurement
+ *
+ * @return metrics_time_t the current time
+ */
+metrics_time_t metrics_start(void);
+
+/**
+ * @brief End a measurement
+ *
+ * @param id the measurement
+ * @param start the time returned by metrics_start() on the same thread
+ */
+void metrics_stop(metrics_id_t id, metrics_time_t start);
+
+/**
+ * @brief Count a status code sent to a client
+ *
+ * @param status the status code, codes from METRICS_STATUSES on are not counted
+ */
+void metrics_status(uint8_t status);
+
+/**
+ * @brief Get the latency summary of a measurement
+ *
+ * @param id the measurement
+ * @param summary pointer to store the summary in
+ */
+void metrics_summary(metrics_id_t id, metrics_summary_t *summary);
+
+/**
+ * @brief Write a page of the statistics
+ *
+ * @param page the page, METRICS_PAGE_*
+ * @param data the buffer to write the page to
+ * @param size the size of the buffer
+ * @return size_t the length of the page, 0 if the page is unknown or does not fit
+ */
+size_t metrics_page(uint32_t page, uint8_t *data, size_t size);
+
+#endif /* METRICS_H */
@@ -0,0 +1,165 @@
+/**
+ * @file pipeline.cpp
+ * @brief This file contains the implementation of the pipeline module.
+ *        The pipeline spreads the request processing over both cores of the ESP32.
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @details The stages are connected by bounded lock-free queues with one producer and one consumer:
+ *
+ *          | receive (core 0) | -> | verify, decrypt (core 1) | -> | handler (core 0) | -> | encrypt (core 1) | -> | transmit (core 0) |
+ *
+ *          The receive and transmit stages belong to the communication module. The session, which owns
+ *          all keys, only runs in the Arduino loop on core 1: it verifies and decrypts a request, defers it
+ *          and passes it to the handler thread, and it encrypts the responses the handler thread returns.
+ *          A stage with nothing to do sleeps until it is notified, a busy stage never waits for a lock.
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "pipeline.h"
+#include "queue.h"
+#include "memory.h"
+#include "metrics.h"
+#include <thread>
+
+#ifdef ARDUINO
+#include <esp_pthread.h>
+#endif
+
+/* Private define ------------------------------------------------------------*/
+
+/* Private typedef -----------------------------------------------------------*/
+
+/* Private macro -------------------------------------------------------------*/
+
+constexpr size_t JOB_QUEUE_SIZE{SESSION_WINDOW}; /**< Requests queued for the handler */
+constexpr size_t RESULT_QUEUE_SIZE{4};           /**< Responses queued for the encryption */
+constexpr size_t HANDLER_STACK_SIZE{4096};       /**< Stack Size of the handler thread */
+constexpr size_t HANDLER_PRIORITY{1};            /**< Priority of the handler thread, below the receive and transmit threads */
+constexpr int HANDLER_CORE{0};                   /**< The core of the handler thread, the session runs on the other one */
+constexpr uint32_t HANDLER_WAIT{1000};           /**< Longest sleep in ms of the handler thread, it is notified before */
+
+/* Private variables ---------------------------------------------------------*/
+
+static queue_t<pipeline_job_t, JOB_QUEUE_SIZE> jobs;          /**< Requests for the handler */
+static queue_t<pipeline_result_t, RESULT_QUEUE_SIZE> results; /**< Responses of the handler */
+static event_t wakeup;                                        /**< Notified when a request was queued or a response taken */
+static pipeline_handler_t handle{nullptr};                    /**< The request handler */
+static std::atomic<uint32_t> handled{0};                      /**< Requests handled since boot */
+
+/* Static Assertions ---------------------------------------------------------*/
+
+static_assert(JOB_QUEUE_SIZE >= SESSION_WINDOW, "Every outstanding request must fit in the handler queue");
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief The handler thread, it handles the queued requests in order.
+ */
+static void handler(void)
+{
+    memory_task("handler");
+
+    while (true)
+    {
+        pipeline_job_t *job = jobs.peek();
+        pipeline_result_t *result = (job != nullptr) ? results.acquire() : nullptr;
+
+        if (result == nullptr)
+        {
+            (void)wakeup.wait(HANDLER_WAIT);
+            continue;
+        }
+
+        result->handle = job->handle;
+        result->success = false;
+        result->length = 0;
+
+        metrics_time_t start = metrics_start();
+        handle(job, result);
+        metrics_stop(METRICS_HANDLER, start);
+        jobs.release();
+
+        results.publish();
+        communication_wake(); /**< The response is encrypted by the loop */
+        handled++;
+    }
+}
+
+/* Exported user code --------------------------------------------------------*/
+
+bool pipeline_init(pipeline_handler_t function)
+{
+    bool status = false;
+
+    if ((handle == nullptr) && (function != nullptr))
+    {
+        handle = function;
+
+#ifdef ARDUINO
+        esp_pthread_cfg_t cfg = esp_pthread_get_default_config();
+        cfg.stack_size = HANDLER_STACK_SIZE;
+        cfg.prio = HANDLER_PRIORITY;
+        cfg.thread_name = "handler";
+        cfg.pin_to_core = HANDLER_CORE;
+        esp_pthread_set_cfg(&cfg);
+#endif
+        std::thread(handler).detach();
+
+        status = communication_start();
+    }
+
+    return status;
+}
+
+bool pipeline_submit(const pipeline_job_t *job)
+{
+    pipeline_job_t *entry = jobs.acquire();
+
+    if (entry != nullptr)
+    {
+        *entry = *job;
+        jobs.publish();
+        wakeup.notify();
+    }
+
+    return (entry != nullptr);
+}
+
+size_t pipeline_complete(void)
+{
+    size_t count = 0;
+    pipeline_result_t *result{nullptr};
+
+    while (nullptr != (result = results.peek()))
+    {
+        /* The handle of a request dropped in the meantime is rejected, its window entry may serve another request */
+        (void)session_complete(result->handle, result->success, result->data, result->length);
+        results.release();
+        count++;
+    }
+
+    if (count > 0)
+    {
+        wakeup.notify(); /**< The handler may wait for a free result */
+    }
+
+    return count;
+}
+
+void pipeline_stats(pipeline_stats_t *stats)
+{
+    communication_stats(&stats->frames);
+    stats->job_depth = (uint32_t)jobs.depth();
+    stats->job_max = (uint32_t)jobs.high_water();
+    stats->result_depth = (uint32_t)results.depth();
+    stats->result_max = (uint32_t)results.high_water();
+    stats->handled = handled;
+}
@@ -0,0 +1,108 @@
+/**
+ * @file pipeline.h
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @brief
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include "communication.h"
+#include "session.h"
+
+/* Exported defines ----------------------------------------------------------*/
+
+/* Exported constants --------------------------------------------------------*/
+
+constexpr size_t PIPELINE_RESULT_SIZE{816}; /**< Largest response of the handler stage */
+
+/* Exported types ------------------------------------------------------------*/
+
+/**
+ * @brief A request passed to the handler stage.
+ */
+typedef struct
+{
+    session_handle_t handle; /**< The deferred request */
+    request_t request;       /**< The request type */
+    size_t capacity;         /**< The longest response the session can take */
+    uint32_t argument;       /**< The first 4 bytes of the request arguments, 0 if there are none */
+} pipeline_job_t;
+
+/**
+ * @brief The response of the handler stage.
+ */
+typedef struct
+{
+    session_handle_t handle;            /**< The deferred request */
+    bool success;                       /**< The request succeeded */
+    size_t length;                      /**< The length of the response data */
+    uint8_t data[PIPELINE_RESULT_SIZE]; /**< The response data */
+} pipeline_result_t;
+
+/**
+ * @brief The handler of the requests, it runs on the handler thread.
+ */
+typedef void (*pipeline_handler_t)(const pipeline_job_t *job, pipeline_result_t *result);
+
+/**
+ * @brief The queue depths of all pipeline stages.
+ */
+typedef struct
+{
+    communication_stats_t frames; /**< The receive and transmit stages */
+    uint32_t job_depth;           /**< Requests waiting for the handler */
+    uint32_t job_max;             /**< Highest number of requests waiting for the handler */
+    uint32_t result_depth;        /**< Responses waiting to be encrypted */
+    uint32_t result_max;          /**< Highest number of responses waiting to be encrypted */
+    uint32_t handled;             /**< Requests handled since boot */
+} pipeline_stats_t;
+
+/* Exported macro ------------------------------------------------------------*/
+
+/* Exported functions prototypes ---------------------------------------------*/
+
+/**
+ * @brief Start the pipeline stages
+ *
+ * Starts the handler thread and the receive and transmit stages of the communication module.
+ *
+ * @param handler the function handling the requests
+ * @return true if the stages were started
+ * @return false if the pipeline was already started
+ */
+bool pipeline_init(pipeline_handler_t handler);
+
+/**
+ * @brief Pass a deferred request to the handler stage
+ *
+ * @param job the request
+ * @return true if the request was queued
+ * @return false if the handler queue is full
+ */
+bool pipeline_submit(const pipeline_job_t *job);
+
+/**
+ * @brief Encrypt and send the responses of the handler stage
+ *
+ * @return size_t the number of responses sent
+ */
+size_t pipeline_complete(void);
+
+/**
+ * @brief Get the queue depths of all pipeline stages
+ *
+ * @param stats pointer to store the queue depths in
+ */
+void pipeline_stats(pipeline_stats_t *stats);
+
+#endif /* PIPELINE_H */
@@ -0,0 +1,113 @@
+/**
+ * @file pool.h
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @brief
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+/* Exported defines ----------------------------------------------------------*/
+
+/* Exported types ------------------------------------------------------------*/
+
+/**
+ * @brief A fixed pool of pre-allocated entries, shared by any number of threads.
+ *
+ * The free entries are kept in a bitmap, acquire() and release() flip one bit with a
+ * compare-and-swap, so no thread ever waits for a lock. An entry belongs to exactly one
+ * owner at a time and is handed on by its pointer, it is never copied.
+ *
+ * @tparam T the type of the entries
+ * @tparam N the number of entries, at most 32
+ */
+template <typename T, size_t N>
+class pool_t
+{
+    static_assert((N > 0) && (N <= 32), "The free entries must fit in the bitmap");
+
+public:
+    /**
+     * @brief Take a free entry
+     *
+     * @return T* the entry, nullptr if all entries are in use
+     */
+    T *acquire(void)
+    {
+        T *entry{nullptr};
+        uint32_t free = free_.load(std::memory_order_relaxed);
+
+        while ((entry == nullptr) && (free != 0))
+        {
+            uint32_t bit = free & (~free + 1); /**< The lowest free entry */
+
+            if (free_.compare_exchange_weak(free, free & ~bit, std::memory_order_acquire, std::memory_order_relaxed))
+            {
+                entry = &entries_[__builtin_ctz(bit)];
+                used(N - __builtin_popcount(free & ~bit));
+            }
+        }
+
+        return entry;
+    }
+
+    /**
+     * @brief Return an entry taken with acquire()
+     */
+    void release(T *entry)
+    {
+        free_.fetch_or(1UL << (entry - entries_), std::memory_order_release);
+    }
+
+    /**
+     * @brief Get the number of entries in use, may be outdated as soon as it is returned
+     */
+    size_t in_use(void) const
+    {
+        return N - __builtin_popcount(free_.load(std::memory_order_relaxed));
+    }
+
+    /**
+     * @brief Get the highest number of entries that were in use at the same time
+     */
+    size_t high_water(void) const
+    {
+        return high_water_.load(std::memory_order_relaxed);
+    }
+
+private:
+    /**
+     * @brief Record the number of entries in use after an acquire()
+     */
+    void used(size_t count)
+    {
+        size_t highest = high_water_.load(std::memory_order_relaxed);
+
+        while ((count > highest) && !high_water_.compare_exchange_weak(highest, count, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    T entries_[N];                                            /**< The entries */
+    std::atomic<uint32_t> free_{(uint32_t)((1ULL << N) - 1)}; /**< One bit per free entry */
+    std::atomic<size_t> high_water_{0};                       /**< Highest number of entries in use */
+};
+
+/* Exported constants --------------------------------------------------------*/
+
+/* Exported macro ------------------------------------------------------------*/
+
+/* Exported functions prototypes ---------------------------------------------*/
+
+#endif /* POOL_H */
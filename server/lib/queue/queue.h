@@ -0,0 +1,162 @@
+/**
+ * @file queue.h
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @brief
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+
+/* Exported defines ----------------------------------------------------------*/
+
+/* Exported types ------------------------------------------------------------*/
+
+/**
+ * @brief A bounded lock-free queue with one producer and one consumer thread.
+ *
+ * The entries are filled and read in place: the producer takes a free entry with acquire(),
+ * fills it and hands it over with publish(), the consumer reads the oldest entry with peek()
+ * and frees it with release(). Each index is only written by one side, so no lock is needed.
+ *
+ * @tparam T the type of the entries
+ * @tparam N the number of entries, a power of two
+ */
+template <typename T, size_t N>
+class queue_t
+{
+    static_assert((N > 0) && ((N & (N - 1)) == 0), "The queue size must be a power of two");
+
+public:
+    /**
+     * @brief Take the next free entry, to be handed over with publish()
+     *
+     * @return T* the entry, nullptr if the queue is full
+     */
+    T *acquire(void)
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        return (tail - head_.load(std::memory_order_acquire) < N) ? &entries_[tail & (N - 1)] : nullptr;
+    }
+
+    /**
+     * @brief Hand the entry returned by acquire() over to the consumer
+     */
+    void publish(void)
+    {
+        size_t depth = tail_.load(std::memory_order_relaxed) + 1 - head_.load(std::memory_order_relaxed);
+
+        if (depth > high_water_.load(std::memory_order_relaxed))
+        {
+            high_water_.store(depth, std::memory_order_relaxed);
+        }
+
+        tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    /**
+     * @brief Get the oldest entry, to be freed with release()
+     *
+     * @return T* the entry, nullptr if the queue is empty
+     */
+    T *peek(void)
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        return (head != tail_.load(std::memory_order_acquire)) ? &entries_[head & (N - 1)] : nullptr;
+    }
+
+    /**
+     * @brief Free the entry returned by peek()
+     */
+    void release(void)
+    {
+        head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    /**
+     * @brief Get the number of entries waiting, may be outdated as soon as it is returned
+     */
+    size_t depth(void) const
+    {
+        return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+    }
+
+    /**
+     * @brief Get the highest number of entries that were waiting at the same time
+     */
+    size_t high_water(void) const
+    {
+        return high_water_.load(std::memory_order_relaxed);
+    }
+
+private:
+    T entries_[N];                       /**< The entries */
+    std::atomic<size_t> head_{0};        /**< Index of the oldest entry, written by the consumer */
+    std::atomic<size_t> tail_{0};        /**< Index of the next free entry, written by the producer */
+    std::atomic<size_t> high_water_{0};  /**< Highest depth, written by the producer */
+};
+
+/**
+ * @brief Wakes a thread waiting for the other side of a queue.
+ *
+ * A notification is kept until the waiting thread has seen it, so a notify() just before
+ * wait() is not lost. A thread waiting for an event sleeps until it is notified, it does
+ * not poll the queue.
+ */
+class event_t
+{
+public:
+    /**
+     * @brief Wake the waiting thread, or the next one to wait
+     */
+    void notify(void)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            pending_ = true;
+        }
+
+        wakeup_.notify_one();
+    }
+
+    /**
+     * @brief Wait until notify() was called
+     *
+     * @param timeout the longest wait in ms
+     * @return true if notified, false if the wait timed out
+     */
+    bool wait(uint32_t timeout)
+    {
+        std::unique_lock<std::mutex> guard(lock_);
+        bool status = wakeup_.wait_for(guard, std::chrono::milliseconds(timeout), [this]
+                                       { return pending_; });
+        pending_ = false;
+        return status;
+    }
+
+private:
+    std::mutex lock_;                   /**< Protects the pending flag */
+    std::condition_variable wakeup_;    /**< Wakes the waiting thread */
+    bool pending_{false};               /**< notify() was called since the last wait() */
+};
+
+/* Exported constants --------------------------------------------------------*/
+
+/* Exported macro ------------------------------------------------------------*/
+
+/* Exported functions prototypes ---------------------------------------------*/
+
+#endif /* QUEUE_H */
@@ -0,0 +1,211 @@
+/**
+ * @file sampler.cpp
+ * @brief This file contains the implementation of the sampler module.
+ *        The sampler reads the temperature at a fixed rate and keeps a history of the readings.
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @details A low priority thread reads the temperature every SAMPLER_PERIOD ms and writes the
+ *          timestamped reading into a ring buffer of SAMPLER_HISTORY samples, overwriting the oldest.
+ *          The sum, minimum and maximum of the samples in the ring are updated with every sample,
+ *          the minimum and maximum are only searched again when the overwritten sample held one of them.
+ *          Requests are answered from the ring, they never wait for the temperature sensor.
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "sampler.h"
+#include "memory.h"
+#include "hal.h"
+#include <math.h>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#ifdef ARDUINO
+#include <esp_pthread.h>
+#endif
+
+/* Private define ------------------------------------------------------------*/
+
+/* Private typedef -----------------------------------------------------------*/
+
+/* Private macro -------------------------------------------------------------*/
+
+constexpr size_t WORKER_STACK_SIZE{4096}; /**< Stack Size of the sampler thread */
+constexpr size_t WORKER_PRIORITY{1};      /**< Priority of the sampler thread, just above idle */
+
+/* Private variables ---------------------------------------------------------*/
+
+static sample_t ring[SAMPLER_HISTORY]; /**< The Sample History */
+static size_t head{0};                 /**< Index of the next sample to write */
+static size_t count{0};                /**< Number of samples in the ring */
+static int32_t sum{0};                 /**< Sum of the samples in the ring */
+static int16_t minimum{0};             /**< Lowest sample in the ring */
+static int16_t maximum{0};             /**< Highest sample in the ring */
+static float (*sensor)(void){nullptr}; /**< The function reading the temperature */
+
+static std::mutex lock; /**< Protects the ring and the aggregates */
+
+/* Static Assertions ---------------------------------------------------------*/
+
+static_assert(sizeof(sample_t) == 6, "Samples are sent as time (4) | value (2)");
+static_assert(SAMPLER_HISTORY <= UINT16_MAX, "The aggregate counts the samples in 16 bits");
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief Searches the minimum and maximum of the samples in the ring.
+ *
+ * @note The lock must be held.
+ */
+static void rescan(void)
+{
+    minimum = INT16_MAX;
+    maximum = INT16_MIN;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        minimum = (ring[i].value < minimum) ? ring[i].value : minimum;
+        maximum = (ring[i].value > maximum) ? ring[i].value : maximum;
+    }
+}
+
+/**
+ * @brief Reads the temperature and writes the sample into the ring.
+ */
+static void sample(void)
+{
+    sample_t entry{hal_millis(), (int16_t)lroundf(sensor() * 100)};
+    bool search = false;
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (count == SAMPLER_HISTORY)
+    {
+        /* The oldest sample is overwritten */
+        sum -= ring[head].value;
+        search = (ring[head].value == minimum) || (ring[head].value == maximum);
+    }
+    else
+    {
+        count++;
+    }
+
+    ring[head] = entry;
+    head = (head + 1) % SAMPLER_HISTORY;
+    sum += entry.value;
+
+    if (search || (count == 1))
+    {
+        rescan();
+    }
+    else
+    {
+        minimum = (entry.value < minimum) ? entry.value : minimum;
+        maximum = (entry.value > maximum) ? entry.value : maximum;
+    }
+}
+
+/**
+ * @brief The sampler thread, it samples at a fixed rate independent of the time a reading takes.
+ */
+static void worker(void)
+{
+    auto next = std::chrono::steady_clock::now();
+
+    memory_task("sampler");
+
+    while (true)
+    {
+        next += std::chrono::milliseconds(SAMPLER_PERIOD);
+        std::this_thread::sleep_until(next);
+        sample();
+    }
+}
+
+/* Exported user code --------------------------------------------------------*/
+
+bool sampler_init(float (*read)(void))
+{
+    bool status = false;
+
+    if ((sensor == nullptr) && (read != nullptr))
+    {
+        sensor = read;
+        sample();
+
+#ifdef ARDUINO
+        esp_pthread_cfg_t cfg = esp_pthread_get_default_config();
+        cfg.stack_size = WORKER_STACK_SIZE;
+        cfg.prio = WORKER_PRIORITY;
+        cfg.thread_name = "sampler";
+        esp_pthread_set_cfg(&cfg);
+#endif
+        std::thread(worker).detach();
+
+        status = true;
+    }
+
+    return status;
+}
+
+bool sampler_latest(sample_t *sample)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (count > 0)
+    {
+        *sample = ring[(head + SAMPLER_HISTORY - 1) % SAMPLER_HISTORY];
+    }
+
+    return (count > 0);
+}
+
+size_t sampler_history(uint32_t since, sample_t *samples, size_t length)
+{
+    size_t copied = 0;
+    std::lock_guard<std::mutex> guard(lock);
+
+    /* The oldest sample is at the head once the ring is full */
+    size_t oldest = (count == SAMPLER_HISTORY) ? head : 0;
+
+    for (size_t i = 0; (i < count) && (copied < length); i++)
+    {
+        const sample_t &entry = ring[(oldest + i) % SAMPLER_HISTORY];
+
+        /* Compared as a difference, so the wrap of the ms counter does not matter. A difference
+           only orders times less than 24 days apart, 0 asks for the whole history at any time */
+        if ((since == 0) || ((int32_t)(entry.time - since) > 0))
+        {
+            samples[copied++] = entry;
+        }
+    }
+
+    return copied;
+}
+
+void sampler_aggregate(sampler_aggregate_t *aggregate)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    *aggregate = {};
+
+    if (count > 0)
+    {
+        size_t oldest = (count == SAMPLER_HISTORY) ? head : 0;
+
+        aggregate->first = ring[oldest].time;
+        aggregate->last = ring[(head + SAMPLER_HISTORY - 1) % SAMPLER_HISTORY].time;
+        aggregate->count = (uint16_t)count;
+        aggregate->min = minimum;
+        aggregate->max = maximum;
+        aggregate->mean = (int16_t)(sum / (int32_t)count);
+    }
+}
@@ -0,0 +1,92 @@
+/**
+ * @file sampler.h
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @brief
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Exported defines ----------------------------------------------------------*/
+
+/* Exported types ------------------------------------------------------------*/
+
+/**
+ * @brief A timestamped temperature reading, packed as it is sent to the client.
+ */
+typedef struct __attribute__((packed))
+{
+    uint32_t time; /**< Time of the reading in ms since boot */
+    int16_t value; /**< Temperature in hundredths of a degree */
+} sample_t;
+
+/**
+ * @brief The rolling aggregates over the samples in the history, packed as they are sent to the client.
+ */
+typedef struct __attribute__((packed))
+{
+    uint32_t first; /**< Time of the oldest sample in ms */
+    uint32_t last;  /**< Time of the latest sample in ms */
+    uint16_t count; /**< Number of samples */
+    int16_t min;    /**< Lowest temperature in hundredths of a degree */
+    int16_t max;    /**< Highest temperature in hundredths of a degree */
+    int16_t mean;   /**< Mean temperature in hundredths of a degree */
+} sampler_aggregate_t;
+
+/* Exported constants --------------------------------------------------------*/
+
+constexpr uint32_t SAMPLER_PERIOD{1000}; /**< Sample period in ms */
+constexpr size_t SAMPLER_HISTORY{600};   /**< Number of samples kept, 10 minutes */
+
+/* Exported macro ------------------------------------------------------------*/
+
+/* Exported functions prototypes ---------------------------------------------*/
+
+/**
+ * @brief Initialize the sampler
+ *
+ * Takes the first sample and starts the background task which samples every SAMPLER_PERIOD ms.
+ *
+ * @param read the function reading the temperature in degrees
+ * @return true if the sampler was started
+ * @return false if the sampler was already started
+ */
+bool sampler_init(float (*read)(void));
+
+/**
+ * @brief Get the latest sample
+ *
+ * @param sample pointer to store the sample in
+ * @return true if a sample was taken
+ * @return false if the sampler has not been started
+ */
+bool sampler_latest(sample_t *sample);
+
+/**
+ * @brief Copy the samples taken after the given time, oldest first
+ *
+ * @param since only samples taken after this time in ms are copied, 0 for all samples
+ * @param samples the buffer to store the samples in
+ * @param length the number of samples the buffer can hold
+ * @return size_t the number of copied samples
+ */
+size_t sampler_history(uint32_t since, sample_t *samples, size_t length);
+
+/**
+ * @brief Get the rolling aggregates over the samples in the history
+ *
+ * @param aggregate pointer to store the aggregates in
+ */
+void sampler_aggregate(sampler_aggregate_t *aggregate);
+
+#endif /* SAMPLER_H */
@@ -11,25 +11,51 @@
  *          The module also provides functions for reading and writing encrypted data during the session.
  *          The session can be closed using the session_close() function.
  *          The session_request() function is used to receive requests from the client and return the corresponding response.
+ *          Up to SESSION_SLOTS sessions are kept in a fixed table. Each request carries its random session ID in clear in
+ *          front of the ciphertext. The ID is drawn until a keyed permutation, secret to the server, maps it to the
+ *          entry of the session, so the lookup reads a single entry and the ID does not show which one.
+ *          Idle entries expire after KEEP_ALIVE and the least recently used entry is evicted when the table is full.
+ *          With every established session the client receives a ticket. A returning client presents the ticket in
+ *          session_resume() and gets a new session ID and IV for the same key without any RSA operation.
+ *          Instead of the RSA key transport a client can offer an ECDH handshake (X25519 or P-256). The server answers
+ *          in one message with its ephemeral key, the session ID, a ticket and a signature of its identity key, and both
+ *          sides derive the AES key, HMAC key and IV with HKDF salted with the pre-shared secret.
+ *          A client which knows the server key from an earlier handshake can also send its key, proof and establish
+ *          request in a single hybrid message, where RSA only wraps the AES key of the envelope.
+ *          Requests are either a single AES-CBC block with a separate HMAC (legacy) or an AES-256-GCM record of any
+ *          length, sent as FRAME_RECORD. The first valid GCM record switches the session to GCM for good.
+ *          GCM requests carry a request ID, up to SESSION_WINDOW requests can be outstanding and their
+ *          responses, matched by the ID, may be sent in any order.
+ *          GCM sessions can subscribe to temperature pushes, short intervals are batched into one record.
+ *          Requests are decrypted in the pool frame they were received in and every response is built right
+ *          behind the headroom of the record header in a pool frame of its own, encrypted in place and handed
+ *          to the transmit stage, so neither the requests nor the responses are copied.
  *          The session_init() function initializes the session module and sets up the necessary cryptographic contexts.
+ *          All cryptographic operations go through the crypto module, so the provider can be changed without touching
+ *          the protocol. The HMAC contexts of the handshake and of every session are keyed once.
+ *          The server RSA key is owned by the key manager, which loads it from the key store and rotates it in the background.
  *          The session_establish() function establishes a session with the client.
  */
 
 /* Includes ------------------------------------------------------------------*/
 
 #include "communication.h"
+#include "crypto.h"
+#include "hal.h"
+#include "kex.h"
+#include "keymanager.h"
+#include "memory.h"
+#include "metrics.h"
 #include "session.h"
-#include <Arduino.h>
-#include <mbedtls/md.h>
-#include <mbedtls/pk.h>
-#include <mbedtls/rsa.h>
-#include <mbedtls/aes.h>
-#include <mbedtls/entropy.h>
-#include <mbedtls/ctr_drbg.h>
+#include "ticket.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
 /* Private define ------------------------------------------------------------*/
 
 /* Private typedef -----------------------------------------------------------*/
+
 /**
  * @brief The status codes for the session module.
  */
@@ -41,33 +67,124 @@ enum
     STATUS_HASH_ERROR,
     STATUS_BAD_REQUEST,
     STATUS_INVALID_SESSION,
+    STATUS_UNKNOWN_KEY,
+    STATUS_BUSY,
+};
+
+/**
+ * @brief The key transport handshakes, the ECDH handshakes use their kex_mode_t.
+ */
+enum
+{
+    HANDSHAKE_RSA = 0x00,
+    HANDSHAKE_HYBRID = 0x80,
 };
 
+/**
+ * @brief The steps of the RSA handshake, each one is driven by a message of the client.
+ */
+typedef enum
+{
+    HANDSHAKE_IDLE,      /**< No RSA handshake is running */
+    HANDSHAKE_KEYS_SENT, /**< The server key was sent, waiting for the new client key and its signature */
+    HANDSHAKE_VERIFIED,  /**< The client key was verified, waiting for the proof */
+} handshake_state_t;
+
+/**
+ * @brief A temperature subscription of a session.
+ */
+typedef struct
+{
+    uint32_t interval;  /**< Sample interval in ms, 0 if the session is not subscribed */
+    uint16_t threshold; /**< Minimum change to push a sample in hundredths of a degree, 0 to push every sample */
+    uint16_t id;        /**< Request ID of the subscription, echoed in the pushes */
+    uint32_t sampled;   /**< Time of the last sample */
+    uint32_t base;      /**< Time of the first batched sample */
+    int16_t last;       /**< Last pushed sample */
+    uint8_t count;      /**< Number of batched samples */
+    uint8_t batch[32];  /**< Batched samples, time offset (2) | temperature (2) */
+} subscription_t;
+
+/**
+ * @brief An entry of the session table.
+ */
+typedef struct
+{
+    uint64_t id;                   /**< The session ID, 0 if the entry is free */
+    uint32_t accessed;             /**< The last time the session was accessed */
+    crypto_cbc_t enc_ctx;          /**< AES Encryption Context */
+    crypto_cbc_t dec_ctx;          /**< AES Decryption Context */
+    crypto_hmac_t hmac_ctx;        /**< HMAC Context, keyed with the HMAC key of the session */
+    crypto_gcm_t gcm_ctx;          /**< AES-GCM Context of the record layer */
+    uint64_t rx_sequence;          /**< Sequence number of the last accepted record */
+    uint64_t tx_sequence;          /**< Sequence number of the last sent record */
+    bool aead;                     /**< The session uses GCM records */
+    bool closing;                  /**< The session is freed after the current response */
+    subscription_t subscription;   /**< Temperature pushes of the session */
+    uint8_t enc_iv[16];            /**< The Encryption IV */
+    uint8_t dec_iv[16];            /**< The Decryption IV */
+} session_t;
+
+/**
+ * @brief An outstanding request.
+ */
+typedef struct
+{
+    session_t *session; /**< The session of the request, nullptr if the entry is free */
+    uint16_t id;        /**< The request ID chosen by the client */
+    uint8_t generation; /**< Incremented whenever the entry is taken, part of the handle */
+} pending_t;
+
 /* Private macro -------------------------------------------------------------*/
 
 constexpr int AES_SIZE{32};         /**< AES Key Size */
 constexpr int DER_SIZE{294};        /**< DER Size */
 constexpr int RSA_SIZE{256};        /**< RSA Size */
 constexpr int HASH_SIZE{32};        /**< Hash Size */
-constexpr int EXPONENT{65537};      /**< Exponent */
 constexpr int KEEP_ALIVE{60000};    /**< Keep Alive Timer */
+constexpr uint32_t HANDSHAKE_TIMEOUT{5000}; /**< Longest wait in ms for the next message of a RSA handshake */
 constexpr int AES_BLOCK_SIZE{16};   /**< AES Block Size */
+constexpr int SESSION_ID_SIZE{8};   /**< Session ID Size */
+constexpr int RECORD_SIZE{SESSION_ID_SIZE + AES_BLOCK_SIZE}; /**< Session ID + Encrypted Request */
+constexpr int SEQUENCE_SIZE{8};     /**< GCM Record Sequence Number Size */
+constexpr int NONCE_SIZE{12};       /**< GCM Nonce Size */
+constexpr int TAG_SIZE{16};         /**< GCM Tag Size */
+constexpr int RECORD_HEADER_SIZE{SESSION_ID_SIZE + SEQUENCE_SIZE};  /**< Session ID + Sequence Number */
+constexpr int REQUEST_ID_SIZE{2};   /**< Request ID Size of GCM records */
+constexpr int SUBSCRIBE_SIZE{6};    /**< Interval (4) + Threshold (2) */
+constexpr int BAUDRATE_SIZE{4};     /**< Baud Rate of a switch request */
+constexpr int SAMPLE_SIZE{4};       /**< Time Offset (2) + Temperature (2) of a pushed sample */
+constexpr uint32_t PUSH_MIN_INTERVAL{10};  /**< Shortest sample interval in ms */
+constexpr uint32_t PUSH_LATENCY{250};      /**< Longest time in ms a sample is batched */
+constexpr uint32_t PUSH_IDLE{1000};        /**< Time in ms to the next session_publish() without subscriptions */
+constexpr uint32_t DIRECTION_REQUEST{0};  /**< Nonce prefix of client records */
+constexpr uint32_t DIRECTION_RESPONSE{1}; /**< Nonce prefix of server records */
+constexpr int RESUME_SIZE{AES_BLOCK_SIZE + TICKET_SIZE};    /**< Client Nonce + Ticket */
+constexpr int ENVELOPE_SIZE{((DER_SIZE + RSA_SIZE) / AES_BLOCK_SIZE + 1) * AES_BLOCK_SIZE}; /**< Padded Client DER + Signature */
+constexpr int HYBRID_SIZE{RSA_SIZE + ENVELOPE_SIZE};        /**< Wrapped Key + Envelope */
+constexpr size_t SESSION_SLOTS{4};  /**< Number of concurrent sessions */
+constexpr session_handle_t HANDLE_INDEX_MASK{0xFF}; /**< The bits of a handle holding the window entry */
+constexpr int HANDLE_GENERATION_SHIFT{8};           /**< The position of the generation in a handle */
 
 /* Private variables ---------------------------------------------------------*/
 
-static mbedtls_aes_context aes_ctx;         /**< AES Context */
-static mbedtls_md_context_t hmac_ctx;       /**< HMAC Context */
-static mbedtls_pk_context client_ctx;       /**< Client Public Key Context */
-static mbedtls_pk_context server_ctx;       /**< Server Public Key Context */
-static mbedtls_entropy_context entropy;     /**< Entropy Context */
-static mbedtls_ctr_drbg_context ctr_drbg;   /**< CTR DRBG Context */
-
-static uint32_t accessed{0};                        /**< The last time the session was accessed */
-static uint64_t session_id{0};                      /**< The session ID */
-static uint8_t aes_key[AES_SIZE]{0};                /**< The AES Key */
-static uint8_t enc_iv[AES_BLOCK_SIZE]{0};           /**< The Encryption IV */
-static uint8_t dec_iv[AES_BLOCK_SIZE]{0};           /**< The Decryption IV */
-static uint8_t buffer[DER_SIZE + RSA_SIZE] = {0};   /**< The Buffer */
+static crypto_hmac_t hmac_ctx;              /**< HMAC Context of the handshake, keyed with the secret */
+static crypto_rsa_t client_key;             /**< Client Public Key, parsed by the crypto provider */
+static crypto_rsa_t *server_key{nullptr};   /**< Server Key of the running handshake */
+static uint8_t handshake{HANDSHAKE_RSA};    /**< The pending handshake, HANDSHAKE_* or a kex_mode_t */
+static handshake_state_t handshake_state{HANDSHAKE_IDLE}; /**< The step of the running RSA handshake */
+static uint32_t handshake_started{0};       /**< Time the running RSA handshake step was answered */
+static bool handshake_expired{false};       /**< The last RSA handshake was abandoned after HANDSHAKE_TIMEOUT */
+
+static session_t sessions[SESSION_SLOTS];           /**< The Session Table */
+static session_t *current{nullptr};                 /**< The session of the request being handled */
+static pending_t window[SESSION_WINDOW];            /**< The outstanding requests */
+static pending_t *pending{nullptr};                 /**< The request being handled */
+static uint16_t request_id{0};                      /**< The request ID of the last GCM record */
+static size_t arguments{0};                         /**< Length of the arguments of the current GCM request */
+static frame_buffer_t *received{nullptr};           /**< The frame of the request, kept until the next request */
+static uint8_t *buffer{nullptr};                    /**< The payload of the received frame, decrypted in place */
+static uint64_t slot_key{0};                        /**< The key of the permutation from a session ID to its entry */
 
 /* Security Key */
 static const uint8_t secret_key[HASH_SIZE] = {0x29, 0x49, 0xde, 0xc2, 0x3e, 0x1e, 0x34, 0xb5, 0x2d, 0x22, 0xb5,
@@ -76,34 +193,46 @@ static const uint8_t secret_key[HASH_SIZE] = {0x29, 0x49, 0xde, 0xc2, 0x3e, 0x1e
 
 /* Static Assertions ---------------------------------------------------------*/
 
+static_assert(sizeof(session_t::enc_iv) == AES_BLOCK_SIZE, "The IV must be one AES block");
+static_assert(TICKET_KEY_SIZE == AES_SIZE + HASH_SIZE, "A ticket holds the AES and the HMAC key");
+static_assert((AES_SIZE == CRYPTO_KEY_SIZE) && (HASH_SIZE == CRYPTO_HASH_SIZE) && (RSA_SIZE == CRYPTO_RSA_SIZE), "The crypto module uses the same sizes");
+static_assert((NONCE_SIZE == CRYPTO_NONCE_SIZE) && (TAG_SIZE == CRYPTO_TAG_SIZE), "The crypto module uses the same GCM sizes");
+static_assert(NONCE_SIZE == sizeof(uint32_t) + SEQUENCE_SIZE, "The nonce is the direction and the sequence number");
+static_assert(SESSION_WINDOW <= HANDLE_INDEX_MASK, "Every window entry needs a handle");
+static_assert(sizeof(subscription_t::batch) % SAMPLE_SIZE == 0, "The batch holds whole samples");
+static_assert(REQUEST_ID_SIZE == sizeof(pending_t::id), "The request ID is sent as is");
+static_assert(HYBRID_SIZE + HASH_SIZE <= FRAME_MAX_PAYLOAD, "Every handshake message must fit in a frame");
+static_assert(4 * RSA_SIZE <= FRAME_MAX_PAYLOAD, "The RSA proof is decrypted behind itself in the frame");
+static_assert(DER_SIZE + RSA_SIZE <= FRAME_MAX_PAYLOAD, "The client key and signature are decrypted into the response frame");
+static_assert(RECORD_HEADER_SIZE >= AES_BLOCK_SIZE, "A CBC response is encrypted into the headroom of its frame");
+
 /* Private function prototypes -----------------------------------------------*/
 
+static size_t record_capacity(void);
+
 /* Private user code ---------------------------------------------------------*/
 
 
 /**
- * @brief Reads data from the communication channel and verifies its integrity using HMAC.
+ * @brief Verifies the HMAC appended to the received data.
  * 
- * This function reads data from the communication channel into the provided buffer and verifies its integrity
- * using HMAC (Hash-based Message Authentication Code). The function calculates the HMAC of the data using a secret key,
- * and compares it with the HMAC appended to the data. If the HMACs match, the function returns the length of the data
- * without the HMAC. Otherwise, it returns 0 to indicate that the data is not valid.
+ * The function calculates the HMAC of the data with the key of the context and compares it with the HMAC
+ * appended to the data.
  * 
- * @param buf Pointer to the buffer where the data will be stored.
- * @param blen The maximum length of the buffer.
+ * @param ctx The keyed HMAC context to use.
+ * @param buf Pointer to the received data including the HMAC.
+ * @param length The length of the received data including the HMAC.
  * @return The length of the data without the HMAC if the data is valid, 0 otherwise.
  */
-static size_t client_read(uint8_t *buf, size_t blen)
+static size_t hmac_check(crypto_hmac_t *ctx, const uint8_t *buf, size_t length)
 {
-    size_t length = communication_read(buf, blen);
-
     if (length > HASH_SIZE)
     {
         length -= HASH_SIZE;
         uint8_t hmac[HASH_SIZE]{0};
-        mbedtls_md_hmac_starts(&hmac_ctx, secret_key, HASH_SIZE);
-        mbedtls_md_hmac_update(&hmac_ctx, buf, length);
-        mbedtls_md_hmac_finish(&hmac_ctx, hmac);
+        metrics_time_t start = metrics_start();
+        crypto_hmac(ctx, buf, length, hmac);
+        metrics_stop(METRICS_HMAC, start);
         if (0 != memcmp(hmac, buf + length, HASH_SIZE))
         {
             length = 0;
@@ -118,340 +247,1552 @@ static size_t client_read(uint8_t *buf, size_t blen)
 }
 
 /**
- * @brief Writes data to the client with HMAC integrity check.
- * 
- * This function calculates the HMAC of the data using the secret key and appends it to the data buffer.
- * The total length of the data buffer is increased by the size of the HMAC.
- * The resulting data is then written to the client using the communication_write function.
+ * @brief Appends the HMAC of the data and writes it to the client.
  * 
- * @param buf Pointer to the data buffer.
- * @param dlen Length of the data in the buffer.
+ * @param ctx The keyed HMAC context to use.
+ * @param frame The frame holding the data at the start of its payload, the HMAC goes into its tailroom.
+ *              The frame is handed to the transmit stage.
+ * @param dlen Length of the data in the frame.
  * @return True if the write operation was successful, false otherwise.
  */
-static bool client_write(uint8_t *buf, size_t dlen)
+static bool hmac_write(crypto_hmac_t *ctx, frame_buffer_t *frame, size_t dlen)
 {
-    mbedtls_md_hmac_starts(&hmac_ctx, secret_key, HASH_SIZE);
-    mbedtls_md_hmac_update(&hmac_ctx, buf, dlen);
-    mbedtls_md_hmac_finish(&hmac_ctx, buf + dlen);
-    dlen += HASH_SIZE;
+    metrics_time_t start = metrics_start();
+    crypto_hmac(ctx, frame->payload, dlen, frame->payload + dlen);
+    metrics_stop(METRICS_HMAC, start);
 
-    return communication_write(buf, dlen);
+    frame->type = FRAME_DATA;
+    frame->length = (uint16_t)(dlen + HASH_SIZE);
+
+    return communication_send(frame);
 }
 
 /**
- * @brief Performs the exchange of public keys between the server and the client.
- * 
- * This function initializes the session ID, initializes the client context, and performs the exchange
- * of public keys using RSA encryption. It encrypts the client's public key and sends it to the server,
- * and then decrypts the server's public key received from the client. Finally, it verifies the decrypted
- * server's public key with the secret key and encrypts the response message "OKAY" using the client's
- * public key and sends it back to the client.
+ * @brief Writes a handshake message to the client with HMAC integrity check.
  * 
- * @note This function assumes that the necessary cryptographic contexts and buffers have been properly
- * initialized before calling this function.
+ * @param frame The frame holding the message at the start of its payload, it is handed to the transmit stage.
+ * @param dlen Length of the message in the frame.
+ * @return True if the write operation was successful, false otherwise.
  */
-static void exchange_public_keys(void)
+static bool client_write(frame_buffer_t *frame, size_t dlen)
 {
-    session_id = 0;
-    size_t olen, length;
-
-    mbedtls_pk_init(&client_ctx);
-    uint8_t cipher[3 * RSA_SIZE + HASH_SIZE] = {0};
+    return hmac_write(&hmac_ctx, frame, dlen);
+}
 
-    assert(0 == mbedtls_pk_parse_public_key(&client_ctx, buffer, DER_SIZE));
-    assert(MBEDTLS_PK_RSA == mbedtls_pk_get_type(&client_ctx));
+/**
+ * @brief Encrypts a message with the client key.
+ * 
+ * @param input The message, at most RSA_SIZE - 11 bytes.
+ * @param ilen Length of the message.
+ * @param output Buffer of RSA_SIZE bytes for the ciphertext.
+ * @return True if the message was encrypted, false otherwise.
+ */
+static bool rsa_encrypt(const uint8_t *input, size_t ilen, uint8_t *output)
+{
+    metrics_time_t start = metrics_start();
+    bool status = crypto_rsa_encrypt(&client_key, input, ilen, output);
 
-    assert(DER_SIZE == mbedtls_pk_write_pubkey_der(&server_ctx, buffer, DER_SIZE));
+    metrics_stop(METRICS_RSA_ENCRYPT, start);
 
-    assert(0 == mbedtls_pk_encrypt(&client_ctx, buffer, DER_SIZE / 2, cipher,
-                                   &olen, RSA_SIZE, mbedtls_ctr_drbg_random, &ctr_drbg));
+    return status;
+}
 
-    assert(0 == mbedtls_pk_encrypt(&client_ctx, buffer + DER_SIZE / 2, DER_SIZE / 2,
-                                   cipher + RSA_SIZE, &olen, RSA_SIZE, mbedtls_ctr_drbg_random, &ctr_drbg));
+/**
+ * @brief Decrypts a block of RSA_SIZE bytes with the server key of the handshake.
+ * 
+ * @param input The ciphertext.
+ * @param output Buffer for the message.
+ * @param olen Pointer to store the length of the message in.
+ * @param osize Size of the output buffer.
+ * @return True if the block was decrypted, false otherwise.
+ */
+static bool rsa_decrypt(const uint8_t *input, uint8_t *output, size_t *olen, size_t osize)
+{
+    metrics_time_t start = metrics_start();
+    bool status = crypto_rsa_decrypt(server_key, input, output, olen, osize);
 
-    length = 2 * RSA_SIZE;
-    assert(client_write(cipher, length));
+    metrics_stop(METRICS_RSA_DECRYPT, start);
 
-    length = client_read(cipher, sizeof(cipher));
-    assert(length == 3 * RSA_SIZE);
+    return status;
+}
 
-    assert(0 == mbedtls_pk_decrypt(&server_ctx, cipher, RSA_SIZE, buffer, &olen, RSA_SIZE,
-                                   mbedtls_ctr_drbg_random, &ctr_drbg));
+/**
+ * @brief Verifies the client's signature of the secret with the client key.
+ * 
+ * @param signature The signature of RSA_SIZE bytes.
+ * @return True if the signature is valid, false otherwise.
+ */
+static bool rsa_verify(const uint8_t *signature)
+{
+    metrics_time_t start = metrics_start();
+    bool status = crypto_rsa_verify(&client_key, secret_key, signature);
 
-    length = olen;
-    assert(0 == mbedtls_pk_decrypt(&server_ctx, cipher + RSA_SIZE, RSA_SIZE, buffer + length,
-                                   &olen, RSA_SIZE, mbedtls_ctr_drbg_random, &ctr_drbg));
+    metrics_stop(METRICS_RSA_VERIFY, start);
 
-    length += olen;
-    assert(0 == mbedtls_pk_decrypt(&server_ctx, cipher + 2 * RSA_SIZE, RSA_SIZE, buffer + length,
-                                   &olen, RSA_SIZE, mbedtls_ctr_drbg_random, &ctr_drbg));
+    return status;
+}
 
-    length += olen;
-    assert(length == (DER_SIZE + RSA_SIZE));
+/**
+ * @brief Maps a session ID to the entry of the session table it can be stored in.
+ * 
+ * The ID is mixed with slot_key by the SplitMix64 finalizer, a permutation of 64 bits, so the entry
+ * cannot be told from the ID without the key.
+ * 
+ * @param id The session ID.
+ * @return The entry of the ID.
+ */
+static session_t *session_slot(uint64_t id)
+{
+    uint64_t z = id ^ slot_key;
 
-    mbedtls_pk_init(&client_ctx);
-    assert(0 == mbedtls_pk_parse_public_key(&client_ctx, buffer, DER_SIZE));
-    assert(MBEDTLS_PK_RSA == mbedtls_pk_get_type(&client_ctx));
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
 
-    assert(0 == mbedtls_pk_verify(&client_ctx, MBEDTLS_MD_SHA256, secret_key, HASH_SIZE, buffer + DER_SIZE, RSA_SIZE));
+    return &sessions[(z ^ (z >> 31)) % SESSION_SLOTS];
+}
 
-    strcpy((char *)buffer, "OKAY");
-    assert(0 == mbedtls_pk_encrypt(&client_ctx, buffer, strlen((const char *)buffer),
-                                   cipher, &olen, RSA_SIZE, mbedtls_ctr_drbg_random, &ctr_drbg));
+/**
+ * @brief Looks up a session by its ID.
+ * 
+ * @param id The session ID.
+ * @return The session, nullptr if there is no session with this ID.
+ */
+static session_t *session_find(uint64_t id)
+{
+    session_t *session = session_slot(id);
 
-    assert(client_write(cipher, RSA_SIZE));
+    return ((id != 0) && (session->id == id) && !session->closing) ? session : nullptr;
 }
 
-/* Exported user code --------------------------------------------------------*/
-
 /**
- * @brief Writes the given data to the session using AES encryption.
+ * @brief Frees a session entry and wipes its keys.
  * 
- * @param res Pointer to the data to be written.
- * @param size Size of the data to be written.
- * @return True if the data was successfully written, false otherwise.
+ * @param session The session to free.
  */
-static bool session_write(const uint8_t *res, size_t size)
+static void session_free(session_t *session)
 {
-    bool status = false;
-    uint8_t response[AES_BLOCK_SIZE] = {0};
-    uint8_t cipher[AES_BLOCK_SIZE + HASH_SIZE] = {0};
-
-    memcpy(response, res, size);
+    session->id = 0;
+    crypto_cbc_free(&session->enc_ctx);
+    crypto_cbc_free(&session->dec_ctx);
+    crypto_cbc_init(&session->enc_ctx);
+    crypto_cbc_init(&session->dec_ctx);
+    memset(session->enc_iv, 0, sizeof(session->enc_iv));
+    memset(session->dec_iv, 0, sizeof(session->dec_iv));
+    crypto_hmac_free(&session->hmac_ctx);
+    crypto_hmac_init(&session->hmac_ctx);
+    crypto_gcm_free(&session->gcm_ctx);
+    crypto_gcm_init(&session->gcm_ctx);
+    session->rx_sequence = 0;
+    session->tx_sequence = 0;
+    session->aead = false;
+    session->closing = false;
+    memset(&session->subscription, 0, sizeof(session->subscription));
+
+    /* Outstanding requests of the session are dropped */
+    for (pending_t &entry : window)
+    {
+        if (entry.session == session)
+        {
+            entry.session = nullptr;
+        }
+    }
 
-    if (0 == mbedtls_aes_crypt_cbc(&aes_ctx, MBEDTLS_AES_ENCRYPT, sizeof(response), enc_iv, response, cipher))
+    if ((pending != nullptr) && (pending->session == nullptr))
     {
-        status = client_write(cipher, AES_BLOCK_SIZE);
+        pending = nullptr;
     }
 
-    return status;
+    if (current == session)
+    {
+        current = nullptr;
+    }
 }
 
-bool session_init(void)
+/**
+ * @brief Returns an entry for a new session.
+ * 
+ * A free or expired entry is preferred, otherwise the least recently used session is evicted.
+ * 
+ * @param now The current time in ms.
+ * @return The freed entry.
+ */
+static session_t *session_allocate(uint32_t now)
 {
-    bool status = false;
+    session_t *session = &sessions[0];
 
-    if (communication_init())
+    for (session_t &entry : sessions)
     {
+        if ((entry.id == 0) || (now - entry.accessed > KEEP_ALIVE))
+        {
+            session = &entry;
+            break;
+        }
 
-        mbedtls_md_init(&hmac_ctx);
-
-        if (0 == mbedtls_md_setup(&hmac_ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1))
+        if (now - entry.accessed > now - session->accessed)
         {
+            session = &entry;
+        }
+    }
 
-            mbedtls_aes_init(&aes_ctx);
+    session_free(session);
 
-            uint8_t initial[AES_SIZE]{0};
-            mbedtls_entropy_init(&entropy);
-            mbedtls_ctr_drbg_init(&ctr_drbg);
-            for (size_t i = 0; i < sizeof(initial); i++)
-            {
-                initial[i] = random(0x100);
-            }
+    return session;
+}
 
-            if (0 == mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, initial, sizeof(initial)))
-            {
-                // RSA-2048
-                mbedtls_pk_init(&server_ctx);
-                if (0 == mbedtls_pk_setup(&server_ctx, mbedtls_pk_info_from_type(MBEDTLS_PK_RSA)))
-                {
-                    status = (0 == mbedtls_rsa_gen_key(mbedtls_pk_rsa(server_ctx), mbedtls_ctr_drbg_random, &ctr_drbg, RSA_SIZE * CHAR_BIT, EXPONENT));
-                }
-            }
-        }
+/**
+ * @brief Abandons the running RSA handshake and releases its keys.
+ */
+static void handshake_reset(void)
+{
+    if (server_key != nullptr)
+    {
+        keymanager_release(server_key);
+        server_key = nullptr;
     }
 
-    return status;
+    crypto_rsa_free(&client_key);
+
+    handshake_state = HANDSHAKE_IDLE;
 }
 
-bool session_establish(void)
+/**
+ * @brief First step of the RSA handshake, the client has sent its public key.
+ * 
+ * Acquires the server key for the handshake and sends it to the client, encrypted with the client key in two blocks.
+ * 
+ * @return STATUS_OKAY if the client was answered, the status to send otherwise.
+ */
+static uint8_t handshake_keys(void)
 {
-    session_id = 0;
-    bool status = false;
-    size_t olen, length;
-    uint8_t cipher[2 * RSA_SIZE]{0};
+    uint8_t status = STATUS_ERROR;
+    metrics_time_t start = metrics_start();
+    frame_buffer_t *reply = communication_allocate();
+    uint8_t *cipher = reply->payload;
 
-    if (0 == mbedtls_pk_decrypt(&server_ctx, buffer, RSA_SIZE, cipher, &olen, RSA_SIZE, mbedtls_ctr_drbg_random, &ctr_drbg))
-    {
-        length = olen;
+    /* Only called while no other RSA handshake is pending, see session_request() */
+    handshake_expired = false;
 
-        if (0 == mbedtls_pk_decrypt(&server_ctx, buffer + RSA_SIZE, RSA_SIZE, cipher + length, &olen, RSA_SIZE, mbedtls_ctr_drbg_random, &ctr_drbg))
-        {
-            length += olen;
+    /* The handshake keeps this key until it is established, even if the key is rotated meanwhile */
+    server_key = keymanager_acquire();
 
-            if (length == RSA_SIZE)
+    if (crypto_rsa_parse_public(&client_key, buffer, DER_SIZE))
+    {
+        if ((server_key != nullptr) &&
+            (DER_SIZE == crypto_rsa_public(server_key, buffer, DER_SIZE)) &&
+            rsa_encrypt(buffer, DER_SIZE / 2, cipher) &&
+            rsa_encrypt(buffer + DER_SIZE / 2, DER_SIZE / 2, cipher + RSA_SIZE))
+        {
+            if (client_write(reply, 2 * RSA_SIZE))
             {
-                if (0 == mbedtls_pk_verify(&client_ctx, MBEDTLS_MD_SHA256, secret_key, HASH_SIZE, cipher, RSA_SIZE))
-                {
-                    uint8_t *ptr{(uint8_t *)&session_id};
-                    for (size_t i = 0; i < sizeof(session_id); i++)
-                    {
-                        ptr[i] = random(1, 0x100);
-                    }
+                handshake_state = HANDSHAKE_KEYS_SENT;
+                handshake_started = hal_millis();
+                status = STATUS_OKAY;
+            }
 
-                    for (size_t i = 0; i < sizeof(enc_iv); i++)
-                    {
-                        enc_iv[i] = random(0x100);
-                    }
-                    memcpy(dec_iv, enc_iv, sizeof(dec_iv));
+            reply = nullptr; /**< Handed to the transmit stage */
+        }
+    }
+    else
+    {
+        status = STATUS_BAD_REQUEST;
+    }
 
-                    for (size_t i = 0; i < sizeof(aes_key); i++)
-                    {
-                        aes_key[i] = random(0x100);
-                    }
+    if (status != STATUS_OKAY)
+    {
+        handshake_reset();
+    }
 
-                    if (0 == mbedtls_aes_setkey_enc(&aes_ctx, aes_key, sizeof(aes_key) * CHAR_BIT))
-                    {
-                        memcpy(buffer, &session_id, sizeof(session_id));
-                        length = sizeof(session_id);
+    communication_free(reply);
+    metrics_stop(METRICS_HANDSHAKE, start);
 
-                        memcpy(buffer + length, enc_iv, sizeof(enc_iv));
-                        length += sizeof(enc_iv);
+    return status;
+}
 
-                        memcpy(buffer + length, aes_key, sizeof(aes_key));
-                        length += sizeof(aes_key);
+/**
+ * @brief Second step of the RSA handshake, the client has sent its new public key and its signature of the secret.
+ * 
+ * Both are RSA encrypted with the server key in three blocks. If the signature is valid, the client gets "OKAY"
+ * encrypted with its new key and can send its proof, the last step.
+ * 
+ * @return STATUS_OKAY if the client was answered, the status to send otherwise.
+ */
+static uint8_t handshake_verify(void)
+{
+    uint8_t status = STATUS_ERROR;
+    metrics_time_t start = metrics_start();
+    size_t olen = 0;
+    size_t length = 0;
+    frame_buffer_t *reply = communication_allocate();
+    uint8_t *plain = reply->payload; /**< Overwritten by the answer once the signature is verified */
+
+    /* The key and the signature are split over three blocks */
+    for (size_t i = 0; i < 3; i++)
+    {
+        if (!rsa_decrypt(buffer + i * RSA_SIZE, plain + length, &olen, DER_SIZE + RSA_SIZE - length))
+        {
+            length = 0;
+            break;
+        }
 
-                        status = true;
-                    }
-                    else
-                    {
-                        session_id = 0;
-                    }
+        length += olen;
+    }
+
+    crypto_rsa_free(&client_key);
+
+    if ((length == DER_SIZE + RSA_SIZE) && crypto_rsa_parse_public(&client_key, plain, DER_SIZE))
+    {
+        if (rsa_verify(plain + DER_SIZE))
+        {
+            if (rsa_encrypt((const uint8_t *)"OKAY", 4, reply->payload))
+            {
+                if (client_write(reply, RSA_SIZE))
+                {
+                    handshake_state = HANDSHAKE_VERIFIED;
+                    handshake_started = hal_millis();
+                    status = STATUS_OKAY;
                 }
+
+                reply = nullptr; /**< Handed to the transmit stage */
             }
         }
+        else
+        {
+            status = STATUS_HASH_ERROR;
+        }
+    }
+    else
+    {
+        status = STATUS_BAD_REQUEST;
     }
 
-    if (!status)
+    if (status != STATUS_OKAY)
     {
-        memset(buffer, 0, sizeof(buffer));
-        length = sizeof(session_id) + sizeof(enc_iv) + sizeof(aes_key);
+        handshake_reset();
     }
 
-    if (0 == mbedtls_pk_encrypt(&client_ctx, buffer, length, cipher, &olen, RSA_SIZE, mbedtls_ctr_drbg_random, &ctr_drbg))
+    communication_free(reply);
+    metrics_stop(METRICS_HANDSHAKE, start);
+
+    return status;
+}
+
+/**
+ * @brief Sets up a session entry for the given keys.
+ * 
+ * Generates a random session ID, unique in the table, and sets the IV, the AES keys and the HMAC key.
+ * The HMAC context is keyed here once, so the requests of the session only hash their own data.
+ * The ID is only stored in the entry once the client has been answered.
+ * 
+ * @param session The session entry.
+ * @param keys The AES key followed by the HMAC key of the session (TICKET_KEY_SIZE bytes).
+ * @param iv The IV of the session, nullptr to generate a random one.
+ * @param nonce The AES_BLOCK_SIZE bytes nonce of a resuming client, nullptr for a new key.
+ * @param session_id Pointer to store the generated session ID in.
+ * @return True if the AES keys were set, false otherwise.
+ */
+static bool session_setup(session_t *session, const uint8_t *keys, const uint8_t *iv, const uint8_t *nonce, uint64_t *session_id)
+{
+    uint8_t *ptr{(uint8_t *)session_id};
+
+    /* About SESSION_SLOTS draws, the entry was freed, so no other session can have the ID */
+    do
     {
-        if (!client_write(cipher, RSA_SIZE))
+        hal_random(ptr, sizeof(*session_id));
+        for (size_t i = 0; i < sizeof(*session_id); i++)
         {
-            status = false;
+            /* No byte of the ID is zero */
+            while (ptr[i] == 0)
+            {
+                hal_random(&ptr[i], 1);
+            }
         }
-    }
+    } while (session_slot(*session_id) != session);
 
-    if (status)
+    if (iv != nullptr)
     {
-        accessed = millis();
+        memcpy(session->enc_iv, iv, sizeof(session->enc_iv));
     }
     else
     {
-        session_id = 0;
+        hal_random(session->enc_iv, sizeof(session->enc_iv));
+    }
+    memcpy(session->dec_iv, session->enc_iv, sizeof(session->dec_iv));
+
+    /* The GCM key is derived, so the AES key is never used in two modes. The fresh session ID and the nonce of a
+       resuming client are part of the info, the sequence numbers start over with a key no other session had. */
+    static const uint8_t label[] = "record";
+    uint8_t info[sizeof(label) - 1 + SESSION_ID_SIZE + AES_BLOCK_SIZE]{0};
+    size_t ilen = sizeof(label) - 1;
+    uint8_t gcm_key[AES_SIZE]{0};
+
+    memcpy(info, label, ilen);
+    memcpy(info + ilen, session_id, SESSION_ID_SIZE);
+    ilen += SESSION_ID_SIZE;
+
+    if (nonce != nullptr)
+    {
+        memcpy(info + ilen, nonce, AES_BLOCK_SIZE);
+        ilen += AES_BLOCK_SIZE;
     }
 
+    bool status = crypto_cbc_setkey(&session->enc_ctx, CRYPTO_ENCRYPT, keys) &&
+                  crypto_cbc_setkey(&session->dec_ctx, CRYPTO_DECRYPT, keys) &&
+                  crypto_hmac_setkey(&session->hmac_ctx, keys + AES_SIZE, HASH_SIZE) &&
+                  kex_derive(keys + AES_SIZE, HASH_SIZE, keys, AES_SIZE, info, ilen, gcm_key, sizeof(gcm_key)) &&
+                  crypto_gcm_setkey(&session->gcm_ctx, gcm_key);
+
+    memset(gcm_key, 0, sizeof(gcm_key));
+
     return status;
 }
 
-void session_close(void)
+/**
+ * @brief Builds the GCM nonce of a record.
+ * 
+ * @param direction DIRECTION_REQUEST or DIRECTION_RESPONSE.
+ * @param sequence The sequence number of the record.
+ * @param nonce Pointer to the NONCE_SIZE bytes output.
+ */
+static void record_nonce(uint32_t direction, uint64_t sequence, uint8_t *nonce)
 {
-    session_id = 0;
+    memcpy(nonce, &direction, sizeof(direction));
+    memcpy(nonce + sizeof(direction), &sequence, SEQUENCE_SIZE);
 }
 
-request_t session_request(void)
+/**
+ * @brief Returns the largest payload a GCM record can carry.
+ */
+static size_t record_capacity(void)
 {
-    uint8_t response = STATUS_OKAY;
-    request_t request = SESSION_ERROR;
+    return FRAME_MAX_PAYLOAD - RECORD_HEADER_SIZE - TAG_SIZE;
+}
 
-    size_t length = client_read(buffer, sizeof(buffer));
+/**
+ * @brief Writes a GCM record to the session.
+ * 
+ * The record `session ID | sequence number | ciphertext | tag` is built around the plaintext in the frame, the
+ * session ID and the sequence number are authenticated as additional data.
+ * 
+ * @param session The session to write to.
+ * @param frame The frame holding the plaintext at payload + RECORD_HEADER_SIZE, it is encrypted in place and
+ *              handed to the transmit stage.
+ * @param dlen Length of the plaintext, at most record_capacity().
+ * @return True if the record was successfully written, false otherwise.
+ */
+static bool record_write(session_t *session, frame_buffer_t *frame, size_t dlen)
+{
+    bool status = false;
+    uint8_t nonce[NONCE_SIZE]{0};
+    uint8_t *record = frame->payload;
+    uint8_t *payload = record + RECORD_HEADER_SIZE;
 
-    if (length == DER_SIZE)
+    if (dlen <= record_capacity())
     {
-        exchange_public_keys();
+        session->tx_sequence++;
+        memcpy(record, &session->id, SESSION_ID_SIZE);
+        memcpy(record + SESSION_ID_SIZE, &session->tx_sequence, SEQUENCE_SIZE);
+        record_nonce(DIRECTION_RESPONSE, session->tx_sequence, nonce);
+
+        metrics_time_t start = metrics_start();
+        bool sealed = crypto_gcm_seal(&session->gcm_ctx, nonce, record, RECORD_HEADER_SIZE, payload, dlen, payload, payload + dlen);
+        metrics_stop(METRICS_AES, start);
 
-        length = client_read(buffer, sizeof(buffer));
+        if (sealed)
+        {
+            frame->type = FRAME_RECORD;
+            frame->length = (uint16_t)(RECORD_HEADER_SIZE + dlen + TAG_SIZE);
+            status = communication_send(frame);
+            frame = nullptr; /**< Handed to the transmit stage */
+        }
     }
 
-    if (length == 2 * RSA_SIZE)
+    communication_free(frame);
+
+    return status;
+}
+
+/**
+ * @brief Opens a GCM record received in the buffer.
+ * 
+ * The sequence number must be larger than the one of the last accepted record, so records cannot be replayed.
+ * The payload is decrypted in place to buffer + RECORD_HEADER_SIZE.
+ * 
+ * @param length The length of the record.
+ * @param command Pointer to store the request in.
+ * @param response Pointer to store the status in.
+ * @return The session if the record was authenticated, nullptr otherwise.
+ */
+static session_t *record_open(size_t length, uint8_t *command, uint8_t *response)
+{
+    uint64_t id{0};
+    uint64_t sequence{0};
+    session_t *session{nullptr};
+
+    if (length > RECORD_HEADER_SIZE + REQUEST_ID_SIZE + TAG_SIZE)
     {
-        request = SESSION_ESTABLISH;
+        memcpy(&id, buffer, SESSION_ID_SIZE);
+        memcpy(&sequence, buffer + SESSION_ID_SIZE, SEQUENCE_SIZE);
+        session = session_find(id);
     }
-    else if (length == AES_BLOCK_SIZE)
+
+    if ((session != nullptr) && (sequence > session->rx_sequence))
     {
-        if (session_id != 0)
-        {
-            uint32_t now = millis();
+        uint8_t nonce[NONCE_SIZE]{0};
+        uint8_t *payload = buffer + RECORD_HEADER_SIZE;
+        size_t plen = length - RECORD_HEADER_SIZE - TAG_SIZE;
 
-            if (now - accessed <= KEEP_ALIVE)
-            {
-                accessed = now;
+        record_nonce(DIRECTION_REQUEST, sequence, nonce);
 
-                uint8_t temp[AES_BLOCK_SIZE]{0};
+        metrics_time_t start = metrics_start();
+        bool opened = crypto_gcm_open(&session->gcm_ctx, nonce, buffer, RECORD_HEADER_SIZE, payload, plen, payload + plen, payload);
+        metrics_stop(METRICS_AES, start);
 
-                if (0 == mbedtls_aes_crypt_cbc(&aes_ctx, MBEDTLS_AES_DECRYPT, AES_BLOCK_SIZE, dec_iv, buffer, temp))
-                {
-                    if (temp[AES_BLOCK_SIZE - 1] == 9)
-                    {
-                        if (0 == memcmp(&session_id, &temp[1], sizeof(session_id)))
-                        {
-                            switch (temp[0])
-                            {
-                            case SESSION_CLOSE:
-                            case SESSION_GET_TEMP:
-                            case SESSION_TOGGLE_LED:
-                                request = (request_t)temp[0];
-                                break;
-                            default:
-                                response = STATUS_BAD_REQUEST;
-                                break;
-                            }
-                        }
-                        else
-                        {
-                            response = STATUS_INVALID_SESSION;
-                        }
-                    }
-                    else
-                    {
-                        response = STATUS_BAD_REQUEST;
-                    }
-                }
-                else
-                {
-                    response = STATUS_ERROR;
-                }
-            }
-            else
-            {
-                session_id = 0;
-                response = STATUS_EXPIRED;
-            }
+        if (opened)
+        {
+            session->rx_sequence = sequence;
+            session->aead = true;
+            *command = payload[0];
+            memcpy(&request_id, payload + 1, REQUEST_ID_SIZE);
+            arguments = plen - 1 - REQUEST_ID_SIZE;
         }
         else
         {
-            response = STATUS_INVALID_SESSION;
+            session = nullptr;
+            *response = STATUS_HASH_ERROR;
         }
     }
     else
     {
-        response = STATUS_HASH_ERROR;
+        session = nullptr;
+        *response = (length > RECORD_HEADER_SIZE + REQUEST_ID_SIZE + TAG_SIZE) ? STATUS_INVALID_SESSION : STATUS_BAD_REQUEST;
     }
 
-    if (request == SESSION_ERROR)
+    return session;
+}
+
+/**
+ * @brief Takes a free entry of the request window.
+ * 
+ * @param session The session of the request.
+ * @return The entry, or nullptr if SESSION_WINDOW requests are outstanding.
+ */
+static pending_t *pending_allocate(session_t *session)
+{
+    pending_t *entry{nullptr};
+
+    for (size_t i = 0; (i < SESSION_WINDOW) && (entry == nullptr); i++)
     {
-        assert(session_write(&response, sizeof(response)));
+        if (window[i].session == nullptr)
+        {
+            entry = &window[i];
+            entry->session = session;
+            entry->id = request_id;
+            entry->generation++;
+        }
     }
 
-    return request;
+    return entry;
 }
 
-bool session_response(bool success, const uint8_t *res, size_t rlen)
+/**
+ * @brief Encrypts or decrypts one AES-CBC block of a legacy session.
+ * 
+ * @param ctx The AES context of the direction.
+ * @param direction CRYPTO_ENCRYPT or CRYPTO_DECRYPT, the direction of the context.
+ * @param iv The IV of the direction, it is updated.
+ * @param input The block.
+ * @param output Buffer of AES_BLOCK_SIZE bytes for the result.
+ * @return True if the block was processed, false otherwise.
+ */
+static bool block_crypt(crypto_cbc_t *ctx, crypto_direction_t direction, uint8_t *iv, const uint8_t *input, uint8_t *output)
 {
-    size_t len = 1;
-    uint8_t response[AES_BLOCK_SIZE] = {0};
+    metrics_time_t start = metrics_start();
+    bool status = crypto_cbc_crypt(ctx, direction, AES_BLOCK_SIZE, iv, input, output);
 
-    response[0] = success ? STATUS_OKAY : STATUS_ERROR;
+    metrics_stop(METRICS_AES, start);
 
-    if ((res != nullptr) && (rlen > 0))
-    {
-        memcpy(response + len, res, rlen);
-        len += rlen;
-    }
+    return status;
+}
 
-    return session_write(response, len);
+/**
+ * @brief Opens a legacy AES-CBC request received in the buffer.
+ * 
+ * @param length The length of the request including the HMAC.
+ * @param command Pointer to store the request in.
+ * @param response Pointer to store the status in.
+ * @return The session if the request was authenticated, nullptr otherwise.
+ */
+static session_t *block_open(size_t length, uint8_t *command, uint8_t *response)
+{
+    uint64_t id{0};
+    memcpy(&id, buffer, sizeof(id));
+    session_t *session = session_find(id);
+
+    if (session != nullptr)
+    {
+        if (RECORD_SIZE == hmac_check(&session->hmac_ctx, buffer, length))
+        {
+            uint8_t temp[AES_BLOCK_SIZE]{0};
+
+            if (session->aead)
+            {
+                /* No way back to CBC once the session uses GCM */
+                *response = STATUS_BAD_REQUEST;
+            }
+            else if (block_crypt(&session->dec_ctx, CRYPTO_DECRYPT, session->dec_iv, buffer + SESSION_ID_SIZE, temp))
+            {
+                if (temp[AES_BLOCK_SIZE - 1] == 9)
+                {
+                    if (0 == memcmp(&session->id, &temp[1], sizeof(session->id)))
+                    {
+                        *command = temp[0];
+                    }
+                    else
+                    {
+                        *response = STATUS_INVALID_SESSION;
+                    }
+                }
+                else
+                {
+                    *response = STATUS_BAD_REQUEST;
+                }
+            }
+            else
+            {
+                *response = STATUS_ERROR;
+            }
+        }
+        else
+        {
+            /* Not authenticated, the session keys must not be used */
+            session = nullptr;
+            *response = STATUS_HASH_ERROR;
+        }
+    }
+    else
+    {
+        *response = STATUS_INVALID_SESSION;
+    }
+
+    return session;
+}
+
+/**
+ * @brief Writes the response in the frame to the session using AES encryption.
+ * 
+ * GCM sessions get a record of any length up to record_capacity(), legacy sessions a single CBC block,
+ * encrypted into the headroom in front of the response.
+ * 
+ * @param session The session to write to.
+ * @param frame The frame holding the response at payload + RECORD_HEADER_SIZE, it is always consumed.
+ * @param size Size of the response.
+ * @return True if the data was successfully written, false otherwise.
+ */
+static bool session_write(session_t *session, frame_buffer_t *frame, size_t size)
+{
+    bool status = false;
+
+    if (session->aead)
+    {
+        status = record_write(session, frame, size);
+        frame = nullptr;
+    }
+    else if (size <= AES_BLOCK_SIZE)
+    {
+        uint8_t *response = frame->payload + RECORD_HEADER_SIZE;
+
+        memset(response + size, 0, AES_BLOCK_SIZE - size);
+
+        if (block_crypt(&session->enc_ctx, CRYPTO_ENCRYPT, session->enc_iv, response, frame->payload))
+        {
+            status = hmac_write(&session->hmac_ctx, frame, AES_BLOCK_SIZE);
+            frame = nullptr;
+        }
+    }
+
+    communication_free(frame);
+
+    return status;
+}
+
+/**
+ * @brief Sends a status code to the client.
+ * 
+ * If the request could be assigned to a session, the status is encrypted for that session.
+ * Otherwise it is sent in clear, protected by the HMAC only.
+ * 
+ * @param session The session of the request, nullptr if it is unknown.
+ * @param response The status code.
+ * @return True if the status was successfully sent, false otherwise.
+ */
+static bool session_status(session_t *session, uint8_t response)
+{
+    bool status = false;
+    frame_buffer_t *reply = communication_allocate();
+
+    metrics_status(response);
+
+    if (session != nullptr)
+    {
+        /* GCM clients match the status to their request by the ID */
+        uint8_t *plain = reply->payload + RECORD_HEADER_SIZE;
+        plain[0] = response;
+        memcpy(plain + sizeof(response), &request_id, REQUEST_ID_SIZE);
+        status = session_write(session, reply, session->aead ? sizeof(response) + REQUEST_ID_SIZE : sizeof(response));
+    }
+    else
+    {
+        reply->payload[0] = response;
+        status = client_write(reply, sizeof(response));
+    }
+
+    return status;
+}
+
+/**
+ * @brief Pushes the batched samples of a subscribed session.
+ * 
+ * The record is `status | request ID of the subscription | time of the first sample (4) | samples`.
+ * 
+ * @param session The subscribed session.
+ * @return True if the samples were pushed, false otherwise.
+ */
+static bool session_push(session_t *session)
+{
+    subscription_t *subscription = &session->subscription;
+    frame_buffer_t *reply = communication_allocate();
+    uint8_t *push = reply->payload + RECORD_HEADER_SIZE;
+    size_t length = 0;
+
+    push[length++] = STATUS_OKAY;
+    memcpy(push + length, &subscription->id, REQUEST_ID_SIZE);
+    length += REQUEST_ID_SIZE;
+    memcpy(push + length, &subscription->base, sizeof(subscription->base));
+    length += sizeof(subscription->base);
+    memcpy(push + length, subscription->batch, subscription->count * SAMPLE_SIZE);
+    length += subscription->count * SAMPLE_SIZE;
+
+    subscription->count = 0;
+
+    return session_write(session, reply, length);
+}
+
+/**
+ * @brief Answers a key transport handshake.
+ * 
+ * If the client proved the secret, a session is allocated and the session ID, IV, AES key and a ticket are sent
+ * to the client, encrypted with its public key. Otherwise the client gets the same sized message of zeros.
+ * 
+ * @param verified True if the signature of the client was verified.
+ * @return True if the session was established, false otherwise.
+ */
+static bool establish_reply(bool verified)
+{
+    bool status = false;
+    size_t length;
+    uint64_t session_id{0};
+    uint8_t keys[TICKET_KEY_SIZE]{0};
+    frame_buffer_t *reply = communication_allocate();
+    session_t *session{nullptr};
+
+    if (verified)
+    {
+        session = session_allocate(hal_millis());
+
+        /* A random AES key, the HMAC key of the session is derived from it, salted with the pre-shared secret */
+        static const uint8_t label[] = "mac";
+        hal_random(keys, AES_SIZE);
+
+        if (kex_derive(secret_key, HASH_SIZE, keys, AES_SIZE, label, sizeof(label) - 1, keys + AES_SIZE, HASH_SIZE) &&
+            session_setup(session, keys, nullptr, nullptr, &session_id))
+        {
+            memcpy(buffer, &session_id, sizeof(session_id));
+            length = sizeof(session_id);
+
+            memcpy(buffer + length, session->enc_iv, sizeof(session->enc_iv));
+            length += sizeof(session->enc_iv);
+
+            memcpy(buffer + length, keys, AES_SIZE);
+            length += AES_SIZE;
+
+            /* The ticket follows the key material, older clients simply ignore it */
+            if (ticket_issue(keys, hal_millis(), buffer + length))
+            {
+                length += TICKET_SIZE;
+            }
+
+            status = true;
+        }
+
+        memset(keys, 0, sizeof(keys));
+    }
+
+    if (!status)
+    {
+        memset(buffer, 0, FRAME_MAX_PAYLOAD);
+        length = sizeof(session_id) + AES_BLOCK_SIZE + AES_SIZE;
+    }
+
+    if (rsa_encrypt(buffer, length, reply->payload))
+    {
+        if (!client_write(reply, RSA_SIZE))
+        {
+            status = false;
+        }
+    }
+    else
+    {
+        status = false;
+        communication_free(reply);
+        (void)session_status(nullptr, STATUS_ERROR);
+    }
+
+    if (status)
+    {
+        session->id = session_id;
+        session->accessed = hal_millis();
+    }
+    else if (session != nullptr)
+    {
+        session_free(session);
+    }
+
+    memset(buffer, 0, FRAME_MAX_PAYLOAD);
+
+    /* The handshake is over, a rotated key can now be freed */
+    if (server_key != nullptr)
+    {
+        keymanager_release(server_key);
+        server_key = nullptr;
+    }
+
+    return status;
+}
+
+/**
+ * @brief Establishes a session with the RSA key transport handshake.
+ * 
+ * The client has sent its signature of the secret, RSA encrypted in two blocks, as the last step after
+ * handshake_keys() and handshake_verify().
+ * 
+ * @return True if the session was established, false otherwise.
+ */
+static bool establish_rsa(void)
+{
+    bool verified = false;
+    size_t olen, length;
+    uint8_t *plain = buffer + 2 * RSA_SIZE; /**< Decrypted behind the ciphertext in the same frame */
+
+    if ((server_key != nullptr) && rsa_decrypt(buffer, plain, &olen, RSA_SIZE))
+    {
+        length = olen;
+
+        if (rsa_decrypt(buffer + RSA_SIZE, plain + length, &olen, RSA_SIZE))
+        {
+            length += olen;
+
+            if (length == RSA_SIZE)
+            {
+                verified = rsa_verify(plain);
+            }
+        }
+    }
+
+    return establish_reply(verified);
+}
+
+/**
+ * @brief Establishes a session with the single-flight hybrid handshake.
+ * 
+ * The client sends `RSA(wrap key | wrap IV) | AES-256-CBC(client DER | signature | padding)`, using the server key
+ * it got in an earlier handshake. One RSA decrypt recovers the wrap key, the envelope holds everything the two
+ * legacy messages carried, and the answer is the same as for the RSA handshake. If the client used an unknown or
+ * rotated server key, it gets `STATUS_UNKNOWN_KEY | server DER` in clear and can retry right away.
+ * 
+ * @return True if the session was established, false otherwise.
+ */
+static bool establish_hybrid(void)
+{
+    bool status = false;
+    size_t olen = 0;
+    uint8_t wrap[AES_SIZE + AES_BLOCK_SIZE]{0}; /**< Larger plaintexts are rejected by the decryption */
+    uint8_t *envelope = buffer + RSA_SIZE;
+    crypto_cbc_t aes_ctx;
+
+    crypto_cbc_init(&aes_ctx);
+
+    /* Only called while no RSA handshake is pending, both need the client context */
+    server_key = keymanager_acquire();
+
+    if ((server_key != nullptr) &&
+        rsa_decrypt(buffer, wrap, &olen, sizeof(wrap)) &&
+        (olen == AES_SIZE + AES_BLOCK_SIZE))
+    {
+        bool verified = false;
+
+        if (crypto_cbc_setkey(&aes_ctx, CRYPTO_DECRYPT, wrap) &&
+            crypto_cbc_crypt(&aes_ctx, CRYPTO_DECRYPT, ENVELOPE_SIZE, wrap + AES_SIZE, envelope, envelope))
+        {
+            if (crypto_rsa_parse_public(&client_key, envelope, DER_SIZE))
+            {
+                verified = rsa_verify(envelope + DER_SIZE);
+            }
+        }
+
+        status = establish_reply(verified);
+    }
+    else
+    {
+        frame_buffer_t *reply = communication_allocate();
+        reply->payload[0] = STATUS_UNKNOWN_KEY;
+
+        if ((server_key != nullptr) && (DER_SIZE == crypto_rsa_public(server_key, reply->payload + 1, DER_SIZE)))
+        {
+            (void)client_write(reply, 1 + DER_SIZE);
+            reply = nullptr; /**< Handed to the transmit stage */
+        }
+
+        communication_free(reply);
+
+        if (server_key != nullptr)
+        {
+            keymanager_release(server_key);
+            server_key = nullptr;
+        }
+    }
+
+    crypto_cbc_free(&aes_ctx);
+    memset(wrap, 0, sizeof(wrap));
+
+    return status;
+}
+
+/**
+ * @brief Establishes a session with the ECDH handshake.
+ * 
+ * The client has sent `mode | ephemeral public key`. The server answers in one message with
+ * `mode | ephemeral public key | session ID | ticket | identity key | signature length | signature`.
+ * The signature covers `mode | client key | server key | session ID`. The AES key, HMAC key and IV are
+ * derived with HKDF from the shared secret, salted with the pre-shared secret.
+ * 
+ * @return True if the session was established, false otherwise.
+ */
+static bool establish_ecdh(void)
+{
+    bool status = false;
+    size_t length = 0;
+    uint64_t session_id{0};
+    session_t *session{nullptr};
+    uint8_t mode = handshake;
+    size_t size = kex_public_size(mode);
+    uint8_t secret[KEX_SECRET_SIZE]{0};
+    uint8_t keys[TICKET_KEY_SIZE + AES_BLOCK_SIZE]{0};
+    uint8_t transcript[1 + 2 * KEX_MAX_PUBLIC_SIZE + SESSION_ID_SIZE]{mode};
+    frame_buffer_t *reply = communication_allocate();
+    uint8_t *message = reply->payload;
+
+    memcpy(transcript + 1, buffer + 1, size);
+
+    if (kex_agree(mode, transcript + 1, transcript + 1 + size, secret) &&
+        kex_derive(secret_key, HASH_SIZE, secret, sizeof(secret), transcript, 1 + 2 * size, keys, sizeof(keys)))
+    {
+        session = session_allocate(hal_millis());
+
+        if (session_setup(session, keys, keys + TICKET_KEY_SIZE, nullptr, &session_id))
+        {
+            memcpy(transcript + 1 + 2 * size, &session_id, SESSION_ID_SIZE);
+
+            message[0] = mode;
+            length = 1;
+
+            memcpy(message + length, transcript + 1 + size, size);
+            length += size;
+
+            memcpy(message + length, &session_id, SESSION_ID_SIZE);
+            length += SESSION_ID_SIZE;
+
+            if (ticket_issue(keys, hal_millis(), message + length) && kex_identity(message + length + TICKET_SIZE))
+            {
+                length += TICKET_SIZE + KEX_IDENTITY_SIZE;
+
+                size_t slen = kex_sign(transcript, 1 + 2 * size + SESSION_ID_SIZE, message + length + 1);
+
+                if (slen > 0)
+                {
+                    message[length] = (uint8_t)slen;
+                    length += 1 + slen;
+
+                    status = client_write(reply, length);
+                    reply = nullptr; /**< Handed to the transmit stage */
+                }
+            }
+        }
+    }
+
+    if (status)
+    {
+        session->id = session_id;
+        session->accessed = hal_millis();
+    }
+    else
+    {
+        if (session != nullptr)
+        {
+            session_free(session);
+        }
+
+        communication_free(reply);
+        reply = nullptr;
+        (void)session_status(nullptr, STATUS_ERROR);
+    }
+
+    memset(secret, 0, sizeof(secret));
+    memset(keys, 0, sizeof(keys));
+    memset(buffer, 0, FRAME_MAX_PAYLOAD);
+
+    return status;
+}
+
+/* Exported user code --------------------------------------------------------*/
+
+bool session_init(void)
+{
+    bool status = false;
+
+    /* The provider passes its self-test before any key is generated */
+    if (communication_init() && crypto_init())
+    {
+        crypto_hmac_init(&hmac_ctx);
+        crypto_rsa_init(&client_key);
+
+        /* All session contexts are set up here, so the request path never allocates */
+        for (session_t &entry : sessions)
+        {
+            entry.id = 0;
+            crypto_cbc_init(&entry.enc_ctx);
+            crypto_cbc_init(&entry.dec_ctx);
+            crypto_gcm_init(&entry.gcm_ctx);
+            crypto_hmac_init(&entry.hmac_ctx);
+        }
+
+        hal_random((uint8_t *)&slot_key, sizeof(slot_key));
+
+        // RSA-2048, loaded from the key store or generated on the first boot
+        status = crypto_hmac_setkey(&hmac_ctx, secret_key, HASH_SIZE) && keymanager_init() &&
+                 ticket_init(crypto_random, nullptr) && kex_init(crypto_random, nullptr);
+    }
+
+    return status;
+}
+
+bool session_establish(void)
+{
+    bool status = false;
+    metrics_time_t start = metrics_start();
+
+    switch (handshake)
+    {
+    case HANDSHAKE_RSA:
+        status = establish_rsa();
+        break;
+    case HANDSHAKE_HYBRID:
+        status = establish_hybrid();
+        break;
+    default:
+        status = establish_ecdh();
+        break;
+    }
+
+    /* Every RSA or hybrid handshake ends here, successful or not, an ECDH handshake leaves a pending one alone */
+    if ((handshake == HANDSHAKE_RSA) || (handshake == HANDSHAKE_HYBRID))
+    {
+        handshake_reset();
+    }
+
+    handshake = HANDSHAKE_RSA;
+    memory_phase(MEMORY_PHASE_HANDSHAKE);
+    metrics_stop(METRICS_ESTABLISH, start);
+
+    return status;
+}
+
+bool session_resume(void)
+{
+    bool status = false;
+    uint64_t session_id{0};
+    uint32_t issued{0};
+    uint8_t keys[TICKET_KEY_SIZE]{0};
+    frame_buffer_t *reply{nullptr};
+    uint32_t now = hal_millis();
+
+    /* buffer holds the client nonce followed by the ticket, which is redeemed here */
+    if (ticket_open(buffer + AES_BLOCK_SIZE, now, keys, &issued))
+    {
+        session_t *session = session_allocate(now);
+
+        /* The client nonce makes the record key of this resumption fresh */
+        if (session_setup(session, keys, nullptr, buffer, &session_id))
+        {
+            /* ID and IV are encrypted with the resumed key, the client nonce serves as IV */
+            uint8_t plain[2 * AES_BLOCK_SIZE]{0};
+            memcpy(plain, &session_id, sizeof(session_id));
+            memcpy(plain + sizeof(session_id), session->enc_iv, AES_BLOCK_SIZE);
+            reply = communication_allocate();
+
+            /* The follow-up ticket keeps the issue time, resuming does not extend the lifetime */
+            if (crypto_cbc_crypt(&session->enc_ctx, CRYPTO_ENCRYPT, sizeof(plain), buffer, plain, reply->payload) &&
+                ticket_issue(keys, issued, reply->payload + sizeof(plain)))
+            {
+                status = client_write(reply, sizeof(plain) + TICKET_SIZE);
+                reply = nullptr; /**< Handed to the transmit stage */
+            }
+        }
+
+        if (status)
+        {
+            session->id = session_id;
+            session->accessed = now;
+        }
+        else
+        {
+            session_free(session);
+        }
+    }
+    else
+    {
+        (void)session_status(nullptr, STATUS_EXPIRED);
+    }
+
+    communication_free(reply);
+    memset(keys, 0, sizeof(keys));
+    memset(buffer, 0, FRAME_MAX_PAYLOAD);
+
+    return status;
+}
+
+void session_close(void)
+{
+    /* The keys are kept until the response to the close request has been sent */
+    if (current != nullptr)
+    {
+        current->closing = true;
+    }
+}
+
+request_t session_request(void)
+{
+    uint8_t type = FRAME_DATA;
+    uint8_t command = SESSION_ERROR;
+    uint8_t response = STATUS_OKAY;
+    request_t request = SESSION_ERROR;
+    session_t *session{nullptr};
+    bool answered = false;
+
+    /* A client that stopped in the middle of a RSA handshake must not hold its keys */
+    if ((handshake_state != HANDSHAKE_IDLE) && (hal_millis() - handshake_started > HANDSHAKE_TIMEOUT))
+    {
+        handshake_reset();
+        handshake_expired = true;
+        memory_phase(MEMORY_PHASE_HANDSHAKE);
+    }
+
+    /* A request that was neither answered nor deferred is dropped */
+    if (pending != nullptr)
+    {
+        pending->session = nullptr;
+        pending = nullptr;
+    }
+
+    current = nullptr;
+    request_id = 0;
+    arguments = 0;
+
+    /* The frame of the previous request is no longer needed, the next one is decrypted in place */
+    communication_free(received);
+    received = communication_receive();
+    buffer = received->payload;
+
+    /* The time spent on the link is measured by the receive thread */
+    metrics_time_t start = metrics_start();
+    type = received->type;
+
+    size_t length = received->length;
+
+    if ((type == FRAME_RECORD) || (length == RECORD_SIZE + HASH_SIZE))
+    {
+        if (type == FRAME_RECORD)
+        {
+            session = record_open(length, &command, &response);
+        }
+        else
+        {
+            session = block_open(length, &command, &response);
+        }
+
+        if (session != nullptr)
+        {
+            uint32_t now = hal_millis();
+
+            if (now - session->accessed <= KEEP_ALIVE)
+            {
+                session->accessed = now;
+
+                /* An authenticated frame proves that the link works at the current baud rate */
+                communication_confirm();
+
+                if (response == STATUS_OKAY)
+                {
+                    switch (command)
+                    {
+                    case SESSION_CLOSE:
+                    case SESSION_GET_TEMP:
+                    case SESSION_TOGGLE_LED:
+                    case SESSION_SUBSCRIBE:
+                    case SESSION_UNSUBSCRIBE:
+                    case SESSION_GET_LATEST:
+                    case SESSION_GET_HISTORY:
+                    case SESSION_GET_AGGREGATE:
+                    case SESSION_SET_BAUD:
+                    case SESSION_GET_STATS:
+                        pending = pending_allocate(session);
+
+                        if (pending != nullptr)
+                        {
+                            request = (request_t)command;
+                            current = session;
+                        }
+                        else
+                        {
+                            response = STATUS_BUSY;
+                        }
+                        break;
+                    default:
+                        response = STATUS_BAD_REQUEST;
+                        break;
+                    }
+                }
+            }
+            else
+            {
+                /* The client is told with its own key, then the entry is freed */
+                response = STATUS_EXPIRED;
+            }
+        }
+    }
+    else
+    {
+        length = hmac_check(&hmac_ctx, buffer, length);
+
+        if (length == DER_SIZE)
+        {
+            /* The handshake of another client keeps the keys until it ends or times out */
+            if (handshake_state == HANDSHAKE_IDLE)
+            {
+                response = handshake_keys();
+                answered = (response == STATUS_OKAY);
+            }
+            else
+            {
+                response = STATUS_BUSY;
+            }
+        }
+        else if (length == 3 * RSA_SIZE)
+        {
+            if (handshake_state == HANDSHAKE_KEYS_SENT)
+            {
+                response = handshake_verify();
+                answered = (response == STATUS_OKAY);
+            }
+            else
+            {
+                response = handshake_expired ? STATUS_EXPIRED : STATUS_BAD_REQUEST;
+            }
+        }
+        else if (length == 2 * RSA_SIZE)
+        {
+            if (handshake_state == HANDSHAKE_VERIFIED)
+            {
+                handshake = HANDSHAKE_RSA;
+                request = SESSION_ESTABLISH;
+            }
+            else
+            {
+                response = handshake_expired ? STATUS_EXPIRED : STATUS_BAD_REQUEST;
+            }
+        }
+        else if (length == HYBRID_SIZE)
+        {
+            if (handshake_state == HANDSHAKE_IDLE)
+            {
+                handshake = HANDSHAKE_HYBRID;
+                request = SESSION_ESTABLISH;
+            }
+            else
+            {
+                response = STATUS_BUSY;
+            }
+        }
+        else if (length == RESUME_SIZE)
+        {
+            request = SESSION_RESUME;
+        }
+        else if ((length > 1) && (length == 1 + kex_public_size(buffer[0])))
+        {
+            handshake = buffer[0];
+            request = SESSION_ESTABLISH;
+        }
+        else if (length > 0)
+        {
+            /* Authenticated but not understood, e.g. an ECDH mode this build does not support */
+            response = STATUS_BAD_REQUEST;
+        }
+        else
+        {
+            response = STATUS_HASH_ERROR;
+        }
+    }
+
+    if ((request == SESSION_ERROR) && !answered)
+    {
+        /* A client that cannot be answered is not worth more than a lost message */
+        (void)session_status(session, response);
+
+        if (response == STATUS_EXPIRED)
+        {
+            session_free(session);
+        }
+    }
+
+    metrics_stop(METRICS_REQUEST, start);
+
+    return request;
+}
+
+bool session_response(bool success, const uint8_t *res, size_t rlen)
+{
+    return session_complete(session_defer(), success, res, rlen);
+}
+
+const uint8_t *session_arguments(size_t *length)
+{
+    const uint8_t *args{nullptr};
+
+    *length = (current != nullptr) ? arguments : 0;
+
+    if (*length > 0)
+    {
+        args = buffer + RECORD_HEADER_SIZE + 1 + REQUEST_ID_SIZE;
+    }
+
+    return args;
+}
+
+size_t session_capacity(void)
+{
+    size_t capacity = 0;
+
+    if (current != nullptr)
+    {
+        /* The status, and for GCM the request ID, precede the response */
+        capacity = current->aead ? (record_capacity() - 1 - REQUEST_ID_SIZE) : (AES_BLOCK_SIZE - 1);
+    }
+
+    return capacity;
+}
+
+bool session_subscribe(void)
+{
+    bool status = false;
+
+    size_t length = 0;
+    const uint8_t *args = session_arguments(&length);
+
+    if ((current != nullptr) && current->aead && (length == SUBSCRIBE_SIZE))
+    {
+        subscription_t *subscription = &current->subscription;
+        uint32_t interval{0};
+
+        memcpy(&interval, args, sizeof(interval));
+
+        if (interval >= PUSH_MIN_INTERVAL)
+        {
+            memset(subscription, 0, sizeof(*subscription));
+            subscription->interval = interval;
+            memcpy(&subscription->threshold, args + sizeof(interval), sizeof(subscription->threshold));
+            subscription->id = request_id;
+            subscription->sampled = hal_millis() - interval; /**< The first sample is due right away */
+            subscription->last = INT16_MIN;
+            status = true;
+        }
+    }
+
+    return status;
+}
+
+bool session_baudrate(void)
+{
+    bool status = false;
+
+    size_t length = 0;
+    const uint8_t *args = session_arguments(&length);
+
+    if (length == BAUDRATE_SIZE)
+    {
+        uint32_t baudrate{0};
+
+        memcpy(&baudrate, args, sizeof(baudrate));
+        status = communication_switch(baudrate);
+    }
+
+    return status;
+}
+
+void session_unsubscribe(void)
+{
+    if (current != nullptr)
+    {
+        memset(&current->subscription, 0, sizeof(current->subscription));
+    }
+}
+
+uint32_t session_publish(float (*read)(void))
+{
+    bool sampled = false;
+    int16_t sample{0};
+    uint32_t now = hal_millis();
+    uint32_t due = PUSH_IDLE;
+
+    for (session_t &session : sessions)
+    {
+        subscription_t *subscription = &session.subscription;
+
+        if ((session.id != 0) && !session.closing && (subscription->interval != 0))
+        {
+            if (now - subscription->sampled >= subscription->interval)
+            {
+                /* One reading serves all subscriptions that are due */
+                if (!sampled)
+                {
+                    sample = (int16_t)lroundf(read() * 100);
+                    sampled = true;
+                }
+
+                subscription->sampled = now;
+
+                if ((subscription->threshold == 0) || (abs(sample - subscription->last) >= subscription->threshold))
+                {
+                    uint16_t offset{0};
+
+                    if (subscription->count == 0)
+                    {
+                        subscription->base = now;
+                    }
+
+                    offset = (uint16_t)(now - subscription->base);
+                    memcpy(&subscription->batch[subscription->count * SAMPLE_SIZE], &offset, sizeof(offset));
+                    memcpy(&subscription->batch[subscription->count * SAMPLE_SIZE + sizeof(offset)], &sample, sizeof(sample));
+                    subscription->count++;
+                    subscription->last = sample;
+                }
+
+                /* A subscribed session stays alive until it is closed or evicted */
+                session.accessed = now;
+            }
+
+            /* Changes are pushed right away, regular samples once the batch is full or getting old */
+            if ((subscription->count > 0) &&
+                ((subscription->threshold != 0) ||
+                 (subscription->count * SAMPLE_SIZE == sizeof(subscription->batch)) ||
+                 (now - subscription->base + subscription->interval > PUSH_LATENCY)))
+            {
+                (void)session_push(&session);
+            }
+
+            /* The next sample, or the batch getting too old, whatever comes first */
+            uint32_t next = subscription->interval - (now - subscription->sampled);
+
+            if ((subscription->count > 0) && (subscription->interval < PUSH_LATENCY) &&
+                (subscription->base + PUSH_LATENCY - subscription->interval - now < next))
+            {
+                next = subscription->base + PUSH_LATENCY - subscription->interval - now + 1;
+            }
+
+            due = (next < due) ? next : due;
+        }
+    }
+
+    return due;
+}
+
+bool session_available(void)
+{
+    return communication_available();
+}
+
+bool session_wait(uint32_t timeout)
+{
+    return communication_wait(timeout);
+}
+
+session_handle_t session_defer(void)
+{
+    session_handle_t handle = SESSION_NO_HANDLE;
+
+    if (pending != nullptr)
+    {
+        handle = (session_handle_t)(((uint16_t)pending->generation << HANDLE_GENERATION_SHIFT) | (uint16_t)(pending - window));
+        pending = nullptr;
+        current = nullptr;
+    }
+
+    return handle;
+}
+
+bool session_complete(session_handle_t handle, bool success, const uint8_t *res, size_t rlen)
+{
+    bool status = false;
+    metrics_time_t start = metrics_start();
+
+    size_t index = handle & HANDLE_INDEX_MASK;
+    uint8_t generation = (uint8_t)(handle >> HANDLE_GENERATION_SHIFT);
+
+    /* A stale handle must not complete the request that reuses its entry */
+    if ((index < SESSION_WINDOW) && (window[index].session != nullptr) && (window[index].generation == generation))
+    {
+        session_t *session = window[index].session;
+
+        /* The response is built where record_write() encrypts it in place */
+        frame_buffer_t *reply = communication_allocate();
+        uint8_t *response = reply->payload + RECORD_HEADER_SIZE;
+        size_t length = 0;
+        size_t capacity = AES_BLOCK_SIZE;
+
+        response[length++] = success ? STATUS_OKAY : STATUS_ERROR;
+        metrics_status(response[0]);
+
+        if (session->aead)
+        {
+            memcpy(response + length, &window[index].id, REQUEST_ID_SIZE);
+            length += REQUEST_ID_SIZE;
+            capacity = record_capacity();
+        }
+
+        if ((res != nullptr) && (rlen > 0) && (length + rlen <= capacity))
+        {
+            memcpy(response + length, res, rlen);
+            length += rlen;
+        }
+
+        window[index].session = nullptr;
+        status = session_write(session, reply, length);
+
+        if (session->closing)
+        {
+            session_free(session);
+        }
+    }
+
+    metrics_stop(METRICS_RESPONSE, start);
+
+    return status;
 }
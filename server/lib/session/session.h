@@ -29,10 +29,26 @@ typedef enum
     SESSION_GET_TEMP,
 
     SESSION_ESTABLISH,
+    SESSION_RESUME,
+
+    SESSION_SUBSCRIBE,
+    SESSION_UNSUBSCRIBE,
+
+    SESSION_GET_LATEST,
+    SESSION_GET_HISTORY,
+    SESSION_GET_AGGREGATE,
+
+    SESSION_SET_BAUD,
+    SESSION_GET_STATS,
 } request_t;
 
+typedef uint16_t session_handle_t; /**< Handle of an outstanding request, the window entry and its generation */
+
 /* Exported constants --------------------------------------------------------*/
 
+constexpr size_t SESSION_WINDOW{8};                 /**< Requests that can be outstanding at the same time */
+constexpr session_handle_t SESSION_NO_HANDLE{0xFFFF}; /**< No outstanding request */
+
 /* Exported macro ------------------------------------------------------------*/
 
 /* Exported functions prototypes ---------------------------------------------*/
@@ -46,8 +62,9 @@ typedef enum
 bool session_init(void);
 
 /**
- * @brief Close the communication module
+ * @brief Close the session of the current request
  *
+ * The session keys are wiped after the response to the close request has been sent.
  */
 void session_close(void);
 
@@ -59,6 +76,17 @@ void session_close(void);
  */
 bool session_establish(void);
 
+/**
+ * @brief Resume a session from a ticket
+ *
+ * Only symmetric cryptography is used: the session key is recovered from the ticket
+ * and the client gets a new session ID and IV.
+ *
+ * @return true if the session was successfully resumed
+ * @return false if the ticket was invalid or expired
+ */
+bool session_resume(void);
+
 /**
  * @brief Request a session
  *
@@ -67,7 +95,7 @@ bool session_establish(void);
 request_t session_request(void);
 
 /**
- * @brief Respond to a session
+ * @brief Respond to the session of the current request
  *
  * @param success the success of the response
  * @param res the response
@@ -77,4 +105,103 @@ request_t session_request(void);
  */
 bool session_response(bool success, const uint8_t *res, size_t rlen);
 
+/**
+ * @brief Get the arguments of the current request
+ *
+ * Only GCM requests carry arguments, they stay valid until the request is answered or deferred.
+ *
+ * @param length pointer to store the length of the arguments in
+ * @return const uint8_t* the arguments, nullptr if there are none
+ */
+const uint8_t *session_arguments(size_t *length);
+
+/**
+ * @brief Get the longest response the session of the current request can take
+ *
+ * @return size_t the number of bytes, 15 for legacy sessions
+ */
+size_t session_capacity(void);
+
+/**
+ * @brief Subscribe the session of the current request to temperature pushes
+ *
+ * The request carries the sample interval in ms (4 bytes) and the change threshold in
+ * hundredths of a degree (2 bytes), a threshold of 0 pushes every sample.
+ *
+ * @return true if the session is subscribed
+ * @return false if the parameters are invalid or the session does not use GCM records
+ */
+bool session_subscribe(void);
+
+/**
+ * @brief Switch the link of the current request to another baud rate
+ *
+ * The request carries the baud rate (4 bytes). The response is sent at the old rate, then the
+ * server switches. The client confirms the new rate by repeating the request at it, otherwise
+ * the server falls back to the old rate after BAUDRATE_CONFIRM ms.
+ *
+ * @return true if the switch was scheduled, or the request confirmed the current rate
+ * @return false if the baud rate is invalid or the transport has a fixed rate
+ */
+bool session_baudrate(void);
+
+/**
+ * @brief Unsubscribe the session of the current request from temperature pushes
+ */
+void session_unsubscribe(void);
+
+/**
+ * @brief Push temperature samples to the subscribed sessions
+ *
+ * The temperature is only read if a subscription is due, samples are batched into one
+ * record when the interval is short.
+ *
+ * @param read the function reading the temperature in degrees
+ * @return uint32_t the time in ms until the next sample is due
+ */
+uint32_t session_publish(float (*read)(void));
+
+/**
+ * @brief Check if a request has started to arrive
+ *
+ * @return true if data has been received and session_request() should be called
+ * @return false if no data has been received
+ */
+bool session_available(void);
+
+/**
+ * @brief Sleep until a request has started to arrive
+ *
+ * The sleep also ends when another thread has work for the loop, e.g. a response of the pipeline.
+ *
+ * @param timeout the longest sleep in ms
+ * @return true if data has been received and session_request() should be called
+ * @return false if the sleep timed out or was ended early
+ */
+bool session_wait(uint32_t timeout);
+
+/**
+ * @brief Detach the current request so it can be completed later
+ *
+ * The next request can be read while this one is outstanding, requests may be completed in any order.
+ *
+ * @return session_handle_t the handle to complete the request with, SESSION_NO_HANDLE if there is no current request
+ */
+session_handle_t session_defer(void);
+
+/**
+ * @brief Respond to an outstanding request
+ *
+ * @param handle the handle returned by session_defer()
+ * @param success the success of the response
+ * @param res the response
+ * @param rlen the length of the response
+ * @return true if the response was successfully sent
+ * @return false if the handle is not outstanding or the response could not be sent
+ *
+ * @note A handle of a request that was dropped, e.g. because its session was closed, is rejected,
+ *       even if the window entry has been reused by a later request.
+ */
+bool session_complete(session_handle_t handle, bool success, const uint8_t *res, size_t rlen);
+
 #endif /* SESSION_H */
\ No newline at end of file
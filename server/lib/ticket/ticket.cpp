@@ -0,0 +1,207 @@
+/**
+ * @file ticket.cpp
+ * @brief This file contains the implementation of the ticket module.
+ *        Tickets let a returning client resume its session key without a new RSA handshake.
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @details A ticket has the following layout:
+ *
+ *          | IV (16) | AES-256-CBC(AES key (32) | HMAC key (32) | issued (4) | serial (4) | padding (8)) | HMAC-SHA256 (32) |
+ *
+ *          The HMAC covers the IV and the ciphertext (encrypt-then-MAC). Both ticket keys are random
+ *          and only known to the server, the client stores the ticket as an opaque blob.
+ *
+ *          A ticket can be redeemed once. Every ticket gets the next serial number, the serials of the
+ *          last TICKET_REDEEMED redeemed tickets are kept, and when one has to make room, all serials up
+ *          to it are rejected from then on. A ticket that is not redeemed in time is lost, never reused.
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "ticket.h"
+#include "crypto.h"
+#include <string.h>
+
+/* Private define ------------------------------------------------------------*/
+
+/* Private typedef -----------------------------------------------------------*/
+
+/* Private macro -------------------------------------------------------------*/
+
+constexpr size_t AES_SIZE{32};                 /**< AES Key Size */
+constexpr size_t HASH_SIZE{32};                /**< Hash Size */
+constexpr size_t AES_BLOCK_SIZE{16};           /**< AES Block Size */
+constexpr size_t PLAIN_SIZE{80};               /**< Session Keys + Issued + Serial + Padding */
+constexpr uint32_t TICKET_LIFETIME{3600000UL}; /**< Ticket Lifetime in ms (1 hour) */
+constexpr size_t TICKET_REDEEMED{32};          /**< Serials of redeemed tickets kept to reject a second use */
+
+/* Private variables ---------------------------------------------------------*/
+
+static crypto_cbc_t enc_ctx;              /**< Ticket Encryption Context */
+static crypto_cbc_t dec_ctx;              /**< Ticket Decryption Context */
+static crypto_hmac_t hmac_ctx;            /**< Ticket HMAC Context, keyed with the ticket HMAC key */
+static uint32_t serial{0};                /**< The serial number of the last issued ticket */
+static uint32_t redeemed[TICKET_REDEEMED]; /**< The serials of the last redeemed tickets */
+static size_t redeemed_count{0};          /**< Number of valid entries in redeemed */
+static uint32_t redeemed_floor{0};        /**< Tickets up to this serial are rejected */
+
+static int (*rng)(void *, unsigned char *, size_t){nullptr}; /**< Random Number Generator */
+static void *rng_ctx{nullptr};                               /**< Random Number Generator Context */
+
+/* Static Assertions ---------------------------------------------------------*/
+
+static_assert(TICKET_SIZE == AES_BLOCK_SIZE + PLAIN_SIZE + HASH_SIZE, "The ticket layout has changed");
+static_assert(TICKET_KEY_SIZE + 2 * sizeof(uint32_t) <= PLAIN_SIZE, "The session keys must fit into a ticket");
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief Calculates the HMAC of the IV and the ciphertext of a ticket.
+ *
+ * @param ticket Pointer to the ticket.
+ * @param hmac Pointer to the HASH_SIZE bytes output.
+ */
+static void ticket_mac(const uint8_t *ticket, uint8_t *hmac)
+{
+    crypto_hmac(&hmac_ctx, ticket, AES_BLOCK_SIZE + PLAIN_SIZE, hmac);
+}
+
+/**
+ * @brief Marks a ticket as redeemed.
+ *
+ * @param number The serial number of the ticket.
+ * @return True if the ticket had not been redeemed before, false otherwise.
+ */
+static bool ticket_redeem(uint32_t number)
+{
+    bool status = (number > redeemed_floor);
+
+    for (size_t i = 0; status && (i < redeemed_count); i++)
+    {
+        status = (redeemed[i] != number);
+    }
+
+    if (status && (redeemed_count < TICKET_REDEEMED))
+    {
+        redeemed[redeemed_count++] = number;
+    }
+    else if (status)
+    {
+        /* The lowest serial makes room, it and all below it are rejected from now on */
+        size_t lowest = 0;
+
+        for (size_t i = 1; i < TICKET_REDEEMED; i++)
+        {
+            if (redeemed[i] < redeemed[lowest])
+            {
+                lowest = i;
+            }
+        }
+
+        redeemed_floor = redeemed[lowest];
+        redeemed[lowest] = number;
+    }
+
+    return status;
+}
+
+/* Exported user code --------------------------------------------------------*/
+
+bool ticket_init(int (*f_rng)(void *, unsigned char *, size_t), void *p_rng)
+{
+    bool status = false;
+    uint8_t aes_key[AES_SIZE]{0};
+    uint8_t mac_key[HASH_SIZE]{0};
+
+    rng = f_rng;
+    rng_ctx = p_rng;
+
+    crypto_cbc_init(&enc_ctx);
+    crypto_cbc_init(&dec_ctx);
+    crypto_hmac_init(&hmac_ctx);
+
+    serial = 0;
+    redeemed_count = 0;
+    redeemed_floor = 0;
+
+    if ((0 == rng(rng_ctx, aes_key, sizeof(aes_key))) && (0 == rng(rng_ctx, mac_key, sizeof(mac_key))))
+    {
+        status = crypto_cbc_setkey(&enc_ctx, CRYPTO_ENCRYPT, aes_key) &&
+                 crypto_cbc_setkey(&dec_ctx, CRYPTO_DECRYPT, aes_key) &&
+                 crypto_hmac_setkey(&hmac_ctx, mac_key, sizeof(mac_key));
+    }
+
+    memset(aes_key, 0, sizeof(aes_key));
+    memset(mac_key, 0, sizeof(mac_key));
+
+    return status;
+}
+
+bool ticket_issue(const uint8_t *key, uint32_t issued, uint8_t *ticket)
+{
+    bool status = false;
+    uint8_t iv[AES_BLOCK_SIZE]{0};
+    uint8_t plain[PLAIN_SIZE]{0};
+
+    uint32_t number = ++serial;
+
+    memcpy(plain, key, TICKET_KEY_SIZE);
+    memcpy(plain + TICKET_KEY_SIZE, &issued, sizeof(issued));
+    memcpy(plain + TICKET_KEY_SIZE + sizeof(issued), &number, sizeof(number));
+
+    if ((number != 0) && (0 == rng(rng_ctx, ticket, AES_BLOCK_SIZE)))
+    {
+        /* The IV is consumed by the encryption, the ticket keeps the original */
+        memcpy(iv, ticket, sizeof(iv));
+
+        if (crypto_cbc_crypt(&enc_ctx, CRYPTO_ENCRYPT, PLAIN_SIZE, iv, plain, ticket + AES_BLOCK_SIZE))
+        {
+            ticket_mac(ticket, ticket + AES_BLOCK_SIZE + PLAIN_SIZE);
+            status = true;
+        }
+    }
+
+    memset(plain, 0, sizeof(plain));
+
+    return status;
+}
+
+bool ticket_open(const uint8_t *ticket, uint32_t now, uint8_t *key, uint32_t *issued)
+{
+    bool status = false;
+    uint8_t hmac[HASH_SIZE]{0};
+    uint8_t iv[AES_BLOCK_SIZE]{0};
+    uint8_t plain[PLAIN_SIZE]{0};
+
+    ticket_mac(ticket, hmac);
+
+    if (0 == memcmp(hmac, ticket + AES_BLOCK_SIZE + PLAIN_SIZE, HASH_SIZE))
+    {
+        memcpy(iv, ticket, sizeof(iv));
+
+        if (crypto_cbc_crypt(&dec_ctx, CRYPTO_DECRYPT, PLAIN_SIZE, iv, ticket + AES_BLOCK_SIZE, plain))
+        {
+            uint32_t number{0};
+            memcpy(issued, plain + TICKET_KEY_SIZE, sizeof(*issued));
+            memcpy(&number, plain + TICKET_KEY_SIZE + sizeof(*issued), sizeof(number));
+
+            /* An expired ticket is not redeemed, it cannot be used anyway */
+            if ((now - *issued <= TICKET_LIFETIME) && ticket_redeem(number))
+            {
+                memcpy(key, plain, TICKET_KEY_SIZE);
+                status = true;
+            }
+        }
+    }
+
+    memset(plain, 0, sizeof(plain));
+
+    return status;
+}
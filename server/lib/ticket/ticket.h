@@ -0,0 +1,70 @@
+/**
+ * @file ticket.h
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @brief
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef TICKET_H
+#define TICKET_H
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Exported defines ----------------------------------------------------------*/
+
+/* Exported types ------------------------------------------------------------*/
+
+/* Exported constants --------------------------------------------------------*/
+
+constexpr size_t TICKET_KEY_SIZE{64}; /**< Size of the session keys (AES + HMAC) held by a ticket */
+constexpr size_t TICKET_SIZE{128};    /**< IV (16) + Encrypted Keys, Issue Time and Serial (80) + HMAC (32) */
+
+/* Exported macro ------------------------------------------------------------*/
+
+/* Exported functions prototypes ---------------------------------------------*/
+
+/**
+ * @brief Initialize the ticket module with fresh ticket keys
+ *
+ * The ticket keys only live in RAM, so all tickets become invalid on a reboot.
+ *
+ * @param f_rng the random number generator
+ * @param p_rng the context of the random number generator
+ * @return true if the ticket keys were successfully generated
+ * @return false if the ticket keys could not be generated
+ */
+bool ticket_init(int (*f_rng)(void *, unsigned char *, size_t), void *p_rng);
+
+/**
+ * @brief Issue a ticket for the session keys
+ *
+ * @param key the session keys of TICKET_KEY_SIZE bytes
+ * @param issued the issue time in ms, the current time or, for a follow-up ticket, the time of the redeemed one
+ * @param ticket the buffer to store the TICKET_SIZE bytes ticket in
+ * @return true if the ticket was successfully issued
+ * @return false if the ticket could not be issued
+ */
+bool ticket_issue(const uint8_t *key, uint32_t issued, uint8_t *ticket);
+
+/**
+ * @brief Verify and redeem a ticket and recover its session keys
+ *
+ * A ticket can only be redeemed once, the server issues a follow-up ticket for the next resumption.
+ *
+ * @param ticket the TICKET_SIZE bytes ticket
+ * @param now the current time in ms
+ * @param key the buffer to store the TICKET_KEY_SIZE bytes session keys in
+ * @param issued pointer to store the issue time of the ticket in
+ * @return true if the ticket is authentic, has not expired and was not redeemed before
+ * @return false if the ticket is forged, damaged, expired or was already redeemed
+ */
+bool ticket_open(const uint8_t *ticket, uint32_t now, uint8_t *key, uint32_t *issued);
+
+#endif /* TICKET_H */
@@ -12,7 +12,22 @@
     /* Includes ------------------------------------------------------------------*/
 
 #include "session.h"
-#include <Arduino.h>
+#include "sampler.h"
+#include "pipeline.h"
+#include "memory.h"
+#include "metrics.h"
+#include "hal.h"
+#include <stdio.h>
+#include <string.h>
+
+#ifndef ARDUINO
+#include <stdlib.h>
+#include <getopt.h>
+#include <unistd.h>
+#include "communication.h"
+#include "capture.h"
+#include "crypto.h"
+#endif
 
     /* Private define ------------------------------------------------------------*/
 
@@ -25,37 +40,110 @@
 
 /* Private variables ---------------------------------------------------------*/
 
+#ifndef ARDUINO
+static FILE *capture_file{nullptr}; /**< The file of the capture, nullptr if the server does not capture */
+#endif
+
 /* Static Assertions ---------------------------------------------------------*/
 
 /* Private function prototypes -----------------------------------------------*/
 
 /* Private user code ---------------------------------------------------------*/
 
+/**
+ * @brief Handles the requests which do not need the session, on the handler thread.
+ * 
+ * @retval #SESSION_GET_TEMP: Sends the latest temperature as text.
+ * @retval #SESSION_TOGGLE_LED: Toggles the state of an LED and sends the updated state.
+ * @retval #SESSION_GET_LATEST: Sends the latest sample of the sampler.
+ * @retval #SESSION_GET_HISTORY: Sends the samples taken after the time in the request, as many as fit.
+ * @retval #SESSION_GET_AGGREGATE: Sends the minimum, maximum and mean over the sample history.
+ * @retval #SESSION_GET_STATS: Sends the page of the statistics selected in the request.
+ * 
+ * @param job The request.
+ * @param result The response.
+ */
+static void handle_request(const pipeline_job_t *job, pipeline_result_t *result)
+{
+    static bool state = false;       /**< LED state */
+    sample_t sample{};          /**< Sample of the sampler */
+    sampler_aggregate_t aggregate{}; /**< Aggregates of the sampler */
+
+    switch (job->request)
+    {
+    /* Handle the session get temperature request */
+    case SESSION_GET_TEMP:
+        (void)sampler_latest(&sample);
+        result->length = sprintf((char *)result->data, "%2.2f", sample.value / 100.0f);
+        result->success = true;
+        break;
+    /* Handle the session toggle LED request */
+    case SESSION_TOGGLE_LED:
+        state = !state;
+        hal_write(HAL_LED, state);
+        strcpy((char *)result->data, hal_read(HAL_LED) ? ON : OFF);
+        result->length = strlen((char *)result->data);
+        result->success = (state == hal_read(HAL_LED));
+        break;
+    /* Handle the session get latest sample request */
+    case SESSION_GET_LATEST:
+        result->success = sampler_latest(&sample);
+        memcpy(result->data, &sample, sizeof(sample));
+        result->length = sizeof(sample);
+        break;
+    /* Handle the session get history request */
+    case SESSION_GET_HISTORY:
+        result->length = sizeof(sample_t) * sampler_history(job->argument, (sample_t *)result->data, job->capacity / sizeof(sample_t));
+        result->success = true;
+        break;
+    /* Handle the session get aggregate request */
+    case SESSION_GET_AGGREGATE:
+        sampler_aggregate(&aggregate);
+        memcpy(result->data, &aggregate, sizeof(aggregate));
+        result->length = sizeof(aggregate);
+        result->success = (aggregate.count > 0);
+        break;
+    /* Handle the session get statistics request */
+    case SESSION_GET_STATS:
+        result->length = metrics_page(job->argument, result->data, job->capacity);
+        result->success = (result->length > 0);
+        break;
+
+    default:
+        break;
+    }
+}
+
 /* Exported user code --------------------------------------------------------*/
 
 /**
  * @brief Initializes the system setup.
  * 
- * This function sets up the necessary pins for the LED and Relay. It also checks if the session is initialized
- * and blinks the LED if it is not. 
- * 
- * @note This function assumes that the GPIO_NUM_21 pin is used for the LED and GPIO_NUM_32 pin is used for the Relay.
+ * This function sets up the outputs for the LED and Relay through the hardware abstraction layer. It also checks
+ * if the session is initialized and blinks the LED if it is not, a host build exits instead.
  * 
  */
 void setup(void)
 {
-    pinMode(GPIO_NUM_21, OUTPUT); /**< Initialize the LED pin */
-    // TODO Remove this line below it is just for Debugging
-    pinMode(GPIO_NUM_32, OUTPUT); /**< Initialize the Relay pin */
+    (void)hal_init(); /**< Initialize the LED and Relay outputs */
+
+    /* mbedTLS allocates from the arena, or from the heap if it was built without MBEDTLS_PLATFORM_MEMORY */
+    (void)memory_init();
+    memory_task("loop");
 
     /* Check for initialize Error*/
-    if (!session_init())
+    if (!session_init() || !sampler_init(hal_temperature) || !pipeline_init(handle_request))
     {
+#ifndef ARDUINO
+        /* A simulated device has no LED anyone watches */
+        fprintf(stderr, "The server could not be initialized\n");
+        exit(EXIT_FAILURE);
+#endif
         /* If the session is not initialized, blink the LED */
         while (1)
         {
-            digitalWrite(GPIO_NUM_21, !digitalRead(GPIO_NUM_21)); /**< Toggle the LED */
-            delay(500);                                          /**< Delay for 0.5 seconds */
+            hal_write(HAL_LED, !hal_read(HAL_LED)); /**< Toggle the LED */
+            hal_delay(500);                         /**< Delay for 0.5 seconds */
         }
     }
 }
@@ -65,27 +153,49 @@ void setup(void)
  * 
  * This function is responsible for handling different session requests and executing the corresponding actions.
  * It receives a request from the session_request() function and performs the necessary operations based on the request type.
- * The function supports the following request types:
+ * Requests which do not need the session are deferred and handled by handle_request() on the handler thread, the loop
+ * encrypts their responses once they are done. The function supports the following request types:
  * @retval #SESSION_ESTABLISH: Establishes a session with the client.
+ * @retval #SESSION_RESUME: Resumes a session of a returning client from its ticket.
  * @retval #SESSION_CLOSE: Closes the current session.
  * @retval #SESSION_GET_TEMP: Retrieves the temperature reading and sends it as a response.
  * @retval #SESSION_TOGGLE_LED: Toggles the state of an LED and sends the updated state as a response.
+ * @retval #SESSION_GET_LATEST: Sends the latest sample of the sampler.
+ * @retval #SESSION_GET_HISTORY: Sends the samples taken after the time in the request, as many as fit.
+ * @retval #SESSION_GET_AGGREGATE: Sends the minimum, maximum and mean over the sample history.
+ * @retval #SESSION_GET_STATS: Sends a page of the latency, status and memory statistics.
+ * @retval #SESSION_SUBSCRIBE: Subscribes the session to temperature pushes.
+ * @retval #SESSION_UNSUBSCRIBE: Stops the temperature pushes of the session.
+ * 
+ * @note Between requests the temperature is pushed to the subscribed sessions, so the loop only reads a request
+ * once it has started to arrive.
  * 
- * @note This function assumes that the necessary GPIO pins have been configured and initialized.
+ * @note This function assumes that the outputs have been initialized with hal_init().
  * 
- * @note The function uses the session_establish(), session_close(), session_response(), and temperatureRead() functions to perform the required operations.
+ * @note The function uses the session_establish(), session_close(), session_response(), session_defer() and pipeline_submit() functions to perform the required operations.
  * 
  * @note If an error occurs during the execution of a request, the function sets the request to SESSION_ERROR and takes appropriate action.
  * 
- * @note If the request is SESSION_ERROR, the function sets the GPIO_NUM_32 pin to HIGH.
+ * @note If the request is SESSION_ERROR, the function switches the Relay on.
  */
 void loop()
 {
-    char response[8] = {0};     /**< Response buffer */
-    static uint8_t state = LOW; /**< LED state */
+    pipeline_job_t job{};         /**< Request for the handler thread */
+    const uint8_t *args{nullptr}; /**< Arguments of the request */
+    size_t length{0};             /**< Length of the arguments */
+    uint32_t idle{0};             /**< Time in ms until the next sample is due */
+
+    pipeline_complete();                     /**< Encrypt and send the responses of the handler thread */
+    idle = session_publish(hal_temperature); /**< Push the temperature to the subscribers */
+
+    /* Sleep until a request arrives, a response is ready or the next sample is due */
+    if (!session_wait(idle))
+    {
+        return;
+    }
 
     request_t request = session_request(); /**< Get the session request */
-    digitalWrite(GPIO_NUM_32, LOW);        /**< Reset the Relay pin */
+    hal_write(HAL_RELAY, false);           /**< Reset the Relay */
 
     /* Handle the session request */
     switch (request)
@@ -97,6 +207,13 @@ void loop()
             request = SESSION_ERROR;
         }
         break;
+    /* Handle the session resume request */
+    case SESSION_RESUME:
+        if (!session_resume())
+        {
+            request = SESSION_ERROR;
+        }
+        break;
     /* Handle the session closed request */
     case SESSION_CLOSE:
         session_close();
@@ -105,22 +222,47 @@ void loop()
             request = SESSION_ERROR;
         }
         break;
-    /* Handle the session get temperature request */
+    /* Pass the requests which do not need the session to the handler thread */
     case SESSION_GET_TEMP:
-        sprintf((char *)&response, "%2.2f", temperatureRead());
+    case SESSION_TOGGLE_LED:
+    case SESSION_GET_LATEST:
+    case SESSION_GET_HISTORY:
+    case SESSION_GET_AGGREGATE:
+    case SESSION_GET_STATS:
+        args = session_arguments(&length);
+        if (length >= sizeof(job.argument))
+        {
+            memcpy(&job.argument, args, sizeof(job.argument));
+        }
+
+        job.request = request;
+        job.capacity = (session_capacity() < PIPELINE_RESULT_SIZE) ? session_capacity() : PIPELINE_RESULT_SIZE;
+        job.handle = session_defer();
 
-        if (!session_response(true, (const uint8_t *)response, strlen(response)))
+        if (!pipeline_submit(&job))
         {
+            (void)session_complete(job.handle, false, nullptr, 0);
             request = SESSION_ERROR;
         }
         break;
-    /* Handle the session toggle LED request */
-    case SESSION_TOGGLE_LED:
-        state = (state == LOW) ? HIGH : LOW;
-        digitalWrite(GPIO_NUM_21, state);
-        strcpy(response, (LOW == digitalRead(GPIO_NUM_21)) ? OFF : ON);
-
-        if (!session_response((state == digitalRead(GPIO_NUM_21)), (const uint8_t *)response, strlen(response)))
+    /* Handle the session subscribe request */
+    case SESSION_SUBSCRIBE:
+        if (!session_response(session_subscribe(), nullptr, 0))
+        {
+            request = SESSION_ERROR;
+        }
+        break;
+    /* Handle the session baud rate request, the response still goes out at the old rate */
+    case SESSION_SET_BAUD:
+        if (!session_response(session_baudrate(), nullptr, 0))
+        {
+            request = SESSION_ERROR;
+        }
+        break;
+    /* Handle the session unsubscribe request */
+    case SESSION_UNSUBSCRIBE:
+        session_unsubscribe();
+        if (!session_response(true, nullptr, 0))
         {
             request = SESSION_ERROR;
         }
@@ -133,6 +275,131 @@ void loop()
     /* Handle the session error */
     if (request == SESSION_ERROR)
     {
-        digitalWrite(GPIO_NUM_32, HIGH);
+        hal_write(HAL_RELAY, true);
     }
-}
\ No newline at end of file
+}
+#ifndef ARDUINO
+/**
+ * @brief Writes captured bytes to the capture file.
+ *
+ * @param data The bytes.
+ * @param dlen The number of bytes.
+ * @return size_t The number of bytes written.
+ */
+static size_t capture_write(const uint8_t *data, size_t dlen)
+{
+    size_t written = fwrite(data, 1, dlen, capture_file);
+
+    return (0 == fflush(capture_file)) ? written : 0;
+}
+
+/**
+ * @brief Runs the server as a Linux process, a simulated device.
+ *
+ * The options let many devices run on one host, each with its own link and key store:
+ * - `-l, --link NAME[:ADDRESS]` the transport and its address, e.g. `unix:/tmp/device1.sock`, `tcp:5001` or `tty:/dev/pts/3`.
+ * - `-d, --directory DIR` the directory of the key store files, the working directory of the server.
+ * - `-t, --temperature SCRIPT` the simulated temperature, e.g. `0:21.5,60000:24,120000:21.5` (see hal_script()).
+ * - `-c, --crypto NAME` the crypto provider, `mbedtls` or, in a build with CRYPTO_OPENSSL, `openssl`.
+ * - `-w, --capture FILE` captures the frames of the link into FILE, to be replayed with `--link replay:FILE[:max]`.
+ * - `-s, --seed N` seeds the random bytes, for a capture whose sessions can be replayed.
+ *
+ * A seeded server, and one replaying a capture, uses the mbedTLS provider: its random bytes all come from
+ * hal_random(), so the replayed server derives the same keys as the captured one. A capture is only seeded
+ * with an explicit --seed, and a seeded server never writes its key store, see hal_seeded().
+ *
+ * @param argc The number of arguments.
+ * @param argv The arguments.
+ * @return int EXIT_FAILURE if an option is invalid, the server runs until it is killed otherwise.
+ */
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        {"link", required_argument, nullptr, 'l'},
+        {"directory", required_argument, nullptr, 'd'},
+        {"temperature", required_argument, nullptr, 't'},
+        {"crypto", required_argument, nullptr, 'c'},
+        {"capture", required_argument, nullptr, 'w'},
+        {"seed", required_argument, nullptr, 's'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    bool status = true;
+    bool seeded = false;
+    uint64_t seed = 0;
+    const char *capture = nullptr;
+    int option;
+
+    while (status && (-1 != (option = getopt_long(argc, argv, "l:d:t:c:w:s:h", options, nullptr))))
+    {
+        char *address = nullptr;
+        char *end = nullptr;
+
+        switch (option)
+        {
+        case 'l':
+            address = strchr(optarg, ':');
+            if (address != nullptr)
+            {
+                *address++ = '\0';
+            }
+            status = communication_select(optarg, address);
+            seeded = seeded || (0 == strcmp(optarg, "replay"));
+            break;
+        case 'd':
+            status = (0 == chdir(optarg));
+            break;
+        case 't':
+            status = hal_script(optarg);
+            break;
+        case 'c':
+            status = crypto_select(optarg);
+            break;
+        case 'w':
+            capture = optarg;
+            break;
+        case 's':
+            seed = strtoull(optarg, &end, 0);
+            status = (end != optarg) && (*end == '\0') && (seed != 0);
+            seeded = true;
+            break;
+        default:
+            status = false;
+            break;
+        }
+    }
+
+    if (!status || (optind < argc))
+    {
+        fprintf(stderr, "Usage: %s [--link NAME[:ADDRESS]] [--directory DIR] [--temperature SCRIPT] [--crypto NAME] "
+                        "[--capture FILE] [--seed N]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (seeded)
+    {
+        /* The random bytes of the other providers cannot be seeded */
+        (void)crypto_select("mbedtls");
+
+        if (seed != 0)
+        {
+            hal_seed(seed);
+        }
+    }
+
+    /* Opened after all options, so a relative path is in the directory, like the replayed capture */
+    if ((capture != nullptr) && ((nullptr == (capture_file = fopen(capture, "wb"))) || !capture_start(capture_write, seed)))
+    {
+        fprintf(stderr, "The capture could not be started\n");
+        return EXIT_FAILURE;
+    }
+
+    setup();
+
+    while (true)
+    {
+        loop();
+    }
+}
+#endif /* ARDUINO */
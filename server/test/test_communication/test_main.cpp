@@ -0,0 +1,271 @@
+/**
+ * @file test_main.cpp
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @brief Tests of the frame parser: frames are read from the UNIX domain socket transport, noise,
+ *        truncated and oversized frames are dropped and the parser finds the next frame.
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <unity.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "communication.h"
+
+/* Private define ------------------------------------------------------------*/
+
+/* Private macro -------------------------------------------------------------*/
+
+constexpr uint8_t CRC8_POLY{0x07}; /**< CRC-8 polynomial (x^8 + x^2 + x + 1) */
+
+/* Private variables ---------------------------------------------------------*/
+
+static char directory[] = "/tmp/communication_XXXXXX"; /**< The directory of the socket */
+static char path[64]{0};                               /**< The socket the server listens on */
+static int client{-1};                                 /**< The client end of the link */
+static uint8_t buffer[FRAME_MAX_PAYLOAD]{0};           /**< The payload read by the server */
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief Calculates the CRC-8 of the given data, as the communication module does.
+ */
+static uint8_t crc8(const uint8_t *data, size_t dlen)
+{
+    uint8_t crc = 0;
+
+    for (size_t i = 0; i < dlen; i++)
+    {
+        crc ^= data[i];
+
+        for (uint8_t bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 0x80) ? ((crc << 1) ^ CRC8_POLY) : (crc << 1);
+        }
+    }
+
+    return crc;
+}
+
+/**
+ * @brief Builds a frame header.
+ *
+ * @param header Pointer to the FRAME_HEADER_SIZE bytes output.
+ * @param type The frame type.
+ * @param length The payload length announced by the header.
+ */
+static void header_build(uint8_t *header, uint8_t type, uint16_t length)
+{
+    header[0] = FRAME_SYNC_1;
+    header[1] = FRAME_SYNC_2;
+    header[2] = type;
+    header[3] = (uint8_t)(length & 0xFF);
+    header[4] = (uint8_t)(length >> 8);
+    header[5] = crc8(&header[2], 3);
+}
+
+/**
+ * @brief Sends raw bytes from the client to the server.
+ */
+static void client_send(const uint8_t *data, size_t dlen)
+{
+    TEST_ASSERT_EQUAL_INT((int)dlen, (int)write(client, data, dlen));
+}
+
+/**
+ * @brief Sends a frame header from the client, followed by the given payload.
+ *
+ * @param type The frame type.
+ * @param length The payload length announced by the header.
+ * @param payload The payload, dlen bytes of it are sent.
+ * @param dlen The number of payload bytes to send, less than length for a truncated frame.
+ */
+static void client_frame(uint8_t type, uint16_t length, const uint8_t *payload, size_t dlen)
+{
+    uint8_t header[FRAME_HEADER_SIZE];
+
+    header_build(header, type, length);
+    client_send(header, sizeof(header));
+    client_send(payload, dlen);
+}
+
+/**
+ * @brief Reads the next frame on the server and checks it is the expected one.
+ */
+static void assert_frame(uint8_t type, const uint8_t *payload, size_t length)
+{
+    uint8_t received = 0;
+
+    TEST_ASSERT_EQUAL_size_t(length, communication_read(buffer, sizeof(buffer), &received));
+    TEST_ASSERT_EQUAL_UINT8(type, received);
+    TEST_ASSERT_EQUAL_MEMORY(payload, buffer, length);
+}
+
+/**
+ * @brief Connects the client to the server.
+ *
+ * @return True if the client is connected, false otherwise.
+ */
+static bool client_connect(void)
+{
+    struct sockaddr_un address{};
+
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    client = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    return (client >= 0) && (0 == connect(client, (const struct sockaddr *)&address, sizeof(address)));
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+/**
+ * @brief A valid frame is read with its type and payload, the server accepts the client on the first read.
+ */
+static void test_frame(void)
+{
+    uint8_t payload[] = {0x01, 0x02, 0x03, 0x04, 0x05};
+
+    client_frame(FRAME_RECORD, sizeof(payload), payload, sizeof(payload));
+    assert_frame(FRAME_RECORD, payload, sizeof(payload));
+}
+
+/**
+ * @brief Noise and a header with a wrong CRC-8 are skipped until the next valid header.
+ */
+static void test_noise(void)
+{
+    uint8_t payload[] = {0x10, 0x20, 0x30};
+    uint8_t noise[] = {0x00, FRAME_SYNC_1, 0xFF, FRAME_SYNC_1, FRAME_SYNC_2};
+    uint8_t header[FRAME_HEADER_SIZE];
+
+    header_build(header, FRAME_DATA, sizeof(payload));
+    header[5] ^= 0x01;
+
+    client_send(noise, sizeof(noise));
+    client_send(header, sizeof(header));
+    client_frame(FRAME_DATA, sizeof(payload), payload, sizeof(payload));
+
+    assert_frame(FRAME_DATA, payload, sizeof(payload));
+}
+
+/**
+ * @brief A frame whose payload stops short is dropped after the frame timeout.
+ */
+static void test_truncated(void)
+{
+    uint8_t payload[] = {0xAA, 0xBB, 0xCC, 0xDD};
+
+    client_frame(FRAME_DATA, 16, payload, sizeof(payload));
+    TEST_ASSERT_EQUAL_size_t(0, communication_read(buffer, sizeof(buffer)));
+
+    client_frame(FRAME_DATA, sizeof(payload), payload, sizeof(payload));
+    assert_frame(FRAME_DATA, payload, sizeof(payload));
+}
+
+/**
+ * @brief A frame larger than FRAME_MAX_PAYLOAD is dropped with its whole payload, a frame inside of it is not read.
+ */
+static void test_oversized(void)
+{
+    uint8_t payload[] = {0x11, 0x22};
+    static uint8_t large[FRAME_MAX_PAYLOAD + 64]{0};
+
+    header_build(large + 32, FRAME_DATA, sizeof(payload));
+    memcpy(large + 32 + FRAME_HEADER_SIZE, payload, sizeof(payload));
+
+    client_frame(FRAME_DATA, sizeof(large), large, sizeof(large));
+    TEST_ASSERT_EQUAL_size_t(0, communication_read(buffer, sizeof(buffer)));
+
+    client_frame(FRAME_RECORD, sizeof(payload), payload, sizeof(payload));
+    assert_frame(FRAME_RECORD, payload, sizeof(payload));
+}
+
+/**
+ * @brief The largest length in the header is dropped like any other oversized frame.
+ */
+static void test_max_length(void)
+{
+    static uint8_t large[UINT16_MAX]{0};
+
+    client_frame(FRAME_DATA, UINT16_MAX, large, sizeof(large));
+    TEST_ASSERT_EQUAL_size_t(0, communication_read(buffer, sizeof(buffer)));
+}
+
+/**
+ * @brief A frame larger than the buffer of communication_read() is dropped, the next one is read.
+ */
+static void test_small_buffer(void)
+{
+    uint8_t payload[] = {0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08};
+
+    client_frame(FRAME_DATA, sizeof(payload), payload, sizeof(payload));
+    TEST_ASSERT_EQUAL_size_t(0, communication_read(buffer, sizeof(payload) - 1));
+
+    client_frame(FRAME_DATA, sizeof(payload), payload, sizeof(payload));
+    assert_frame(FRAME_DATA, payload, sizeof(payload));
+}
+
+/**
+ * @brief A frame written by the server has a valid header in front of its payload.
+ */
+static void test_write(void)
+{
+    uint8_t payload[] = {0xDE, 0xAD, 0xBE, 0xEF};
+    uint8_t expected[FRAME_HEADER_SIZE];
+    uint8_t frame[FRAME_HEADER_SIZE + sizeof(payload)];
+
+    TEST_ASSERT_TRUE(communication_write(payload, sizeof(payload), FRAME_RECORD));
+    TEST_ASSERT_EQUAL_INT((int)sizeof(frame), (int)recv(client, frame, sizeof(frame), MSG_WAITALL));
+
+    header_build(expected, FRAME_RECORD, sizeof(payload));
+    TEST_ASSERT_EQUAL_MEMORY(expected, frame, sizeof(expected));
+    TEST_ASSERT_EQUAL_MEMORY(payload, frame + FRAME_HEADER_SIZE, sizeof(payload));
+}
+
+int main(void)
+{
+    if (nullptr == mkdtemp(directory))
+    {
+        return EXIT_FAILURE;
+    }
+
+    /* The stages are not started, communication_read() parses the frames in the calling thread */
+    snprintf(path, sizeof(path), "%s/test.sock", directory);
+
+    if (!communication_select("unix", path) || !communication_init() || !client_connect())
+    {
+        return EXIT_FAILURE;
+    }
+
+    UNITY_BEGIN();
+    RUN_TEST(test_frame);
+    RUN_TEST(test_noise);
+    RUN_TEST(test_truncated);
+    RUN_TEST(test_oversized);
+    RUN_TEST(test_max_length);
+    RUN_TEST(test_small_buffer);
+    RUN_TEST(test_write);
+    int failures = UNITY_END();
+
+    close(client);
+    unlink(path);
+    rmdir(directory);
+
+    return failures;
+}
@@ -0,0 +1,174 @@
+/**
+ * @file test_main.cpp
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @brief Tests of the key manager: a seeded first boot generates the RSA key of its seed, so the replay
+ *        of a seeded capture decrypts the captured RSA and hybrid handshakes.
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @copyright Copyright (c) 2024
+ *
+ * @details Every boot runs in a child process with a key store directory of its own, the key manager
+ *          and the seeded random bytes cannot be reset in a process. The child writes the public key
+ *          of its active key to a pipe.
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <unity.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "crypto.h"
+#include "hal.h"
+#include "keymanager.h"
+
+/* Private typedef -----------------------------------------------------------*/
+
+/**
+ * @brief The public key of the active key of a boot.
+ */
+typedef struct
+{
+    uint8_t der[512]; /**< The DER encoded public key */
+    size_t length;    /**< The length of the DER, 0 if the boot failed */
+    size_t files;     /**< The files in the key store directory after the boot */
+} boot_t;
+
+/* Private variables ---------------------------------------------------------*/
+
+static char directory[] = "/tmp/keymanager_XXXXXX"; /**< The directory of the key store directories */
+static int boots{0};                                 /**< The number of boots, names the key store directory */
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief Counts the files in the working directory.
+ */
+static size_t count_files(void)
+{
+    size_t count = 0;
+    DIR *dir = opendir(".");
+
+    for (struct dirent *entry = (dir != nullptr) ? readdir(dir) : nullptr; entry != nullptr; entry = readdir(dir))
+    {
+        count += (entry->d_name[0] != '.') ? 1 : 0;
+    }
+
+    if (dir != nullptr)
+    {
+        closedir(dir);
+    }
+
+    return count;
+}
+
+/**
+ * @brief Boots the key manager on an empty key store in a child process, as the native server does.
+ *
+ * @param seed The seed of the random bytes, 0 for an unseeded boot.
+ * @param boot Pointer to store the public key of the active key in.
+ */
+static void boot(uint64_t seed, boot_t *boot)
+{
+    int fds[2];
+    char path[64];
+
+    snprintf(path, sizeof(path), "%s/%d", directory, boots++);
+    TEST_ASSERT_EQUAL_INT(0, mkdir(path, 0700));
+    TEST_ASSERT_EQUAL_INT(0, pipe(fds));
+
+    pid_t child = fork();
+    TEST_ASSERT_TRUE(child >= 0);
+
+    if (child == 0)
+    {
+        boot_t result{};
+        crypto_rsa_t *key{nullptr};
+
+        if (seed != 0)
+        {
+            hal_seed(seed);
+        }
+
+        if ((0 == chdir(path)) && crypto_select("mbedtls") && crypto_init() && keymanager_init() &&
+            (nullptr != (key = keymanager_acquire())))
+        {
+            result.length = crypto_rsa_public(key, result.der, sizeof(result.der));
+            keymanager_release(key);
+        }
+
+        /* The worker stores the generated key right after keymanager_init() */
+        hal_delay(200);
+        result.files = count_files();
+
+        _exit((sizeof(result) == write(fds[1], &result, sizeof(result))) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    int status = 0;
+    close(fds[1]);
+    TEST_ASSERT_EQUAL_INT((int)sizeof(*boot), (int)read(fds[0], boot, sizeof(*boot)));
+    close(fds[0]);
+    TEST_ASSERT_EQUAL_INT(child, waitpid(child, &status, 0));
+    TEST_ASSERT_TRUE(boot->length > 0);
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+/**
+ * @brief Two boots with the same seed, the capture and its replay, generate the same RSA key and store none.
+ */
+static void test_seeded(void)
+{
+    boot_t capture{}, replay{};
+
+    boot(42, &capture);
+    boot(42, &replay);
+
+    TEST_ASSERT_EQUAL_size_t(capture.length, replay.length);
+    TEST_ASSERT_EQUAL_MEMORY(capture.der, replay.der, capture.length);
+    TEST_ASSERT_EQUAL_size_t(0, capture.files);
+}
+
+/**
+ * @brief Boots with another seed or without a seed generate keys of their own, an unseeded boot stores its key.
+ */
+static void test_unseeded(void)
+{
+    boot_t seeded{}, other{}, first{}, second{};
+
+    boot(42, &seeded);
+    boot(43, &other);
+    boot(0, &first);
+    boot(0, &second);
+
+    TEST_ASSERT_FALSE(0 == memcmp(seeded.der, other.der, seeded.length));
+    TEST_ASSERT_FALSE(0 == memcmp(seeded.der, first.der, seeded.length));
+    TEST_ASSERT_FALSE(0 == memcmp(first.der, second.der, first.length));
+    TEST_ASSERT_TRUE(first.files > 0);
+}
+
+int main(void)
+{
+    if (nullptr == mkdtemp(directory))
+    {
+        return EXIT_FAILURE;
+    }
+
+    UNITY_BEGIN();
+    RUN_TEST(test_seeded);
+    RUN_TEST(test_unseeded);
+    int failures = UNITY_END();
+
+    return failures;
+}
@@ -0,0 +1,321 @@
+/**
+ * @file test_main.cpp
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @brief Tests of the key store: a stored key survives a simulated reboot, the key store time
+ *        continues from the last sync and an expired or corrupted key is not loaded.
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <unity.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <thread>
+#include <sys/stat.h>
+#include <mbedtls/ecp.h>
+#include <mbedtls/rsa.h>
+#include "hal.h"
+#include "keystore.h"
+
+/* Private define ------------------------------------------------------------*/
+
+#define IDENTITY_FILE "keystore_identity.bin" /**< The blob of KEYSTORE_IDENTITY in KEYSTORE_DIR */
+#define CLOCK_FILE "keystore_clock.bin"       /**< The blob of the key store clock in KEYSTORE_DIR */
+#define RSA_FILE "keystore_rsa.bin"           /**< The blob of KEYSTORE_RSA in KEYSTORE_DIR */
+
+/* Private macro -------------------------------------------------------------*/
+
+constexpr uint32_t CLOCK_MAGIC{0x434C4B31}; /**< "CLK1" */
+constexpr uint32_t LIFETIME{100};           /**< The lifetime of the test keys in seconds */
+constexpr size_t DER_SIZE{1232};            /**< Max DER Size of a RSA-2048 Private Key */
+constexpr int STORES{50};                   /**< Stores of each thread in the concurrency test */
+
+/* Private variables ---------------------------------------------------------*/
+
+static char directory[] = "/tmp/keystore_XXXXXX"; /**< The key store directory of the test run */
+static mbedtls_pk_context key;                    /**< The stored key */
+static mbedtls_pk_context loaded;                 /**< The loaded key */
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief The random number generator of the test keys.
+ */
+static int rng(void *, unsigned char *buffer, size_t length)
+{
+    hal_random(buffer, length);
+    return 0;
+}
+
+/**
+ * @brief Generates a P-256 key.
+ *
+ * @param ctx The initialized and empty context of the key.
+ */
+static void generate(mbedtls_pk_context *ctx)
+{
+    TEST_ASSERT_EQUAL_INT(0, mbedtls_pk_setup(ctx, mbedtls_pk_info_from_type(MBEDTLS_PK_ECKEY)));
+    TEST_ASSERT_EQUAL_INT(0, mbedtls_ecp_gen_key(MBEDTLS_ECP_DP_SECP256R1, mbedtls_pk_ec(*ctx), rng, nullptr));
+}
+
+/**
+ * @brief Checks that the two keys have the same DER encoding.
+ */
+static void assert_same_key(mbedtls_pk_context *expected, mbedtls_pk_context *actual)
+{
+    uint8_t first[DER_SIZE]{0};
+    uint8_t second[DER_SIZE]{0};
+
+    int length = mbedtls_pk_write_key_der(expected, first, sizeof(first));
+    TEST_ASSERT_TRUE(length > 0);
+    TEST_ASSERT_EQUAL_INT(length, mbedtls_pk_write_key_der(actual, second, sizeof(second)));
+
+    /* The DER is written at the end of the given buffer */
+    TEST_ASSERT_EQUAL_MEMORY(first + sizeof(first) - length, second + sizeof(second) - length, length);
+}
+
+/**
+ * @brief Writes a key store clock blob, as written by keystore_sync() of a previous boot.
+ *
+ * @param seconds The key store time of the last sync.
+ */
+static void write_clock(uint32_t seconds)
+{
+    uint32_t clock[] = {CLOCK_MAGIC, seconds, ~seconds};
+    FILE *file = fopen(CLOCK_FILE, "wb");
+
+    TEST_ASSERT_NOT_NULL(file);
+    TEST_ASSERT_EQUAL_size_t(sizeof(clock), fwrite(clock, 1, sizeof(clock), file));
+    TEST_ASSERT_EQUAL_INT(0, fclose(file));
+}
+
+void setUp(void)
+{
+    remove(RSA_FILE);
+    remove(IDENTITY_FILE);
+    remove(CLOCK_FILE);
+
+    mbedtls_pk_init(&key);
+    mbedtls_pk_init(&loaded);
+    TEST_ASSERT_TRUE(keystore_init());
+}
+
+void tearDown(void)
+{
+    mbedtls_pk_free(&loaded);
+    mbedtls_pk_free(&key);
+}
+
+/**
+ * @brief An empty key store has no key and starts its time at zero.
+ */
+static void test_empty(void)
+{
+    TEST_ASSERT_FALSE(keystore_load(KEYSTORE_IDENTITY, &loaded));
+    TEST_ASSERT_TRUE(keystore_time() < LIFETIME);
+}
+
+/**
+ * @brief A stored key is loaded again after a reboot, with its expiry time.
+ */
+static void test_reboot(void)
+{
+    uint32_t expires = 0;
+    uint32_t lifetime = keystore_time() + LIFETIME;
+
+    generate(&key);
+    TEST_ASSERT_TRUE(keystore_store(KEYSTORE_IDENTITY, &key, lifetime));
+
+    /* The reboot, the uptime restarts at zero */
+    TEST_ASSERT_TRUE(keystore_init());
+
+    TEST_ASSERT_TRUE(keystore_load(KEYSTORE_IDENTITY, &loaded, &expires));
+    TEST_ASSERT_EQUAL_UINT32(lifetime, expires);
+    assert_same_key(&key, &loaded);
+}
+
+/**
+ * @brief A stored key is only readable by the owner and no temp file is left behind.
+ */
+static void test_permissions(void)
+{
+    struct stat info{};
+
+    /* A world readable blob of an older build is replaced */
+    write_clock(0);
+    TEST_ASSERT_EQUAL_INT(0, chmod(CLOCK_FILE, 0644));
+
+    generate(&key);
+    TEST_ASSERT_TRUE(keystore_store(KEYSTORE_IDENTITY, &key, keystore_time() + LIFETIME));
+
+    TEST_ASSERT_EQUAL_INT(0, stat(IDENTITY_FILE, &info));
+    TEST_ASSERT_EQUAL_UINT32(0600, info.st_mode & 0777);
+    TEST_ASSERT_EQUAL_INT(0, stat(CLOCK_FILE, &info));
+    TEST_ASSERT_EQUAL_UINT32(0600, info.st_mode & 0777);
+    TEST_ASSERT_TRUE(access(IDENTITY_FILE ".tmp", F_OK) != 0);
+}
+
+/**
+ * @brief The key store time continues from the last sync instead of restarting at zero.
+ */
+static void test_clock(void)
+{
+    write_clock(100000);
+    TEST_ASSERT_TRUE(keystore_init());
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT32(100000, keystore_time());
+
+    TEST_ASSERT_TRUE(keystore_sync());
+    TEST_ASSERT_TRUE(keystore_init());
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT32(100000, keystore_time());
+}
+
+/**
+ * @brief A key that outlived its lifetime in key store time is not loaded after a reboot.
+ */
+static void test_expired(void)
+{
+    write_clock(100000);
+    TEST_ASSERT_TRUE(keystore_init());
+
+    generate(&key);
+    TEST_ASSERT_TRUE(keystore_store(KEYSTORE_IDENTITY, &key, 100000 + LIFETIME));
+
+    /* A later boot, the key store time of its last sync is past the expiry */
+    write_clock(100000 + LIFETIME);
+    TEST_ASSERT_TRUE(keystore_init());
+
+    TEST_ASSERT_FALSE(keystore_load(KEYSTORE_IDENTITY, &loaded));
+}
+
+/**
+ * @brief A key stored after the last sync moves the key store time forward when it is loaded.
+ */
+static void test_lost_sync(void)
+{
+    write_clock(100000);
+    TEST_ASSERT_TRUE(keystore_init());
+
+    generate(&key);
+    TEST_ASSERT_TRUE(keystore_store(KEYSTORE_IDENTITY, &key, 100000 + LIFETIME));
+
+    /* The clock blob of an older sync, the time between it and the store was lost */
+    write_clock(50);
+    TEST_ASSERT_TRUE(keystore_init());
+
+    TEST_ASSERT_TRUE(keystore_load(KEYSTORE_IDENTITY, &loaded));
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT32(100000, keystore_time());
+}
+
+/**
+ * @brief A blob with a changed byte is not loaded.
+ */
+static void test_corrupted(void)
+{
+    generate(&key);
+    TEST_ASSERT_TRUE(keystore_store(KEYSTORE_IDENTITY, &key, keystore_time() + LIFETIME));
+
+    /* Flip the bits of a byte of the DER key */
+    FILE *file = fopen(IDENTITY_FILE, "r+b");
+    TEST_ASSERT_NOT_NULL(file);
+    TEST_ASSERT_EQUAL_INT(0, fseek(file, 40, SEEK_SET));
+    int byte = fgetc(file);
+    TEST_ASSERT_EQUAL_INT(0, fseek(file, 40, SEEK_SET));
+    TEST_ASSERT_EQUAL_INT(byte ^ 0xFF, fputc(byte ^ 0xFF, file));
+    TEST_ASSERT_EQUAL_INT(0, fclose(file));
+
+    TEST_ASSERT_TRUE(keystore_init());
+    TEST_ASSERT_FALSE(keystore_load(KEYSTORE_IDENTITY, &loaded));
+}
+
+/**
+ * @brief The key manager worker stores the RSA key while the main thread stores the identity, neither blob is torn.
+ */
+static void test_concurrent(void)
+{
+    mbedtls_pk_context rsa, rsa_loaded;
+    bool stored[2] = {true, true};
+    uint32_t lifetime = keystore_time() + LIFETIME;
+
+    mbedtls_pk_init(&rsa);
+    mbedtls_pk_init(&rsa_loaded);
+    generate(&key);
+    TEST_ASSERT_EQUAL_INT(0, mbedtls_pk_setup(&rsa, mbedtls_pk_info_from_type(MBEDTLS_PK_RSA)));
+    TEST_ASSERT_EQUAL_INT(0, mbedtls_rsa_gen_key(mbedtls_pk_rsa(rsa), rng, nullptr, 1024, 65537));
+
+    std::thread worker([&]() {
+        for (int i = 0; i < STORES; i++)
+        {
+            stored[0] = keystore_store(KEYSTORE_RSA, &rsa, lifetime) && stored[0];
+            stored[0] = keystore_sync() && stored[0];
+        }
+    });
+
+    for (int i = 0; i < STORES; i++)
+    {
+        stored[1] = keystore_store(KEYSTORE_IDENTITY, &key, lifetime) && stored[1];
+        stored[1] = (keystore_load(KEYSTORE_IDENTITY, &loaded) && stored[1]);
+        mbedtls_pk_free(&loaded);
+        mbedtls_pk_init(&loaded);
+    }
+
+    worker.join();
+    TEST_ASSERT_TRUE(stored[0]);
+    TEST_ASSERT_TRUE(stored[1]);
+
+    TEST_ASSERT_TRUE(keystore_init());
+    TEST_ASSERT_TRUE(keystore_load(KEYSTORE_IDENTITY, &loaded));
+    assert_same_key(&key, &loaded);
+    TEST_ASSERT_TRUE(keystore_load(KEYSTORE_RSA, &rsa_loaded));
+    assert_same_key(&rsa, &rsa_loaded);
+
+    mbedtls_pk_free(&rsa_loaded);
+    mbedtls_pk_free(&rsa);
+}
+
+/**
+ * @brief A seeded server does not write the key store. Runs last, the seed cannot be undone.
+ */
+static void test_seeded(void)
+{
+    hal_seed(42);
+
+    generate(&key);
+    TEST_ASSERT_FALSE(keystore_store(KEYSTORE_IDENTITY, &key, keystore_time() + LIFETIME));
+    TEST_ASSERT_TRUE(access(IDENTITY_FILE, F_OK) != 0);
+    TEST_ASSERT_TRUE(access(CLOCK_FILE, F_OK) != 0);
+}
+
+int main(void)
+{
+    /* The host key store lives in the working directory */
+    if ((nullptr == mkdtemp(directory)) || (0 != chdir(directory)))
+    {
+        return EXIT_FAILURE;
+    }
+
+    UNITY_BEGIN();
+    RUN_TEST(test_empty);
+    RUN_TEST(test_reboot);
+    RUN_TEST(test_permissions);
+    RUN_TEST(test_clock);
+    RUN_TEST(test_expired);
+    RUN_TEST(test_lost_sync);
+    RUN_TEST(test_corrupted);
+    RUN_TEST(test_concurrent);
+    RUN_TEST(test_seeded);
+    int failures = UNITY_END();
+
+    remove(RSA_FILE);
+    remove(IDENTITY_FILE);
+    remove(CLOCK_FILE);
+    rmdir(directory);
+
+    return failures;
+}
@@ -0,0 +1,84 @@
+/**
+ * @file test_main.cpp
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @brief Tests of the sample history: the whole history is returned for a since of 0 and the
+ *        history pages across the wrap of the ms counter.
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @copyright Copyright (c) 2024
+ *
+ * @details The sampler is started once, the clock of hal_millis() is set near the times of the
+ *          tests, the sampler takes a sample every SAMPLER_PERIOD ms of the test.
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <unity.h>
+#include <stdlib.h>
+#include "hal.h"
+#include "sampler.h"
+
+/* Private variables ---------------------------------------------------------*/
+
+static sample_t samples[8]; /**< The samples copied from the history */
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief The sensor of the sampler, a constant temperature.
+ */
+static float sensor(void)
+{
+    return 21.5f;
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+/**
+ * @brief Past half of the ms counter, the first sample is still after a since of 0.
+ */
+static void test_half(void)
+{
+    hal_clock(0x80000000u + 1000);
+    TEST_ASSERT_TRUE(sampler_init(sensor));
+
+    TEST_ASSERT_EQUAL_size_t(1, sampler_history(0, samples, 8));
+    TEST_ASSERT_TRUE(samples[0].time >= 0x80000000u + 1000);
+    TEST_ASSERT_EQUAL_INT16(2150, samples[0].value);
+}
+
+/**
+ * @brief A sample before the wrap and one after it, paging from the one before finds the one after.
+ */
+static void test_wrap(void)
+{
+    /* The next samples are taken about 200 ms before and 800 ms after the wrap */
+    hal_clock(UINT32_MAX - 1200);
+    hal_delay(2 * SAMPLER_PERIOD + SAMPLER_PERIOD / 2);
+
+    TEST_ASSERT_EQUAL_size_t(3, sampler_history(0, samples, 8));
+    TEST_ASSERT_TRUE(samples[1].time > 0x80000000u);
+    TEST_ASSERT_TRUE(samples[2].time < SAMPLER_PERIOD);
+
+    sample_t before = samples[1];
+    sample_t after = samples[2];
+
+    TEST_ASSERT_EQUAL_size_t(1, sampler_history(before.time, samples, 8));
+    TEST_ASSERT_EQUAL_UINT32(after.time, samples[0].time);
+    TEST_ASSERT_EQUAL_size_t(0, sampler_history(after.time, samples, 8));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_half);
+    RUN_TEST(test_wrap);
+    return UNITY_END();
+}
@@ -0,0 +1,511 @@
+/**
+ * @file test_main.cpp
+ * @author Oliver Joisten (contact@oliver-joisten.se)
+ * @brief Tests of the session module: every resumption of a ticket gets a record key of its own,
+ *        the handle of a dropped request cannot complete the request that reuses its window entry
+ *        and every session of a full table is found by its ID.
+ * @version 0.1
+ * @date 2024-06-05
+ *
+ * @copyright Copyright (c) 2024
+ *
+ * @details The test plays the client over the UNIX domain socket transport. The stages of the
+ *          communication module are not started, so the server reads and writes the frames in the
+ *          thread of the test: the client writes a request, the test calls the session function that
+ *          handles it and the client reads the response.
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <unity.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <mbedtls/ecdh.h>
+#include "communication.h"
+#include "crypto.h"
+#include "hal.h"
+#include "kex.h"
+#include "session.h"
+#include "ticket.h"
+
+/* Private define ------------------------------------------------------------*/
+
+/* Private typedef -----------------------------------------------------------*/
+
+/**
+ * @brief The keys of a session on the client side.
+ */
+typedef struct
+{
+    uint8_t keys[TICKET_KEY_SIZE];            /**< AES key | HMAC key, the keys held by the ticket */
+    uint8_t ticket[TICKET_SIZE];              /**< The ticket to resume the session with */
+    uint8_t id[8];                            /**< The session ID */
+    uint8_t record_key[CRYPTO_KEY_SIZE];      /**< The key of the GCM records */
+    uint64_t sequence;                        /**< The sequence number of the last request */
+    uint16_t request;                         /**< The ID of the last request */
+} client_session_t;
+
+/* Private macro -------------------------------------------------------------*/
+
+constexpr size_t SESSION_ID_SIZE{8};   /**< Session ID Size */
+constexpr size_t HEADER_SIZE{16};      /**< Session ID + Sequence Number of a GCM record */
+constexpr size_t REQUEST_ID_SIZE{2};   /**< Request ID Size of GCM records */
+constexpr size_t BLOCK_SIZE{16};       /**< AES Block Size */
+constexpr size_t SESSION_SLOTS{4};     /**< Number of concurrent sessions of the server */
+constexpr uint8_t STATUS_OKAY{0};      /**< The status of a successful request */
+constexpr uint8_t STATUS_HASH_ERROR{3}; /**< The status of a record that could not be authenticated */
+
+/* Private variables ---------------------------------------------------------*/
+
+static char directory[] = "/tmp/session_XXXXXX"; /**< The directory of the socket and the key store */
+static char path[64]{0};                         /**< The socket the server listens on */
+static int client{-1};                           /**< The client end of the link */
+static crypto_hmac_t hmac;                       /**< The HMAC of the handshake, keyed with the secret */
+static uint8_t message[FRAME_MAX_PAYLOAD]{0};    /**< The message the client sends or received */
+
+/* The pre-shared key of the handshake messages */
+static const uint8_t secret_key[CRYPTO_HASH_SIZE] = {0x29, 0x49, 0xde, 0xc2, 0x3e, 0x1e, 0x34, 0xb5, 0x2d, 0x22, 0xb5,
+                                                     0xba, 0x4c, 0x34, 0x23, 0x3a, 0x9d, 0x3f, 0xe2, 0x97, 0x14, 0xbe,
+                                                     0x24, 0x62, 0x81, 0x0c, 0x86, 0xb1, 0xf6, 0x92, 0x54, 0xd6};
+
+/* Private user code ---------------------------------------------------------*/
+
+/**
+ * @brief Writes a frame from the client to the server.
+ */
+static void client_send(uint8_t type, const uint8_t *data, size_t dlen)
+{
+    uint8_t header[FRAME_HEADER_SIZE]{FRAME_SYNC_1, FRAME_SYNC_2, type, (uint8_t)(dlen & 0xFF), (uint8_t)(dlen >> 8), 0};
+
+    /* CRC-8 (x^8 + x^2 + x + 1) of the type and the length */
+    for (size_t i = 2; i < 5; i++)
+    {
+        header[5] ^= header[i];
+
+        for (uint8_t bit = 0; bit < 8; bit++)
+        {
+            header[5] = (header[5] & 0x80) ? ((header[5] << 1) ^ 0x07) : (header[5] << 1);
+        }
+    }
+
+    TEST_ASSERT_EQUAL_INT((int)sizeof(header), (int)write(client, header, sizeof(header)));
+    TEST_ASSERT_EQUAL_INT((int)dlen, (int)write(client, data, dlen));
+}
+
+/**
+ * @brief Reads the next frame the server wrote to the client into message.
+ *
+ * @param type The expected frame type.
+ * @return The length of the payload.
+ */
+static size_t client_receive(uint8_t type)
+{
+    uint8_t header[FRAME_HEADER_SIZE]{0};
+
+    TEST_ASSERT_EQUAL_INT((int)sizeof(header), (int)recv(client, header, sizeof(header), MSG_WAITALL));
+    TEST_ASSERT_EQUAL_UINT8(FRAME_SYNC_1, header[0]);
+    TEST_ASSERT_EQUAL_UINT8(type, header[2]);
+
+    size_t length = header[3] | (header[4] << 8);
+    TEST_ASSERT_TRUE(length <= sizeof(message));
+    TEST_ASSERT_EQUAL_INT((int)length, (int)recv(client, message, length, MSG_WAITALL));
+
+    return length;
+}
+
+/**
+ * @brief Sends the first mlen bytes of message as a handshake message, followed by its HMAC.
+ */
+static void handshake_send(size_t mlen)
+{
+    crypto_hmac(&hmac, message, mlen, message + mlen);
+    client_send(FRAME_DATA, message, mlen + CRYPTO_HASH_SIZE);
+}
+
+/**
+ * @brief Reads a handshake message into message and checks its HMAC.
+ *
+ * @return The length of the message without the HMAC.
+ */
+static size_t handshake_receive(void)
+{
+    uint8_t mac[CRYPTO_HASH_SIZE]{0};
+    size_t length = client_receive(FRAME_DATA);
+
+    TEST_ASSERT_TRUE(length > CRYPTO_HASH_SIZE);
+    length -= CRYPTO_HASH_SIZE;
+    crypto_hmac(&hmac, message, length, mac);
+    TEST_ASSERT_EQUAL_MEMORY(mac, message + length, CRYPTO_HASH_SIZE);
+
+    return length;
+}
+
+/**
+ * @brief Derives the GCM key of a session as the server does.
+ *
+ * @param session The session with its keys and ID.
+ * @param nonce The nonce of a resuming client, nullptr for a new session.
+ */
+static void record_key(client_session_t *session, const uint8_t *nonce)
+{
+    uint8_t info[6 + SESSION_ID_SIZE + BLOCK_SIZE] = {'r', 'e', 'c', 'o', 'r', 'd'};
+    size_t ilen = 6;
+
+    memcpy(info + ilen, session->id, SESSION_ID_SIZE);
+    ilen += SESSION_ID_SIZE;
+
+    if (nonce != nullptr)
+    {
+        memcpy(info + ilen, nonce, BLOCK_SIZE);
+        ilen += BLOCK_SIZE;
+    }
+
+    TEST_ASSERT_TRUE(kex_derive(session->keys + CRYPTO_KEY_SIZE, CRYPTO_HASH_SIZE, session->keys, CRYPTO_KEY_SIZE,
+                                info, ilen, session->record_key, CRYPTO_KEY_SIZE));
+    session->sequence = 0;
+}
+
+/**
+ * @brief Builds the GCM nonce of a record, the direction and the sequence number.
+ */
+static void record_nonce(uint32_t direction, uint64_t sequence, uint8_t *nonce)
+{
+    memcpy(nonce, &direction, sizeof(direction));
+    memcpy(nonce + sizeof(direction), &sequence, sizeof(sequence));
+}
+
+/**
+ * @brief Sends a GCM request of the session.
+ *
+ * @param session The session.
+ * @param key The key to seal the record with, the record key of the session or a wrong one.
+ * @param command The request.
+ */
+static void record_send(client_session_t *session, const uint8_t *key, uint8_t command)
+{
+    uint8_t nonce[CRYPTO_NONCE_SIZE]{0};
+    uint8_t *payload = message + HEADER_SIZE;
+    crypto_gcm_t gcm;
+
+    session->sequence++;
+    session->request++;
+
+    memcpy(message, session->id, SESSION_ID_SIZE);
+    memcpy(message + SESSION_ID_SIZE, &session->sequence, sizeof(session->sequence));
+    payload[0] = command;
+    memcpy(payload + 1, &session->request, REQUEST_ID_SIZE);
+    record_nonce(0, session->sequence, nonce);
+
+    crypto_gcm_init(&gcm);
+    TEST_ASSERT_TRUE(crypto_gcm_setkey(&gcm, key));
+    TEST_ASSERT_TRUE(crypto_gcm_seal(&gcm, nonce, message, HEADER_SIZE, payload, 1 + REQUEST_ID_SIZE, payload,
+                                     payload + 1 + REQUEST_ID_SIZE));
+    crypto_gcm_free(&gcm);
+
+    client_send(FRAME_RECORD, message, HEADER_SIZE + 1 + REQUEST_ID_SIZE + CRYPTO_TAG_SIZE);
+}
+
+/**
+ * @brief Reads a GCM response of the session and checks its status and request ID.
+ *
+ * @param session The session.
+ * @param status The expected status.
+ * @param request The expected request ID.
+ */
+static void record_receive(client_session_t *session, uint8_t status, uint16_t request)
+{
+    uint8_t nonce[CRYPTO_NONCE_SIZE]{0};
+    uint8_t *payload = message + HEADER_SIZE;
+    uint64_t sequence{0};
+    uint16_t id{0};
+    crypto_gcm_t gcm;
+
+    size_t length = client_receive(FRAME_RECORD);
+    TEST_ASSERT_TRUE(length >= HEADER_SIZE + 1 + REQUEST_ID_SIZE + CRYPTO_TAG_SIZE);
+    TEST_ASSERT_EQUAL_MEMORY(session->id, message, SESSION_ID_SIZE);
+
+    length -= HEADER_SIZE + CRYPTO_TAG_SIZE;
+    memcpy(&sequence, message + SESSION_ID_SIZE, sizeof(sequence));
+    record_nonce(1, sequence, nonce);
+
+    crypto_gcm_init(&gcm);
+    TEST_ASSERT_TRUE(crypto_gcm_setkey(&gcm, session->record_key));
+    TEST_ASSERT_TRUE(crypto_gcm_open(&gcm, nonce, message, HEADER_SIZE, payload, length, payload + length, payload));
+    crypto_gcm_free(&gcm);
+
+    memcpy(&id, payload + 1, REQUEST_ID_SIZE);
+    TEST_ASSERT_EQUAL_UINT8(status, payload[0]);
+    TEST_ASSERT_EQUAL_UINT16(request, id);
+}
+
+/**
+ * @brief The random number generator of the client key.
+ */
+static int rng(void *, unsigned char *buffer, size_t length)
+{
+    return crypto_random(nullptr, buffer, length);
+}
+
+/**
+ * @brief Establishes a session with a X25519 handshake.
+ *
+ * @param session The session to fill in.
+ */
+static void establish(client_session_t *session)
+{
+    size_t olen = 0;
+    size_t size = kex_public_size(KEX_X25519);
+    uint8_t secret[KEX_SECRET_SIZE]{0};
+    uint8_t keys[TICKET_KEY_SIZE + BLOCK_SIZE]{0};
+    uint8_t transcript[1 + 2 * KEX_MAX_PUBLIC_SIZE]{KEX_X25519};
+    mbedtls_ecp_group grp;
+    mbedtls_ecp_point own, peer;
+    mbedtls_mpi d, z;
+
+    mbedtls_ecp_group_init(&grp);
+    mbedtls_ecp_point_init(&own);
+    mbedtls_ecp_point_init(&peer);
+    mbedtls_mpi_init(&d);
+    mbedtls_mpi_init(&z);
+
+    /* mode | client public key */
+    TEST_ASSERT_EQUAL_INT(0, mbedtls_ecp_group_load(&grp, MBEDTLS_ECP_DP_CURVE25519));
+    TEST_ASSERT_EQUAL_INT(0, mbedtls_ecdh_gen_public(&grp, &d, &own, rng, nullptr));
+    TEST_ASSERT_EQUAL_INT(0, mbedtls_ecp_point_write_binary(&grp, &own, MBEDTLS_ECP_PF_UNCOMPRESSED, &olen, transcript + 1, size));
+
+    memcpy(message, transcript, 1 + size);
+    handshake_send(1 + size);
+    TEST_ASSERT_EQUAL_INT(SESSION_ESTABLISH, session_request());
+    TEST_ASSERT_TRUE(session_establish());
+
+    /* mode | server public key | session ID | ticket | identity | signature */
+    TEST_ASSERT_TRUE(handshake_receive() > 1 + size + SESSION_ID_SIZE + TICKET_SIZE);
+    TEST_ASSERT_EQUAL_UINT8(KEX_X25519, message[0]);
+    memcpy(transcript + 1 + size, message + 1, size);
+    memcpy(session->id, message + 1 + size, SESSION_ID_SIZE);
+    memcpy(session->ticket, message + 1 + size + SESSION_ID_SIZE, TICKET_SIZE);
+
+    TEST_ASSERT_EQUAL_INT(0, mbedtls_ecp_point_read_binary(&grp, &peer, transcript + 1 + size, size));
+    TEST_ASSERT_EQUAL_INT(0, mbedtls_ecdh_compute_shared(&grp, &z, &peer, &d, rng, nullptr));
+    TEST_ASSERT_EQUAL_INT(0, mbedtls_mpi_write_binary_le(&z, secret, sizeof(secret)));
+    TEST_ASSERT_TRUE(kex_derive(secret_key, sizeof(secret_key), secret, sizeof(secret), transcript, 1 + 2 * size, keys, sizeof(keys)));
+
+    memcpy(session->keys, keys, TICKET_KEY_SIZE);
+    record_key(session, nullptr);
+
+    mbedtls_mpi_free(&z);
+    mbedtls_mpi_free(&d);
+    mbedtls_ecp_point_free(&peer);
+    mbedtls_ecp_point_free(&own);
+    mbedtls_ecp_group_free(&grp);
+}
+
+/**
+ * @brief Resumes a session from the ticket of another one.
+ *
+ * @param from The session whose ticket is redeemed, it gets the follow-up ticket.
+ * @param session The resumed session to fill in.
+ * @param nonce The client nonce of BLOCK_SIZE bytes.
+ */
+static void resume(client_session_t *from, client_session_t *session, const uint8_t *nonce)
+{
+    uint8_t iv[BLOCK_SIZE]{0};
+    uint8_t plain[2 * BLOCK_SIZE]{0};
+    crypto_cbc_t cbc;
+
+    /* nonce | ticket */
+    memcpy(message, nonce, BLOCK_SIZE);
+    memcpy(message + BLOCK_SIZE, from->ticket, TICKET_SIZE);
+    handshake_send(BLOCK_SIZE + TICKET_SIZE);
+    TEST_ASSERT_EQUAL_INT(SESSION_RESUME, session_request());
+    TEST_ASSERT_TRUE(session_resume());
+
+    /* CBC(session ID | IV) with the nonce as IV | ticket */
+    TEST_ASSERT_EQUAL_size_t(sizeof(plain) + TICKET_SIZE, handshake_receive());
+    memcpy(iv, nonce, BLOCK_SIZE);
+    crypto_cbc_init(&cbc);
+    TEST_ASSERT_TRUE(crypto_cbc_setkey(&cbc, CRYPTO_DECRYPT, from->keys));
+    TEST_ASSERT_TRUE(crypto_cbc_crypt(&cbc, CRYPTO_DECRYPT, sizeof(plain), iv, message, plain));
+    crypto_cbc_free(&cbc);
+
+    memcpy(session->keys, from->keys, TICKET_KEY_SIZE);
+    memcpy(session->id, plain, SESSION_ID_SIZE);
+    memcpy(from->ticket, message + sizeof(plain), TICKET_SIZE);
+    memcpy(session->ticket, from->ticket, TICKET_SIZE);
+    record_key(session, nonce);
+}
+
+/**
+ * @brief Sends a request of the session and checks the server reads it.
+ */
+static void request(client_session_t *session, request_t command)
+{
+    record_send(session, session->record_key, (uint8_t)command);
+    TEST_ASSERT_EQUAL_INT(command, session_request());
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+/**
+ * @brief Two resumptions of the same ticket chain with the same client nonce get different record keys.
+ */
+static void test_resume_keys(void)
+{
+    static const uint8_t nonce[BLOCK_SIZE] = {0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+                                              0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10};
+    client_session_t origin{}, first{}, second{};
+
+    establish(&origin);
+    resume(&origin, &first, nonce);
+    resume(&origin, &second, nonce);
+
+    TEST_ASSERT_FALSE(0 == memcmp(origin.record_key, first.record_key, CRYPTO_KEY_SIZE));
+    TEST_ASSERT_FALSE(0 == memcmp(first.record_key, second.record_key, CRYPTO_KEY_SIZE));
+    TEST_ASSERT_FALSE(0 == memcmp(first.id, second.id, SESSION_ID_SIZE));
+
+    /* Both sessions start their sequence numbers at 1, the GCM nonces only differ by the key */
+    request(&first, SESSION_GET_TEMP);
+    TEST_ASSERT_TRUE(session_response(true, nullptr, 0));
+    record_receive(&first, STATUS_OKAY, first.request);
+
+    request(&second, SESSION_GET_TEMP);
+    TEST_ASSERT_TRUE(session_response(true, nullptr, 0));
+    record_receive(&second, STATUS_OKAY, second.request);
+
+    /* A record sealed with the key of the first session is not accepted by the second */
+    record_send(&second, first.record_key, SESSION_GET_TEMP);
+    TEST_ASSERT_EQUAL_INT(SESSION_ERROR, session_request());
+    TEST_ASSERT_EQUAL_size_t(1 + CRYPTO_HASH_SIZE, client_receive(FRAME_DATA));
+    TEST_ASSERT_EQUAL_UINT8(STATUS_HASH_ERROR, message[0]);
+}
+
+/**
+ * @brief A ticket is redeemed once, the same ticket is not accepted again.
+ */
+static void test_ticket_reuse(void)
+{
+    static const uint8_t nonce[BLOCK_SIZE] = {0x10};
+    client_session_t origin{}, first{};
+
+    establish(&origin);
+    uint8_t ticket[TICKET_SIZE];
+    memcpy(ticket, origin.ticket, sizeof(ticket));
+    resume(&origin, &first, nonce);
+
+    memcpy(message, nonce, BLOCK_SIZE);
+    memcpy(message + BLOCK_SIZE, ticket, TICKET_SIZE);
+    handshake_send(BLOCK_SIZE + TICKET_SIZE);
+    TEST_ASSERT_EQUAL_INT(SESSION_RESUME, session_request());
+    TEST_ASSERT_FALSE(session_resume());
+    TEST_ASSERT_EQUAL_size_t(1, handshake_receive());
+}
+
+/**
+ * @brief The handle of a request dropped with its session does not complete the request that reuses its entry.
+ */
+static void test_stale_handle(void)
+{
+    client_session_t first{}, second{};
+
+    establish(&first);
+    establish(&second);
+
+    request(&first, SESSION_GET_TEMP);
+    session_handle_t stale = session_defer();
+    TEST_ASSERT_TRUE(stale != SESSION_NO_HANDLE);
+
+    /* Closing the session drops its outstanding request */
+    request(&first, SESSION_CLOSE);
+    session_close();
+    TEST_ASSERT_TRUE(session_response(true, nullptr, 0));
+    record_receive(&first, STATUS_OKAY, first.request);
+
+    /* The next request takes the free entry of the dropped one */
+    request(&second, SESSION_GET_TEMP);
+    session_handle_t handle = session_defer();
+    TEST_ASSERT_EQUAL_UINT16(stale & 0xFF, handle & 0xFF);
+    TEST_ASSERT_TRUE(stale != handle);
+
+    TEST_ASSERT_FALSE(session_complete(stale, true, nullptr, 0));
+    TEST_ASSERT_TRUE(session_complete(handle, true, nullptr, 0));
+    record_receive(&second, STATUS_OKAY, second.request);
+
+    /* A handle completes its request once */
+    TEST_ASSERT_FALSE(session_complete(handle, true, nullptr, 0));
+}
+
+/**
+ * @brief Every session of a full table is found by its ID, a new one evicts the least recently used.
+ */
+static void test_table(void)
+{
+    client_session_t sessions[SESSION_SLOTS + 1]{};
+
+    /* The access times in ms order the sessions */
+    for (client_session_t &session : sessions)
+    {
+        establish(&session);
+        hal_delay(2);
+    }
+
+    for (size_t i = 1; i <= SESSION_SLOTS; i++)
+    {
+        request(&sessions[i], SESSION_GET_TEMP);
+        TEST_ASSERT_TRUE(session_response(true, nullptr, 0));
+        record_receive(&sessions[i], STATUS_OKAY, sessions[i].request);
+    }
+
+    /* The first session was evicted by the last one */
+    record_send(&sessions[0], sessions[0].record_key, SESSION_GET_TEMP);
+    TEST_ASSERT_EQUAL_INT(SESSION_ERROR, session_request());
+    TEST_ASSERT_EQUAL_size_t(1 + CRYPTO_HASH_SIZE, client_receive(FRAME_DATA));
+}
+
+int main(void)
+{
+    struct sockaddr_un address{};
+
+    /* The key store of the server lives in the working directory */
+    if ((nullptr == mkdtemp(directory)) || (0 != chdir(directory)))
+    {
+        return EXIT_FAILURE;
+    }
+
+    /* The stages are not started, the session functions read and write the frames in the calling thread */
+    snprintf(path, sizeof(path), "%s/test.sock", directory);
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    client = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (!communication_select("unix", path) || !session_init() || (client < 0) ||
+        (0 != connect(client, (const struct sockaddr *)&address, sizeof(address))))
+    {
+        return EXIT_FAILURE;
+    }
+
+    crypto_hmac_init(&hmac);
+    (void)crypto_hmac_setkey(&hmac, secret_key, sizeof(secret_key));
+
+    UNITY_BEGIN();
+    RUN_TEST(test_resume_keys);
+    RUN_TEST(test_ticket_reuse);
+    RUN_TEST(test_stale_handle);
+    RUN_TEST(test_table);
+    int failures = UNITY_END();
+
+    crypto_hmac_free(&hmac);
+    close(client);
+    unlink(path);
+
+    return failures;
+}